@@ -0,0 +1,978 @@
+/*
+ * Description:
+ * Buffer objects of the driver and the cache of their kernel mappings.
+ *
+ * Submitting a job used to vmap its buffer objects, and the job vunmapped
+ * them once it was done. For a render loop using the same instruction and
+ * frame buffer objects every frame, that's pinning the pages, building a
+ * scatter gather list and setting up a vmap for nothing every single frame.
+ * Now the mapping stays around once the last job using it is done, and the
+ * shrinker drops idle mappings (least recently used first) when the system
+ * is low on memory, which unpins the pages.
+ *
+ * Dumb buffers are also recycled. Apps that resize their windows or rebuild
+ * their swapchains free and allocate buffers of the same few sizes over and
+ * over, and every new shmem object has to set up a shmem file and an mmap
+ * offset, and fault in and zero every page. Freed dumb buffers go to a pool
+ * instead, and a new buffer of the same size is served from the pool with its
+ * pages already populated (and mapped). They only need to be cleared.
+ *
+ * The residency manager (see residency.c) can move objects in system memory to
+ * vram and back. Userspace mappings go through pi_bo_fault() so they follow
+ * the object, and kernel mappings or pins from outside the driver keep it
+ * where it is.
+ */
+#include "asm-generic/errno-base.h"
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_debugfs.h"
+#include "drm/drm_device.h"
+#include "drm/drm_file.h"
+#include "drm/drm_gem.h"
+#include "drm/drm_gem_shmem_helper.h"
+#include "drm/drm_mode.h"
+#include "drm/drm_vma_manager.h"
+#include "linux/bitops.h"
+#include "linux/dma-resv.h"
+#include "linux/err.h"
+#include "linux/hashtable.h"
+#include "linux/iosys-map.h"
+#include "linux/ktime.h"
+#include "linux/list.h"
+#include "linux/math64.h"
+#include "linux/mm.h"
+#include "linux/module.h"
+#include "linux/mutex.h"
+#include "linux/seq_file.h"
+#include "linux/shrinker.h"
+#include "linux/slab.h"
+#include "linux/workqueue.h"
+
+#include "bo.h"
+#include "dma_bo.h"
+#include "driver.h"
+#include "residency.h"
+#include "vram.h"
+
+static unsigned int bo_pool_mb = 64;
+module_param(bo_pool_mb, uint, 0644);
+MODULE_PARM_DESC(bo_pool_mb,
+                 "Size of the freed dumb buffers kept for reuse, in MB (0 = off)");
+
+static bool pi_bo_pool_put(struct pi_bo *bo);
+
+static void pi_bo_destroy(struct pi_bo *bo) {
+  struct drm_gem_object *obj = &bo->base.base;
+  struct pi_gpu *gpu = to_gpu(obj->dev);
+  struct pi_bo_cache *cache = &gpu->bo_cache;
+
+  bool resident = pi_bo_resident(bo);
+
+  if (bo->poolable) {
+    atomic64_dec(&gpu->mem_stats.system_objects);
+    atomic64_sub(obj->size, &gpu->mem_stats.system_bytes);
+  }
+
+  // Nobody else can find the object anymore, except the shrinker through the
+  // LRU list
+  mutex_lock(&cache->lock);
+  if (!list_empty(&bo->lru)) {
+    list_del_init(&bo->lru);
+    cache->num_idle--;
+  }
+  mutex_unlock(&cache->lock);
+
+  // The mapping of an object in vram is a part of vram
+  pi_residency_release(gpu, bo);
+  if (resident) {
+    iosys_map_clear(&bo->map);
+  } else if (!iosys_map_is_null(&bo->map)) {
+    dma_resv_lock(obj->resv, NULL);
+    drm_gem_shmem_vunmap(&bo->base, &bo->map);
+    iosys_map_clear(&bo->map);
+    dma_resv_unlock(obj->resv);
+  }
+
+  drm_gem_shmem_free(&bo->base);
+}
+
+static void pi_bo_free(struct drm_gem_object *obj) {
+  struct pi_bo *bo = to_pi_bo(obj);
+
+  if (!pi_bo_pool_put(bo))
+    pi_bo_destroy(bo);
+}
+
+/*
+ * Kernel mappings and pins from outside the driver, like the display or a
+ * dma-buf importer. The object doesn't move while they exist.
+ */
+static int pi_bo_object_vmap(struct drm_gem_object *obj, struct iosys_map *map) {
+  struct pi_bo *bo = to_pi_bo(obj);
+  int ret = 0;
+
+  dma_resv_assert_held(obj->resv);
+
+  if (pi_bo_resident(bo))
+    *map = bo->map;
+  else
+    ret = drm_gem_shmem_object_vmap(obj, map);
+
+  if (!ret)
+    bo->res.pin_count++;
+  return ret;
+}
+
+static void pi_bo_object_vunmap(struct drm_gem_object *obj,
+                                struct iosys_map *map) {
+  struct pi_bo *bo = to_pi_bo(obj);
+
+  dma_resv_assert_held(obj->resv);
+
+  if (!pi_bo_resident(bo))
+    drm_gem_shmem_object_vunmap(obj, map);
+  bo->res.pin_count--;
+}
+
+// The pages are handed out as is, so the object has to be in system memory
+static int pi_bo_object_pin(struct drm_gem_object *obj) {
+  struct pi_bo *bo = to_pi_bo(obj);
+  int ret;
+
+  ret = dma_resv_lock_interruptible(obj->resv, NULL);
+  if (ret)
+    return ret;
+  if (pi_bo_resident(bo))
+    ret = pi_residency_evict(to_gpu(obj->dev), bo);
+  if (!ret)
+    bo->res.pin_count++;
+  dma_resv_unlock(obj->resv);
+  if (ret)
+    return ret;
+
+  ret = drm_gem_shmem_object_pin(obj);
+  if (ret) {
+    dma_resv_lock(obj->resv, NULL);
+    bo->res.pin_count--;
+    dma_resv_unlock(obj->resv);
+  }
+  return ret;
+}
+
+static void pi_bo_object_unpin(struct drm_gem_object *obj) {
+  struct pi_bo *bo = to_pi_bo(obj);
+
+  drm_gem_shmem_object_unpin(obj);
+
+  dma_resv_lock(obj->resv, NULL);
+  bo->res.pin_count--;
+  dma_resv_unlock(obj->resv);
+}
+
+/*
+ * Same as drm_gem_shmem_fault(), except that objects in vram are mapped from
+ * vram. The reservation lock is held while the residency manager moves the
+ * object, so the fault maps wherever the object ended up.
+ */
+static vm_fault_t pi_bo_fault(struct vm_fault *vmf) {
+  struct vm_area_struct *vma = vmf->vma;
+  struct drm_gem_object *obj = vma->vm_private_data;
+  struct pi_bo *bo = to_pi_bo(obj);
+  // vmf->pgoff has the fake offset of the object in it
+  pgoff_t page_offset = (vmf->address - vma->vm_start) >> PAGE_SHIFT;
+  unsigned long pfn;
+  vm_fault_t ret;
+
+  dma_resv_lock(obj->resv, NULL);
+
+  if (page_offset >= obj->size >> PAGE_SHIFT) {
+    ret = VM_FAULT_SIGBUS;
+  } else if (pi_bo_resident(bo)) {
+    pfn = pi_vram_pfn(to_gpu(obj->dev),
+                      bo->vram_node.start + (page_offset << PAGE_SHIFT));
+    ret = vmf_insert_pfn(vma, vmf->address, pfn);
+  } else if (WARN_ON_ONCE(!bo->base.pages) || bo->base.madv < 0) {
+    ret = VM_FAULT_SIGBUS;
+  } else {
+    pfn = page_to_pfn(bo->base.pages[page_offset]);
+    ret = vmf_insert_pfn(vma, vmf->address, pfn);
+  }
+
+  dma_resv_unlock(obj->resv);
+  return ret;
+}
+
+static void pi_bo_vm_open(struct vm_area_struct *vma) {
+  drm_gem_shmem_vm_ops.open(vma);
+}
+
+static void pi_bo_vm_close(struct vm_area_struct *vma) {
+  drm_gem_shmem_vm_ops.close(vma);
+}
+
+static const struct vm_operations_struct pi_bo_vm_ops = {
+    .fault = pi_bo_fault,
+    .open = pi_bo_vm_open,
+    .close = pi_bo_vm_close,
+};
+
+// Same as the shmem helpers, except for freeing, and for everything that
+// depends on where the object is
+static const struct drm_gem_object_funcs pi_gem_funcs = {
+    .free = pi_bo_free,
+    .print_info = drm_gem_shmem_object_print_info,
+    .pin = pi_bo_object_pin,
+    .unpin = pi_bo_object_unpin,
+    .get_sg_table = drm_gem_shmem_object_get_sg_table,
+    .vmap = pi_bo_object_vmap,
+    .vunmap = pi_bo_object_vunmap,
+    .mmap = drm_gem_shmem_object_mmap,
+    .vm_ops = &pi_bo_vm_ops,
+};
+
+bool pi_is_bo(struct drm_gem_object *obj) {
+  return obj->funcs == &pi_gem_funcs || pi_bo_in_vram(to_pi_bo(obj)) ||
+         pi_bo_is_dma(to_pi_bo(obj));
+}
+
+// Common to objects in system memory and in vram
+void pi_bo_init(struct pi_bo *bo) {
+  INIT_LIST_HEAD(&bo->lru);
+  INIT_LIST_HEAD(&bo->pool_lru);
+  INIT_LIST_HEAD(&bo->res.link);
+  pi_cmd_cache_init(&bo->cmd_cache);
+}
+
+/*
+ * Called by the shmem helpers (through drm_driver.gem_create_object) every
+ * time they need a new object, including for dumb buffers.
+ */
+struct drm_gem_object *pi_gem_create_object(struct drm_device *dev,
+                                            size_t size) {
+  struct pi_bo *bo;
+
+  bo = kzalloc(sizeof(*bo), GFP_KERNEL);
+  if (!bo)
+    return ERR_PTR(-ENOMEM);
+
+  pi_bo_init(bo);
+  bo->base.base.funcs = &pi_gem_funcs;
+  return &bo->base.base;
+}
+
+/*-------------------------------------------------------------------------------
+ * Recycle pool
+ *
+ * An object whose last reference is dropped is normally freed right away.
+ * Poolable objects are kept instead: nothing can find them anymore (their
+ * handles, names and mmaps are all gone, and an mmap offset lookup fails since
+ * their refcount is 0), but they keep their shmem file, pages, mmap offset and
+ * cached kernel mapping. pi_bo_pool_create() brings one back to life by
+ * resetting its refcount.
+ *-------------------------------------------------------------------------------
+ */
+
+// Called with pool->lock held
+static void pi_bo_pool_del(struct pi_bo_pool *pool, struct pi_bo *bo) {
+  hash_del(&bo->pool_node);
+  list_del_init(&bo->pool_lru);
+  pool->size -= bo->base.base.size;
+}
+
+// Returns true if the pool took the object, false if it must be freed
+static bool pi_bo_pool_put(struct pi_bo *bo) {
+  struct drm_gem_object *obj = &bo->base.base;
+  struct pi_bo_pool *pool = &to_gpu(obj->dev)->bo_pool;
+  size_t max_size = (size_t)READ_ONCE(bo_pool_mb) << 20;
+  struct pi_bo *old, *tmp;
+  LIST_HEAD(evicted);
+
+  // Purged or imported objects don't have pages of their own to reuse
+  if (!bo->poolable || bo->base.madv || obj->import_attach ||
+      obj->size > max_size || pi_bo_resident(bo))
+    return false;
+
+  mutex_lock(&pool->lock);
+  if (pool->closed) {
+    mutex_unlock(&pool->lock);
+    return false;
+  }
+
+  list_for_each_entry_safe(old, tmp, &pool->lru, pool_lru) {
+    if (pool->size + obj->size <= max_size)
+      break;
+    pi_bo_pool_del(pool, old);
+    list_add_tail(&old->pool_lru, &evicted);
+    pool->evictions++;
+  }
+
+  hash_add(pool->buckets, &bo->pool_node, obj->size);
+  list_add_tail(&bo->pool_lru, &pool->lru);
+  pool->size += obj->size;
+  mutex_unlock(&pool->lock);
+
+  list_for_each_entry_safe(old, tmp, &evicted, pool_lru)
+    pi_bo_destroy(old);
+  return true;
+}
+
+// Takes the most recently freed object of the given size out of the pool
+static struct pi_bo *pi_bo_pool_get(struct pi_bo_pool *pool, size_t size) {
+  struct pi_bo *bo, *found = NULL;
+
+  mutex_lock(&pool->lock);
+  hash_for_each_possible(pool->buckets, bo, pool_node, size) {
+    if (bo->base.base.size == size) {
+      found = bo;
+      break;
+    }
+  }
+  if (found) {
+    pi_bo_pool_del(pool, found);
+    pool->hits++;
+  } else {
+    pool->misses++;
+  }
+  mutex_unlock(&pool->lock);
+
+  return found;
+}
+
+/**
+ * pi_bo_pool_create - creates a buffer object that's recycled once freed
+ * @dev: DRM device
+ * @size: size of the object, rounded up to a whole number of pages
+ *
+ * A freed object of the same size is reused if the pool has one. Its pages are
+ * cleared, so the new owner sees the same zeroed memory as with a new object.
+ * The pool tells objects apart by their size alone, so anything created here
+ * has to be a plain shmem object in system memory. Objects that are placed or
+ * created differently must not come from the pool, or it needs a bigger key.
+ *
+ * Returns:
+ * The object with a reference for the caller, or an ERR_PTR().
+ */
+struct pi_bo *pi_bo_pool_create(struct drm_device *dev, size_t size) {
+  struct pi_bo_pool *pool = &to_gpu(dev)->bo_pool;
+  struct drm_gem_shmem_object *shmem;
+  struct iosys_map map;
+  struct pi_bo *bo;
+
+  size = PAGE_ALIGN(size);
+
+  bo = pi_bo_pool_get(pool, size);
+  if (bo) {
+    kref_init(&bo->base.base.refcount);
+    pi_cmd_cache_init(&bo->cmd_cache);
+    pi_residency_reset(to_gpu(dev), bo);
+
+    // Usually still mapped from its previous life, then this is only a memset
+    if (!pi_bo_vmap(bo, &map)) {
+      memset(map.vaddr, 0, size);
+      pi_bo_vunmap(bo);
+      return bo;
+    }
+
+    // Without its pages it's no better than a new object. Nobody else knows
+    // about it, so there's no need to go through its refcount.
+    pi_bo_destroy(bo);
+  }
+
+  shmem = drm_gem_shmem_create(dev, size);
+  if (IS_ERR(shmem))
+    return ERR_CAST(shmem);
+
+  bo = to_pi_bo(&shmem->base);
+  bo->poolable = true;
+  atomic64_inc(&to_gpu(dev)->mem_stats.system_objects);
+  atomic64_add(size, &to_gpu(dev)->mem_stats.system_bytes);
+  return bo;
+}
+
+int pi_dumb_create(struct drm_file *file, struct drm_device *dev,
+                   struct drm_mode_create_dumb *args) {
+  struct pi_bo *bo;
+  int ret;
+
+  // drm_mode_create_dumb() already checked these can't overflow
+  args->pitch = DIV_ROUND_UP(args->width * args->bpp, 8);
+  args->size = PAGE_ALIGN((u64)args->pitch * args->height);
+
+  bo = pi_bo_pool_create(dev, args->size);
+  if (IS_ERR(bo))
+    return PTR_ERR(bo);
+
+  // The handle holds its own reference
+  ret = drm_gem_handle_create(file, &bo->base.base, &args->handle);
+  drm_gem_object_put(&bo->base.base);
+  return ret;
+}
+
+/**
+ * pi_gem_create_ioctl - creates a buffer object in vram or system memory
+ * @dev: DRM device
+ * @data: &struct pi_gem_create
+ * @file: DRM file of the client
+ *
+ * Without a placement flag, small objects go to vram and the others to system
+ * memory. Objects that should go to vram but don't fit (including frames that
+ * would take more than a quarter of it) end up in system memory instead.
+ * Scanout buffers are always in contiguous DMA memory, or not created at all.
+ *
+ * Returns:
+ * 0 on success or a negative error code.
+ */
+int pi_gem_create_ioctl(struct drm_device *dev, void *data,
+                        struct drm_file *file) {
+  struct pi_gem_create *args = data;
+  struct pi_gpu *gpu = to_gpu(dev);
+  struct pi_bo *bo = NULL;
+  size_t size;
+  bool vram;
+  int ret;
+
+  if (args->flags & ~(PI_GEM_VRAM | PI_GEM_SYSTEM | PI_GEM_SCANOUT) ||
+      hweight32(args->flags) > 1 || args->pad)
+    return -EINVAL;
+
+  size = PAGE_ALIGN(args->size);
+  if (!args->size || args->size > SIZE_MAX || size < args->size)
+    return -EINVAL;
+
+  if (args->flags & PI_GEM_SCANOUT) {
+    bo = pi_dma_bo_create(gpu, size);
+    if (IS_ERR(bo))
+      return PTR_ERR(bo);
+    vram = false;
+  } else if (args->flags & PI_GEM_VRAM)
+    vram = true;
+  else if (args->flags & PI_GEM_SYSTEM)
+    vram = false;
+  else
+    vram = size <= VRAM_SMALL_OBJECT;
+
+  if (vram) {
+    if (size <= gpu->vram_heap.size / 4)
+      bo = pi_vram_bo_create(gpu, size);
+    else
+      bo = ERR_PTR(-ENOSPC);
+
+    if (IS_ERR(bo)) {
+      if (PTR_ERR(bo) != -ENOSPC)
+        return PTR_ERR(bo);
+      atomic64_inc(&gpu->mem_stats.vram_fallbacks);
+      bo = NULL;
+    }
+  }
+
+  if (!bo) {
+    bo = pi_bo_pool_create(dev, size);
+    if (IS_ERR(bo))
+      return PTR_ERR(bo);
+  }
+
+  ret = drm_gem_create_mmap_offset(&bo->base.base);
+  if (!ret)
+    ret = drm_gem_handle_create(file, &bo->base.base, &args->handle);
+  if (!ret) {
+    if (pi_bo_is_dma(bo))
+      args->placement = PI_GEM_SCANOUT;
+    else if (pi_bo_in_vram(bo))
+      args->placement = PI_GEM_VRAM;
+    else
+      args->placement = PI_GEM_SYSTEM;
+    args->offset = drm_vma_node_offset_addr(&bo->base.base.vma_node);
+  }
+
+  // The handle holds its own reference
+  drm_gem_object_put(&bo->base.base);
+  return ret;
+}
+
+static void pi_bo_pool_free_work(struct work_struct *work) {
+  struct pi_bo_pool *pool = container_of(work, struct pi_bo_pool, free_work);
+  struct pi_bo *bo, *tmp;
+  LIST_HEAD(dead);
+
+  mutex_lock(&pool->lock);
+  list_splice_init(&pool->dead, &dead);
+  mutex_unlock(&pool->lock);
+
+  list_for_each_entry_safe(bo, tmp, &dead, pool_lru)
+    pi_bo_destroy(bo);
+}
+
+static unsigned long pi_bo_pool_shrinker_count(struct shrinker *shrinker,
+                                               struct shrink_control *sc) {
+  struct pi_bo_pool *pool =
+      container_of(shrinker, struct pi_bo_pool, shrinker);
+
+  return (READ_ONCE(pool->size) >> PAGE_SHIFT) ?: SHRINK_EMPTY;
+}
+
+// Evicts the least recently freed objects, counted in pages
+static unsigned long pi_bo_pool_shrinker_scan(struct shrinker *shrinker,
+                                              struct shrink_control *sc) {
+  struct pi_bo_pool *pool =
+      container_of(shrinker, struct pi_bo_pool, shrinker);
+  struct pi_bo *bo, *tmp;
+  unsigned long freed = 0;
+
+  if (!mutex_trylock(&pool->lock))
+    return SHRINK_STOP;
+
+  list_for_each_entry_safe(bo, tmp, &pool->lru, pool_lru) {
+    if (freed >= sc->nr_to_scan)
+      break;
+    freed += bo->base.base.size >> PAGE_SHIFT;
+    pi_bo_pool_del(pool, bo);
+    list_add_tail(&bo->pool_lru, &pool->dead);
+    pool->evictions++;
+  }
+  mutex_unlock(&pool->lock);
+
+  if (freed)
+    schedule_work(&pool->free_work);
+  return freed ?: SHRINK_STOP;
+}
+
+static int pi_bo_pool_init(struct pi_gpu *gpu) {
+  struct pi_bo_pool *pool = &gpu->bo_pool;
+
+  mutex_init(&pool->lock);
+  hash_init(pool->buckets);
+  INIT_LIST_HEAD(&pool->lru);
+  INIT_LIST_HEAD(&pool->dead);
+  INIT_WORK(&pool->free_work, pi_bo_pool_free_work);
+
+  pool->shrinker.count_objects = pi_bo_pool_shrinker_count;
+  pool->shrinker.scan_objects = pi_bo_pool_shrinker_scan;
+  pool->shrinker.seeks = DEFAULT_SEEKS;
+  return register_shrinker(&pool->shrinker, "pi_gpu-bo-pool");
+}
+
+// Frees everything in the pool, objects freed afterwards aren't pooled anymore
+static void pi_bo_pool_fini(struct pi_gpu *gpu) {
+  struct pi_bo_pool *pool = &gpu->bo_pool;
+
+  // pi_bo_cache_init() failed before getting to the pool
+  if (!pool->free_work.func)
+    return;
+
+  unregister_shrinker(&pool->shrinker);
+
+  mutex_lock(&pool->lock);
+  pool->closed = true;
+  list_splice_tail_init(&pool->lru, &pool->dead);
+  hash_init(pool->buckets);
+  pool->size = 0;
+  mutex_unlock(&pool->lock);
+
+  // Also waits for a run scheduled by the shrinker
+  schedule_work(&pool->free_work);
+  flush_work(&pool->free_work);
+}
+
+/**
+ * pi_bo_vmap - gets the kernel mapping of a buffer object
+ * @bo: buffer object, the caller must hold a reference to it
+ * @map: filled with the mapping
+ *
+ * The mapping is cached, so only the first call (or the first one after the
+ * shrinker reclaimed the mapping) actually maps the object. Every successful
+ * call must be paired with a call to pi_bo_vunmap().
+ *
+ * Returns:
+ * 0 on success or a negative error code.
+ */
+int pi_bo_vmap(struct pi_bo *bo, struct iosys_map *map) {
+  struct drm_gem_object *obj = &bo->base.base;
+  struct pi_bo_cache *cache = &to_gpu(obj->dev)->bo_cache;
+  struct iosys_map new_map;
+  bool hit = true;
+  int ret = 0;
+
+  // Always mapped
+  if (pi_bo_in_vram(bo) || pi_bo_is_dma(bo)) {
+    *map = bo->map;
+    return 0;
+  }
+
+  // Fast path, the mapping can't go away while it's on the LRU list since the
+  // shrinker also needs the lock
+  mutex_lock(&cache->lock);
+  if (!iosys_map_is_null(&bo->map) && !bo->moving)
+    goto use;
+  mutex_unlock(&cache->lock);
+
+  dma_resv_lock(obj->resv, NULL);
+
+  // Only mapped with the reservation lock held, so if it's still not mapped,
+  // nobody else is mapping it either. The cache lock isn't held while mapping
+  // since the shrinker could be called while allocating.
+  if (iosys_map_is_null(&bo->map)) {
+    ret = drm_gem_shmem_vmap(&bo->base, &new_map);
+    if (!ret && new_map.is_iomem) {
+      drm_gem_shmem_vunmap(&bo->base, &new_map);
+      ret = -EINVAL;
+    }
+    hit = false;
+  }
+
+  mutex_lock(&cache->lock);
+  if (!ret && !hit)
+    bo->map = new_map;
+  dma_resv_unlock(obj->resv);
+  if (ret) {
+    mutex_unlock(&cache->lock);
+    return ret;
+  }
+
+use:
+  if (hit)
+    cache->hits++;
+  else
+    cache->misses++;
+
+  if (bo->users++ == 0 && !list_empty(&bo->lru)) {
+    list_del_init(&bo->lru);
+    cache->num_idle--;
+  }
+  *map = bo->map;
+  mutex_unlock(&cache->lock);
+  return 0;
+}
+
+/*
+ * Releases a mapping obtained with pi_bo_vmap(). The object stays mapped, the
+ * shrinker can reclaim the mapping once nobody uses it anymore.
+ */
+void pi_bo_vunmap(struct pi_bo *bo) {
+  struct pi_bo_cache *cache = &to_gpu(bo->base.base.dev)->bo_cache;
+
+  bool idle = false;
+
+  if (pi_bo_in_vram(bo) || pi_bo_is_dma(bo))
+    return;
+
+  mutex_lock(&cache->lock);
+  if (!WARN_ON(!bo->users) && --bo->users == 0) {
+    idle = true;
+    // Vram isn't reclaimed by the shrinker
+    if (!pi_bo_resident(bo)) {
+      list_add_tail(&bo->lru, &cache->lru);
+      cache->num_idle++;
+    }
+  }
+  mutex_unlock(&cache->lock);
+
+  // Objects only move while no job uses them
+  if (idle && READ_ONCE(bo->res.promote))
+    pi_residency_queue(to_gpu(bo->base.base.dev), bo);
+}
+
+/*
+ * Called with the reservation lock held before the residency manager moves an
+ * object. Fails if a job uses the object, otherwise new users wait until
+ * pi_bo_end_move().
+ */
+bool pi_bo_begin_move(struct pi_bo *bo) {
+  struct pi_bo_cache *cache = &to_gpu(bo->base.base.dev)->bo_cache;
+
+  mutex_lock(&cache->lock);
+  if (bo->users) {
+    mutex_unlock(&cache->lock);
+    return false;
+  }
+
+  bo->moving = true;
+  if (!list_empty(&bo->lru)) {
+    list_del_init(&bo->lru);
+    cache->num_idle--;
+  }
+  mutex_unlock(&cache->lock);
+  return true;
+}
+
+// Sets the mapping of the object once it moved (or didn't), with the
+// reservation lock still held
+void pi_bo_end_move(struct pi_bo *bo, struct iosys_map *map) {
+  struct pi_bo_cache *cache = &to_gpu(bo->base.base.dev)->bo_cache;
+
+  mutex_lock(&cache->lock);
+  bo->map = *map;
+  bo->moving = false;
+  if (!iosys_map_is_null(map) && !pi_bo_resident(bo)) {
+    list_add_tail(&bo->lru, &cache->lru);
+    cache->num_idle++;
+  }
+  mutex_unlock(&cache->lock);
+}
+
+static unsigned long pi_bo_shrinker_count(struct shrinker *shrinker,
+                                          struct shrink_control *sc) {
+  struct pi_bo_cache *cache =
+      container_of(shrinker, struct pi_bo_cache, shrinker);
+
+  return READ_ONCE(cache->num_idle) ?: SHRINK_EMPTY;
+}
+
+/*
+ * Unmaps idle objects, least recently used first. Only trylocks are used,
+ * since we can be called while someone holds the locks and allocates memory.
+ */
+static unsigned long pi_bo_shrinker_scan(struct shrinker *shrinker,
+                                         struct shrink_control *sc) {
+  struct pi_bo_cache *cache =
+      container_of(shrinker, struct pi_bo_cache, shrinker);
+  struct pi_bo *bo, *tmp;
+  unsigned long freed = 0;
+
+  if (!mutex_trylock(&cache->lock))
+    return SHRINK_STOP;
+
+  list_for_each_entry_safe(bo, tmp, &cache->lru, lru) {
+    struct dma_resv *resv = bo->base.base.resv;
+
+    if (freed >= sc->nr_to_scan)
+      break;
+    if (!dma_resv_trylock(resv))
+      continue;
+
+    list_del_init(&bo->lru);
+    cache->num_idle--;
+    cache->evictions++;
+
+    // Drops the vmap and unpins the pages, they can be swapped out again
+    drm_gem_shmem_vunmap(&bo->base, &bo->map);
+    iosys_map_clear(&bo->map);
+    dma_resv_unlock(resv);
+    freed++;
+  }
+  mutex_unlock(&cache->lock);
+
+  return freed ?: SHRINK_STOP;
+}
+
+int pi_bo_cache_init(struct pi_gpu *gpu) {
+  struct pi_bo_cache *cache = &gpu->bo_cache;
+  int ret;
+
+  mutex_init(&cache->lock);
+  INIT_LIST_HEAD(&cache->lru);
+
+  cache->shrinker.count_objects = pi_bo_shrinker_count;
+  cache->shrinker.scan_objects = pi_bo_shrinker_scan;
+  cache->shrinker.seeks = DEFAULT_SEEKS;
+  ret = register_shrinker(&cache->shrinker, "pi_gpu-vmap");
+  if (ret)
+    return ret;
+
+  return pi_bo_pool_init(gpu);
+}
+
+// Runs when the drm device is released, by then only the pool still holds
+// objects
+void pi_bo_cache_fini(struct pi_gpu *gpu) {
+  // Pooled objects are still on the LRU list of the mapping cache
+  pi_bo_pool_fini(gpu);
+  unregister_shrinker(&gpu->bo_cache.shrinker);
+}
+
+/*-------------------------------------------------------------------------------
+ * Benchmark
+ *
+ * A steady-state render loop maps the same 16KB instruction buffer and 1080p
+ * frame over and over. The benchmark's own hits count in the next read.
+ *-------------------------------------------------------------------------------
+ */
+
+#define PI_BO_BENCH_ITERATIONS 256
+
+static int pi_bo_cache_show(struct seq_file *m, void *unused) {
+  struct drm_debugfs_entry *entry = m->private;
+  struct pi_gpu *gpu = to_gpu(entry->dev);
+  struct pi_bo_cache *cache = &gpu->bo_cache;
+  const size_t sizes[] = {16 * 1024, 1920 * 1080 * 4};
+  struct drm_gem_shmem_object *objs[ARRAY_SIZE(sizes)] = {};
+  u64 hits, misses, evictions, submits, submit_ns;
+  u64 uncached_ns, cached_ns, start;
+  struct iosys_map map;
+  int ret = 0;
+
+  mutex_lock(&cache->lock);
+  hits = cache->hits;
+  misses = cache->misses;
+  evictions = cache->evictions;
+  mutex_unlock(&cache->lock);
+  submits = atomic64_read(&gpu->submit_stats.submits);
+  submit_ns = atomic64_read(&gpu->submit_stats.ns);
+
+  seq_printf(m, "hits: %llu, misses: %llu, hit rate: %llu%%\n", hits, misses,
+             div64_u64(hits * 100, max_t(u64, hits + misses, 1)));
+  seq_printf(m, "idle mappings: %u, evictions: %llu\n",
+             READ_ONCE(cache->num_idle), evictions);
+  seq_printf(m, "submits: %llu, average submit latency: %llu ns\n", submits,
+             div64_u64(submit_ns, max_t(u64, submits, 1)));
+
+  for (unsigned int i = 0; i < ARRAY_SIZE(sizes); i++) {
+    objs[i] = drm_gem_shmem_create(&gpu->drm_device, sizes[i]);
+    if (IS_ERR(objs[i])) {
+      ret = PTR_ERR(objs[i]);
+      objs[i] = NULL;
+      goto out;
+    }
+  }
+
+  // What every submission used to do
+  start = ktime_get_ns();
+  for (int n = 0; n < PI_BO_BENCH_ITERATIONS && !ret; n++) {
+    for (unsigned int i = 0; i < ARRAY_SIZE(objs) && !ret; i++) {
+      struct dma_resv *resv = objs[i]->base.resv;
+
+      dma_resv_lock(resv, NULL);
+      ret = drm_gem_shmem_vmap(objs[i], &map);
+      if (!ret)
+        drm_gem_shmem_vunmap(objs[i], &map);
+      dma_resv_unlock(resv);
+    }
+  }
+  uncached_ns = ktime_get_ns() - start;
+
+  start = ktime_get_ns();
+  for (int n = 0; n < PI_BO_BENCH_ITERATIONS && !ret; n++) {
+    for (unsigned int i = 0; i < ARRAY_SIZE(objs) && !ret; i++) {
+      struct pi_bo *bo = to_pi_bo(&objs[i]->base);
+
+      ret = pi_bo_vmap(bo, &map);
+      if (!ret)
+        pi_bo_vunmap(bo);
+    }
+  }
+  cached_ns = ktime_get_ns() - start;
+
+  if (ret)
+    goto out;
+
+  seq_printf(m, "mapping a job's buffers: uncached %llu ns, cached %llu ns\n",
+             div64_u64(uncached_ns, PI_BO_BENCH_ITERATIONS),
+             div64_u64(cached_ns, PI_BO_BENCH_ITERATIONS));
+
+out:
+  for (unsigned int i = 0; i < ARRAY_SIZE(objs); i++) {
+    if (objs[i])
+      drm_gem_object_put(&objs[i]->base);
+  }
+  return ret;
+}
+
+#define PI_BO_POOL_BENCH_ITERATIONS 64
+
+// A cycle creates a buffer, populates its pages like a client would, and frees
+// it again
+static u64 pi_bo_pool_cycles(struct pi_gpu *gpu, size_t size, bool pooled,
+                             int *ret) {
+  struct iosys_map map;
+  u64 start, elapsed;
+
+  start = ktime_get_ns();
+  for (int n = 0; n < PI_BO_POOL_BENCH_ITERATIONS && !*ret; n++) {
+    struct drm_gem_shmem_object *shmem;
+    struct pi_bo *bo;
+
+    if (pooled) {
+      bo = pi_bo_pool_create(&gpu->drm_device, size);
+      if (IS_ERR(bo)) {
+        *ret = PTR_ERR(bo);
+        break;
+      }
+      *ret = pi_bo_vmap(bo, &map);
+      if (!*ret)
+        pi_bo_vunmap(bo);
+      drm_gem_object_put(&bo->base.base);
+    } else {
+      // What dumb_create used to do
+      shmem = drm_gem_shmem_create(&gpu->drm_device, size);
+      if (IS_ERR(shmem)) {
+        *ret = PTR_ERR(shmem);
+        break;
+      }
+      dma_resv_lock(shmem->base.resv, NULL);
+      *ret = drm_gem_shmem_vmap(shmem, &map);
+      if (!*ret)
+        drm_gem_shmem_vunmap(shmem, &map);
+      dma_resv_unlock(shmem->base.resv);
+      drm_gem_object_put(&shmem->base);
+    }
+  }
+  elapsed = ktime_get_ns() - start;
+
+  return div64_u64((u64)PI_BO_POOL_BENCH_ITERATIONS * NSEC_PER_SEC,
+                   max_t(u64, elapsed, 1));
+}
+
+static int pi_bo_pool_show(struct seq_file *m, void *unused) {
+  struct drm_debugfs_entry *entry = m->private;
+  struct pi_gpu *gpu = to_gpu(entry->dev);
+  struct pi_bo_pool *pool = &gpu->bo_pool;
+  const size_t sizes[] = {64 * 1024, 1024 * 1024, 1920 * 1080 * 4};
+  u64 hits, misses, evictions, uncached, cached;
+  size_t size;
+  int ret = 0;
+
+  mutex_lock(&pool->lock);
+  hits = pool->hits;
+  misses = pool->misses;
+  evictions = pool->evictions;
+  size = pool->size;
+  mutex_unlock(&pool->lock);
+
+  seq_printf(m, "hits: %llu, misses: %llu, hit rate: %llu%%\n", hits, misses,
+             div64_u64(hits * 100, max_t(u64, hits + misses, 1)));
+  seq_printf(m, "pooled: %zu KB of %u MB, evictions: %llu\n", size >> 10,
+             READ_ONCE(bo_pool_mb), evictions);
+
+  if (!READ_ONCE(bo_pool_mb))
+    return 0;
+
+  for (unsigned int i = 0; i < ARRAY_SIZE(sizes) && !ret; i++) {
+    uncached = pi_bo_pool_cycles(gpu, sizes[i], false, &ret);
+    cached = pi_bo_pool_cycles(gpu, sizes[i], true, &ret);
+    if (!ret)
+      seq_printf(m, "%7zu KB: %llu cycles/s without the pool, %llu with\n",
+                 sizes[i] >> 10, uncached, cached);
+  }
+
+  return ret;
+}
+
+static int pi_mem_show(struct seq_file *m, void *unused) {
+  struct drm_debugfs_entry *entry = m->private;
+  struct pi_gpu *gpu = to_gpu(entry->dev);
+  struct pi_mem_stats *stats = &gpu->mem_stats;
+
+  seq_printf(m, "vram: %lld objects, %lld KB of %llu KB\n",
+             atomic64_read(&stats->vram_objects),
+             atomic64_read(&stats->vram_bytes) >> 10,
+             gpu->vram_heap.size >> 10);
+  seq_printf(m, "system: %lld objects, %lld KB (%zu KB in the recycle pool)\n",
+             atomic64_read(&stats->system_objects),
+             atomic64_read(&stats->system_bytes) >> 10,
+             READ_ONCE(gpu->bo_pool.size) >> 10);
+  seq_printf(m, "scanout: %lld objects, %lld KB\n",
+             atomic64_read(&stats->dma_objects),
+             atomic64_read(&stats->dma_bytes) >> 10);
+  seq_printf(m, "vram fallbacks: %lld\n",
+             atomic64_read(&stats->vram_fallbacks));
+  return 0;
+}
+
+static const struct drm_debugfs_info pi_bo_debugfs_list[] = {
+    {"bo_cache", pi_bo_cache_show, 0},
+    {"bo_pool", pi_bo_pool_show, 0},
+    {"mem", pi_mem_show, 0},
+};
+
+void pi_bo_debugfs_init(struct pi_gpu *gpu) {
+  drm_debugfs_add_files(&gpu->drm_device, pi_bo_debugfs_list,
+                        ARRAY_SIZE(pi_bo_debugfs_list));
+}
@@ -0,0 +1,150 @@
+#ifndef BO_H
+#define BO_H
+
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_gem_shmem_helper.h"
+#include "drm/drm_mm.h"
+#include "linux/atomic.h"
+#include "linux/hashtable.h"
+#include "linux/iosys-map.h"
+#include "linux/list.h"
+#include "linux/mutex.h"
+#include "linux/shrinker.h"
+#include "linux/workqueue.h"
+
+#include "residency.h"
+#include "validate.h"
+
+struct drm_file;
+struct drm_mode_create_dumb;
+struct pi_gpu;
+
+/*
+ * Buffer object of the driver. A shmem object that keeps its kernel mapping
+ * across submissions: the pages are pinned and vmapped by the first job using
+ * the object, and stay that way until the object is freed or the shrinker
+ * reclaims the mapping.
+ *
+ * Objects placed in vram (see vram.c) and objects in contiguous DMA memory (see
+ * dma_bo.c) only use the drm_gem_object of base, none of the shmem helpers can
+ * be used on them.
+ */
+struct pi_bo {
+  struct drm_gem_shmem_object base;
+
+  // Cached kernel mapping. Only set or cleared with both the reservation lock
+  // of the object and bo_cache.lock held, so holding either is enough to read
+  // it. Objects in vram are mapped for their whole life.
+  struct iosys_map map;
+
+  // Range of vram of the object, for objects in vram and objects the residency
+  // manager promoted
+  struct drm_mm_node vram_node;
+  struct pi_bo_residency res;
+
+  // Bus address of objects in contiguous DMA memory, what the display scans out
+  dma_addr_t dma_addr;
+
+  // Protected by bo_cache.lock. Objects with a mapping nobody uses are on the
+  // LRU list of the cache, the least recently used one first.
+  u32 users;
+  struct list_head lru;
+  // Set while the residency manager moves the object, pi_bo_vmap() then waits
+  // for the reservation lock
+  bool moving;
+
+  // Command streams of the object that passed validation, see validate.c
+  struct pi_cmd_cache cmd_cache;
+
+  // Objects created through pi_bo_pool_create() go back to the pool instead of
+  // being freed. Once in the pool, the object is on a bucket of its size and on
+  // the LRU list of the pool, both protected by bo_pool.lock.
+  bool poolable;
+  struct hlist_node pool_node;
+  struct list_head pool_lru;
+};
+
+struct pi_bo_cache {
+  struct mutex lock;
+  struct list_head lru;
+  u32 num_idle; // objects on the LRU list
+
+  u64 hits;
+  u64 misses;
+  u64 evictions;
+
+  struct shrinker shrinker;
+};
+
+/*
+ * Recently freed dumb buffers, kept with their pages (and kernel mapping, if
+ * they have one) so that allocating a buffer of the same size again doesn't
+ * go through shmem. Bounded by the bo_pool_mb module parameter, and emptied
+ * by the shrinker under memory pressure.
+ */
+struct pi_bo_pool {
+  struct mutex lock;
+  // By size only: pooled objects are all shmem objects in system memory, made
+  // by pi_bo_pool_create() which takes no other attribute
+  DECLARE_HASHTABLE(buckets, 6);
+  struct list_head lru;          // least recently freed first
+  size_t size;                   // of all the objects in the pool, in bytes
+  bool closed;
+
+  u64 hits;
+  u64 misses;
+  u64 evictions;
+
+  // The shrinker can't free objects itself, it could be called while a
+  // reservation lock is held. Evicted objects are freed by the worker.
+  struct list_head dead;
+  struct work_struct free_work;
+  struct shrinker shrinker;
+};
+
+// Memory used by the buffer objects created by clients, per placement
+struct pi_mem_stats {
+  atomic64_t vram_objects;
+  atomic64_t vram_bytes;
+  atomic64_t system_objects; // including the ones in the recycle pool
+  atomic64_t system_bytes;
+  atomic64_t dma_objects; // scanout buffers
+  atomic64_t dma_bytes;
+  // Objects that should have gone to vram but didn't fit
+  atomic64_t vram_fallbacks;
+};
+
+static inline struct pi_bo *to_pi_bo(struct drm_gem_object *obj) {
+  return container_of(obj, struct pi_bo, base.base);
+}
+
+bool pi_is_bo(struct drm_gem_object *obj);
+
+void pi_bo_init(struct pi_bo *bo);
+
+struct drm_gem_object *pi_gem_create_object(struct drm_device *dev,
+                                            size_t size);
+
+struct pi_bo *pi_bo_pool_create(struct drm_device *dev, size_t size);
+
+int pi_dumb_create(struct drm_file *file, struct drm_device *dev,
+                   struct drm_mode_create_dumb *args);
+
+int pi_gem_create_ioctl(struct drm_device *dev, void *data,
+                        struct drm_file *file);
+
+int pi_bo_vmap(struct pi_bo *bo, struct iosys_map *map);
+
+bool pi_bo_begin_move(struct pi_bo *bo);
+
+void pi_bo_end_move(struct pi_bo *bo, struct iosys_map *map);
+
+void pi_bo_vunmap(struct pi_bo *bo);
+
+int pi_bo_cache_init(struct pi_gpu *gpu);
+
+void pi_bo_cache_fini(struct pi_gpu *gpu);
+
+void pi_bo_debugfs_init(struct pi_gpu *gpu);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * Description:
+ * Buffer object lists. A client creates a list once with the handles its jobs
+ * use, and then passes the ID of the list to the exec ioctls instead of an
+ * array of handles. The lists are per client (per &drm_file), just like the
+ * handles themselves.
+ */
+#include "asm-generic/errno-base.h"
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_device.h"
+#include "drm/drm_file.h"
+#include "drm/drm_gem.h"
+#include "linux/err.h"
+#include "linux/idr.h"
+#include "linux/kref.h"
+#include "linux/mutex.h"
+#include "linux/slab.h"
+#include "linux/uaccess.h"
+
+#include "bo.h"
+#include "bo_list.h"
+#include "driver.h"
+#include "execbuffer.h"
+
+static void pi_bo_list_release(struct kref *ref) {
+  struct pi_bo_list *list = container_of(ref, struct pi_bo_list, ref);
+
+  for (u32 i = 0; i < list->num_entries; i++) {
+    struct pi_bo *bo = list->entries[i].bo;
+
+    if (!iosys_map_is_null(&list->entries[i].map))
+      pi_bo_vunmap(bo);
+    drm_gem_object_put(&bo->base.base);
+  }
+  kvfree(list->entries);
+  kfree(list);
+}
+
+void pi_bo_list_put(struct pi_bo_list *list) {
+  kref_put(&list->ref, pi_bo_list_release);
+}
+
+/*
+ * Returns:
+ * A new reference to the list with the given ID, or NULL if the client doesn't
+ * have such a list.
+ */
+struct pi_bo_list *pi_bo_list_get(struct drm_file *file, u32 id) {
+  struct pi_file *pfile = file->driver_priv;
+  struct pi_bo_list *list;
+
+  mutex_lock(&pfile->lock);
+  list = idr_find(&pfile->bo_lists, id);
+  if (list)
+    kref_get(&list->ref);
+  mutex_unlock(&pfile->lock);
+
+  return list;
+}
+
+static int pi_bo_list_fini_entry(int id, void *p, void *data) {
+  pi_bo_list_put(p);
+  return 0;
+}
+
+// Drops the lists the client didn't destroy itself
+void pi_bo_list_file_fini(struct pi_file *pfile) {
+  idr_for_each(&pfile->bo_lists, pi_bo_list_fini_entry, NULL);
+  idr_destroy(&pfile->bo_lists);
+}
+
+static int pi_bo_list_add(struct drm_device *dev, struct drm_file *file,
+                          struct pi_bo_list *list,
+                          const struct pi_exec_buffer_obj *obj) {
+  struct pi_bo_list_entry *entry = &list->entries[list->num_entries];
+  struct drm_gem_object *gem;
+
+  switch (obj->flag) {
+  case INS_OBJ:
+    if (list->ins >= 0)
+      return -EINVAL;
+    list->ins = list->num_entries;
+    break;
+  case FRM_OBJ:
+    if (list->frm >= 0)
+      return -EINVAL;
+    list->frm = list->num_entries;
+    break;
+  case DATA_OBJ:
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  gem = drm_gem_object_lookup(file, obj->handle);
+  if (!gem)
+    return -ENOENT;
+
+  if (gem->dev != dev || !pi_is_bo(gem)) {
+    drm_gem_object_put(gem);
+    return -ENODEV;
+  }
+
+  // From now on the entry is released with the list
+  entry->bo = to_pi_bo(gem);
+  entry->flag = obj->flag;
+  list->num_entries++;
+
+  return pi_bo_vmap(entry->bo, &entry->map);
+}
+
+int pi_bo_list_create_ioctl(struct drm_device *dev, void *data,
+                            struct drm_file *file) {
+  struct pi_file *pfile = file->driver_priv;
+  struct pi_bo_list_create *args = data;
+  struct pi_exec_buffer_obj *objs;
+  struct pi_bo_list *list;
+  int ret = 0;
+
+  if (!args->num_entries || args->num_entries > PI_MAX_BO_LIST_ENTRIES)
+    return -EINVAL;
+
+  objs = kvmalloc_array(args->num_entries, sizeof(*objs), GFP_KERNEL);
+  list = kzalloc(sizeof(*list), GFP_KERNEL);
+  if (!objs || !list) {
+    ret = -ENOMEM;
+    goto free;
+  }
+
+  kref_init(&list->ref);
+  list->ins = -1;
+  list->frm = -1;
+  list->entries =
+      kvcalloc(args->num_entries, sizeof(*list->entries), GFP_KERNEL);
+  if (!list->entries) {
+    ret = -ENOMEM;
+    goto free;
+  }
+
+  if (copy_from_user(objs, u64_to_user_ptr(args->entries),
+                     args->num_entries * sizeof(*objs))) {
+    ret = -EFAULT;
+    goto put;
+  }
+
+  for (u32 i = 0; i < args->num_entries; i++) {
+    ret = pi_bo_list_add(dev, file, list, &objs[i]);
+    if (ret)
+      goto put;
+  }
+
+  mutex_lock(&pfile->lock);
+  ret = idr_alloc(&pfile->bo_lists, list, 1, 0, GFP_KERNEL);
+  mutex_unlock(&pfile->lock);
+  if (ret < 0)
+    goto put;
+
+  args->id = ret;
+  kvfree(objs);
+  return 0;
+
+put:
+  pi_bo_list_put(list);
+  kvfree(objs);
+  return ret;
+
+free:
+  kfree(list);
+  kvfree(objs);
+  return ret;
+}
+
+int pi_bo_list_destroy_ioctl(struct drm_device *dev, void *data,
+                             struct drm_file *file) {
+  struct pi_file *pfile = file->driver_priv;
+  struct pi_bo_list_destroy *args = data;
+  struct pi_bo_list *list;
+
+  mutex_lock(&pfile->lock);
+  list = idr_remove(&pfile->bo_lists, args->id);
+  mutex_unlock(&pfile->lock);
+
+  if (!list)
+    return -ENOENT;
+
+  // Jobs still using the list keep it alive
+  pi_bo_list_put(list);
+  return 0;
+}
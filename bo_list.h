@@ -0,0 +1,50 @@
+#ifndef BO_LIST_H
+#define BO_LIST_H
+
+#include "asm-generic/int-ll64.h"
+#include "linux/iosys-map.h"
+#include "linux/kref.h"
+
+struct drm_device;
+struct drm_file;
+struct pi_bo;
+struct pi_file;
+
+struct pi_bo_list_entry {
+  struct pi_bo *bo;
+  struct iosys_map map;
+  u8 flag; // INS_OBJ, FRM_OBJ or DATA_OBJ
+};
+
+/*
+ * Buffer objects resolved once and reused by many submissions. Every object of
+ * the list is referenced and mapped for as long as the list exists, so
+ * submitting with a list doesn't look up or map anything.
+ *
+ * Jobs hold a reference to the list, so destroying it while jobs using it are
+ * still running is fine.
+ */
+struct pi_bo_list {
+  struct kref ref;
+
+  u32 num_entries;
+  struct pi_bo_list_entry *entries;
+
+  // Index of the instruction and frame buffer objects, -1 if there's none
+  s32 ins;
+  s32 frm;
+};
+
+struct pi_bo_list *pi_bo_list_get(struct drm_file *file, u32 id);
+
+void pi_bo_list_put(struct pi_bo_list *list);
+
+void pi_bo_list_file_fini(struct pi_file *pfile);
+
+int pi_bo_list_create_ioctl(struct drm_device *dev, void *data,
+                            struct drm_file *file);
+
+int pi_bo_list_destroy_ioctl(struct drm_device *dev, void *data,
+                             struct drm_file *file);
+
+#endif
@@ -0,0 +1,798 @@
+/*
+ * Description:
+ * Composition of the planes of the CRTC into display memory.
+ *
+ * The display only reads one frame, so the planes are composed into display
+ * memory by the flush, only over the damaged rectangles and a row at a time.
+ * Each plane is shown at its own position (its destination rectangle) from its
+ * own source rectangle, in zpos order. Planes with an alpha channel are
+ * blended with their pixel blend mode (premultiplied or coverage) and plane
+ * alpha by a SIMD kernel (compose_neon.c and compose_x86.c), the scalar one
+ * being the reference.
+ *
+ * Scaled planes are interpolated as they're fetched, a row at a time (see
+ * scale.c), so they cost the size they're shown at. Tiled framebuffers
+ * (PI_FORMAT_MOD_TILED_8X8) are detiled the same way, a row of micro-tiles
+ * being 8 contiguous pixels each.
+ *
+ * Opaque planes are copied instead of blended, and whatever is below one that
+ * covers a whole rectangle isn't read at all. The kernels also copy runs of
+ * opaque pixels and skip transparent ones, so a video or UI overlay that is
+ * mostly one or the other costs little more than a copy.
+ */
+#include "asm-generic/errno-base.h"
+#include "asm-generic/int-ll64.h"
+#include "asm/simd.h"
+#include "drm/drm_blend.h"
+#include "drm/drm_crtc.h"
+#include "drm/drm_debugfs.h"
+#include "drm/drm_fourcc.h"
+#include "drm/drm_framebuffer.h"
+#include "drm/drm_plane.h"
+#include "drm/drm_rect.h"
+#include "linux/bug.h"
+#include "linux/ktime.h"
+#include "linux/math64.h"
+#include "linux/minmax.h"
+#include "linux/mutex.h"
+#include "linux/random.h"
+#include "linux/seq_file.h"
+#include "linux/string.h"
+#include "linux/vmalloc.h"
+
+#ifdef CONFIG_ARM64
+#include "asm/cpufeature.h"
+#endif
+
+#ifdef CONFIG_X86_64
+#include "asm/cpufeature.h"
+#endif
+
+#include "compose.h"
+#include "convert.h"
+#include "driver.h"
+#include "executor.h"
+#include "raster.h"
+#include "scale.h"
+#include "simd.h"
+
+void pi_blend_premulti_scalar(u32 *dst, const u32 *src, unsigned int pixels,
+                              u8 alpha) {
+  for (unsigned int i = 0; i < pixels; i++) {
+    u32 s = src[i], d = dst[i], a, out = 0;
+
+    // A premultiplied pixel only adds nothing if all of it is 0
+    if (!s)
+      continue;
+    if (alpha == 255 && s >> 24 == 255) {
+      dst[i] = s;
+      continue;
+    }
+
+    a = pi_div255((s >> 24) * alpha);
+    for (int c = 0; c < 32; c += 8) {
+      u32 sc = pi_div255(((s >> c) & 0xff) * alpha);
+
+      out |= min(sc + pi_div255(((d >> c) & 0xff) * (255 - a)), 255U) << c;
+    }
+    dst[i] = out;
+  }
+}
+
+void pi_blend_coverage_scalar(u32 *dst, const u32 *src, unsigned int pixels,
+                              u8 alpha) {
+  for (unsigned int i = 0; i < pixels; i++) {
+    u32 s = src[i], d = dst[i], a = pi_div255((s >> 24) * alpha), out = 0;
+
+    if (a == 0)
+      continue;
+    if (a == 255) {
+      dst[i] = s;
+      continue;
+    }
+
+    for (int c = 0; c < 32; c += 8)
+      out |= pi_div255(((s >> c) & 0xff) * a + ((d >> c) & 0xff) * (255 - a))
+             << c;
+    dst[i] = out;
+  }
+}
+
+static bool pi_blend_always_usable(void) { return true; }
+
+#ifdef CONFIG_ARM64
+static bool pi_blend_neon_usable(void) {
+  return cpu_have_named_feature(ASIMD);
+}
+#endif
+
+const struct pi_blend_impl pi_blend_impls[] = {
+    {"scalar", pi_blend_premulti_scalar, pi_blend_coverage_scalar, false,
+     pi_blend_always_usable},
+#ifdef CONFIG_ARM64
+    {"neon", pi_blend_premulti_neon, pi_blend_coverage_neon, true,
+     pi_blend_neon_usable},
+#endif
+#ifdef CONFIG_X86_64
+    // Every x86-64 CPU has SSE2
+    {"sse2", pi_blend_premulti_sse2, pi_blend_coverage_sse2, true,
+     pi_blend_always_usable},
+#endif
+};
+
+const unsigned int pi_num_blend_impls = ARRAY_SIZE(pi_blend_impls);
+
+void pi_compose_init(struct pi_gpu *gpu) {
+  mutex_init(&gpu->compose.lock);
+  for (int i = pi_num_blend_impls - 1; i >= 0; i--) {
+    if (pi_blend_impls[i].usable()) {
+      gpu->blend = &pi_blend_impls[i];
+      return;
+    }
+  }
+}
+
+// The kernels a row is composed with
+struct pi_compose_kernels {
+  const struct pi_blend_impl *blend;
+  const struct pi_convert_impl *convert;
+  const struct pi_scale_impl *scale;
+};
+
+/*
+ * Same as for the rasterizer, the SIMD registers have to be claimed first.
+ * The blending, conversion and scaling kernels all run in between, the scalar
+ * ones being used if the registers can't be claimed. Returns whether they were.
+ */
+static bool pi_compose_begin(struct pi_gpu *gpu,
+                             struct pi_compose_kernels *kernels) {
+  kernels->blend = gpu->blend;
+  kernels->convert = gpu->convert;
+  kernels->scale = gpu->scale;
+  if (!kernels->blend->simd && !kernels->convert->simd &&
+      !kernels->scale->simd)
+    return false;
+  if (!may_use_simd()) {
+    kernels->blend = &pi_blend_impls[0];
+    kernels->convert = &pi_convert_impls[0];
+    kernels->scale = &pi_scale_impls[0];
+    return false;
+  }
+
+  pi_simd_begin();
+  return true;
+}
+
+static bool pi_rect_contains(const struct drm_rect *outer,
+                             const struct drm_rect *inner) {
+  return outer->x1 <= inner->x1 && outer->y1 <= inner->y1 &&
+         outer->x2 >= inner->x2 && outer->y2 >= inner->y2;
+}
+
+/**
+ * pi_compose_layers - gets the visible planes of a CRTC
+ * @crtc: the CRTC, in the commit tail
+ * @layers: filled with the planes, at most %PI_MAX_LAYERS
+ *
+ * The framebuffers are the mappings the plane states hold (see
+ * pi_plane_helper_prepare_fb()). The filters of the scaled planes are updated,
+ * so the composition lock must be held.
+ *
+ * Returns:
+ * The number of planes, sorted from the bottom one to the top one.
+ */
+unsigned int pi_compose_layers(struct drm_crtc *crtc, struct pi_layer *layers) {
+  struct pi_gpu *gpu = to_gpu(crtc->dev);
+  struct drm_plane *plane;
+  unsigned int num = 0;
+
+  drm_for_each_plane_mask(plane, crtc->dev, crtc->state->plane_mask) {
+    struct drm_plane_state *state = plane->state;
+    struct drm_framebuffer *fb = state->fb;
+    struct pi_layer layer;
+    unsigned int i;
+
+    if (!fb || !state->visible || WARN_ON(num == PI_MAX_LAYERS))
+      continue;
+
+    layer.state = state;
+    layer.vaddr =
+        (const u8 *)to_pi_primary_plane(state)->map.vaddr + fb->offsets[0];
+    layer.format = fb->format;
+    layer.pitch = fb->pitches[0];
+    layer.dst = state->dst;
+    layer.src_x = state->src.x1 >> 16;
+    layer.src_y = state->src.y1 >> 16;
+    layer.alpha = state->alpha >> 8;
+    layer.pixel_alpha = fb->format->has_alpha &&
+                        state->pixel_blend_mode != DRM_MODE_BLEND_PIXEL_NONE;
+    layer.premulti = state->pixel_blend_mode == DRM_MODE_BLEND_PREMULTI;
+    layer.opaque = !layer.pixel_alpha && layer.alpha == 255;
+    layer.tiled = fb->modifier == PI_FORMAT_MOD_TILED_8X8;
+    layer.scaler = NULL;
+    if (pi_scale_needed(&state->src, &state->dst)) {
+      struct pi_scaler *scaler = &gpu->scalers[drm_plane_index(plane)];
+
+      pi_scaler_update(scaler, &state->src, &state->dst);
+      layer.scaler = scaler;
+    }
+
+    for (i = num; i > 0 && layers[i - 1].state->normalized_zpos >
+                               state->normalized_zpos;
+         i--)
+      layers[i] = layers[i - 1];
+    layers[i] = layer;
+    num++;
+  }
+  return num;
+}
+
+// The pixel at x, y in the framebuffer of a layer
+static const u8 *pi_layer_fb_pixel(const struct pi_layer *layer, int x, int y) {
+  if (layer->tiled)
+    return layer->vaddr +
+           pi_tiled_offset(x, y, layer->pitch, layer->format->cpp[0]);
+  return layer->vaddr + y * layer->pitch + x * layer->format->cpp[0];
+}
+
+// The pixel of an unscaled linear layer shown at x, y in CRTC coordinates
+static const u8 *pi_layer_pixel(const struct pi_layer *layer, int x, int y) {
+  return pi_layer_fb_pixel(layer, layer->src_x + x - layer->dst.x1,
+                           layer->src_y + y - layer->dst.y1);
+}
+
+/*
+ * Gets width contiguous pixels of a framebuffer from src as ARGB8888. 32 bit
+ * framebuffers are read in place, unless opaque asks for their X or alpha byte
+ * to be set, the others are expanded into tmp.
+ */
+static const u32 *pi_layer_pixels(const struct pi_layer *layer, const u8 *src,
+                                  unsigned int width, u32 *tmp, bool opaque) {
+  switch (layer->format->format) {
+  case DRM_FORMAT_RGB565:
+    for (unsigned int i = 0; i < width; i++) {
+      u32 p = ((const u16 *)src)[i];
+      u32 r = p >> 11, g = (p >> 5) & 0x3f, b = p & 0x1f;
+
+      tmp[i] = 0xff000000 | (r << 3 | r >> 2) << 16 | (g << 2 | g >> 4) << 8 |
+               (b << 3 | b >> 2);
+    }
+    return tmp;
+  case DRM_FORMAT_RGB888:
+    for (unsigned int i = 0; i < width; i++)
+      tmp[i] = 0xff000000 | src[3 * i + 2] << 16 | src[3 * i + 1] << 8 |
+               src[3 * i];
+    return tmp;
+  default:
+    if (!opaque)
+      return (const u32 *)src;
+    for (unsigned int i = 0; i < width; i++)
+      tmp[i] = ((const u32 *)src)[i] | 0xff000000;
+    return tmp;
+  }
+}
+
+/*
+ * Gets width pixels of a framebuffer from x, y as ARGB8888, see
+ * pi_layer_pixels(). A tiled framebuffer is detiled into tmp, a micro-tile at
+ * a time.
+ */
+static const u32 *pi_layer_fb_row(const struct pi_layer *layer, int x, int y,
+                                  unsigned int width, u32 *tmp, bool opaque) {
+  unsigned int n;
+
+  if (!layer->tiled)
+    return pi_layer_pixels(layer, pi_layer_fb_pixel(layer, x, y), width, tmp,
+                           opaque);
+
+  for (unsigned int i = 0; i < width; i += n, x += n) {
+    const u32 *src;
+
+    n = min(width - i, PI_MICROTILE_SIZE - (x & (PI_MICROTILE_SIZE - 1)));
+    src = pi_layer_pixels(layer, pi_layer_fb_pixel(layer, x, y), n, tmp + i,
+                          opaque);
+    if (src != tmp + i)
+      memcpy(tmp + i, src, n * 4);
+  }
+  return tmp;
+}
+
+/*
+ * Gets the pixels of a layer on row y from column x, in CRTC coordinates, as
+ * ARGB8888, either read in place or written to tmp. A scaled layer is
+ * interpolated into tmp from the framebuffer pixels the row samples.
+ */
+static const u32 *pi_layer_row(struct pi_compose *compose,
+                               const struct pi_scale_impl *scale,
+                               const struct pi_layer *layer, int x, int y,
+                               unsigned int width, u32 *tmp, bool opaque) {
+  const struct pi_scaler *scaler = layer->scaler;
+  unsigned int dx = x - layer->dst.x1, dy = y - layer->dst.y1;
+  unsigned int first, n;
+  const u32 *src;
+  int sx, sy;
+  u8 frac;
+
+  if (!scaler)
+    return pi_layer_fb_row(layer, layer->src_x + dx, layer->src_y + dy, width,
+                           tmp, opaque);
+
+  first = scaler->x.index[dx];
+  n = scaler->x.index[dx + width - 1] + 2 - first;
+  frac = scaler->y.frac[dy];
+  sx = layer->src_x + first;
+  sy = layer->src_y + scaler->y.index[dy];
+
+  src = pi_layer_fb_row(layer, sx, sy, n, compose->scale[0], opaque);
+  if (frac) {
+    scale->vlerp(compose->scale[0], src,
+                 pi_layer_fb_row(layer, sx, sy + 1, n, compose->scale[1],
+                                 opaque),
+                 n, frac);
+    src = compose->scale[0];
+  }
+  scale->hlerp(tmp, src, scaler->x.index + dx, scaler->x.frac + dx, width,
+               first);
+  return tmp;
+}
+
+// Same as pi_compose_rect(), into a frame at vaddr instead of display memory
+static size_t pi_compose_rect_to(struct pi_gpu *gpu, void *vaddr,
+                                 const struct pi_layer *layers,
+                                 unsigned int num, const struct drm_rect *rect,
+                                 const struct drm_format_info *format,
+                                 unsigned int pitch, bool dither) {
+  struct pi_compose *compose = &gpu->compose;
+  struct pi_flush_stats *stats = &gpu->flush_stats;
+  unsigned int width = drm_rect_width(rect);
+  unsigned int cpp = format->cpp[0];
+  struct pi_compose_kernels kernels;
+  const struct pi_layer *base;
+  unsigned int first = 0;
+  int fb_dx, fb_dy;
+  struct drm_rect span;
+  const u32 *row;
+  bool simd;
+  u8 *dst;
+
+  if (!num || !drm_rect_visible(rect) ||
+      WARN_ON(width > PI_COMPOSE_MAX_WIDTH))
+    return 0;
+
+  // The dithering matrix is anchored to the framebuffer of the bottom plane,
+  // so it moves with the picture when it's panned
+  fb_dx = layers[0].src_x - layers[0].dst.x1;
+  fb_dy = layers[0].src_y - layers[0].dst.y1;
+
+  for (unsigned int i = num - 1; i > 0; i--) {
+    if (layers[i].opaque && pi_rect_contains(&layers[i].dst, rect)) {
+      first = i;
+      break;
+    }
+  }
+  for (unsigned int i = 0; i < first; i++) {
+    span = layers[i].dst;
+    if (drm_rect_intersect(&span, rect))
+      stats->hidden += (u64)drm_rect_width(&span) * drm_rect_height(&span);
+  }
+  base = &layers[first];
+
+  dst = (u8 *)vaddr + drm_fb_clip_offset(pitch, format, rect);
+  for (int y = rect->y1; y < rect->y2; y++, dst += pitch) {
+    row = NULL;
+    simd = pi_compose_begin(gpu, &kernels);
+
+    for (unsigned int i = first + 1; i < num; i++) {
+      const struct pi_layer *layer = &layers[i];
+      const u32 *src;
+      unsigned int n;
+      u32 *out;
+
+      span = DRM_RECT_INIT(rect->x1, y, width, 1);
+      if (!drm_rect_intersect(&span, &layer->dst))
+        continue;
+
+      if (!row) {
+        row = pi_layer_row(compose, kernels.scale, base, rect->x1, y, width,
+                           compose->row, false);
+        if (row != compose->row)
+          memcpy(compose->row, row, width * 4);
+        row = compose->row;
+      }
+
+      out = compose->row + (span.x1 - rect->x1);
+      n = drm_rect_width(&span);
+      if (layer->opaque) {
+        src = pi_layer_row(compose, kernels.scale, layer, span.x1, y, n, out,
+                           false);
+        if (src != out)
+          memcpy(out, src, n * 4);
+        continue;
+      }
+
+      // Without pixel alpha, only the plane alpha is left
+      src = pi_layer_row(compose, kernels.scale, layer, span.x1, y, n,
+                         compose->src, !layer->pixel_alpha);
+      if (layer->pixel_alpha && layer->premulti)
+        kernels.blend->premulti(out, src, n, layer->alpha);
+      else
+        kernels.blend->coverage(out, src, n, layer->alpha);
+      stats->blended += n;
+    }
+
+    if (!row && !base->scaler && !base->tiled && base->format == format) {
+      memcpy(dst, pi_layer_pixel(base, rect->x1, y), width * cpp);
+    } else {
+      if (!row)
+        row = pi_layer_row(compose, kernels.scale, base, rect->x1, y, width,
+                           compose->row, false);
+      if (cpp == 4)
+        memcpy(dst, row, width * 4);
+      else
+        pi_convert_row(kernels.convert, dst, row, width, rect->x1 + fb_dx,
+                       y + fb_dy, format->format, dither);
+    }
+
+    if (simd)
+      pi_simd_end();
+  }
+  return (size_t)width * cpp * drm_rect_height(rect);
+}
+
+/**
+ * pi_compose_rect - composes a rectangle of the screen into display memory
+ * @gpu: the device
+ * @layers: the visible planes, from pi_compose_layers()
+ * @num: number of planes
+ * @rect: the rectangle, in CRTC coordinates
+ * @format: format of display memory
+ * @pitch: pitch of display memory
+ * @dither: whether RGB565 is dithered
+ *
+ * The composition starts from the highest opaque plane covering the whole
+ * rectangle. A row no plane above it crosses is copied (or converted) straight
+ * from its framebuffer, unless it's scaled or tiled. Otherwise the row is
+ * copied to a buffer, and the planes above are blended over it one at a time,
+ * or copied if they're opaque.
+ *
+ * Returns:
+ * The number of bytes written to display memory.
+ */
+size_t pi_compose_rect(struct pi_gpu *gpu, const struct pi_layer *layers,
+                       unsigned int num, const struct drm_rect *rect,
+                       const struct drm_format_info *format,
+                       unsigned int pitch, bool dither) {
+  return pi_compose_rect_to(gpu, gpu->display_addr.vaddr, layers, num, rect,
+                            format, pitch, dither);
+}
+
+#define PI_BLEND_WIDTH 1920
+#define PI_BLEND_HEIGHT 1080
+#define PI_BLEND_ITERATIONS 8
+
+// The ui source is made of opaque, transparent and translucent runs of 64
+// pixels, like a UI overlay, the others are random
+static const struct {
+  const char *name;
+  bool premulti;
+  u8 alpha;
+  bool ui;
+} pi_blend_benches[] = {
+    {"premulti", true, 255, false},  {"premulti-a", true, 128, false},
+    {"coverage", false, 255, false}, {"coverage-a", false, 128, false},
+    {"premulti-ui", true, 255, true},
+};
+
+// Same as the composition, the SIMD registers are claimed a row at a time
+static void pi_blend_frame(const struct pi_blend_impl *impl, u32 *dst,
+                           const u32 *src, bool premulti, u8 alpha) {
+  for (int y = 0; y < PI_BLEND_HEIGHT; y++) {
+    const struct pi_blend_impl *used = impl;
+
+    if (impl->simd) {
+      if (may_use_simd())
+        pi_simd_begin();
+      else
+        used = &pi_blend_impls[0];
+    }
+
+    if (premulti)
+      used->premulti(dst, src, PI_BLEND_WIDTH, alpha);
+    else
+      used->coverage(dst, src, PI_BLEND_WIDTH, alpha);
+
+    if (used->simd)
+      pi_simd_end();
+    dst += PI_BLEND_WIDTH;
+    src += PI_BLEND_WIDTH;
+  }
+}
+
+static void pi_blend_ui_source(u32 *src, size_t pixels) {
+  for (size_t i = 0; i < pixels; i++) {
+    switch ((i / 64) % 4) {
+    case 0:
+    case 2:
+      src[i] = 0;
+      break;
+    case 1:
+      src[i] |= 0xff000000;
+      break;
+    default:
+      // Premultiplied, so no channel is above alpha
+      src[i] &= (src[i] >> 24) * 0x010101 | 0xff000000;
+      break;
+    }
+  }
+}
+
+static int pi_blend_show(struct seq_file *m, void *unused) {
+  const size_t pixels = PI_BLEND_WIDTH * PI_BLEND_HEIGHT;
+  u32 *src, *bg, *dst, *ref;
+  u64 start, elapsed;
+  int ret = 0;
+
+  src = vmalloc(pixels * 4);
+  bg = vmalloc(pixels * 4);
+  dst = vmalloc(pixels * 4);
+  ref = vmalloc(pixels * 4);
+  if (!src || !bg || !dst || !ref) {
+    ret = -ENOMEM;
+    goto out;
+  }
+  get_random_bytes(bg, pixels * 4);
+
+  for (unsigned int b = 0; b < ARRAY_SIZE(pi_blend_benches); b++) {
+    get_random_bytes(src, pixels * 4);
+    if (pi_blend_benches[b].ui)
+      pi_blend_ui_source(src, pixels);
+
+    for (unsigned int i = 0; i < pi_num_blend_impls; i++) {
+      const struct pi_blend_impl *impl = &pi_blend_impls[i];
+      u32 *out = i ? dst : ref;
+      const char *check;
+
+      if (!impl->usable())
+        continue;
+
+      memcpy(out, bg, pixels * 4);
+      start = ktime_get_ns();
+      for (int n = 0; n < PI_BLEND_ITERATIONS; n++)
+        pi_blend_frame(impl, out, src, pi_blend_benches[b].premulti,
+                       pi_blend_benches[b].alpha);
+      elapsed = max_t(u64, ktime_get_ns() - start, 1);
+
+      // The scalar kernel comes first and is the reference
+      check = "";
+      if (i)
+        check = memcmp(out, ref, pixels * 4) ? ", MISMATCH" : ", exact";
+
+      seq_printf(m, "%-11s %-6s: %llu Mpixels/s%s\n", pi_blend_benches[b].name,
+                 impl->name,
+                 div64_u64((u64)pixels * PI_BLEND_ITERATIONS * 1000, elapsed),
+                 check);
+    }
+  }
+
+out:
+  vfree(ref);
+  vfree(dst);
+  vfree(bg);
+  vfree(src);
+  return ret;
+}
+
+/*
+ * Linear against tiled frames, composed as XRGB8888 and as RGB565 (what a 1080p
+ * display is set to, see pi_convert_format()). The ui frame is made of panels,
+ * text sized rectangles and icon sized triangles, the tris one of larger
+ * triangles, most of their blocks being fully covered.
+ */
+#define PI_TILED_WIDTH 1920
+#define PI_TILED_HEIGHT 1080
+#define PI_TILED_PANELS 48
+#define PI_TILED_GLYPHS 4096
+#define PI_TILED_ICONS 256
+#define PI_TILED_TRIS 1024
+#define PI_TILED_ITERATIONS 8
+
+// Enough for the commands of either frame
+#define PI_TILED_MAX_WORDS                                                     \
+  (4 + 2 + PI_TILED_PANELS * 4 + PI_TILED_GLYPHS * 4 + PI_TILED_ICONS * 5 + 1)
+
+static inline u32 pi_tiled_rand(u32 *seed) {
+  *seed = *seed * 1664525 + 1013904223;
+  return *seed >> 8;
+}
+
+// Sets the target and clears it, returns where the next command goes
+static u32 *pi_tiled_begin(u32 *cmd, bool tiled) {
+  *cmd++ = PI_CMD_HDR(PI_OP_SET_TARGET, 4);
+  *cmd++ = PI_TILED_WIDTH | (PI_TILED_HEIGHT << 16);
+  *cmd++ = PI_TILED_WIDTH * 4;
+  *cmd++ = PIX_FMT_XRGB8888 | (tiled ? PI_TARGET_TILED : 0);
+
+  *cmd++ = PI_CMD_HDR(PI_OP_CLEAR, 2);
+  *cmd++ = 0x00303030;
+  return cmd;
+}
+
+static size_t pi_tiled_build_ui(u32 *cmds, bool tiled) {
+  u32 seed = 0x9abc;
+  u32 *cmd = pi_tiled_begin(cmds, tiled);
+
+  for (int i = 0; i < PI_TILED_PANELS; i++) {
+    *cmd++ = PI_CMD_HDR(PI_OP_FILL_RECT, 4);
+    *cmd++ = PI_CMD_XY(pi_tiled_rand(&seed) % PI_TILED_WIDTH,
+                       pi_tiled_rand(&seed) % PI_TILED_HEIGHT);
+    *cmd++ = PI_CMD_XY(64 + pi_tiled_rand(&seed) % 512,
+                       32 + pi_tiled_rand(&seed) % 256);
+    *cmd++ = pi_tiled_rand(&seed);
+  }
+
+  for (int i = 0; i < PI_TILED_GLYPHS; i++) {
+    *cmd++ = PI_CMD_HDR(PI_OP_FILL_RECT, 4);
+    *cmd++ = PI_CMD_XY(pi_tiled_rand(&seed) % PI_TILED_WIDTH,
+                       pi_tiled_rand(&seed) % PI_TILED_HEIGHT);
+    *cmd++ = PI_CMD_XY(1 + pi_tiled_rand(&seed) % 6,
+                       8 + pi_tiled_rand(&seed) % 4);
+    *cmd++ = 0x00e0e0e0;
+  }
+
+  for (int i = 0; i < PI_TILED_ICONS; i++) {
+    s32 size = 8 + pi_tiled_rand(&seed) % 40;
+    s32 x = pi_tiled_rand(&seed) % PI_TILED_WIDTH;
+    s32 y = pi_tiled_rand(&seed) % PI_TILED_HEIGHT;
+
+    *cmd++ = PI_CMD_HDR(PI_OP_DRAW_TRI, 5);
+    *cmd++ = PI_CMD_XY(x, y);
+    *cmd++ = PI_CMD_XY(x + size, y + size / 2);
+    *cmd++ = PI_CMD_XY(x, y + size);
+    *cmd++ = pi_tiled_rand(&seed);
+  }
+
+  *cmd++ = PI_CMD_HDR(PI_OP_END, 1);
+
+  return (cmd - cmds) * sizeof(u32);
+}
+
+// Triangles of any shape and winding, from 32 to 287 pixels across
+static size_t pi_tiled_build_tris(u32 *cmds, bool tiled) {
+  u32 seed = 0x5eed;
+  u32 *cmd = pi_tiled_begin(cmds, tiled);
+
+  for (int i = 0; i < PI_TILED_TRIS; i++) {
+    s32 size = 32 + pi_tiled_rand(&seed) % 256;
+    s32 x = pi_tiled_rand(&seed) % PI_TILED_WIDTH;
+    s32 y = pi_tiled_rand(&seed) % PI_TILED_HEIGHT;
+
+    *cmd++ = PI_CMD_HDR(PI_OP_DRAW_TRI, 5);
+    for (int v = 0; v < 3; v++)
+      *cmd++ = PI_CMD_XY(x + pi_tiled_rand(&seed) % size,
+                         y + pi_tiled_rand(&seed) % size);
+    *cmd++ = pi_tiled_rand(&seed);
+  }
+
+  *cmd++ = PI_CMD_HDR(PI_OP_END, 1);
+
+  return (cmd - cmds) * sizeof(u32);
+}
+
+static const struct {
+  const char *name;
+  size_t (*build)(u32 *cmds, bool tiled);
+} pi_tiled_scenes[] = {
+    {"ui", pi_tiled_build_ui},
+    {"tris", pi_tiled_build_tris},
+};
+
+// Composes a whole frame of one plane, in the format of display memory
+static void pi_tiled_scanout(struct pi_gpu *gpu, const u8 *frame, bool tiled,
+                             void *dst, u32 format) {
+  const struct drm_format_info *info = drm_format_info(format);
+  struct drm_rect screen =
+      DRM_RECT_INIT(0, 0, PI_TILED_WIDTH, PI_TILED_HEIGHT);
+  struct pi_layer layer = {
+      .vaddr = frame,
+      .format = drm_format_info(DRM_FORMAT_XRGB8888),
+      .pitch = PI_TILED_WIDTH * 4,
+      .dst = screen,
+      .alpha = 255,
+      .opaque = true,
+      .tiled = tiled,
+  };
+
+  pi_compose_rect_to(gpu, dst, &layer, 1, &screen, info,
+                     PI_TILED_WIDTH * info->cpp[0], false);
+}
+
+static int pi_tiled_show(struct seq_file *m, void *unused) {
+  struct drm_debugfs_entry *entry = m->private;
+  struct pi_gpu *gpu = to_gpu(entry->dev);
+  const size_t pixels = PI_TILED_WIDTH * PI_TILED_HEIGHT;
+  const u64 frames_ns = (u64)PI_TILED_ITERATIONS * NSEC_PER_SEC;
+  u8 *frame, *ref32, *ref16, *out32, *out16;
+  struct pi_exec_ctx ctx;
+  u32 *cmds;
+  int ret = 0;
+
+  frame = vmalloc(pixels * 4);
+  ref32 = vmalloc(pixels * 4);
+  out32 = vmalloc(pixels * 4);
+  ref16 = vmalloc(pixels * 2);
+  out16 = vmalloc(pixels * 2);
+  cmds = vmalloc(PI_TILED_MAX_WORDS * sizeof(u32));
+  if (!frame || !ref32 || !out32 || !ref16 || !out16 || !cmds) {
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  for (unsigned int sc = 0; sc < ARRAY_SIZE(pi_tiled_scenes) && !ret; sc++) {
+    for (int tiled = 0; tiled < 2; tiled++) {
+      size_t len = pi_tiled_scenes[sc].build(cmds, tiled);
+      u8 *dst32 = tiled ? out32 : ref32, *dst16 = tiled ? out16 : ref16;
+      u64 render, scan32, scan16, start;
+      const char *check = "";
+
+      // Same as a job on the ring
+      mutex_lock(&gpu->raster.lock);
+      start = ktime_get_ns();
+      for (int n = 0; n < PI_TILED_ITERATIONS && !ret; n++) {
+        pi_exec_ctx_init(&ctx, &gpu->raster, frame, pixels * 4);
+        ret = pi_execute(&ctx, cmds, len);
+      }
+      render = max_t(u64, ktime_get_ns() - start, 1);
+      mutex_unlock(&gpu->raster.lock);
+      if (ret)
+        break;
+
+      // Same as the flush, for the row buffers
+      mutex_lock(&gpu->compose.lock);
+      start = ktime_get_ns();
+      for (int n = 0; n < PI_TILED_ITERATIONS; n++)
+        pi_tiled_scanout(gpu, frame, tiled, dst32, DRM_FORMAT_XRGB8888);
+      scan32 = max_t(u64, ktime_get_ns() - start, 1);
+
+      start = ktime_get_ns();
+      for (int n = 0; n < PI_TILED_ITERATIONS; n++)
+        pi_tiled_scanout(gpu, frame, tiled, dst16, DRM_FORMAT_RGB565);
+      scan16 = max_t(u64, ktime_get_ns() - start, 1);
+      mutex_unlock(&gpu->compose.lock);
+
+      // The linear frame comes first and is the reference
+      if (tiled) {
+        bool same = !memcmp(out32, ref32, pixels * 4) &&
+                    !memcmp(out16, ref16, pixels * 2);
+
+        check = same ? ", exact" : ", MISMATCH";
+      }
+
+      seq_printf(m,
+                 "%-4s %-6s: render %llu, scanout %llu (XRGB8888) %llu "
+                 "(RGB565), render + scanout %llu frames/s%s\n",
+                 pi_tiled_scenes[sc].name, tiled ? "tiled" : "linear",
+                 div64_u64(frames_ns, render), div64_u64(frames_ns, scan32),
+                 div64_u64(frames_ns, scan16),
+                 div64_u64(frames_ns, render + scan16), check);
+    }
+  }
+
+out:
+  vfree(cmds);
+  vfree(out16);
+  vfree(ref16);
+  vfree(out32);
+  vfree(ref32);
+  vfree(frame);
+  return ret;
+}
+
+static const struct drm_debugfs_info pi_compose_debugfs_list[] = {
+    {"blend", pi_blend_show, 0},
+    {"tiled", pi_tiled_show, 0},
+};
+
+void pi_compose_debugfs_init(struct pi_gpu *gpu) {
+  drm_debugfs_add_files(&gpu->drm_device, pi_compose_debugfs_list,
+                        ARRAY_SIZE(pi_compose_debugfs_list));
+}
@@ -0,0 +1,105 @@
+#ifndef COMPOSE_H
+#define COMPOSE_H
+
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_rect.h"
+#include "linux/mutex.h"
+#include "linux/types.h"
+
+struct drm_crtc;
+struct drm_format_info;
+struct drm_plane_state;
+struct pi_gpu;
+struct pi_scaler;
+
+// Widest row the composition buffers hold, at least mode_config.max_width
+#define PI_COMPOSE_MAX_WIDTH 2048
+// At least the number of planes of the CRTC
+#define PI_MAX_LAYERS 4
+
+/*
+ * Blends rows of ARGB8888 pixels over XRGB8888 ones, in place.
+ *
+ * alpha is the alpha of the plane (0 to 255), applied on top of the alpha of
+ * the pixels. With a = src_alpha * alpha, each of the 4 bytes of a pixel is:
+ * - premulti, the source is premultiplied: src * alpha + dst * (1 - a),
+ *   saturating at 255
+ * - coverage: src * a + dst * (1 - a)
+ * where every product of two bytes is divided by 255, rounded to nearest.
+ * Opaque pixels are copied and transparent ones skipped, which gives the same
+ * result.
+ *
+ * All the implementations must give exactly the same pixels as the scalar one.
+ */
+struct pi_blend_impl {
+  const char *name;
+  void (*premulti)(u32 *dst, const u32 *src, unsigned int pixels, u8 alpha);
+  void (*coverage)(u32 *dst, const u32 *src, unsigned int pixels, u8 alpha);
+  bool simd; // needs the FPU/SIMD registers
+  bool (*usable)(void);
+};
+
+// From the slowest to the fastest one, the scalar one is always first
+extern const struct pi_blend_impl pi_blend_impls[];
+extern const unsigned int pi_num_blend_impls;
+
+void pi_blend_premulti_scalar(u32 *dst, const u32 *src, unsigned int pixels,
+                              u8 alpha);
+void pi_blend_coverage_scalar(u32 *dst, const u32 *src, unsigned int pixels,
+                              u8 alpha);
+void pi_blend_premulti_neon(u32 *dst, const u32 *src, unsigned int pixels,
+                            u8 alpha);
+void pi_blend_coverage_neon(u32 *dst, const u32 *src, unsigned int pixels,
+                            u8 alpha);
+void pi_blend_premulti_sse2(u32 *dst, const u32 *src, unsigned int pixels,
+                            u8 alpha);
+void pi_blend_coverage_sse2(u32 *dst, const u32 *src, unsigned int pixels,
+                            u8 alpha);
+
+// x / 255 rounded to nearest, exact for x up to 255 * 255
+static inline u32 pi_div255(u32 x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+// A visible plane of the CRTC, see pi_compose_layers()
+struct pi_layer {
+  struct drm_plane_state *state;
+  const u8 *vaddr; // first byte of the framebuffer
+  const struct drm_format_info *format;
+  unsigned int pitch;
+  struct drm_rect dst; // where it's shown, in CRTC coordinates
+  int src_x, src_y;    // framebuffer pixel shown at dst.x1, dst.y1
+  // Filter of a scaled plane, NULL if it isn't. src_x, src_y are then the first
+  // pixel its source rectangle touches
+  const struct pi_scaler *scaler;
+  u8 alpha;            // of the plane
+  bool pixel_alpha;    // the alpha of the pixels is used
+  bool premulti;
+  bool opaque; // hides whatever is below it
+  bool tiled;  // PI_FORMAT_MOD_TILED_8X8
+};
+
+// Rows the layers are composed in
+struct pi_compose {
+  // Held while composing and programming the display, by the commit tail and
+  // by cursor moves, which don't wait for it
+  struct mutex lock;
+  u32 row[PI_COMPOSE_MAX_WIDTH];
+  u32 src[PI_COMPOSE_MAX_WIDTH];
+  // The two framebuffer rows a scaled row is interpolated from
+  u32 scale[2][PI_COMPOSE_MAX_WIDTH];
+};
+
+void pi_compose_init(struct pi_gpu *gpu);
+
+unsigned int pi_compose_layers(struct drm_crtc *crtc, struct pi_layer *layers);
+
+size_t pi_compose_rect(struct pi_gpu *gpu, const struct pi_layer *layers,
+                       unsigned int num, const struct drm_rect *rect,
+                       const struct drm_format_info *format,
+                       unsigned int pitch, bool dither);
+
+void pi_compose_debugfs_init(struct pi_gpu *gpu);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Description:
+ * NEON blending kernels of the composition (see struct pi_blend_impl).
+ *
+ * Built with the FPU flags of the kernel, so they must only be called between
+ * kernel_neon_begin() and kernel_neon_end().
+ */
+#include "asm/neon-intrinsics.h"
+
+#include "compose.h"
+
+static inline uint16x8_t pi_div255_n(uint16x8_t x) {
+  x = vaddq_u16(x, vdupq_n_u16(128));
+  return vshrq_n_u16(vsraq_n_u16(x, x, 8), 8);
+}
+
+/*
+ * 16 pixels at a time, loaded as planes of blue, green, red and alpha bytes,
+ * each half widened to 16 bits for the products. The premultiplied blend is
+ * narrowed back with saturation.
+ */
+static inline uint8x8_t pi_premulti_n(uint16x8_t s, uint8x8_t d,
+                                      uint16x8_t inv) {
+  return vqmovn_u16(vaddq_u16(s, pi_div255_n(vmulq_u16(vmovl_u8(d), inv))));
+}
+
+static inline uint8x8x4_t pi_premulti_half(uint8x8x4_t s, uint8x8x4_t d,
+                                           u8 alpha) {
+  uint16x8_t s16[4];
+  uint16x8_t inv;
+  uint8x8x4_t out;
+
+  for (int c = 0; c < 4; c++) {
+    s16[c] = vmovl_u8(s.val[c]);
+    if (alpha != 255)
+      s16[c] = pi_div255_n(vmull_u8(s.val[c], vdup_n_u8(alpha)));
+  }
+  inv = vsubq_u16(vdupq_n_u16(255), s16[3]);
+  for (int c = 0; c < 4; c++)
+    out.val[c] = pi_premulti_n(s16[c], d.val[c], inv);
+  return out;
+}
+
+static inline uint8x8x4_t pi_coverage_half(uint8x8x4_t s, uint8x8x4_t d,
+                                           u8 alpha) {
+  uint16x8_t a = vmovl_u8(s.val[3]);
+  uint16x8_t inv;
+  uint8x8x4_t out;
+
+  if (alpha != 255)
+    a = pi_div255_n(vmull_u8(s.val[3], vdup_n_u8(alpha)));
+  inv = vsubq_u16(vdupq_n_u16(255), a);
+  for (int c = 0; c < 4; c++)
+    out.val[c] = vmovn_u16(pi_div255_n(vmlaq_u16(
+        vmulq_u16(vmovl_u8(s.val[c]), a), vmovl_u8(d.val[c]), inv)));
+  return out;
+}
+
+static inline uint8x8x4_t pi_low(uint8x16x4_t v) {
+  return (uint8x8x4_t){{vget_low_u8(v.val[0]), vget_low_u8(v.val[1]),
+                        vget_low_u8(v.val[2]), vget_low_u8(v.val[3])}};
+}
+
+static inline uint8x8x4_t pi_high(uint8x16x4_t v) {
+  return (uint8x8x4_t){{vget_high_u8(v.val[0]), vget_high_u8(v.val[1]),
+                        vget_high_u8(v.val[2]), vget_high_u8(v.val[3])}};
+}
+
+static inline void pi_blend_neon(u32 *dst, const u32 *src, unsigned int pixels,
+                                 u8 alpha, bool premulti) {
+  unsigned int i = 0;
+
+  for (; i + 16 <= pixels; i += 16) {
+    uint8x16x4_t s = vld4q_u8((const u8 *)(src + i));
+    uint8x16x4_t d;
+    uint8x8x4_t lo, hi;
+    uint8x16_t any = s.val[3];
+
+    // A premultiplied pixel only adds nothing if all of it is 0
+    if (premulti)
+      any = vorrq_u8(vorrq_u8(s.val[0], s.val[1]), vorrq_u8(s.val[2], any));
+    if (vmaxvq_u8(any) == 0)
+      continue;
+    if (alpha == 255 && vminvq_u8(s.val[3]) == 255) {
+      vst4q_u8((u8 *)(dst + i), s);
+      continue;
+    }
+
+    d = vld4q_u8((const u8 *)(dst + i));
+    if (premulti) {
+      lo = pi_premulti_half(pi_low(s), pi_low(d), alpha);
+      hi = pi_premulti_half(pi_high(s), pi_high(d), alpha);
+    } else {
+      lo = pi_coverage_half(pi_low(s), pi_low(d), alpha);
+      hi = pi_coverage_half(pi_high(s), pi_high(d), alpha);
+    }
+    for (int c = 0; c < 4; c++)
+      d.val[c] = vcombine_u8(lo.val[c], hi.val[c]);
+    vst4q_u8((u8 *)(dst + i), d);
+  }
+
+  if (premulti)
+    pi_blend_premulti_scalar(dst + i, src + i, pixels - i, alpha);
+  else
+    pi_blend_coverage_scalar(dst + i, src + i, pixels - i, alpha);
+}
+
+void pi_blend_premulti_neon(u32 *dst, const u32 *src, unsigned int pixels,
+                            u8 alpha) {
+  pi_blend_neon(dst, src, pixels, alpha, true);
+}
+
+void pi_blend_coverage_neon(u32 *dst, const u32 *src, unsigned int pixels,
+                            u8 alpha) {
+  pi_blend_neon(dst, src, pixels, alpha, false);
+}
@@ -0,0 +1,103 @@
+/*
+ * Description:
+ * SSE2 blending kernels of the composition (see struct pi_blend_impl).
+ *
+ * Written with the vector extensions of the compiler, like raster_x86.c. The
+ * file is built with the FPU flags of the kernel (SSE2), so the kernels must
+ * only be called between kernel_fpu_begin() and kernel_fpu_end().
+ */
+#include "compose.h"
+
+typedef s16 pi_v8hi __attribute__((vector_size(16)));
+typedef u16 pi_v8hu __attribute__((vector_size(16)));
+typedef char pi_v16qi __attribute__((vector_size(16)));
+
+// Alpha bytes of 4 pixels in the masks of pmovmskb
+#define PI_ALPHA_BITS 0x8888
+
+static inline __attribute__((always_inline)) pi_v8hu pi_div255_v(pi_v8hu x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+// The alpha of each of the 2 pixels of a vector in all its 4 lanes
+static inline __attribute__((always_inline)) pi_v8hu pi_alpha_v(pi_v8hu x) {
+  return (pi_v8hu)__builtin_ia32_pshufhw(
+      __builtin_ia32_pshuflw((pi_v8hi)x, 0xff), 0xff);
+}
+
+/*
+ * 4 pixels at a time, widened to 16 bit lanes, 2 pixels per vector, so the
+ * products of two bytes fit. The saturating pack back to bytes is the
+ * saturation of the premultiplied blend.
+ */
+static inline __attribute__((always_inline)) pi_v8hu
+pi_premulti_v(pi_v8hu s, pi_v8hu d, u8 alpha) {
+  if (alpha != 255)
+    s = pi_div255_v(s * alpha);
+  return s + pi_div255_v(d * (255 - pi_alpha_v(s)));
+}
+
+static inline __attribute__((always_inline)) pi_v8hu
+pi_coverage_v(pi_v8hu s, pi_v8hu d, u8 alpha) {
+  pi_v8hu a = pi_alpha_v(s);
+
+  if (alpha != 255)
+    a = pi_div255_v(a * alpha);
+  return pi_div255_v(s * a + d * (255 - a));
+}
+
+static inline __attribute__((always_inline)) void
+pi_blend_sse2(u32 *dst, const u32 *src, unsigned int pixels, u8 alpha,
+              bool premulti) {
+  const pi_v16qi zero = {0};
+  unsigned int i = 0;
+
+  for (; i + 4 <= pixels; i += 4) {
+    pi_v16qi s, d;
+    pi_v8hu lo, hi;
+    int transparent;
+
+    __builtin_memcpy(&s, src + i, sizeof(s));
+    transparent = __builtin_ia32_pmovmskb128(s == 0);
+    // A premultiplied pixel only adds nothing if all of it is 0
+    if (premulti ? transparent == 0xffff
+                 : (transparent & PI_ALPHA_BITS) == PI_ALPHA_BITS)
+      continue;
+    if (alpha == 255 && (__builtin_ia32_pmovmskb128(s == -1) &
+                         PI_ALPHA_BITS) == PI_ALPHA_BITS) {
+      __builtin_memcpy(dst + i, &s, sizeof(s));
+      continue;
+    }
+
+    __builtin_memcpy(&d, dst + i, sizeof(d));
+    if (premulti) {
+      lo = pi_premulti_v((pi_v8hu)__builtin_ia32_punpcklbw128(s, zero),
+                         (pi_v8hu)__builtin_ia32_punpcklbw128(d, zero), alpha);
+      hi = pi_premulti_v((pi_v8hu)__builtin_ia32_punpckhbw128(s, zero),
+                         (pi_v8hu)__builtin_ia32_punpckhbw128(d, zero), alpha);
+    } else {
+      lo = pi_coverage_v((pi_v8hu)__builtin_ia32_punpcklbw128(s, zero),
+                         (pi_v8hu)__builtin_ia32_punpcklbw128(d, zero), alpha);
+      hi = pi_coverage_v((pi_v8hu)__builtin_ia32_punpckhbw128(s, zero),
+                         (pi_v8hu)__builtin_ia32_punpckhbw128(d, zero), alpha);
+    }
+    d = __builtin_ia32_packuswb128((pi_v8hi)lo, (pi_v8hi)hi);
+    __builtin_memcpy(dst + i, &d, sizeof(d));
+  }
+
+  if (premulti)
+    pi_blend_premulti_scalar(dst + i, src + i, pixels - i, alpha);
+  else
+    pi_blend_coverage_scalar(dst + i, src + i, pixels - i, alpha);
+}
+
+void pi_blend_premulti_sse2(u32 *dst, const u32 *src, unsigned int pixels,
+                            u8 alpha) {
+  pi_blend_sse2(dst, src, pixels, alpha, true);
+}
+
+void pi_blend_coverage_sse2(u32 *dst, const u32 *src, unsigned int pixels,
+                            u8 alpha) {
+  pi_blend_sse2(dst, src, pixels, alpha, false);
+}
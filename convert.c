@@ -0,0 +1,300 @@
+/*
+ * Description:
+ * Format conversion of the framebuffers copied to display memory.
+ *
+ * The pitch register of the display is only 12 bits, so an XRGB8888
+ * framebuffer wider than 1022 pixels is shown as RGB888 or RGB565 (see
+ * pi_convert_format()), and has to be converted when it's composed into
+ * display memory. Only the damaged rectangles are, a row at a time, by a SIMD
+ * kernel (convert_neon.c and convert_x86.c), the scalar one being the
+ * reference.
+ *
+ * RGB565 can optionally be dithered with a 4x4 ordered (Bayer) matrix, which
+ * trades the banding of smooth gradients for a fixed pattern. The matrix is
+ * anchored to the framebuffer, not to the rectangles, so partial updates dither
+ * exactly like full ones, and the pattern doesn't crawl over a panned picture.
+ */
+#include "asm-generic/errno-base.h"
+#include "asm-generic/int-ll64.h"
+#include "asm/simd.h"
+#include "drm/drm_debugfs.h"
+#include "drm/drm_format_helper.h"
+#include "drm/drm_fourcc.h"
+#include "drm/drm_framebuffer.h"
+#include "drm/drm_rect.h"
+#include "linux/iosys-map.h"
+#include "linux/ktime.h"
+#include "linux/math64.h"
+#include "linux/minmax.h"
+#include "linux/module.h"
+#include "linux/random.h"
+#include "linux/seq_file.h"
+#include "linux/string.h"
+#include "linux/vmalloc.h"
+
+#ifdef CONFIG_ARM64
+#include "asm/cpufeature.h"
+#endif
+
+#ifdef CONFIG_X86_64
+#include "asm/cpufeature.h"
+#endif
+
+#include "convert.h"
+#include "driver.h"
+#include "simd.h"
+
+static bool dither_565;
+module_param(dither_565, bool, 0644);
+MODULE_PARM_DESC(dither_565,
+                 "Dither framebuffers converted to RGB565 (default: off)");
+
+static const u8 pi_bayer[4][4] = {
+    {0, 8, 2, 10},
+    {12, 4, 14, 6},
+    {3, 11, 1, 9},
+    {15, 7, 13, 5},
+};
+
+void pi_xrgb8888_to_rgb565_scalar(u16 *dst, const u32 *src,
+                                  unsigned int pixels, const u8 *dither) {
+  for (unsigned int i = 0; i < pixels; i++) {
+    u32 t = dither ? dither[i & 3] : 0;
+    u32 r = min(((src[i] >> 16) & 0xff) + (t >> 1), 255U);
+    u32 g = min(((src[i] >> 8) & 0xff) + (t >> 2), 255U);
+    u32 b = min((src[i] & 0xff) + (t >> 1), 255U);
+
+    dst[i] = (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+  }
+}
+
+// RGB888 is stored blue first, like XRGB8888
+void pi_xrgb8888_to_rgb888_scalar(u8 *dst, const u32 *src,
+                                  unsigned int pixels) {
+  for (unsigned int i = 0; i < pixels; i++) {
+    dst[3 * i] = src[i];
+    dst[3 * i + 1] = src[i] >> 8;
+    dst[3 * i + 2] = src[i] >> 16;
+  }
+}
+
+static bool pi_convert_always_usable(void) { return true; }
+
+#ifdef CONFIG_ARM64
+static bool pi_convert_neon_usable(void) {
+  return cpu_have_named_feature(ASIMD);
+}
+#endif
+
+#ifdef CONFIG_X86_64
+static bool pi_convert_ssse3_usable(void) {
+  return boot_cpu_has(X86_FEATURE_SSSE3);
+}
+#endif
+
+const struct pi_convert_impl pi_convert_impls[] = {
+    {"scalar", pi_xrgb8888_to_rgb565_scalar, pi_xrgb8888_to_rgb888_scalar,
+     false, pi_convert_always_usable},
+#ifdef CONFIG_ARM64
+    {"neon", pi_xrgb8888_to_rgb565_neon, pi_xrgb8888_to_rgb888_neon, true,
+     pi_convert_neon_usable},
+#endif
+#ifdef CONFIG_X86_64
+    {"ssse3", pi_xrgb8888_to_rgb565_ssse3, pi_xrgb8888_to_rgb888_ssse3, true,
+     pi_convert_ssse3_usable},
+#endif
+};
+
+const unsigned int pi_num_convert_impls = ARRAY_SIZE(pi_convert_impls);
+
+void pi_convert_init(struct pi_gpu *gpu) {
+  for (int i = pi_num_convert_impls - 1; i >= 0; i--) {
+    if (pi_convert_impls[i].usable()) {
+      gpu->convert = &pi_convert_impls[i];
+      return;
+    }
+  }
+}
+
+// Same as for the rasterizer, the SIMD registers have to be claimed first
+static const struct pi_convert_impl *
+pi_convert_begin(const struct pi_convert_impl *impl) {
+  if (!impl->simd)
+    return impl;
+  if (!may_use_simd())
+    return &pi_convert_impls[0];
+
+  pi_simd_begin();
+  return impl;
+}
+
+static void pi_convert_end(const struct pi_convert_impl *impl) {
+  if (impl->simd)
+    pi_simd_end();
+}
+
+/**
+ * pi_convert_row - converts a row of XRGB8888 pixels
+ * @impl: the kernels, whose SIMD registers the caller has claimed if needed
+ * @dst: first pixel of the row in the destination
+ * @src: first pixel of the row
+ * @width: number of pixels
+ * @x: column of the first pixel in the framebuffer, for the dithering matrix
+ * @y: row in the framebuffer, for the dithering matrix
+ * @format: DRM_FORMAT_RGB565 or DRM_FORMAT_RGB888
+ * @dither: whether RGB565 is dithered
+ */
+void pi_convert_row(const struct pi_convert_impl *impl, void *dst,
+                    const u32 *src, unsigned int width, int x, int y,
+                    u32 format, bool dither) {
+  u8 row_dither[4];
+
+  if (format == DRM_FORMAT_RGB565) {
+    for (int i = 0; i < 4; i++)
+      row_dither[i] = pi_bayer[y & 3][(x + i) & 3];
+    impl->to_rgb565(dst, src, width, dither ? row_dither : NULL);
+  } else {
+    impl->to_rgb888(dst, src, width);
+  }
+}
+
+/*
+ * The SIMD registers are claimed a row at a time, so converting a whole frame
+ * doesn't keep preemption disabled for milliseconds.
+ */
+static void pi_convert_rows(const struct pi_convert_impl *impl, u8 *dst,
+                            unsigned int dst_pitch, const u8 *src,
+                            unsigned int src_pitch, const struct drm_rect *clip,
+                            u32 format, bool dither) {
+  unsigned int width = drm_rect_width(clip);
+  const struct pi_convert_impl *used;
+
+  for (int y = clip->y1; y < clip->y2; y++) {
+    used = pi_convert_begin(impl);
+    pi_convert_row(used, dst, (const u32 *)src, width, clip->x1, y, format,
+                   dither);
+    pi_convert_end(used);
+
+    dst += dst_pitch;
+    src += src_pitch;
+  }
+}
+
+// Whether RGB565 is dithered, the dither_565 module parameter
+bool pi_convert_dither(void) { return READ_ONCE(dither_565); }
+
+#define PI_CONVERT_WIDTH 1920
+#define PI_CONVERT_HEIGHT 1080
+#define PI_CONVERT_ITERATIONS 8
+
+static const struct {
+  const char *name;
+  u32 format;
+  bool dither;
+} pi_convert_benches[] = {
+    {"rgb565", DRM_FORMAT_RGB565, false},
+    {"rgb565d", DRM_FORMAT_RGB565, true},
+    {"rgb888", DRM_FORMAT_RGB888, false},
+};
+
+// Converts the frame with the DRM helper, returns the time it took in ns
+static u64 pi_convert_drm(u8 *dst, const u8 *src, u32 format) {
+  const struct drm_rect clip =
+      DRM_RECT_INIT(0, 0, PI_CONVERT_WIDTH, PI_CONVERT_HEIGHT);
+  struct drm_framebuffer fb = {
+      .format = drm_format_info(DRM_FORMAT_XRGB8888),
+      .pitches = {PI_CONVERT_WIDTH * 4},
+      .width = PI_CONVERT_WIDTH,
+      .height = PI_CONVERT_HEIGHT,
+  };
+  unsigned int dst_pitch = PI_CONVERT_WIDTH * drm_format_info(format)->cpp[0];
+  struct iosys_map dst_map = IOSYS_MAP_INIT_VADDR(dst);
+  struct iosys_map src_map = IOSYS_MAP_INIT_VADDR((void *)src);
+  u64 start = ktime_get_ns();
+
+  if (format == DRM_FORMAT_RGB565)
+    drm_fb_xrgb8888_to_rgb565(&dst_map, &dst_pitch, &src_map, &fb, &clip,
+                              false);
+  else
+    drm_fb_xrgb8888_to_rgb888(&dst_map, &dst_pitch, &src_map, &fb, &clip);
+  return ktime_get_ns() - start;
+}
+
+static int pi_convert_show(struct seq_file *m, void *unused) {
+  const struct drm_rect clip =
+      DRM_RECT_INIT(0, 0, PI_CONVERT_WIDTH, PI_CONVERT_HEIGHT);
+  const size_t pixels = PI_CONVERT_WIDTH * PI_CONVERT_HEIGHT;
+  u8 *src, *dst, *ref;
+  u64 start, elapsed;
+  int ret = 0;
+
+  src = vmalloc(pixels * 4);
+  dst = vmalloc(pixels * 3);
+  ref = vmalloc(pixels * 3);
+  if (!src || !dst || !ref) {
+    ret = -ENOMEM;
+    goto out;
+  }
+  get_random_bytes(src, pixels * 4);
+
+  for (unsigned int b = 0; b < ARRAY_SIZE(pi_convert_benches); b++) {
+    u32 format = pi_convert_benches[b].format;
+    unsigned int cpp = drm_format_info(format)->cpp[0];
+    const char *check;
+
+    for (unsigned int i = 0; i < pi_num_convert_impls; i++) {
+      const struct pi_convert_impl *impl = &pi_convert_impls[i];
+      u8 *out = i ? dst : ref;
+
+      if (!impl->usable())
+        continue;
+
+      memset(out, 0, pixels * cpp);
+      start = ktime_get_ns();
+      for (int n = 0; n < PI_CONVERT_ITERATIONS; n++)
+        pi_convert_rows(impl, out, PI_CONVERT_WIDTH * cpp, src,
+                        PI_CONVERT_WIDTH * 4, &clip, format,
+                        pi_convert_benches[b].dither);
+      elapsed = max_t(u64, ktime_get_ns() - start, 1);
+
+      // The scalar kernel comes first and is the reference
+      check = "";
+      if (i)
+        check = memcmp(out, ref, pixels * cpp) ? ", MISMATCH" : ", exact";
+
+      seq_printf(m, "%-8s %-6s: %llu Mpixels/s%s\n",
+                 pi_convert_benches[b].name, impl->name,
+                 div64_u64((u64)pixels * PI_CONVERT_ITERATIONS * 1000, elapsed),
+                 check);
+    }
+
+    if (pi_convert_benches[b].dither)
+      continue;
+
+    memset(dst, 0, pixels * cpp);
+    elapsed = 0;
+    for (int n = 0; n < PI_CONVERT_ITERATIONS; n++)
+      elapsed += pi_convert_drm(dst, src, format);
+    check = memcmp(dst, ref, pixels * cpp) ? ", MISMATCH" : ", exact";
+    seq_printf(m, "%-8s %-6s: %llu Mpixels/s%s\n", pi_convert_benches[b].name,
+               "drm",
+               div64_u64((u64)pixels * PI_CONVERT_ITERATIONS * 1000,
+                         max_t(u64, elapsed, 1)),
+               check);
+  }
+
+out:
+  vfree(ref);
+  vfree(dst);
+  vfree(src);
+  return ret;
+}
+
+static const struct drm_debugfs_info pi_convert_debugfs_list[] = {
+    {"convert", pi_convert_show, 0},
+};
+
+void pi_convert_debugfs_init(struct pi_gpu *gpu) {
+  drm_debugfs_add_files(&gpu->drm_device, pi_convert_debugfs_list,
+                        ARRAY_SIZE(pi_convert_debugfs_list));
+}
@@ -0,0 +1,56 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include "asm-generic/int-ll64.h"
+#include "linux/types.h"
+
+struct pi_gpu;
+
+/*
+ * Converts rows of XRGB8888 pixels to the formats the display falls back to
+ * when a framebuffer is too wide for its pitch register.
+ *
+ * dither is NULL, or the 4 thresholds (0 to 15) of the ordered dithering
+ * matrix for the row, dither[i & 3] applying to pixel i. A threshold t is added
+ * to each channel before truncating it, t / 2 for the 5 bit channels and t / 4
+ * for the 6 bit one, saturating at 255.
+ *
+ * All the implementations must give exactly the same pixels as the scalar one.
+ * Without dithering, that's also what drm_fb_xrgb8888_to_rgb565() and
+ * drm_fb_xrgb8888_to_rgb888() give.
+ */
+struct pi_convert_impl {
+  const char *name;
+  void (*to_rgb565)(u16 *dst, const u32 *src, unsigned int pixels,
+                    const u8 *dither);
+  void (*to_rgb888)(u8 *dst, const u32 *src, unsigned int pixels);
+  bool simd; // needs the FPU/SIMD registers
+  bool (*usable)(void);
+};
+
+// From the slowest to the fastest one, the scalar one is always first
+extern const struct pi_convert_impl pi_convert_impls[];
+extern const unsigned int pi_num_convert_impls;
+
+void pi_xrgb8888_to_rgb565_scalar(u16 *dst, const u32 *src,
+                                  unsigned int pixels, const u8 *dither);
+void pi_xrgb8888_to_rgb888_scalar(u8 *dst, const u32 *src,
+                                  unsigned int pixels);
+void pi_xrgb8888_to_rgb565_neon(u16 *dst, const u32 *src, unsigned int pixels,
+                                const u8 *dither);
+void pi_xrgb8888_to_rgb888_neon(u8 *dst, const u32 *src, unsigned int pixels);
+void pi_xrgb8888_to_rgb565_ssse3(u16 *dst, const u32 *src,
+                                 unsigned int pixels, const u8 *dither);
+void pi_xrgb8888_to_rgb888_ssse3(u8 *dst, const u32 *src,
+                                 unsigned int pixels);
+
+void pi_convert_init(struct pi_gpu *gpu);
+
+void pi_convert_row(const struct pi_convert_impl *impl, void *dst,
+                    const u32 *src, unsigned int width, int x, int y,
+                    u32 format, bool dither);
+bool pi_convert_dither(void);
+
+void pi_convert_debugfs_init(struct pi_gpu *gpu);
+
+#endif
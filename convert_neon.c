@@ -0,0 +1,68 @@
+/*
+ * Description:
+ * NEON format conversion kernels (see struct pi_convert_impl).
+ *
+ * Built with the FPU flags of the kernel, so they must only be called between
+ * kernel_neon_begin() and kernel_neon_end().
+ */
+#include "asm/neon-intrinsics.h"
+
+#include "convert.h"
+
+/*
+ * 16 pixels at a time, loaded as planes of blue, green, red and X bytes. The
+ * thresholds are added with a saturating add, and each channel is shifted into
+ * place with a shift and insert, which truncates it like the scalar kernel.
+ */
+static inline uint16x8_t pi_pack_rgb565(uint8x8_t r, uint8x8_t g,
+                                        uint8x8_t b) {
+  uint16x8_t out = vshll_n_u8(r, 8);
+
+  out = vsriq_n_u16(out, vshll_n_u8(g, 8), 5);
+  return vsriq_n_u16(out, vshll_n_u8(b, 8), 11);
+}
+
+void pi_xrgb8888_to_rgb565_neon(u16 *dst, const u32 *src, unsigned int pixels,
+                                const u8 *dither) {
+  u8 t5[16] = {0}, t6[16] = {0};
+  uint8x16_t d5, d6;
+  unsigned int i = 0;
+
+  if (dither) {
+    for (int k = 0; k < 16; k++) {
+      t5[k] = dither[k & 3] >> 1;
+      t6[k] = dither[k & 3] >> 2;
+    }
+  }
+  d5 = vld1q_u8(t5);
+  d6 = vld1q_u8(t6);
+
+  // 16 is a multiple of the period of the dithering
+  for (; i + 16 <= pixels; i += 16) {
+    uint8x16x4_t p = vld4q_u8((const u8 *)(src + i));
+    uint8x16_t b = vqaddq_u8(p.val[0], d5);
+    uint8x16_t g = vqaddq_u8(p.val[1], d6);
+    uint8x16_t r = vqaddq_u8(p.val[2], d5);
+
+    vst1q_u16(dst + i,
+              pi_pack_rgb565(vget_low_u8(r), vget_low_u8(g), vget_low_u8(b)));
+    vst1q_u16(dst + i + 8, pi_pack_rgb565(vget_high_u8(r), vget_high_u8(g),
+                                          vget_high_u8(b)));
+  }
+
+  pi_xrgb8888_to_rgb565_scalar(dst + i, src + i, pixels - i, dither);
+}
+
+// The X plane is just not stored back
+void pi_xrgb8888_to_rgb888_neon(u8 *dst, const u32 *src, unsigned int pixels) {
+  unsigned int i = 0;
+
+  for (; i + 16 <= pixels; i += 16) {
+    uint8x16x4_t p = vld4q_u8((const u8 *)(src + i));
+    uint8x16x3_t out = {{p.val[0], p.val[1], p.val[2]}};
+
+    vst3q_u8(dst + 3 * i, out);
+  }
+
+  pi_xrgb8888_to_rgb888_scalar(dst + 3 * i, src + i, pixels - i);
+}
@@ -0,0 +1,88 @@
+/*
+ * Description:
+ * SSSE3 format conversion kernels (see struct pi_convert_impl).
+ *
+ * Written with the vector extensions of the compiler, like raster_x86.c. The
+ * file is built with the FPU flags of the kernel, the kernels enable SSSE3 for
+ * themselves and are only used if the CPU has it. They must only be called
+ * between kernel_fpu_begin() and kernel_fpu_end().
+ */
+#include "convert.h"
+
+typedef u32 pi_v4su __attribute__((vector_size(16)));
+typedef s32 pi_v4si __attribute__((vector_size(16)));
+typedef s16 pi_v8hi __attribute__((vector_size(16)));
+typedef char pi_v16qi __attribute__((vector_size(16)));
+
+// Adds the thresholds to a channel, saturating at 255
+static inline __attribute__((always_inline)) pi_v4su
+pi_dither_add(pi_v4su c, pi_v4su t) {
+  c += t;
+  // Only 256 to 262 have bit 8 set, those become 255
+  return (c | -(c >> 8)) & 0xff;
+}
+
+/*
+ * 4 pixels are converted to 565 in the low half of 32 bit lanes, and two of
+ * those vectors are narrowed to 8 16 bit pixels with a signed saturating pack,
+ * after sign extending them so that it doesn't saturate.
+ */
+static inline __attribute__((always_inline)) pi_v4si
+pi_pack_rgb565(pi_v4su p, pi_v4su d5, pi_v4su d6) {
+  pi_v4su r = pi_dither_add((p >> 16) & 0xff, d5);
+  pi_v4su g = pi_dither_add((p >> 8) & 0xff, d6);
+  pi_v4su b = pi_dither_add(p & 0xff, d5);
+  pi_v4su c = (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+
+  return (pi_v4si)(c << 16) >> 16;
+}
+
+__attribute__((target("ssse3"))) void
+pi_xrgb8888_to_rgb565_ssse3(u16 *dst, const u32 *src, unsigned int pixels,
+                            const u8 *dither) {
+  pi_v4su d5 = {0}, d6 = {0};
+  unsigned int i = 0;
+
+  if (dither) {
+    for (int k = 0; k < 4; k++) {
+      d5[k] = dither[k] >> 1;
+      d6[k] = dither[k] >> 2;
+    }
+  }
+
+  // 8 is a multiple of the period of the dithering
+  for (; i + 8 <= pixels; i += 8) {
+    pi_v4su lo, hi;
+    pi_v8hi out;
+
+    __builtin_memcpy(&lo, src + i, sizeof(lo));
+    __builtin_memcpy(&hi, src + i + 4, sizeof(hi));
+    out = __builtin_ia32_packssdw128(pi_pack_rgb565(lo, d5, d6),
+                                     pi_pack_rgb565(hi, d5, d6));
+    __builtin_memcpy(dst + i, &out, sizeof(out));
+  }
+
+  pi_xrgb8888_to_rgb565_scalar(dst + i, src + i, pixels - i, dither);
+}
+
+/*
+ * A byte shuffle drops the X byte of 4 pixels. The 16 byte store writes 4
+ * bytes past the 12 converted ones, which the next iteration overwrites, so the
+ * loop stops while there are still enough pixels left to cover them.
+ */
+__attribute__((target("ssse3"))) void
+pi_xrgb8888_to_rgb888_ssse3(u8 *dst, const u32 *src, unsigned int pixels) {
+  const pi_v16qi drop_x = {0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+                           -1, -1, -1, -1};
+  unsigned int i = 0;
+
+  for (; i + 8 <= pixels; i += 4) {
+    pi_v16qi p;
+
+    __builtin_memcpy(&p, src + i, sizeof(p));
+    p = __builtin_ia32_pshufb128(p, drop_x);
+    __builtin_memcpy(dst + 3 * i, &p, sizeof(p));
+  }
+
+  pi_xrgb8888_to_rgb888_scalar(dst + 3 * i, src + i, pixels - i);
+}
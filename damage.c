@@ -0,0 +1,183 @@
+/*
+ * Description:
+ * Damage tracking for the display update.
+ *
+ * Userspace reports the parts of a framebuffer it changed with damage clips
+ * (FB_DAMAGE_CLIPS). The flush only composes those, moved to where the plane
+ * is shown, instead of the whole frame, which is 8MB at 1080p even when only a
+ * cursor blinked. The clips are merged as they're added: rectangles that
+ * overlap, or that are close enough that the pixels in between are cheap to
+ * copy, become one, so that the flush does a few long row copies rather than
+ * many short ones.
+ */
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_damage_helper.h"
+#include "drm/drm_debugfs.h"
+#include "drm/drm_device.h"
+#include "drm/drm_plane.h"
+#include "drm/drm_rect.h"
+#include "linux/limits.h"
+#include "linux/math.h"
+#include "linux/math64.h"
+#include "linux/minmax.h"
+#include "linux/seq_file.h"
+
+#include "damage.h"
+#include "driver.h"
+#include "scale.h"
+
+static u64 pi_rect_area(const struct drm_rect *r) {
+  return (u64)drm_rect_width(r) * drm_rect_height(r);
+}
+
+static struct drm_rect pi_rect_union(const struct drm_rect *a,
+                                     const struct drm_rect *b) {
+  return DRM_RECT_INIT(min(a->x1, b->x1), min(a->y1, b->y1),
+                       max(a->x2, b->x2) - min(a->x1, b->x1),
+                       max(a->y2, b->y2) - min(a->y1, b->y1));
+}
+
+/*
+ * Where a scaled plane shows a rectangle of its framebuffer. Each pixel shown is
+ * interpolated from the pixels around it, so the rectangle grows by one on each
+ * side first.
+ */
+static void pi_damage_scale(struct drm_rect *rect,
+                            const struct drm_plane_state *state) {
+  const struct drm_rect *src = &state->src, *dst = &state->dst;
+  u32 src_w = drm_rect_width(src), src_h = drm_rect_height(src);
+  u32 dst_w = drm_rect_width(dst), dst_h = drm_rect_height(dst);
+  s64 x1 = max_t(s64, ((s64)(rect->x1 - 1) << 16) - src->x1, 0);
+  s64 y1 = max_t(s64, ((s64)(rect->y1 - 1) << 16) - src->y1, 0);
+  s64 x2 = max_t(s64, ((s64)(rect->x2 + 1) << 16) - src->x1, 0);
+  s64 y2 = max_t(s64, ((s64)(rect->y2 + 1) << 16) - src->y1, 0);
+
+  rect->x1 = dst->x1 + div_u64(x1 * dst_w, src_w);
+  rect->y1 = dst->y1 + div_u64(y1 * dst_h, src_h);
+  rect->x2 = dst->x1 + DIV_ROUND_UP_ULL(x2 * dst_w, src_w);
+  rect->y2 = dst->y1 + DIV_ROUND_UP_ULL(y2 * dst_h, src_h);
+}
+
+static void pi_damage_remove(struct pi_damage *damage, unsigned int i) {
+  damage->rects[i] = damage->rects[--damage->num];
+}
+
+/**
+ * pi_damage_add - adds a rectangle to the damage of a commit
+ * @damage: damage of the commit
+ * @rect: changed rectangle, in CRTC coordinates
+ *
+ * The rectangle is merged with the ones it overlaps or is close to, and the
+ * result with the ones it now overlaps or is close to. Once there are
+ * %PI_DAMAGE_RECTS rectangles, it's merged with the one whose bounding box
+ * grows the least.
+ */
+void pi_damage_add(struct pi_damage *damage, const struct drm_rect *rect) {
+  struct drm_rect r = *rect;
+  struct drm_rect u, overlap;
+  u64 growth, best_growth;
+  unsigned int i, best;
+
+  if (!drm_rect_visible(&r))
+    return;
+
+again:
+  for (i = 0; i < damage->num; i++) {
+    overlap = r;
+    u = pi_rect_union(&damage->rects[i], &r);
+    if (drm_rect_intersect(&overlap, &damage->rects[i]) ||
+        pi_rect_area(&u) <= pi_rect_area(&damage->rects[i]) +
+                                pi_rect_area(&r) + PI_DAMAGE_SLACK) {
+      r = u;
+      pi_damage_remove(damage, i);
+      goto again;
+    }
+  }
+
+  if (damage->num < PI_DAMAGE_RECTS) {
+    damage->rects[damage->num++] = r;
+    return;
+  }
+
+  best = 0;
+  best_growth = U64_MAX;
+  for (i = 0; i < damage->num; i++) {
+    u = pi_rect_union(&damage->rects[i], &r);
+    growth = pi_rect_area(&u) - pi_rect_area(&damage->rects[i]);
+    if (growth < best_growth) {
+      best = i;
+      best_growth = growth;
+    }
+  }
+  r = pi_rect_union(&damage->rects[best], &r);
+  pi_damage_remove(damage, best);
+  goto again;
+}
+
+/**
+ * pi_damage_add_plane - adds the damage of a plane update
+ * @damage: damage of the commit
+ * @old_state: state of the plane before the commit
+ * @new_state: state of the plane in the commit
+ *
+ * The damage clips are in framebuffer coordinates, they're moved (and scaled)
+ * to where the plane is shown. Without damage clips, or when the framebuffer
+ * changed, the whole plane is damaged. When the plane moved, appeared, disappeared or
+ * changed how it's blended, both where it was and where it is are.
+ */
+void pi_damage_add_plane(struct pi_damage *damage,
+                         struct drm_plane_state *old_state,
+                         struct drm_plane_state *new_state) {
+  struct drm_atomic_helper_damage_iter iter;
+  struct drm_rect rect;
+
+  if (old_state->visible != new_state->visible ||
+      !drm_rect_equals(&old_state->dst, &new_state->dst) ||
+      old_state->normalized_zpos != new_state->normalized_zpos ||
+      old_state->alpha != new_state->alpha ||
+      old_state->pixel_blend_mode != new_state->pixel_blend_mode) {
+    if (old_state->visible)
+      pi_damage_add(damage, &old_state->dst);
+    if (new_state->visible)
+      pi_damage_add(damage, &new_state->dst);
+    return;
+  }
+
+  drm_atomic_helper_damage_iter_init(&iter, old_state, new_state);
+  drm_atomic_for_each_plane_damage(&iter, &rect) {
+    if (pi_scale_needed(&new_state->src, &new_state->dst))
+      pi_damage_scale(&rect, new_state);
+    else
+      drm_rect_translate(&rect, new_state->dst.x1 - (new_state->src.x1 >> 16),
+                         new_state->dst.y1 - (new_state->src.y1 >> 16));
+    if (drm_rect_intersect(&rect, &new_state->dst))
+      pi_damage_add(damage, &rect);
+  }
+}
+
+static int pi_flush_show(struct seq_file *m, void *unused) {
+  struct drm_debugfs_entry *entry = m->private;
+  struct pi_gpu *gpu = to_gpu(entry->dev);
+  struct pi_flush_stats stats = gpu->flush_stats;
+
+  seq_printf(m, "commits: %llu, zero-copy flips: %llu, rectangles: %llu\n",
+             stats.commits, stats.flips, stats.rects);
+  seq_printf(m, "cursor moves: %llu\n", stats.cursor_moves);
+  seq_printf(m, "bytes copied: %llu KB, last commit: %llu bytes\n",
+             stats.bytes >> 10, stats.last_bytes);
+  seq_printf(m, "pixels blended: %llu, hidden by opaque planes: %llu\n",
+             stats.blended, stats.hidden);
+  seq_printf(m, "average per commit: %llu bytes (full frame: %llu bytes)\n",
+             div64_u64(stats.bytes, max_t(u64, stats.commits, 1)),
+             stats.frame_bytes);
+  return 0;
+}
+
+static const struct drm_debugfs_info pi_damage_debugfs_list[] = {
+    {"flush", pi_flush_show, 0},
+};
+
+void pi_damage_debugfs_init(struct pi_gpu *gpu) {
+  drm_debugfs_add_files(&gpu->drm_device, pi_damage_debugfs_list,
+                        ARRAY_SIZE(pi_damage_debugfs_list));
+}
@@ -0,0 +1,51 @@
+#ifndef DAMAGE_H
+#define DAMAGE_H
+
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_rect.h"
+
+struct drm_plane_state;
+struct pi_gpu;
+
+// Beyond this many rectangles, new damage is merged into the closest one
+#define PI_DAMAGE_RECTS 8
+
+/*
+ * Two rectangles are merged when their bounding box is at most this many
+ * pixels bigger than both of them, a 64x64 tile. Copying a few pixels that
+ * didn't change is cheaper than many short row copies.
+ */
+#define PI_DAMAGE_SLACK (64 * 64)
+
+// Damage of a commit in CRTC coordinates, rectangles don't overlap
+struct pi_damage {
+  unsigned int num;
+  struct drm_rect rects[PI_DAMAGE_RECTS];
+};
+
+// Updated under the composition lock, see struct pi_compose
+struct pi_flush_stats {
+  u64 commits;
+  u64 flips; // commits that only pointed the display at a framebuffer
+  u64 rects;
+  u64 blended;      // pixels blended over the planes below them
+  u64 hidden;       // pixels not read, under an opaque plane
+  u64 cursor_moves; // applied without a commit, see atomic_async_update
+  u64 bytes;        // copied by all the commits
+  u64 last_bytes;   // copied by the last commit
+  u64 frame_bytes;  // what copying the last frame whole would have been
+};
+
+static inline void pi_damage_init(struct pi_damage *damage) {
+  damage->num = 0;
+}
+
+void pi_damage_add(struct pi_damage *damage, const struct drm_rect *rect);
+
+void pi_damage_add_plane(struct pi_damage *damage,
+                         struct drm_plane_state *old_state,
+                         struct drm_plane_state *new_state);
+
+void pi_damage_debugfs_init(struct pi_gpu *gpu);
+
+#endif
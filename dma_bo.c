@@ -0,0 +1,269 @@
+/*
+ * Description:
+ * Buffer objects in contiguous DMA memory, for the buffers the display scans
+ * out.
+ *
+ * Shmem objects aren't contiguous, so a framebuffer in system memory has to be
+ * vmapped and copied to the display memory in vram at every update. These
+ * objects are one dma_alloc_coherent() allocation each (from CMA, or from the
+ * device's reserved pool), so the display can scan them out from their bus
+ * address. The executor renders into them through their kernel mapping like
+ * into any other object, and a frame it renders is shown without a copy.
+ *
+ * The drm_gem_dma helpers would do the allocation, but they expect every object
+ * of the device to be a drm_gem_dma_object, and ours are all &pi_bo. Same idea
+ * as the vram objects: only the drm_gem_object of the &pi_bo is used.
+ */
+#include "asm-generic/errno-base.h"
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_debugfs.h"
+#include "drm/drm_device.h"
+#include "drm/drm_gem.h"
+#include "drm/drm_gem_shmem_helper.h"
+#include "drm/drm_modeset_lock.h"
+#include "drm/drm_vma_manager.h"
+#include "linux/dma-mapping.h"
+#include "linux/err.h"
+#include "linux/io.h"
+#include "linux/iosys-map.h"
+#include "linux/ktime.h"
+#include "linux/math64.h"
+#include "linux/mm.h"
+#include "linux/seq_file.h"
+#include "linux/slab.h"
+#include "linux/string.h"
+
+#include "bo.h"
+#include "dma_bo.h"
+#include "driver.h"
+#include "vram.h"
+
+static void pi_dma_bo_free(struct drm_gem_object *obj) {
+  struct pi_bo *bo = to_pi_bo(obj);
+  struct pi_gpu *gpu = to_gpu(obj->dev);
+
+  if (bo->map.vaddr) {
+    dma_free_coherent(obj->dev->dev, obj->size, bo->map.vaddr, bo->dma_addr);
+    atomic64_dec(&gpu->mem_stats.dma_objects);
+    atomic64_sub(obj->size, &gpu->mem_stats.dma_bytes);
+  }
+
+  drm_gem_object_release(obj);
+  kfree(bo);
+}
+
+static int pi_dma_bo_vmap(struct drm_gem_object *obj, struct iosys_map *map) {
+  *map = to_pi_bo(obj)->map;
+  return 0;
+}
+
+static void pi_dma_bo_vunmap(struct drm_gem_object *obj,
+                             struct iosys_map *map) {}
+
+static int pi_dma_bo_mmap(struct drm_gem_object *obj,
+                          struct vm_area_struct *vma) {
+  struct pi_bo *bo = to_pi_bo(obj);
+
+  // The fake offset of the object isn't an offset in the object
+  vma->vm_pgoff -= drm_vma_node_start(&obj->vma_node);
+  vm_flags_set(vma, VM_DONTEXPAND);
+
+  return dma_mmap_coherent(obj->dev->dev, vma, bo->map.vaddr, bo->dma_addr,
+                           obj->size);
+}
+
+static const struct vm_operations_struct pi_dma_vm_ops = {
+    .open = drm_gem_vm_open,
+    .close = drm_gem_vm_close,
+};
+
+static const struct drm_gem_object_funcs pi_dma_gem_funcs = {
+    .free = pi_dma_bo_free,
+    .vmap = pi_dma_bo_vmap,
+    .vunmap = pi_dma_bo_vunmap,
+    .mmap = pi_dma_bo_mmap,
+    .vm_ops = &pi_dma_vm_ops,
+};
+
+bool pi_bo_is_dma(struct pi_bo *bo) {
+  return bo->base.base.funcs == &pi_dma_gem_funcs;
+}
+
+/**
+ * pi_bo_scanout_addr - gets the address the display reads an object from
+ * @bo: the object
+ * @addr: filled with the bus address of the start of the object
+ *
+ * Objects in DMA memory and objects created in vram are contiguous and never
+ * move, unlike the objects the residency manager promotes to vram.
+ *
+ * Returns:
+ * True if the display can read the object directly, false if it has to be
+ * copied to display memory.
+ */
+bool pi_bo_scanout_addr(struct pi_bo *bo, dma_addr_t *addr) {
+  struct pi_gpu *gpu = to_gpu(bo->base.base.dev);
+
+  if (pi_bo_is_dma(bo)) {
+    *addr = bo->dma_addr;
+    return true;
+  }
+  if (pi_bo_in_vram(bo)) {
+    *addr = gpu->dma_handle_vram + bo->vram_node.start;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * pi_dma_bo_create - creates a buffer object in contiguous DMA memory
+ * @gpu: the device
+ * @size: size of the object, rounded up to a whole number of pages
+ *
+ * The object is cleared and has an mmap offset.
+ *
+ * Returns:
+ * The object with a reference for the caller, or an ERR_PTR().
+ */
+struct pi_bo *pi_dma_bo_create(struct pi_gpu *gpu, size_t size) {
+  struct drm_device *dev = &gpu->drm_device;
+  struct drm_gem_object *obj;
+  struct pi_bo *bo;
+  void *vaddr;
+  int ret;
+
+  size = PAGE_ALIGN(size);
+  if (!size)
+    return ERR_PTR(-EINVAL);
+
+  bo = kzalloc(sizeof(*bo), GFP_KERNEL);
+  if (!bo)
+    return ERR_PTR(-ENOMEM);
+
+  pi_bo_init(bo);
+  obj = &bo->base.base;
+  obj->funcs = &pi_dma_gem_funcs;
+  drm_gem_private_object_init(dev, obj, size);
+
+  // Zeroed by the DMA API
+  vaddr = dma_alloc_coherent(dev->dev, size, &bo->dma_addr,
+                             GFP_KERNEL | __GFP_NOWARN);
+  if (!vaddr) {
+    drm_gem_object_release(obj);
+    kfree(bo);
+    return ERR_PTR(-ENOMEM);
+  }
+
+  bo->map = IOSYS_MAP_INIT_VADDR(vaddr);
+  atomic64_inc(&gpu->mem_stats.dma_objects);
+  atomic64_add(size, &gpu->mem_stats.dma_bytes);
+
+  ret = drm_gem_create_mmap_offset(obj);
+  if (ret) {
+    drm_gem_object_put(obj);
+    return ERR_PTR(ret);
+  }
+
+  return bo;
+}
+
+// A flip either copies the whole frame from system memory, or only writes the
+// scanout registers
+#define PI_SCANOUT_COPIES 16
+#define PI_SCANOUT_FLIPS 1024
+
+// Average time of a flip through a copy in ns
+static u64 pi_scanout_copy_ns(struct drm_gem_object *src, struct pi_bo *dst,
+                              int *ret) {
+  struct iosys_map map;
+  u64 start, elapsed = 0;
+
+  for (unsigned int i = 0; i < PI_SCANOUT_COPIES; i++) {
+    start = ktime_get_ns();
+    *ret = drm_gem_vmap_unlocked(src, &map);
+    if (*ret)
+      return 0;
+    memcpy(dst->map.vaddr, map.vaddr, src->size);
+    drm_gem_vunmap_unlocked(src, &map);
+    elapsed += ktime_get_ns() - start;
+  }
+
+  return div_u64(elapsed, PI_SCANOUT_COPIES);
+}
+
+// Average time of a flip through the registers in ns. The caller restores them.
+static u64 pi_scanout_flip_ns(struct pi_gpu *gpu, struct pi_bo *bo) {
+  u64 start = ktime_get_ns();
+
+  for (unsigned int i = 0; i < PI_SCANOUT_FLIPS; i++)
+    pi_scanout_set(gpu, bo->dma_addr);
+
+  return div_u64(ktime_get_ns() - start, PI_SCANOUT_FLIPS);
+}
+
+static int pi_scanout_show(struct seq_file *m, void *unused) {
+  struct drm_debugfs_entry *entry = m->private;
+  struct pi_gpu *gpu = to_gpu(entry->dev);
+  struct drm_device *dev = &gpu->drm_device;
+  const struct {
+    u32 width, height;
+  } modes[] = {{1280, 720},
+               {1920, 1080},
+               {dev->mode_config.max_width, dev->mode_config.max_height}};
+  struct drm_gem_shmem_object *shmem;
+  u64 copy_ns, flip_ns;
+  struct pi_bo *dst;
+  u32 lo, hi;
+  int ret = 0;
+
+  seq_printf(m, "scanout buffers: %lld objects, %lld KB\n",
+             atomic64_read(&gpu->mem_stats.dma_objects),
+             atomic64_read(&gpu->mem_stats.dma_bytes) >> 10);
+
+  for (unsigned int i = 0; i < ARRAY_SIZE(modes) && !ret; i++) {
+    size_t size = (size_t)modes[i].width * modes[i].height * 4;
+
+    shmem = drm_gem_shmem_create(dev, size);
+    if (IS_ERR(shmem))
+      return PTR_ERR(shmem);
+
+    dst = pi_dma_bo_create(gpu, size);
+    if (IS_ERR(dst)) {
+      drm_gem_object_put(&shmem->base);
+      return PTR_ERR(dst);
+    }
+
+    copy_ns = pi_scanout_copy_ns(&shmem->base, dst, &ret);
+
+    // Nothing must be committed while the registers point to the test buffer
+    drm_modeset_lock_all(dev);
+    lo = ioread32(gpu->registers + REG_SCANOUT_LO);
+    hi = ioread32(gpu->registers + REG_SCANOUT_HI);
+    flip_ns = pi_scanout_flip_ns(gpu, dst);
+    iowrite32(lo, gpu->registers + REG_SCANOUT_LO);
+    iowrite32(hi, gpu->registers + REG_SCANOUT_HI);
+    drm_modeset_unlock_all(dev);
+
+    if (!ret)
+      seq_printf(m,
+                 "%4ux%-4u: copy %llu ns/flip (%llu MB/s), "
+                 "register %llu ns/flip\n",
+                 modes[i].width, modes[i].height, copy_ns,
+                 div64_u64((u64)size * 1000, max_t(u64, copy_ns, 1)),
+                 flip_ns);
+
+    drm_gem_object_put(&dst->base.base);
+    drm_gem_object_put(&shmem->base);
+  }
+
+  return ret;
+}
+
+static const struct drm_debugfs_info pi_dma_bo_debugfs_list[] = {
+    {"scanout", pi_scanout_show, 0},
+};
+
+void pi_dma_bo_debugfs_init(struct pi_gpu *gpu) {
+  drm_debugfs_add_files(&gpu->drm_device, pi_dma_bo_debugfs_list,
+                        ARRAY_SIZE(pi_dma_bo_debugfs_list));
+}
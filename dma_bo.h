@@ -0,0 +1,17 @@
+#ifndef DMA_BO_H
+#define DMA_BO_H
+
+#include "linux/types.h"
+
+struct pi_bo;
+struct pi_gpu;
+
+struct pi_bo *pi_dma_bo_create(struct pi_gpu *gpu, size_t size);
+
+bool pi_bo_is_dma(struct pi_bo *bo);
+
+bool pi_bo_scanout_addr(struct pi_bo *bo, dma_addr_t *addr);
+
+void pi_dma_bo_debugfs_init(struct pi_gpu *gpu);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "drm/drm_atomic.h"
 #include "drm/drm_atomic_helper.h"
+#include "drm/drm_blend.h"
 #include "drm/drm_crtc.h"
 #include "drm/drm_device.h"
 #include "drm/drm_drv.h"
@@ -18,7 +19,10 @@
 #include "drm/drm_modeset_helper_vtables.h"
 #include "drm/drm_plane.h"
 #include "drm/drm_probe_helper.h"
+#include "drm/drm_rect.h"
+#include "drm/drm_vblank.h"
 
+#include "linux/bits.h"
 #include "linux/clk.h"
 #include "linux/container_of.h"
 #include "linux/device.h"
@@ -36,8 +40,13 @@
 #include "linux/slab.h"
 #include "linux/platform_device.h"
 
+#include "bo_list.h"
+#include "compose.h"
 #include "driver.h"
 #include "execbuffer.h"
+#include "residency.h"
+#include "vm.h"
+#include "vram.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Victor");
@@ -48,16 +57,12 @@ MODULE_DESCRIPTION("GPU driver for the rasberry pi");
                 = 4088. It's made sure that it's a multiple of 8 for easier    \
                 and consistent memory access.                                  \
                 */
-#define PI_MAX_VRAM                                                            \
-  (4 * 1024 * 1024) /* 4MB since 1024 bytes is a KB and 1024 KB is a MB */
-
-// NOTE: We only need to define our cutom iocts like this.
-// So all the ioctls in the .iocts field in drm_driver are custom ones, WE
-// created Non-custom ioctls aren't added there. For example dumb_create is a
-// callback from an ioctl which help us create GEM object (and returns a GEM
-// object handler)
-#define DRM_IOCTL_EXC_BUFFER_IOCTL                                             \
-  DRM_IOWR(DRM_COMMAND_BASE + DRM_IOCTL_EXC_BUFFER, struct pi_exec_buffer)
+// Framebuffers in system memory are copied to display memory, so they have to
+// fit in it (4MB since 1024 bytes is a KB and 1024 KB is a MB)
+#define PI_MAX_VRAM VRAM_DISPLAY_SIZE
+// The cursor plane shows up to 64x64 pixels, always on top of the others
+#define PI_CURSOR_SIZE 64
+#define PI_CURSOR_ZPOS (NUM_PLANES - 1)
 
 struct pi_gpu;
 static int probe_fake_gpu(struct platform_device *);
@@ -67,13 +72,55 @@ static void pi_format_set(struct pi_gpu *gpu,
 static void pi_pitch_set(struct pi_gpu *gpu, unsigned int pitch);
 static int pi_gpu_unload(struct drm_device *drm);
 
+static int pi_gpu_open(struct drm_device *dev, struct drm_file *file) {
+  struct pi_file *pfile;
+
+  pfile = kzalloc(sizeof(*pfile), GFP_KERNEL);
+  if (!pfile)
+    return -ENOMEM;
+
+  pfile->vm = pi_vm_create();
+  if (!pfile->vm) {
+    kfree(pfile);
+    return -ENOMEM;
+  }
+
+  mutex_init(&pfile->lock);
+  idr_init_base(&pfile->bo_lists, 1);
+  file->driver_priv = pfile;
+  return 0;
+}
+
+static void pi_gpu_postclose(struct drm_device *dev, struct drm_file *file) {
+  struct pi_file *pfile = file->driver_priv;
+
+  pi_bo_list_file_fini(pfile);
+  // The bindings are released once the jobs of the client are done
+  pi_vm_put(pfile->vm);
+  mutex_destroy(&pfile->lock);
+  kfree(pfile);
+}
+
 static const struct drm_ioctl_desc ioctl_funcs[] = {
     DRM_IOCTL_DEF_DRV(EXC_BUFFER_IOCTL, gpu_render_ioctl, DRM_RENDER_ALLOW),
+    DRM_IOCTL_DEF_DRV(PI_WAIT_IOCTL, pi_wait_ioctl, DRM_RENDER_ALLOW),
+    DRM_IOCTL_DEF_DRV(PI_EXEC_BATCH_IOCTL, pi_exec_batch_ioctl,
+                      DRM_RENDER_ALLOW),
+    DRM_IOCTL_DEF_DRV(PI_BO_LIST_CREATE_IOCTL, pi_bo_list_create_ioctl,
+                      DRM_RENDER_ALLOW),
+    DRM_IOCTL_DEF_DRV(PI_BO_LIST_DESTROY_IOCTL, pi_bo_list_destroy_ioctl,
+                      DRM_RENDER_ALLOW),
+    DRM_IOCTL_DEF_DRV(PI_VM_BIND_IOCTL, pi_vm_bind_ioctl, DRM_RENDER_ALLOW),
+    DRM_IOCTL_DEF_DRV(PI_VM_UNBIND_IOCTL, pi_vm_unbind_ioctl,
+                      DRM_RENDER_ALLOW),
+    DRM_IOCTL_DEF_DRV(PI_GEM_CREATE_IOCTL, pi_gem_create_ioctl,
+                      DRM_RENDER_ALLOW),
     // TODO: more if needed
 };
 
 static const struct drm_driver pi_gpu_driver = {
-    .driver_features = DRIVER_GEM | DRIVER_MODESET | DRIVER_RENDER,
+    .driver_features = DRIVER_GEM | DRIVER_MODESET | DRIVER_RENDER |
+                       DRIVER_SYNCOBJ | DRIVER_SYNCOBJ_TIMELINE,
     .name = "pi_gpu",
     .desc = "PI GPU Controller",
     .date = "20240319",
@@ -82,13 +129,19 @@ static const struct drm_driver pi_gpu_driver = {
     .patchlevel = 0,
     .ioctls = ioctl_funcs,
     .num_ioctls = ARRAY_SIZE(ioctl_funcs),
+    .open = pi_gpu_open,
+    .postclose = pi_gpu_postclose,
 
     /* SHMEM isshared memory, I think it's for RAM
      * This function returns the handle of the GEM object created
      *
      * shmem isn't guaranteed to be continuous, it's not allocated by the CMA
      */
-    .dumb_create = drm_gem_shmem_dumb_create,
+    // Same as drm_gem_shmem_dumb_create(), except that freed dumb buffers are
+    // recycled, see pi_bo_pool_create()
+    .dumb_create = pi_dumb_create,
+    // Every object is a &pi_bo, so their kernel mappings can be cached
+    .gem_create_object = pi_gem_create_object,
     // some more things down below I need to learn about
 };
 
@@ -107,30 +160,14 @@ static struct platform_driver pi_connection_driver = {
 };
 
 #define to_pi(_dev) container_of(_dev, struct pi_gpu, drm_device)
-/*
- * Just like the pi_gpu, we're going to create our own version of a plane state
- * for this driver it's going to embed a drm_shadow_plane_state which itself
- * embeds a drm_plane_state
- *
- * A shadow plane is a struct that has a plane_state, but also a copy of it,
- * which can be modified before actually updating the plane
- */
-struct pi_primary_plane_state {
-  struct drm_shadow_plane_state base;
-
-  const struct drm_format_info *format;
-
-  // The pitch is NOTE: the number of bytes between the start of one line of
-  // pixels and the start of the next line
-  unsigned int pitch;
-};
 
 
 static int remove_fake_gpu(struct platform_device *pdev) {
   struct drm_device *drm = platform_get_drvdata(pdev);
 
-  drm_dev_unregister(drm);
   pi_gpu_unload(drm);
+  // Ioctls fail from now on, and the paths touching the registers bail out
+  drm_dev_unplug(drm);
 
   return 0;
 }
@@ -140,6 +177,40 @@ struct pi_gpu *to_gpu(struct drm_device *drm) {
   return container_of_const(drm, struct pi_gpu, drm_device);
 }
 
+/*
+ * The GEM helper checks that the buffer object holds the framebuffer in the
+ * linear layout. A tiled one is made of whole micro-tiles, so its pitch must
+ * hold whole ones and its height is rounded up to them.
+ */
+static struct drm_framebuffer *
+pi_fb_create(struct drm_device *drm, struct drm_file *file,
+             const struct drm_mode_fb_cmd2 *cmd) {
+  const struct drm_format_info *info;
+  struct drm_gem_object *obj;
+  u64 size;
+
+  if (!(cmd->flags & DRM_MODE_FB_MODIFIERS) ||
+      cmd->modifier[0] != PI_FORMAT_MOD_TILED_8X8)
+    return drm_gem_fb_create(drm, file, cmd);
+
+  info = drm_get_format_info(drm, cmd);
+  if (!info || cmd->pitches[0] % (PI_MICROTILE_SIZE * info->cpp[0]))
+    return ERR_PTR(-EINVAL);
+
+  obj = drm_gem_object_lookup(file, cmd->handles[0]);
+  if (!obj)
+    return ERR_PTR(-ENOENT);
+  size = obj->size;
+  drm_gem_object_put(obj);
+
+  if ((u64)cmd->pitches[0] * ALIGN(cmd->height, PI_MICROTILE_SIZE) +
+          cmd->offsets[0] >
+      size)
+    return ERR_PTR(-EINVAL);
+
+  return drm_gem_fb_create(drm, file, cmd);
+}
+
 // -------------------------------------------------
 static const struct drm_mode_config_funcs fake_gpu_modecfg_funcs = {
     /*
@@ -162,8 +233,9 @@ static const struct drm_mode_config_funcs fake_gpu_modecfg_funcs = {
      * shared memory but not VRAM, it would do that through MMIOs like in the
      * NES
      *
+     * Tiled framebuffers are checked first, see pi_fb_create().
      */
-    .fb_create = drm_gem_fb_create,
+    .fb_create = pi_fb_create,
 
     /*
      * Basically checks if transitioning to the new state is legal.
@@ -180,11 +252,6 @@ static const struct drm_mode_config_funcs fake_gpu_modecfg_funcs = {
     .atomic_commit = drm_atomic_helper_commit,
 };
 
-static inline struct pi_primary_plane_state *
-to_pi_primary_plane(struct drm_plane_state *state) {
-  return container_of(state, struct pi_primary_plane_state, base.base);
-}
-
 static void pi_primary_destroy_state(struct drm_plane *plane,
                                      struct drm_plane_state *state) {
   struct pi_primary_plane_state *pp_state = to_pi_primary_plane(state);
@@ -233,7 +300,10 @@ pi_primary_duplicate_state(struct drm_plane *plane) {
   // plane state I checked
   __drm_gem_duplicate_shadow_plane_state(plane, shadow_state_new);
   pp_state_new->base = pp_state->base;
+  pp_state_new->format = pp_state->format;
   pp_state_new->pitch = pp_state->pitch;
+  pp_state_new->direct = pp_state->direct;
+  pp_state_new->scanout = pp_state->scanout;
 
   return &pp_state_new->base.base;
 }
@@ -241,8 +311,12 @@ pi_primary_duplicate_state(struct drm_plane *plane) {
 /**
  * pi_convert_format - tries to conver the format of the framebuffer plane to a
  * more compact one if the size of the pitch exceeds the maximum pitch
- * @fb: framebuffer whose plane we're attempting to make fit with the maximum
- * pitch size
+ * @format: format of the framebuffer
+ * @width: width of the frame, in pixels
+ * @pitch: pitch of the frame
+ *
+ * A scaled primary plane is composed at the size it's shown at, so it passes
+ * the size of its destination rectangle instead of the one of its framebuffer.
  *
  * This function is an attempt to convert the pitch into a valid format, but
  * does not guarantee it. The caller must ensure that the pitch is valid.
@@ -251,10 +325,10 @@ pi_primary_duplicate_state(struct drm_plane *plane) {
  * NULL on success, and ERR_PTR on failure
  */
 static const struct drm_format_info *
-pi_convert_format(const struct drm_framebuffer *fb) {
-  if (fb->format->format == DRM_FORMAT_XRGB8888 &&
-      fb->pitches[0] > PI_MAX_PITCH) {
-    if (fb->width * 3 <= PI_MAX_PITCH) {
+pi_convert_format(const struct drm_format_info *format, unsigned int width,
+                  unsigned int pitch) {
+  if (format->format == DRM_FORMAT_XRGB8888 && pitch > PI_MAX_PITCH) {
+    if (width * 3 <= PI_MAX_PITCH) {
       return drm_format_info(DRM_FORMAT_RGB888);
     } else {
       return drm_format_info(DRM_FORMAT_RGB565);
@@ -263,27 +337,31 @@ pi_convert_format(const struct drm_framebuffer *fb) {
   return NULL;
 }
 
-static int pi_pitch(struct drm_framebuffer *fb) {
-  const struct drm_format_info *format = pi_convert_format(fb);
+static int pi_pitch(const struct drm_format_info *format, unsigned int width,
+                    unsigned int pitch) {
+  const struct drm_format_info *converted =
+      pi_convert_format(format, width, pitch);
 
-  if (format) {
+  if (converted) {
     // Finds the minimum valid pitch
     // Since we're using simple formats, it would just be
     // width * bytes per pixel
-    return drm_format_info_min_pitch(format, 0, fb->width);
+    return drm_format_info_min_pitch(converted, 0, width);
   }
-  return fb->pitches[0];
+  return pitch;
 }
 
 // Function to actually get a converted format from the original format in the
 // frame buffer
 static const struct drm_format_info *
-pi_format(const struct drm_framebuffer *fb) {
-  const struct drm_format_info *format = pi_convert_format(fb);
-
-  if (format)
-    return format;
-  return fb->format;
+pi_format(const struct drm_format_info *format, unsigned int width,
+          unsigned int pitch) {
+  const struct drm_format_info *converted =
+      pi_convert_format(format, width, pitch);
+
+  if (converted)
+    return converted;
+  return format;
 }
 
 /*
@@ -318,6 +396,15 @@ pi_primary_plane_helper_atomic_check(struct drm_plane *plane,
 
   struct drm_crtc *new_crtc = new_plane_state->crtc;
   struct drm_crtc_state *new_crtc_state = NULL;
+  struct pi_gpu *gpu = to_pi(plane->dev);
+  // Overlays are shown anywhere on the screen, the primary plane covers it
+  bool overlay = plane->type != DRM_PLANE_TYPE_PRIMARY;
+  bool cursor = plane->type == DRM_PLANE_TYPE_CURSOR;
+  unsigned int width, height, fb_pitch;
+  struct pi_bo *bo;
+  struct drm_rect src;
+  dma_addr_t addr;
+  bool scaled;
   int ret = 0;
   unsigned int pitch;
 
@@ -330,9 +417,11 @@ pi_primary_plane_helper_atomic_check(struct drm_plane *plane,
     new_crtc_state = drm_atomic_get_new_crtc_state(state, new_crtc);
   }
 
-  ret = drm_atomic_helper_check_plane_state(new_plane_state, new_crtc_state,
-                                            DRM_PLANE_NO_SCALING,
-                                            DRM_PLANE_NO_SCALING, false, false);
+  // The cursor is shown as is, the other planes are scaled while composed
+  ret = drm_atomic_helper_check_plane_state(
+      new_plane_state, new_crtc_state,
+      cursor ? DRM_PLANE_NO_SCALING : PI_SCALE_MIN,
+      cursor ? DRM_PLANE_NO_SCALING : PI_SCALE_MAX, overlay, false);
 
   if (ret) {
     return ret;
@@ -342,102 +431,122 @@ pi_primary_plane_helper_atomic_check(struct drm_plane *plane,
     return 0;
   }
 
-  pitch = pi_pitch(display_fb);
-  if (pitch > PI_MAX_PITCH) {
+  if (cursor && (display_fb->width > PI_CURSOR_SIZE ||
+                 display_fb->height > PI_CURSOR_SIZE))
     return -EINVAL;
-  } else if (pitch * display_fb->height > PI_MAX_VRAM) {
+
+  width = display_fb->width;
+  height = display_fb->height;
+  fb_pitch = display_fb->pitches[0];
+  scaled = pi_scale_needed(&new_plane_state->src, &new_plane_state->dst);
+  if (scaled) {
+    // The filter interpolates between 2 pixels on each axis
+    if (drm_rect_width(&new_plane_state->src) < 2 << 16 ||
+        drm_rect_height(&new_plane_state->src) < 2 << 16)
+      return -EINVAL;
+
+    // Composed at the size it's shown at, which for the primary plane is the
+    // size of display memory
+    width = drm_rect_width(&new_plane_state->dst);
+    height = drm_rect_height(&new_plane_state->dst);
+    fb_pitch = width * display_fb->format->cpp[0];
+  }
+
+  // A contiguous buffer is shown as is, unless the display can't read its
+  // format or layout, or it's scaled
+  bo = to_pi_bo(drm_gem_fb_get_obj(display_fb, 0));
+  pp_state->direct =
+      pi_bo_scanout_addr(bo, &addr) && !scaled &&
+      display_fb->modifier == DRM_FORMAT_MOD_LINEAR &&
+      !pi_convert_format(display_fb->format, width, fb_pitch);
+
+  pitch = pi_pitch(display_fb->format, width, fb_pitch);
+  if (overlay) {
+    // Composed into display memory, unless the display can read it
+    if (pitch > PI_MAX_PITCH)
+      pp_state->direct = false;
+  } else if (pitch > PI_MAX_PITCH) {
+    return -EINVAL;
+  } else if (!pp_state->direct && pitch * height > PI_MAX_VRAM) {
     return -EINVAL;
   }
 
   // In this case, we know that the pitch was already fine, or the pitch was
   // successfully converted, so we modify the state from the actual commit to
   // make sure that the correct one is selected
-  pp_state->format = pi_format(display_fb);
+  pp_state->format = pi_format(display_fb->format, width, fb_pitch);
   pp_state->pitch = pitch;
+
+  if (pp_state->direct) {
+    // The display starts at the first visible pixel of the framebuffer
+    drm_rect_fp_to_int(&src, &new_plane_state->src);
+    pp_state->scanout = addr + display_fb->offsets[0] +
+                        drm_fb_clip_offset(pitch, pp_state->format, &src);
+  } else {
+    pp_state->scanout = gpu->display_dma;
+  }
   return 0;
 }
 
+/*
+ * Nothing is written per plane. Which plane the display reads, and so what the
+ * format, pitch and scanout registers are set to, depends on both planes, so
+ * it's done by pi_crtc_helper_atomic_flush() once all of them are updated.
+ */
 static void
 pi_primary_plane_helper_atomic_update(struct drm_plane *plane,
-                                      struct drm_atomic_state *state) {
-  struct pi_gpu *gpu = to_pi(plane->dev);
-  struct drm_plane_state *plane_state =
-      drm_atomic_get_new_plane_state(state, plane);
-  struct pi_primary_plane_state *pp_state = to_pi_primary_plane(plane_state);
-
-  // I think this should just be the same as doing pp_state->base
-  // struct drm_shadow_plane_state *shadow_state =
-  //     to_drm_shadow_plane_state(plane_state);
-
-  struct drm_framebuffer *display_fb = plane_state->fb;
+                                      struct drm_atomic_state *state) {}
 
-  const struct drm_format_info *format = pp_state->format;
-  unsigned int pitch = pp_state->pitch;
+/*
+ * The display memory of a CRTC is composed from all its planes, not only the
+ * ones of the commit, and cursor moves compose it outside of any commit. So
+ * the framebuffer of a plane state is mapped for as long as the state exists
+ * (see pi_primary_plane_state.map), and not only while it's committed like
+ * the shadow plane helpers do. The mapping also keeps the residency manager
+ * from moving a framebuffer that's being shown.
+ */
+static int pi_plane_helper_prepare_fb(struct drm_plane *plane,
+                                      struct drm_plane_state *state) {
+  struct pi_primary_plane_state *pp_state = to_pi_primary_plane(state);
+  int ret;
 
-  // Get the old state using helper functions. Can't just do plane->state cuz
-  // the state might have been modified along the way.
-  struct drm_plane_state *old_state =
-      drm_atomic_get_old_plane_state(state, plane);
-  struct pi_primary_plane_state *old_pp_state = to_pi_primary_plane(old_state);
+  if (!state->fb)
+    return 0;
 
-  // inits an iosys_map struct, specifying that we have system memory, no I/O
-  // memory
-  // struct iosys_map vaddr = IOSYS_MAP_INIT_VADDR(gpu->vram);
+  // Waits for the fences of the framebuffer before it's shown
+  ret = drm_gem_plane_helper_prepare_fb(plane, state);
+  if (ret)
+    return ret;
 
-  /*
-   * In graphics rendering, damage is the parts of a framebuffer that have been
-   * modified since the last refresh (update). So we just re-render those parts
-   * instead of re-rendering everything available
-   *
-   * It keeps track of the parts it needs to re-render in rectangles
-   */
-  // struct drm_atomic_helper_damage_iter iter;
-  // struct drm_rect damage;
-  int idx = 0;
+  return pi_bo_vmap(to_pi_bo(drm_gem_fb_get_obj(state->fb, 0)),
+                    &pp_state->map);
+}
 
-  if (!display_fb) {
-    return;
-  }
+static void pi_plane_helper_cleanup_fb(struct drm_plane *plane,
+                                       struct drm_plane_state *state) {
+  struct pi_primary_plane_state *pp_state = to_pi_primary_plane(state);
 
-  // This checks if the device is still alive and hasn't just been unplugged or
-  // something to avoid a nasty error like that
-  if (!drm_dev_enter(&gpu->drm_device, &idx)) {
+  if (!state->fb || iosys_map_is_null(&pp_state->map))
     return;
-  }
 
-  if (old_pp_state->format != format) {
-    pi_format_set(gpu, format);
-  }
-  if (old_pp_state->pitch != pitch) {
-    pi_pitch_set(gpu, pitch);
-  }
-
-  // drm_atomic_helper_damage_iter_init(&iter, old_state, plane_state);
-  // drm_atomic_for_each_plane_damage(&iter, &damage) {
-  //   // Calculate where the start of the dirty area is. Need the pitch for the
-  //   // width bytes needed, format for bytes/pixel and of course where the
-  //   area
-  //   // is.
-  //   unsigned int offset = drm_fb_clip_offset(pitch, format, &damage);
-  //   struct iosys_map dst = IOSYS_MAP_INIT_OFFSET(&vaddr, offset);
-
-  //   // TODO: purpose of the blit was to write to display memory
-  //
-  //   drm_fb_blit(&dst, &pitch, format->format, shadow_state->data, fb,
-  //   &damage);
-  // }
-  drm_dev_exit(idx);
+  pi_bo_vunmap(to_pi_bo(drm_gem_fb_get_obj(state->fb, 0)));
+  iosys_map_clear(&pp_state->map);
 }
 
 /*
  * Pretty straightforward check function, as we only check
  * if the CRTC is enabled or not. If it's not, there can't be a problem.
- * The only other check is checking whether the CRTC has a primary plane.
+ * The other checks are whether the CRTC has a primary plane, and whether the
+ * planes can be composed in display memory when there are several of them.
  *
  */
 static int pi_crtc_helper_atomic_check(struct drm_crtc *crtc,
                                        struct drm_atomic_state *state) {
   struct drm_crtc_state *new_state = drm_atomic_get_new_crtc_state(state, crtc);
+  const struct drm_plane_state *plane_state;
+  struct pi_primary_plane_state *pp_state = NULL;
+  struct drm_plane *plane;
+  bool overlays = false;
   int ret;
 
   if (!new_state->enable)
@@ -447,9 +556,92 @@ static int pi_crtc_helper_atomic_check(struct drm_crtc *crtc,
   if (ret)
     return ret;
 
+  drm_atomic_crtc_state_for_each_plane_state(plane, plane_state, new_state) {
+    if (!plane_state->visible)
+      continue;
+    if (plane->type == DRM_PLANE_TYPE_PRIMARY)
+      pp_state = to_pi_primary_plane((struct drm_plane_state *)plane_state);
+    else
+      overlays = true;
+  }
+
+  // A primary plane the display reads directly may not fit in display memory
+  if (overlays && pp_state &&
+      pp_state->pitch * new_state->mode.vdisplay > PI_MAX_VRAM)
+    return -EINVAL;
+
   return 0;
 }
 
+// Points the display at a frame, only writing the registers that change. The
+// plane is the one whose framebuffer it is, NULL for display memory.
+static void pi_scanout_program(struct pi_gpu *gpu, struct drm_plane *plane,
+                               const struct drm_format_info *format,
+                               unsigned int pitch, dma_addr_t addr) {
+  struct pi_scanout *scanout = &gpu->scanout;
+
+  if (scanout->format != format) {
+    pi_format_set(gpu, format);
+    scanout->format = format;
+  }
+  if (scanout->pitch != pitch) {
+    pi_pitch_set(gpu, pitch);
+    scanout->pitch = pitch;
+  }
+  // Flipping between buffers the display can read is only this, no copy
+  if (scanout->addr != addr) {
+    pi_scanout_set(gpu, addr);
+    scanout->addr = addr;
+  }
+  scanout->plane = plane;
+}
+
+/*
+ * Points the display back at display memory when it reads a framebuffer. Done
+ * when nothing is shown anymore, before the framebuffer is released at the end
+ * of the commit: its buffer object could be freed and reused right after.
+ */
+static void pi_scanout_release(struct pi_gpu *gpu) {
+  struct pi_scanout *scanout = &gpu->scanout;
+
+  if (scanout->plane)
+    pi_scanout_program(gpu, NULL, scanout->format, scanout->pitch,
+                       gpu->display_dma);
+}
+
+// Composes the damage into display memory from the layers of
+// pi_compose_layers(), returns the number of bytes written
+static size_t pi_display_compose(struct pi_gpu *gpu,
+                                 const struct pi_layer *layers,
+                                 unsigned int num,
+                                 const struct pi_damage *damage) {
+  struct pi_primary_plane_state *ppp_display =
+      to_pi_primary_plane(gpu->crtc.primary->state);
+  size_t bytes = 0;
+  bool dither;
+
+  // Only dithered if it's converted, see pi_convert_format()
+  dither = pi_convert_dither() &&
+           ppp_display->format != ppp_display->base.base.fb->format;
+  for (unsigned int i = 0; i < damage->num; i++)
+    bytes += pi_compose_rect(gpu, layers, num, &damage->rects[i],
+                             ppp_display->format, ppp_display->pitch, dither);
+  return bytes;
+}
+
+/*
+ * In graphics rendering, damage is the parts of a framebuffer that have been
+ * modified since the last refresh (update). So we just re-render those parts
+ * instead of re-rendering everything available
+ *
+ * When the top plane is opaque, covers the whole screen and the display can
+ * read its framebuffer, the display is pointed at it instead: a page flip
+ * costs the same at any resolution, and nothing is composed.
+ *
+ * Otherwise, the planes are composed into display memory (see compose.c), only
+ * over the damage of the commit: the damage of every plane, where it's shown,
+ * and where the planes that moved were and are.
+ */
 static void pi_crtc_helper_atomic_flush(struct drm_crtc *crtc,
                                         struct drm_atomic_state *state) {
   // Update our display buffer
@@ -457,15 +649,173 @@ static void pi_crtc_helper_atomic_flush(struct drm_crtc *crtc,
 
   struct pi_primary_plane_state *ppp_display =
       to_pi_primary_plane(crtc->primary->state);
-  struct pi_primary_plane_state *ppp_render =
-      to_pi_primary_plane(gpu->planes[1].state);
+  struct drm_framebuffer *display_fb = ppp_display->base.base.fb;
+  struct pi_primary_plane_state *ppp_top;
+  struct drm_plane_state *old_state, *new_state;
+  struct pi_flush_stats *stats = &gpu->flush_stats;
+  struct drm_rect screen = DRM_RECT_INIT(0, 0, crtc->state->mode.hdisplay,
+                                         crtc->state->mode.vdisplay);
+  struct pi_layer layers[PI_MAX_LAYERS];
+  struct pi_damage damage;
+  struct pi_layer *top;
+  struct drm_plane *plane;
+  unsigned int num;
+  size_t bytes;
+  int idx, i;
+
+  if (!drm_dev_enter(&gpu->drm_device, &idx))
+    goto out;
+
+  mutex_lock(&gpu->compose.lock);
+  if (!display_fb || !ppp_display->base.base.visible) {
+    pi_scanout_release(gpu);
+    goto unlock;
+  }
 
-  void *display_addr = ppp_display->base.data[0].vaddr;
-  void *render_addr = ppp_render->base.data[0].vaddr;
-  unsigned int len =
-      ppp_display->base.base.fb->pitches[0] * ppp_display->base.base.fb->height;
+  // The primary plane is visible, so there's at least one
+  num = pi_compose_layers(crtc, layers);
+  top = &layers[num - 1];
+  ppp_top = to_pi_primary_plane(top->state);
+  if (top->opaque && ppp_top->direct && drm_rect_equals(&top->dst, &screen)) {
+    pi_scanout_program(gpu, top->state->plane, ppp_top->format, ppp_top->pitch,
+                       ppp_top->scanout);
+    stats->commits++;
+    stats->flips++;
+    stats->last_bytes = 0;
+    goto unlock;
+  }
+
+  pi_damage_init(&damage);
+  // Display memory wasn't updated while the display read a framebuffer
+  if (gpu->scanout.plane)
+    pi_damage_add(&damage, &screen);
+  for_each_oldnew_plane_in_state(state, plane, old_state, new_state, i)
+    pi_damage_add_plane(&damage, old_state, new_state);
+
+  bytes = pi_display_compose(gpu, layers, num, &damage);
+
+  stats->commits++;
+  stats->rects += damage.num;
+  stats->bytes += bytes;
+  stats->last_bytes = bytes;
+  stats->frame_bytes = (u64)ppp_display->pitch * screen.y2;
+
+  // After the composition, the display doesn't show a half updated frame when
+  // it switches back from a framebuffer
+  pi_scanout_program(gpu, NULL, ppp_display->format, ppp_display->pitch,
+                     gpu->display_dma);
+unlock:
+  mutex_unlock(&gpu->compose.lock);
+  drm_dev_exit(idx);
+out:
+  // The commit is done once the display shows it, at the next vblank
+  pi_vblank_send_event(crtc);
 
-  memcpy(display_addr, render_addr, len);
+  // Where the residency manager counts frames
+  pi_residency_end_frame(gpu);
+}
+
+/*
+ * Moving the cursor doesn't need a commit: when only its position changes, the
+ * legacy cursor ioctls and atomic commits flagged as cursor updates are applied
+ * right away by pi_cursor_plane_helper_atomic_async_update(). Anything else,
+ * like a new cursor image, goes through a normal commit, and so does a move
+ * while a plane has no mapping to compose it from.
+ */
+static int
+pi_cursor_plane_helper_atomic_async_check(struct drm_plane *plane,
+                                          struct drm_atomic_state *state) {
+  struct drm_plane_state *new_state =
+      drm_atomic_get_new_plane_state(state, plane);
+  struct drm_plane_state *old_state = plane->state;
+  struct drm_plane *other;
+
+  // Display memory is only up to date if the cursor was composed into it
+  if (!old_state->visible || !new_state->visible ||
+      old_state->fb != new_state->fb)
+    return -EINVAL;
+
+  // The move is composed outside of any commit, from the mappings the current
+  // states hold (see pi_plane_helper_prepare_fb()), so they all need one
+  drm_for_each_plane_mask(other, plane->dev,
+                          old_state->crtc->state->plane_mask) {
+    struct drm_plane_state *cur = other->state;
+
+    if (cur->fb && cur->visible &&
+        iosys_map_is_null(&to_pi_primary_plane(cur)->map))
+      return -EINVAL;
+  }
+  return 0;
+}
+
+/*
+ * The state of the plane is updated in place, and only where the cursor was
+ * and where it is now are composed again. Neither the CRTC state nor a vblank
+ * are involved, so the pointer follows the mouse at any rate.
+ */
+static void
+pi_cursor_plane_helper_atomic_async_update(struct drm_plane *plane,
+                                           struct drm_atomic_state *state) {
+  struct drm_plane_state *new_state =
+      drm_atomic_get_new_plane_state(state, plane);
+  struct drm_plane_state *cur = plane->state;
+  struct pi_gpu *gpu = to_pi(plane->dev);
+  struct pi_flush_stats *stats = &gpu->flush_stats;
+  struct pi_layer layers[PI_MAX_LAYERS];
+  struct pi_damage damage;
+  size_t bytes = 0;
+  int idx;
+
+  mutex_lock(&gpu->compose.lock);
+  pi_damage_init(&damage);
+  pi_damage_add(&damage, &cur->dst);
+
+  cur->crtc_x = new_state->crtc_x;
+  cur->crtc_y = new_state->crtc_y;
+  cur->crtc_w = new_state->crtc_w;
+  cur->crtc_h = new_state->crtc_h;
+  cur->src_x = new_state->src_x;
+  cur->src_y = new_state->src_y;
+  cur->src_w = new_state->src_w;
+  cur->src_h = new_state->src_h;
+  cur->src = new_state->src;
+  cur->dst = new_state->dst;
+  pi_damage_add(&damage, &cur->dst);
+
+  // Nothing is composed while the display reads a framebuffer
+  if (!gpu->scanout.plane && gpu->crtc.primary->state->visible &&
+      drm_dev_enter(&gpu->drm_device, &idx)) {
+    bytes = pi_display_compose(gpu, layers,
+                               pi_compose_layers(&gpu->crtc, layers), &damage);
+    drm_dev_exit(idx);
+  }
+
+  stats->cursor_moves++;
+  stats->rects += damage.num;
+  stats->bytes += bytes;
+  stats->last_bytes = bytes;
+  mutex_unlock(&gpu->compose.lock);
+}
+
+// The vblank timer only runs while the CRTC is on
+static void pi_crtc_helper_atomic_enable(struct drm_crtc *crtc,
+                                         struct drm_atomic_state *state) {
+  drm_crtc_vblank_on(crtc);
+}
+
+static void pi_crtc_helper_atomic_disable(struct drm_crtc *crtc,
+                                          struct drm_atomic_state *state) {
+  struct pi_gpu *gpu = to_gpu(crtc->dev);
+  int idx;
+
+  drm_crtc_vblank_off(crtc);
+
+  if (drm_dev_enter(&gpu->drm_device, &idx)) {
+    mutex_lock(&gpu->compose.lock);
+    pi_scanout_release(gpu);
+    mutex_unlock(&gpu->compose.lock);
+    drm_dev_exit(idx);
+  }
 }
 
 /*-------------------------------------------------------------------------------
@@ -478,12 +828,6 @@ static void pi_crtc_helper_atomic_flush(struct drm_crtc *crtc,
 #define REG_FORMAT 0x04
 #define REG_PITCH 0x08
 
-enum {
-  PIX_FMT_RGB565 = 0,
-  PIX_FMT_RGB888 = 1,
-  PIX_FMT_XRGB8888 = 2,
-};
-
 static void pi_format_set(struct pi_gpu *gpu,
                           const struct drm_format_info *format) {
   u8 fmt;
@@ -495,6 +839,8 @@ static void pi_format_set(struct pi_gpu *gpu,
   case DRM_FORMAT_RGB888:
     fmt = PIX_FMT_RGB888;
     break;
+  // The display ignores alpha, only opaque planes are scanned out
+  case DRM_FORMAT_ARGB8888:
   case DRM_FORMAT_XRGB8888:
     fmt = PIX_FMT_XRGB8888;
     break;
@@ -512,6 +858,12 @@ static void pi_pitch_set(struct pi_gpu *gpu, unsigned int pitch) {
   iowrite16(reg_pitch, gpu->registers + REG_PITCH);
 }
 
+// Points the display at a frame, the new address is used from the next refresh
+void pi_scanout_set(struct pi_gpu *gpu, dma_addr_t addr) {
+  iowrite32(get_64_lo((u64)addr), gpu->registers + REG_SCANOUT_LO);
+  iowrite32(get_64_hi((u64)addr), gpu->registers + REG_SCANOUT_HI);
+}
+
 /*
  * These are all the mandatory functions I need for my plane
  * Since I'm using the atomic thing
@@ -527,42 +879,53 @@ static const struct drm_plane_funcs pi_primary_plane_funcs = {
 };
 
 static const struct drm_plane_helper_funcs pi_primary_plane_helper_funcs = {
-    // Macro that initializes some helper functions
-    // Apparently they're tedious, and shouldn't be written by me
-    //
-    // NOTE: Shadow plane states only map the frame buffers to the kernel
-    // address space
-    // so the CPU can access them. There's no copy made or anything
-    // The only time changes to the framebuffer really occur are in the
-    // atomic_update()
-    // The above is done by begin_fb_access()
-    // And I think the end_fb_access() relesases the memory or someeee
-    //
     // NOTE: The driver never scans the framebuffer for "dirt" (changed regions
     // in the framebuffer)
     // Those are supplied by the user space (and we call
     // drm_plane_enable_fb_damage_clips) to receive them
     //
-    // There's no need to define prepare_fb or cleanup_fb because if they're not
-    // defined,
-    // begin_access_fb() implements them, and that's what happens in
-    // DRM_GEM_SHADOW_PLANE_HELPER_FUNCS
-    DRM_GEM_SHADOW_PLANE_HELPER_FUNCS,
+    // The framebuffers are mapped by prepare_fb for the whole life of the
+    // plane state, not by begin_fb_access for the commit only
+    .prepare_fb = pi_plane_helper_prepare_fb,
+    .cleanup_fb = pi_plane_helper_cleanup_fb,
+    .atomic_check = pi_primary_plane_helper_atomic_check,
+    .atomic_update = pi_primary_plane_helper_atomic_update,
+};
+
+// The same, plus moves without a commit
+static const struct drm_plane_helper_funcs pi_cursor_plane_helper_funcs = {
+    .prepare_fb = pi_plane_helper_prepare_fb,
+    .cleanup_fb = pi_plane_helper_cleanup_fb,
     .atomic_check = pi_primary_plane_helper_atomic_check,
     .atomic_update = pi_primary_plane_helper_atomic_update,
+    .atomic_async_check = pi_cursor_plane_helper_atomic_async_check,
+    .atomic_async_update = pi_cursor_plane_helper_atomic_async_update,
 };
 
 static struct drm_crtc_helper_funcs pi_crtc_helper_funcs = {
     .atomic_check = pi_crtc_helper_atomic_check,
     .atomic_flush = pi_crtc_helper_atomic_flush,
+    .atomic_enable = pi_crtc_helper_atomic_enable,
+    .atomic_disable = pi_crtc_helper_atomic_disable,
     .mode_set_nofb = NULL, // TODO:
 };
 
 static const uint32_t pi_primary_plane_formats[] = {
     DRM_FORMAT_XRGB8888, DRM_FORMAT_RGB888, DRM_FORMAT_RGB565};
 
+// The overlay is composed, so it can have an alpha channel
+static const uint32_t pi_overlay_plane_formats[] = {
+    DRM_FORMAT_ARGB8888, DRM_FORMAT_XRGB8888, DRM_FORMAT_RGB888,
+    DRM_FORMAT_RGB565};
+
+// Cursor images come premultiplied
+static const uint32_t pi_cursor_plane_formats[] = {DRM_FORMAT_ARGB8888};
+
+// Tiled framebuffers are detiled when they're composed
 static const uint64_t pi_primary_plane_modifiers[] = {
     DRM_FORMAT_MOD_LINEAR,
+    PI_FORMAT_MOD_TILED_8X8,
+    DRM_FORMAT_MOD_INVALID,
 };
 
 static const struct drm_crtc_funcs pi_crtc_funcs = {
@@ -572,11 +935,13 @@ static const struct drm_crtc_funcs pi_crtc_funcs = {
     .page_flip = drm_atomic_helper_page_flip,
     .atomic_duplicate_state = drm_atomic_helper_crtc_duplicate_state,
     .atomic_destroy_state = drm_atomic_helper_crtc_destroy_state,
+    .enable_vblank = pi_vblank_enable,
+    .disable_vblank = pi_vblank_disable,
+    .get_vblank_timestamp = pi_vblank_get_timestamp,
 };
 
 static int pi_pipe_init(struct pi_gpu *gpu) {
   struct drm_device *drm = &gpu->drm_device;
-  struct drm_crtc *crtc = NULL;
   int ret = 0;
 
   /*
@@ -628,28 +993,98 @@ static int pi_pipe_init(struct pi_gpu *gpu) {
    */
   drm_plane_enable_fb_damage_clips(&(gpu->planes[0]));
 
+  // Always at the bottom
+  ret = drm_plane_create_zpos_immutable_property(&(gpu->planes[0]), 0);
+  if (ret)
+    return ret;
+
   ret = drm_universal_plane_init(
       drm, &(gpu->planes[1]), 0, &pi_primary_plane_funcs,
-      pi_primary_plane_formats, ARRAY_SIZE(pi_primary_plane_formats),
+      pi_overlay_plane_formats, ARRAY_SIZE(pi_overlay_plane_formats),
       pi_primary_plane_modifiers, DRM_PLANE_TYPE_OVERLAY, NULL);
+  if (ret)
+    return ret;
+
+  // Same helpers, so its framebuffer is mapped for the flush to compose it
+  drm_plane_helper_add(&(gpu->planes[1]), &pi_primary_plane_helper_funcs);
+  drm_plane_enable_fb_damage_clips(&(gpu->planes[1]));
+
+  // How it's stacked and blended, see compose.c
+  ret = drm_plane_create_zpos_property(&(gpu->planes[1]), 1, 1,
+                                       PI_CURSOR_ZPOS - 1);
+  if (ret)
+    return ret;
+  ret = drm_plane_create_alpha_property(&(gpu->planes[1]));
+  if (ret)
+    return ret;
+  ret = drm_plane_create_blend_mode_property(
+      &(gpu->planes[1]), BIT(DRM_MODE_BLEND_PIXEL_NONE) |
+                             BIT(DRM_MODE_BLEND_PREMULTI) |
+                             BIT(DRM_MODE_BLEND_COVERAGE));
+  if (ret)
+    return ret;
+
+  ret = drm_universal_plane_init(
+      drm, &(gpu->planes[2]), 0, &pi_primary_plane_funcs,
+      pi_cursor_plane_formats, ARRAY_SIZE(pi_cursor_plane_formats),
+      pi_primary_plane_modifiers, DRM_PLANE_TYPE_CURSOR, NULL);
+  if (ret)
+    return ret;
+
+  drm_plane_helper_add(&(gpu->planes[2]), &pi_cursor_plane_helper_funcs);
+  drm_plane_enable_fb_damage_clips(&(gpu->planes[2]));
+
+  ret = drm_plane_create_zpos_immutable_property(&(gpu->planes[2]),
+                                                 PI_CURSOR_ZPOS);
+  if (ret)
+    return ret;
 
   /*
-   * The first NULL is for the cursor plane
-   *
    * NOTE: CRTC is owned by the device, so still exists even if there's no
    * planes pointing to it
    */
-  ret = drmm_crtc_init_with_planes(drm, &gpu->crtc, &(gpu->planes[0]), NULL,
-                                   &pi_crtc_funcs, NULL);
+  ret = drmm_crtc_init_with_planes(drm, &gpu->crtc, &(gpu->planes[0]),
+                                   &(gpu->planes[2]), &pi_crtc_funcs, NULL);
 
   if (ret) {
     return ret;
   }
-  drm_crtc_helper_add(crtc, &pi_crtc_helper_funcs);
+  drm_crtc_helper_add(&gpu->crtc, &pi_crtc_helper_funcs);
+
+  ret = pi_vblank_init(gpu);
+  if (ret)
+    return ret;
 
   return 0;
 }
 
+static void pi_vram_release(struct drm_device *drm, void *unused) {
+  struct pi_gpu *gpu = to_gpu(drm);
+
+  dma_free_coherent(drm->dev, gpu->vram_size, gpu->vram, gpu->dma_handle_vram);
+}
+
+static void pi_raster_release(struct drm_device *drm, void *unused) {
+  pi_raster_fini(&to_gpu(drm)->raster);
+}
+
+static void pi_heap_release(struct drm_device *drm, void *unused) {
+  struct pi_gpu *gpu = to_gpu(drm);
+
+  // Evictions still in flight hold buffers that live in the heap
+  pi_residency_fini(gpu);
+  pi_vram_heap_fini(gpu);
+}
+
+static void pi_bo_cache_release(struct drm_device *drm, void *unused) {
+  pi_bo_cache_fini(to_gpu(drm));
+}
+
+static void pi_ring_release(struct drm_device *drm, void *unused) {
+  // The GPU has to be idle before its vram goes away
+  pi_ring_fini(to_gpu(drm));
+}
+
 static int fake_gpu_load(struct pi_gpu *gpu) {
   // cool way to get back the platform device from the device without having
   // to pass it in the function. to_platform_device is a wrapper for
@@ -703,7 +1138,11 @@ static int fake_gpu_load(struct pi_gpu *gpu) {
    * Divide by 2 because the smallest Bpp we have is 2
    */
   drm->mode_config.max_width = PI_MAX_PITCH / 2;
+  drm->mode_config.cursor_width = PI_CURSOR_SIZE;
+  drm->mode_config.cursor_height = PI_CURSOR_SIZE;
   drm->mode_config.funcs = &fake_gpu_modecfg_funcs;
+  // Computes the normalized_zpos the composition stacks the planes by
+  drm->mode_config.normalize_zpos = true;
 
   /*
    * resources have a start address and a size
@@ -820,10 +1259,71 @@ static int fake_gpu_load(struct pi_gpu *gpu) {
                                  GFP_KERNEL);
   gpu->vram_size = (size_t)vram_size;
 
-  if (IS_ERR(gpu->vram)) {
-    return PTR_ERR(gpu->vram);
+  if (!gpu->vram) {
+    return -ENOMEM;
   }
 
+  /*
+   * The vram and everything living in it stay until the drm device is
+   * released, not just until the platform device goes away: buffers mmapped
+   * or exported by clients, and jobs still on the ring, can outlive
+   * remove_fake_gpu(). The drmm actions run in reverse order, so the ring is
+   * idle before the buffers go, and the buffers are gone before the vram.
+   */
+  ret = drmm_add_action_or_reset(drm, pi_vram_release, NULL);
+  if (ret)
+    return ret;
+
+  // Framebuffers in system memory are copied there for the display to read
+  if (gpu->vram_size < VRAM_DISPLAY_START + VRAM_DISPLAY_SIZE)
+    return -ENOSPC;
+  gpu->display_addr =
+      IOSYS_MAP_INIT_VADDR((u8 *)gpu->vram + VRAM_DISPLAY_START);
+  gpu->display_dma = gpu->dma_handle_vram + VRAM_DISPLAY_START;
+
+  // Safe to tear down half initialized
+  ret = drmm_add_action_or_reset(drm, pi_raster_release, NULL);
+  if (ret)
+    return ret;
+  ret = pi_raster_init(&gpu->raster);
+  if (ret)
+    return ret;
+  pi_convert_init(gpu);
+  pi_compose_init(gpu);
+  pi_scale_init(gpu);
+
+  pi_vram_heap_init(gpu);
+  pi_residency_init(gpu);
+  ret = drmm_add_action_or_reset(drm, pi_heap_release, NULL);
+  if (ret)
+    return ret;
+
+  // Does nothing if the shrinkers never got registered
+  ret = drmm_add_action_or_reset(drm, pi_bo_cache_release, NULL);
+  if (ret)
+    return ret;
+  ret = pi_bo_cache_init(gpu);
+  if (ret)
+    return ret;
+
+  ret = drmm_add_action_or_reset(drm, pi_ring_release, NULL);
+  if (ret)
+    return ret;
+  ret = pi_ring_init(gpu);
+  if (ret)
+    return ret;
+
+  pi_executor_debugfs_init(gpu);
+  pi_bo_debugfs_init(gpu);
+  pi_validate_debugfs_init(gpu);
+  pi_residency_debugfs_init(gpu);
+  pi_dma_bo_debugfs_init(gpu);
+  pi_damage_debugfs_init(gpu);
+  pi_vblank_debugfs_init(gpu);
+  pi_convert_debugfs_init(gpu);
+  pi_compose_debugfs_init(gpu);
+  pi_scale_debugfs_init(gpu);
+
   /*
    * Gets the first endpoint from the device tree. The second param (where we
    * pass in NULL) is the previous endpoint. Since we passed NULL, we would
@@ -859,9 +1359,12 @@ static int fake_gpu_load(struct pi_gpu *gpu) {
 
 static int pi_gpu_unload(struct drm_device *drm) {
   struct pi_gpu *pi_device = to_gpu(drm);
-  dma_free_coherent(drm->dev, pi_device->vram_size, pi_device->vram, pi_device->dma_handle_vram);
-  drm_kms_helper_poll_fini(drm);
+
+  // Turns the display off and releases the framebuffers of the planes, the
+  // rest goes with the drm device once the last client is gone
   drm_atomic_helper_shutdown(drm);
+  drm_kms_helper_poll_fini(drm);
+  pi_vblank_fini(pi_device);
 
   return 0;
 }
@@ -894,13 +1397,10 @@ static int probe_fake_gpu(struct platform_device *device) {
     return PTR_ERR(pi_device);
   }
 
+  // What got set up is torn down by the drmm actions
   ret = fake_gpu_load(pi_device);
-
-  if (ret) {
-    dma_free_coherent(&device->dev, pi_device->vram_size, pi_device->vram, pi_device->dma_handle_vram);
+  if (ret)
     return ret;
-  }
-
 
   ret = drm_dev_register(&(pi_device->drm_device), 0);
   if (ret)
@@ -9,19 +9,63 @@
 #include "drm/drm_format_helper.h"
 #include "drm/drm_fourcc.h"
 #include "drm/drm_framebuffer.h"
+#include "drm/drm_gem_atomic_helper.h"
 #include "drm/drm_gem_framebuffer_helper.h"
 #include "drm/drm_ioctl.h"
 #include "drm/drm_mode_config.h"
 #include "drm/drm_plane.h"
+#include "linux/idr.h"
+#include "linux/iosys-map.h"
+#include "linux/mutex.h"
 #include <linux/platform_device.h>
 
+#include "bo.h"
+#include "compose.h"
+#include "convert.h"
+#include "damage.h"
+#include "dma_bo.h"
+#include "execbuffer.h"
+#include "pi_gpu_drm.h"
+#include "executor.h"
+#include "raster.h"
+#include "residency.h"
+#include "ring.h"
+#include "scale.h"
+#include "validate.h"
+#include "vblank.h"
+#include "vm.h"
+#include "vram.h"
+
 
 #define get_64_lo(val) (val & 0xFFFFFFFF)
 
 #define get_64_hi(val) ((val >> 32) & 0xFFFFFFFF)
 
 #define GPU_ID 0x0000 // temporary offset for the ID register for now
-#define NUM_PLANES 2
+
+// Bus address the display reads the frame from, written low half first
+#define REG_SCANOUT_LO 0x0C
+#define REG_SCANOUT_HI 0x10
+#define NUM_PLANES 3
+
+
+// Per client state, in &drm_file.driver_priv
+struct pi_file {
+  struct mutex lock;
+  struct idr bo_lists; // &pi_bo_list by ID
+
+  // GPU address space of the client, jobs using it hold a reference
+  struct pi_vm *vm;
+};
+
+
+// What the display registers are set to, only touched by the commit tail
+struct pi_scanout {
+  struct drm_plane *plane; // the display reads, NULL for display memory
+  const struct drm_format_info *format;
+  unsigned int pitch;
+  dma_addr_t addr;
+};
 
 
 // This is the main device the driver will be for.
@@ -42,17 +86,79 @@ struct pi_gpu {
   // Unused since there's no actual DMA, but here for the future
   dma_addr_t dma_handle_vram;
   size_t vram_size;
-  struct iosys_map render_addr;
+  // Display memory in vram, see VRAM_DISPLAY_START
   struct iosys_map display_addr;
+  dma_addr_t display_dma;
+  struct pi_scanout scanout;
+  // Fastest usable format conversion, blending and scaling kernels
+  const struct pi_convert_impl *convert;
+  const struct pi_blend_impl *blend;
+  const struct pi_scale_impl *scale;
+  struct pi_compose compose;
+  // Filters of the scaled planes, by plane index, under compose.lock
+  struct pi_scaler scalers[NUM_PLANES];
+  struct pi_vblank vblank;
+
+  struct pi_ring ring;
+  // Only updated by the GPU front-end
+  struct pi_exec_stats exec_stats;
+  // Shared by the front-end and the benchmarks, see raster.lock
+  struct pi_raster raster;
+
+  struct pi_bo_cache bo_cache;
+  struct pi_bo_pool bo_pool;
+  struct pi_vram_heap vram_heap;
+  struct pi_mem_stats mem_stats;
+  struct pi_residency residency;
+  struct pi_submit_stats submit_stats;
+  struct pi_validate_stats validate_stats;
+  struct pi_flush_stats flush_stats;
 
   // plane[0] -> Primary plane
-  // plane[1] -> Render plane
-  struct drm_plane planes[2];
+  // plane[1] -> Render plane, an overlay
+  // plane[2] -> Cursor plane
+  struct drm_plane planes[NUM_PLANES];
   struct drm_connector connector;
   struct drm_encoder encoder;
   struct drm_crtc crtc;
 };
 
+/*
+ * Just like the pi_gpu, we're going to create our own version of a plane state
+ * for this driver it's going to embed a drm_shadow_plane_state which itself
+ * embeds a drm_plane_state
+ *
+ * A shadow plane is a struct that has a plane_state, but also a copy of it,
+ * which can be modified before actually updating the plane
+ */
+struct pi_primary_plane_state {
+  struct drm_shadow_plane_state base;
+
+  const struct drm_format_info *format;
+
+  // The pitch is NOTE: the number of bytes between the start of one line of
+  // pixels and the start of the next line
+  unsigned int pitch;
+
+  // The framebuffer is in contiguous DMA memory and needs no conversion, so
+  // the display can read it directly instead of a copy in display memory
+  bool direct;
+  // What the scanout registers are set to for this state
+  dma_addr_t scanout;
+
+  // Mapping of the framebuffer, held from prepare_fb to cleanup_fb. Unlike the
+  // ones of the shadow plane helpers, it outlives the commit, so the planes a
+  // commit doesn't touch (and cursor moves) are composed from it.
+  struct iosys_map map;
+};
+
+static inline struct pi_primary_plane_state *
+to_pi_primary_plane(struct drm_plane_state *state) {
+  return container_of(state, struct pi_primary_plane_state, base.base);
+}
+
 struct pi_gpu *to_gpu(struct drm_device *drm);
 
+void pi_scanout_set(struct pi_gpu *gpu, dma_addr_t addr);
+
 #endif
@@ -12,40 +12,66 @@
 #include "drm/drm_gem_shmem_helper.h"
 #include "drm/drm_ioctl.h"
 #include "drm/drm_mode_config.h"
+#include "drm/drm_syncobj.h"
+#include "linux/align.h"
+#include "linux/atomic.h"
+#include "linux/dma-fence-chain.h"
+#include "linux/dma-fence.h"
+#include "linux/dma-resv.h"
 #include "linux/err.h"
+#include "linux/fcntl.h"
+#include "linux/file.h"
 #include "linux/gfp_types.h"
 #include "linux/iosys-map.h"
+#include "linux/jiffies.h"
+#include "linux/ktime.h"
 #include "linux/kern_levels.h"
 #include "linux/kernel.h"
 #include "linux/printk.h"
 #include "linux/rcupdate.h"
 #include "linux/slab.h"
+#include "linux/string.h"
+#include "linux/sync_file.h"
 #include "linux/uaccess.h"
 #include <linux/platform_device.h>
 
+#include "bo.h"
+#include "bo_list.h"
 #include "driver.h"
 #include "execbuffer.h"
+#include "executor.h"
+#include "ring.h"
+#include "validate.h"
+#include "vm.h"
 
-#define INS_OBJ 0x00
-#define FRM_OBJ 0x01
-
-#define MAX_BO_COUNT 2
-
-int process_gem_exec_obj(unsigned long addr, size_t size, u8 flag,
-                          struct pi_gpu *gpu, struct pi_exec_buffer *buffer) {
+int process_gem_exec_obj(unsigned long addr, size_t size, u8 flag, u32 *regs,
+                         struct pi_exec_buffer *buffer) {
   int ret = 0;
+  size_t instr_len;
+
   switch (flag) {
   case INS_OBJ:
-    *(gpu->vram + INS_BUFFER_OFFSET) = get_64_lo(addr);
-    *(gpu->vram + INS_BUFFER_OFFSET + 1) = get_64_hi(addr);
-    *(gpu->vram + INS_BUFFER_LEN_OFFSET) = buffer->instr_len == 0 ? size : buffer->instr_len;
-    *(gpu->vram + INS_BUFFER_START_OFFSET) = buffer->instr_start_offset;
+    // Instructions are 32-bit words, and the executed range has to be inside
+    // of the buffer object
+    if (buffer->instr_start_offset > size ||
+        !IS_ALIGNED(buffer->instr_start_offset, sizeof(u32)))
+      return -EINVAL;
+    instr_len = buffer->instr_len == 0 ? size - buffer->instr_start_offset
+                                       : buffer->instr_len;
+    if (instr_len > size - buffer->instr_start_offset ||
+        !IS_ALIGNED(instr_len, sizeof(u32)))
+      return -EINVAL;
+
+    *(regs + INS_BUFFER_OFFSET) = get_64_lo(addr);
+    *(regs + INS_BUFFER_OFFSET + 1) = get_64_hi(addr);
+    *(regs + INS_BUFFER_LEN_OFFSET) = instr_len;
+    *(regs + INS_BUFFER_START_OFFSET) = buffer->instr_start_offset;
     break;
   case FRM_OBJ:
-    *(gpu->vram + FRM_BUFFER_OFFSET) = get_64_lo(addr);
-    *(gpu->vram + FRM_BUFFER_OFFSET + 1) = get_64_hi(addr);
-    *(gpu->vram + FRM_BUFFER_LEN_OFFSET) = get_64_lo(size);
-    *(gpu->vram + FRM_BUFFER_LEN_OFFSET + 1) = get_64_hi(size);
+    *(regs + FRM_BUFFER_OFFSET) = get_64_lo(addr);
+    *(regs + FRM_BUFFER_OFFSET + 1) = get_64_hi(addr);
+    *(regs + FRM_BUFFER_LEN_OFFSET) = get_64_lo(size);
+    *(regs + FRM_BUFFER_LEN_OFFSET + 1) = get_64_hi(size);
     break;
   default:
     printk(KERN_CRIT "Invalid flag for GEM buffer object"); 
@@ -56,143 +82,601 @@ int process_gem_exec_obj(unsigned long addr, size_t size, u8 flag,
 }
 
 
-static inline void init_bo_list(Pair (*obj_adr_list)[MAX_BO_COUNT]) {
-  for (int i = 0; i < MAX_BO_COUNT; i++) {
-    (*obj_adr_list)[i].first = NULL;
-    (*obj_adr_list)[i].second = NULL;
+// Releases the mappings of the job (and with them the references to the
+// buffer objects), its dependencies and its fence.
+void pi_job_free(struct pi_job *job) {
+  if (job->bo_list)
+    pi_bo_list_put(job->bo_list);
+  if (job->vm)
+    pi_vm_put(job->vm);
+
+  for (u32 i = 0; i < job->num_bos; i++) {
+    pi_bo_vunmap(job->bos[i]);
+    drm_gem_object_put(&job->bos[i]->base.base);
   }
+
+  for (u32 i = 0; i < job->num_deps; i++)
+    dma_fence_put(job->deps[i]);
+  kfree(job->deps);
+
+  if (job->fence)
+    dma_fence_put(job->fence);
+  kfree(job);
 }
 
 
-// Unmaps the mapping for the Virtual address of the buffer AND decrements the reference of the
-// base of the &drm_gem_shmem_object's base field.
-static void destroy_bo_list(Pair obj_adr_list[MAX_BO_COUNT]) {
-  for (int i = 0; i < MAX_BO_COUNT; i++) {
-    drm_gem_shmem_vunmap(obj_adr_list[i].first, obj_adr_list[i].second);
+/*
+ * Timeline points come as the dma_fence_chain node of the syncobj, which also
+ * waits for the points before it. Only the unsignaled fences of the chain
+ * decide whether it's ours.
+ */
+static bool pi_fence_is_ours(struct pi_gpu *gpu, struct dma_fence *fence) {
+  struct dma_fence *iter;
 
-    struct drm_gem_shmem_object *obj = obj_adr_list[i].first;
+  dma_fence_chain_for_each(iter, fence) {
+    struct dma_fence *f = dma_fence_chain_contained(iter);
 
-    drm_gem_object_put(&obj->base);
+    if (f->context != gpu->ring.fence_context && !dma_fence_is_signaled(f)) {
+      dma_fence_put(iter);
+      return false;
+    }
   }
+  return true;
 }
 
-
 /*
- * data argument is a pointer that the kernel already converted for us into the
- kernel address space
- * (by doing copy_from_user). So we can cast it to a struct we defined in
- user-space (that's also defined)
- * in the kernel module.
- * e.g.
- *struct drm_my_ioctl_args {
-    __u32 some_cool_argument;
-  };
+ * Resolves the in syncs of a submission into the fences the GPU has to wait on.
+ *
+ * Fences that already signaled are dropped, and so are the ones coming from our
+ * own ring since it executes jobs in order anyway. That way, most dependencies
+ * between jobs of the same client cost nothing.
+ */
+static int pi_job_add_in_syncs(struct pi_gpu *gpu, struct drm_file *file,
+                               struct pi_exec_buffer *args,
+                               struct pi_job *job) {
+  struct pi_exec_sync *syncs;
+  struct dma_fence *fence;
+  int ret = 0;
 
-  This function transforms data into a &pi_exec_buffer structure. That structure
- contains a list of pointers to shmem GEM buffer objects. This is similar to:
- &struct drm_i915_execbuffer2 defined in linux/include/uapi/drm/i915_drm.h An
- example of using the struct can be found in
- linux/drivers/gpu/drm/i915/gem/i915_gem_execbuffer.c
+  if (!args->num_in_syncs)
+    return 0;
+  if (args->num_in_syncs > PI_MAX_SYNCS)
+    return -EINVAL;
+
+  syncs = kmalloc_array(args->num_in_syncs, sizeof(*syncs), GFP_KERNEL);
+  job->deps = kcalloc(args->num_in_syncs, sizeof(*job->deps), GFP_KERNEL);
+  if (!syncs || !job->deps) {
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  if (copy_from_user(syncs, u64_to_user_ptr(args->in_syncs),
+                     args->num_in_syncs * sizeof(*syncs))) {
+    ret = -EFAULT;
+    goto out;
+  }
+
+  for (u32 i = 0; i < args->num_in_syncs; i++) {
+    ret = drm_syncobj_find_fence(file, syncs[i].handle, syncs[i].point, 0,
+                                 &fence);
+    if (ret)
+      goto out;
+
+    if (pi_fence_is_ours(gpu, fence) || dma_fence_is_signaled(fence)) {
+      dma_fence_put(fence);
+      continue;
+    }
+    job->deps[job->num_deps++] = fence;
+  }
+
+out:
+  kfree(syncs);
+  return ret;
+}
+
+// Syncobj to signal once a submission is queued
+struct pi_out_sync {
+  struct drm_syncobj *syncobj;
+  struct dma_fence_chain *chain; // only for timeline points
+  u64 point;
+};
+
+static void pi_put_out_syncs(struct pi_out_sync *syncs, u32 count) {
+  if (!syncs)
+    return;
+
+  for (u32 i = 0; i < count; i++) {
+    if (syncs[i].syncobj)
+      drm_syncobj_put(syncs[i].syncobj);
+    dma_fence_chain_free(syncs[i].chain);
+  }
+  kfree(syncs);
+}
+
+/*
+ * Looks up the out syncs of a submission before it's queued, so that nothing
+ * can fail anymore once the job is running.
+ *
+ * Returns:
+ * NULL if there are no out syncs, an array of args->num_out_syncs entries or an
+ * ERR_PTR.
  */
-int gpu_render_ioctl(struct drm_device *dev, void *data,
-                     struct drm_file *file) {
-  struct pi_gpu *gpu = to_gpu(dev);
+static struct pi_out_sync *pi_get_out_syncs(struct drm_file *file,
+                                            struct pi_exec_buffer *args) {
+  struct pi_exec_sync *handles;
+  struct pi_out_sync *syncs;
+  int ret = 0;
 
-  if (IS_ERR(gpu))
-    return -ENODEV;
+  if (!args->num_out_syncs)
+    return NULL;
+  if (args->num_out_syncs > PI_MAX_SYNCS)
+    return ERR_PTR(-EINVAL);
 
-  struct pi_exec_buffer *args = data;
+  handles = kmalloc_array(args->num_out_syncs, sizeof(*handles), GFP_KERNEL);
+  syncs = kcalloc(args->num_out_syncs, sizeof(*syncs), GFP_KERNEL);
+  if (!handles || !syncs) {
+    ret = -ENOMEM;
+    goto out;
+  }
 
-  if (args->num_buffers > MAX_BO_COUNT)
-    return -EINVAL;
+  if (copy_from_user(handles, u64_to_user_ptr(args->out_syncs),
+                     args->num_out_syncs * sizeof(*handles))) {
+    ret = -EFAULT;
+    goto out;
+  }
+
+  for (u32 i = 0; i < args->num_out_syncs; i++) {
+    syncs[i].syncobj = drm_syncobj_find(file, handles[i].handle);
+    if (!syncs[i].syncobj) {
+      ret = -ENOENT;
+      goto out;
+    }
+
+    syncs[i].point = handles[i].point;
+    if (syncs[i].point) {
+      syncs[i].chain = dma_fence_chain_alloc();
+      if (!syncs[i].chain) {
+        ret = -ENOMEM;
+        goto out;
+      }
+    }
+  }
+
+out:
+  kfree(handles);
+  if (ret) {
+    pi_put_out_syncs(syncs, args->num_out_syncs);
+    return ERR_PTR(ret);
+  }
+  return syncs;
+}
+
+static void pi_signal_out_syncs(struct pi_out_sync *syncs, u32 count,
+                                struct dma_fence *fence) {
+  for (u32 i = 0; syncs && i < count; i++) {
+    if (syncs[i].chain) {
+      // The chain node is owned by the timeline from now on
+      drm_syncobj_add_point(syncs[i].syncobj, syncs[i].chain, fence,
+                            syncs[i].point);
+      syncs[i].chain = NULL;
+    } else {
+      drm_syncobj_replace_fence(syncs[i].syncobj, fence);
+    }
+  }
+}
+
+
+/*
+ * Buffer objects already looked up by a submission. A batch usually renders
+ * into the same frame buffer object over and over, so every distinct handle is
+ * only looked up once per ioctl.
+ */
+struct pi_bo_lookup {
+  u32 count;
+  u32 handles[PI_MAX_BATCH * MAX_BO_COUNT];
+  struct pi_bo *bos[PI_MAX_BATCH * MAX_BO_COUNT];
+};
+
+// Returns the object of handle, only referenced by the lookup
+static struct pi_bo *pi_bo_lookup_get(struct pi_bo_lookup *lookup,
+                                      struct drm_device *dev,
+                                      struct drm_file *file, u32 handle) {
+  struct drm_gem_object *obj;
+
+  for (u32 i = 0; i < lookup->count; i++) {
+    if (lookup->handles[i] == handle)
+      return lookup->bos[i];
+  }
 
-  struct drm_gem_shmem_object *shmem_obj;
+  // NOTE: Need to decrement reference count after caling this function
+  obj = drm_gem_object_lookup(file, handle);
+  if (!obj)
+    return ERR_PTR(-ENOENT);
 
-  struct iosys_map bo_va;
+  if (obj->dev != dev || !pi_is_bo(obj)) {
+    drm_gem_object_put(obj);
+    return ERR_PTR(-ENODEV);
+  }
 
+  lookup->handles[lookup->count] = handle;
+  lookup->bos[lookup->count++] = to_pi_bo(obj);
+  return to_pi_bo(obj);
+}
 
-  // Pair of <drm_gem_shmem_object *, iosys_map *>
-  Pair obj_adr_pair;
-  Pair obj_adr_list[MAX_BO_COUNT];
-  init_bo_list(&obj_adr_list);
+static void pi_bo_lookup_fini(struct pi_bo_lookup *lookup) {
+  for (u32 i = 0; i < lookup->count; i++)
+    drm_gem_object_put(&lookup->bos[i]->base.base);
+}
 
-  size_t bo_size = 0;
+/*
+ * Everything in the list is already referenced and mapped, only the registers
+ * of the job have to be filled in. Doesn't depend on the size of the list.
+ */
+static int pi_job_use_bo_list(struct pi_job *job, struct drm_file *file,
+                              struct pi_exec_buffer *args) {
+  struct pi_bo_list *list;
   int ret;
-  u32 handle;
 
-  u8 *va;
-  unsigned long addr;
+  list = pi_bo_list_get(file, args->bo_list);
+  if (!list)
+    return -ENOENT;
+  job->bo_list = list;
+
+  for (int i = 0; i < 2; i++) {
+    s32 index = i ? list->frm : list->ins;
+    const struct pi_bo_list_entry *entry;
+
+    if (index < 0)
+      continue;
+
+    entry = &list->entries[index];
+
+    ret = process_gem_exec_obj((unsigned long)entry->map.vaddr,
+                               entry->bo->base.base.size, entry->flag,
+                               job->regs, args);
+    if (ret)
+      return ret;
+  }
+  return 0;
+}
+
+/*
+ * Checks the instruction buffer of the job against its frame buffer object
+ * before it's queued, see validate.c.
+ */
+static int pi_job_validate(struct pi_gpu *gpu, struct pi_job *job,
+                           struct pi_bo *ins, const void *ins_vaddr) {
+  struct pi_validate_stats *stats = &gpu->validate_stats;
+  const u32 *regs = job->regs;
+  u32 start = regs[INS_BUFFER_START_OFFSET];
+  u32 len = regs[INS_BUFFER_LEN_OFFSET];
+  u64 frame_size, begin = ktime_get_ns();
+  bool hit;
+  int ret;
 
-  size_t buffer_ptrs_size =
-      args->num_buffers * sizeof(struct pi_exec_buffer_obj);
-  struct pi_exec_buffer_obj *bo_ptr = kmalloc(buffer_ptrs_size, GFP_KERNEL);
+  frame_size = ((u64)regs[FRM_BUFFER_LEN_OFFSET + 1] << 32) |
+               regs[FRM_BUFFER_LEN_OFFSET];
 
-  if (IS_ERR(bo_ptr))
+  // The GPU can't execute a job without both buffers anyway
+  if (!ins || !frame_size)
     return -EINVAL;
 
-  ret =
-      copy_from_user(bo_ptr, u64_to_user_ptr(args->buffers), buffer_ptrs_size);
+  ret = pi_validate_cached(&ins->cmd_cache, ins_vaddr, start, len, frame_size,
+                           &hit);
 
+  atomic64_inc(hit ? &stats->hits : &stats->misses);
   if (ret)
-    goto release;
+    atomic64_inc(&stats->rejected);
+  atomic64_add(len, &stats->bytes);
+  atomic64_add(ktime_get_ns() - begin, &stats->ns);
+  return ret;
+}
 
-  for (int i = 0; i < args->num_buffers; i++) {
+/*
+ * The instructions are fetched through the address space of the client, so
+ * nothing is looked up or mapped here. The GPU faults (and fails the job) if
+ * the range isn't bound once it executes the job.
+ */
+static int pi_job_use_vm(struct pi_job *job, struct drm_file *file,
+                         struct pi_exec_buffer *args) {
+  struct pi_file *pfile = file->driver_priv;
+  u64 vm_addr;
 
-    handle = (bo_ptr + i)->handle;
+  if (args->num_buffers || args->bo_list || args->instr_start_offset)
+    return -EINVAL;
+  if (!args->instr_len || !IS_ALIGNED(args->instr_len, sizeof(u32)) ||
+      !IS_ALIGNED(args->instr_va, sizeof(u32)))
+    return -EINVAL;
 
-    // NOTE: Need to decrement reference count after caling this function
-    struct drm_gem_object *obj = drm_gem_object_lookup(file, handle);
+  job->vm = pi_vm_get(pfile->vm);
+  vm_addr = (uintptr_t)job->vm;
 
-    if (IS_ERR(obj))
-      return -EINVAL;
+  job->regs[INS_BUFFER_OFFSET] = get_64_lo(args->instr_va);
+  job->regs[INS_BUFFER_OFFSET + 1] = get_64_hi(args->instr_va);
+  job->regs[INS_BUFFER_LEN_OFFSET] = args->instr_len;
+  job->regs[VM_OFFSET] = get_64_lo(vm_addr);
+  job->regs[VM_OFFSET + 1] = get_64_hi(vm_addr);
+  return 0;
+}
 
-    shmem_obj = to_drm_gem_shmem_obj(obj);
+// Everything a job needs to be queued, reserved before anything is queued
+struct pi_submit {
+  struct pi_job *job;
+  struct pi_out_sync *out_syncs;
+  int fence_fd;
+};
+
+static int pi_submit_prepare(struct drm_device *dev, struct drm_file *file,
+                             struct pi_exec_buffer *args,
+                             struct pi_bo_lookup *lookup,
+                             struct pi_submit *submit) {
+  struct pi_gpu *gpu = to_gpu(dev);
+  struct pi_exec_buffer_obj objs[MAX_BO_COUNT];
+  const void *ins_vaddr = NULL;
+  struct pi_bo *ins = NULL;
+  struct pi_job *job;
+  int ret;
 
-    if (IS_ERR(shmem_obj))
-      return -EINVAL;
+  if (args->num_buffers > MAX_BO_COUNT)
+    return -EINVAL;
+  if (args->flags & ~PI_EXEC_FLAGS)
+    return -EINVAL;
 
-    obj_adr_pair.first = shmem_obj;
+  if (args->bo_list && args->num_buffers)
+    return -EINVAL;
 
-    bo_size = shmem_obj->base.size;
+  if (copy_from_user(objs, u64_to_user_ptr(args->buffers),
+                     args->num_buffers * sizeof(*objs)))
+    return -EFAULT;
 
-    // Essentially pins the pages in memory
-    // Gets a scatter gather list
-    // Maps the memory into virtual addresses
-    ret = drm_gem_shmem_vmap(shmem_obj, &bo_va);
+  // The job outlives the ioctl, it's freed once the GPU is done with it
+  job = kzalloc(sizeof(*job), GFP_KERNEL);
+  if (!job)
+    return -ENOMEM;
+  submit->job = job;
 
+  if (args->flags & PI_EXEC_VA) {
+    ret = pi_job_use_vm(job, file, args);
     if (ret)
       return ret;
+  } else if (args->bo_list) {
+    ret = pi_job_use_bo_list(job, file, args);
+    if (ret)
+      return ret;
+
+    if (job->bo_list->ins >= 0) {
+      ins = job->bo_list->entries[job->bo_list->ins].bo;
+      ins_vaddr = job->bo_list->entries[job->bo_list->ins].map.vaddr;
+    }
+  }
+
+  for (u32 i = 0; i < args->num_buffers; i++) {
+    struct iosys_map map;
+    struct pi_bo *bo;
 
-    obj_adr_pair.second = &bo_va;
-    obj_adr_list[i] = obj_adr_pair;
+    bo = pi_bo_lookup_get(lookup, dev, file, objs[i].handle);
+    if (IS_ERR(bo))
+      return PTR_ERR(bo);
+
+    // Usually a cache hit, see bo.c
+    ret = pi_bo_vmap(bo, &map);
+    if (ret)
+      return ret;
+    drm_gem_object_get(&bo->base.base);
+    job->bos[job->num_bos++] = bo;
+    pi_residency_use(gpu, bo);
 
-    // Add object address 
+    ret = process_gem_exec_obj((unsigned long)map.vaddr, bo->base.base.size,
+                               objs[i].flag, job->regs, args);
+    if (ret)
+      return ret;
 
-    if (bo_va.is_iomem) {
-      printk(KERN_CRIT "Not supposed to be io mem\n");
-      goto unmap_release;
+    if (objs[i].flag == INS_OBJ) {
+      ins = bo;
+      ins_vaddr = map.vaddr;
     }
+  }
+
+  // PI_EXEC_VA jobs are only checked by the GPU, their buffers can be bound
+  // after they're submitted
+  if (!(args->flags & PI_EXEC_VA)) {
+    ret = pi_job_validate(gpu, job, ins, ins_vaddr);
+    if (ret)
+      return ret;
+  }
+
+  ret = pi_job_add_in_syncs(gpu, file, args, job);
+  if (ret)
+    return ret;
+
+  // Out syncs and the fence fd are reserved before submitting, so nothing can
+  // fail once the job is queued (except running out of memory)
+  submit->out_syncs = pi_get_out_syncs(file, args);
+  if (IS_ERR(submit->out_syncs)) {
+    ret = PTR_ERR(submit->out_syncs);
+    submit->out_syncs = NULL;
+    return ret;
+  }
+
+  if (args->flags & PI_EXEC_FENCE_OUT) {
+    submit->fence_fd = get_unused_fd_flags(O_CLOEXEC);
+    if (submit->fence_fd < 0)
+      return submit->fence_fd;
+  }
+  return 0;
+}
+
+/*
+ * Publishes the results of a queued job: signals its out syncs and installs
+ * its fence fd.
+ */
+static int pi_submit_complete(struct pi_exec_buffer *args,
+                              struct pi_submit *submit,
+                              struct dma_fence *fence) {
+  struct sync_file *sync_file;
+  int ret = 0;
+
+  args->seqno = fence->seqno;
+  args->fence_fd = -1;
 
-    printk(KERN_INFO "Correctly mapped Buffer Object\n");
+  pi_signal_out_syncs(submit->out_syncs, args->num_out_syncs, fence);
 
-    if (obj->dev != dev) {
-      ret = -ENODEV;
-      goto unmap_release;
+  if (submit->fence_fd >= 0) {
+    sync_file = sync_file_create(fence);
+    if (!sync_file) {
+      // The job is already running, the caller can still wait on its seqno
+      put_unused_fd(submit->fence_fd);
+      ret = -ENOMEM;
+    } else {
+      fd_install(submit->fence_fd, sync_file->file);
+      args->fence_fd = submit->fence_fd;
     }
+    submit->fence_fd = -1;
+  }
+  return ret;
+}
+
+/*
+ * Queues count jobs back-to-back. Either all of them are queued or none of
+ * them is.
+ */
+static int pi_submit(struct drm_device *dev, struct drm_file *file,
+                     struct pi_exec_buffer *args, u32 count) {
+  struct pi_gpu *gpu = to_gpu(dev);
+  struct pi_bo_lookup *lookup;
+  struct pi_submit *submits;
+  struct dma_fence **fences;
+  struct pi_job **jobs;
+  u64 start = ktime_get_ns();
+  int ret = 0;
+  u32 i;
+
+  lookup = kzalloc(sizeof(*lookup), GFP_KERNEL);
+  submits = kcalloc(count, sizeof(*submits), GFP_KERNEL);
+  jobs = kcalloc(count, sizeof(*jobs), GFP_KERNEL);
+  fences = kcalloc(count, sizeof(*fences), GFP_KERNEL);
+  if (!lookup || !submits || !jobs || !fences) {
+    ret = -ENOMEM;
+    goto out;
+  }
 
-    va = bo_va.vaddr;
-    addr = (unsigned long)va;
+  for (i = 0; i < count; i++)
+    submits[i].fence_fd = -1;
 
-    ret = process_gem_exec_obj(addr, bo_size, bo_ptr->flag, gpu, args);
+  for (i = 0; i < count; i++) {
+    ret = pi_submit_prepare(dev, file, &args[i], lookup, &submits[i]);
     if (ret)
-      goto unmap_release;
+      goto out;
+    jobs[i] = submits[i].job;
+  }
+
+  // Only queues the jobs, the GPU renders them asynchronously
+  ret = pi_ring_submit(gpu, jobs, fences, count);
+  if (ret)
+    goto out;
+
+  for (i = 0; i < count; i++) {
+    int err = pi_submit_complete(&args[i], &submits[i], fences[i]);
+
+    if (err && !ret)
+      ret = err;
+    // The ring owns the job now
+    submits[i].job = NULL;
+    dma_fence_put(fences[i]);
+  }
+
+  atomic64_add(count, &gpu->submit_stats.submits);
+  atomic64_add(ktime_get_ns() - start, &gpu->submit_stats.ns);
+
+out:
+  for (i = 0; submits && i < count; i++) {
+    if (submits[i].fence_fd >= 0)
+      put_unused_fd(submits[i].fence_fd);
+    pi_put_out_syncs(submits[i].out_syncs, args[i].num_out_syncs);
+    if (submits[i].job)
+      pi_job_free(submits[i].job);
   }
+  if (lookup)
+    pi_bo_lookup_fini(lookup);
+  kfree(fences);
+  kfree(jobs);
+  kfree(submits);
+  kfree(lookup);
+  return ret;
+}
+
+/*
+ * data argument is a pointer that the kernel already converted for us into the
+ kernel address space
+ * (by doing copy_from_user). So we can cast it to a struct we defined in
+ user-space (that's also defined)
+ * in the kernel module.
+ * e.g.
+ *struct drm_my_ioctl_args {
+    __u32 some_cool_argument;
+  };
+
+  This function transforms data into a &pi_exec_buffer structure. That structure
+ contains a list of pointers to shmem GEM buffer objects. This is similar to:
+ &struct drm_i915_execbuffer2 defined in linux/include/uapi/drm/i915_drm.h An
+ example of using the struct can be found in
+ linux/drivers/gpu/drm/i915/gem/i915_gem_execbuffer.c
+ */
+int gpu_render_ioctl(struct drm_device *dev, void *data,
+                     struct drm_file *file) {
+  struct pi_gpu *gpu = to_gpu(dev);
+
+  if (IS_ERR(gpu))
+    return -ENODEV;
+
+  return pi_submit(dev, file, data, 1);
+}
+
+/*
+ * Same as gpu_render_ioctl(), but for an array of jobs. The jobs are validated
+ * all at once, buffer objects they share are only looked up and mapped once,
+ * and they're written to the ring under one lock with a single doorbell.
+ *
+ * The seqno and fence_fd of every &pi_exec_buffer are written back to the
+ * array.
+ */
+int pi_exec_batch_ioctl(struct drm_device *dev, void *data,
+                        struct drm_file *file) {
+  struct pi_exec_batch *batch = data;
+  struct pi_exec_buffer *args;
+  size_t size;
+  int ret;
+
+  if (!batch->num_jobs || batch->num_jobs > PI_MAX_BATCH || batch->pad)
+    return -EINVAL;
 
-  // TODO: execute_bfr();
-unmap_release:
-  destroy_bo_list(obj_adr_list);
-release:
-  kfree(bo_ptr);
+  size = batch->num_jobs * sizeof(*args);
+  args = memdup_user(u64_to_user_ptr(batch->jobs), size);
+  if (IS_ERR(args))
+    return PTR_ERR(args);
 
+  ret = pi_submit(dev, file, args, batch->num_jobs);
+
+  // Copied back even on errors, since the jobs may have been queued anyway
+  // (e.g. only creating a sync file failed)
+  if (copy_to_user(u64_to_user_ptr(batch->jobs), args, size) && !ret)
+    ret = -EFAULT;
+
+  kfree(args);
   return ret;
 }
+
+/*
+ * Waits for a submission to complete. Only the sequence number is needed, so
+ * clients that didn't ask for a fence fd can still wait on their work.
+ */
+int pi_wait_ioctl(struct drm_device *dev, void *data, struct drm_file *file) {
+  struct pi_gpu *gpu = to_gpu(dev);
+  struct pi_wait *args = data;
+  unsigned long timeout = 0;
+
+  if (args->timeout_ns > 0)
+    timeout = nsecs_to_jiffies(args->timeout_ns);
+
+  return pi_ring_wait(gpu, args->seqno, timeout);
+}
@@ -14,69 +14,91 @@
 #include "drm/drm_gem_framebuffer_helper.h"
 #include "drm/drm_ioctl.h"
 #include "drm/drm_mode_config.h"
+#include "linux/atomic.h"
+#include "linux/build_bug.h"
+#include "linux/iosys-map.h"
+#include "linux/list.h"
 #include <linux/platform_device.h>
 
+#include "pi_gpu_drm.h"
+#include "ring.h"
 
-#define DRM_IOCTL_EXC_BUFFER 0x00
 
-#define FRM_BUFFER_OFFSET 0x1000
-#define FRM_BUFFER_LEN_OFFSET 0x1002
+// Buffer registers of a job. These are offsets (in 32-bit words) inside of a
+// ring entry, see ring.h
 #define INS_BUFFER_OFFSET 0x0000
 #define INS_BUFFER_START_OFFSET 0x0002
 #define INS_BUFFER_LEN_OFFSET 0x0003
+#define FRM_BUFFER_OFFSET 0x0004
+#define FRM_BUFFER_LEN_OFFSET 0x0006
+// 2 words, address space of the job (&pi_vm). 0 if the buffer registers are
+// kernel addresses.
+#define VM_OFFSET 0x000A
 
+// Without a BO list, a job can only have an instruction and a frame buffer
+#define MAX_BO_COUNT 2
 
-// Forward declarations
-struct pi_gpu;
-
-
-typedef struct pair {
-  void *first;
-  void *second;
-} Pair;
+// A whole batch has to fit in the ring
+static_assert(PI_MAX_BATCH <= RING_SIZE);
 
 
-struct pi_exec_buffer {
-  __u64 buffers;     // pointer to buffer objects of type &pi_exec_buffer_obj
-  __u32 num_buffers; // number of buffer objects;
-                     // NOTE: Right now, only 2 buffers are supported. An
-                     // instruction buffer and frame buffer.
+// Forward declarations
+struct pi_gpu;
+struct pi_bo;
+struct pi_bo_list;
+struct pi_vm;
+struct dma_fence;
 
-  /* Offset from where we start execution from the instruction buffer (one of
-   * the submitted buffers). Usually 0.
-   */
-  __u32 instr_start_offset;
 
-  /* Length of how many instructions we want to execute from the instruction
-   * buffer from instr_start_offset. If specified as 0, the entire length of the
-   * buffer is executed.
-   */
-  __u32 instr_len;
+/*
+ * A submission, from the exec ioctl until the GPU is done with it.
+ *
+ * The buffer objects stay referenced and mapped for the whole lifetime of the
+ * job since the GPU reads from/writes to them asynchronously.
+ */
+struct pi_job {
+  struct list_head link;
+  u64 seqno;
+  u32 slot; // ring entry the job was written to
+  struct dma_fence *fence;
+
+  // Either the buffer objects of the job are in a BO list, or they're
+  // referenced and mapped one by one with pi_bo_vmap()
+  struct pi_bo_list *bo_list;
+  u32 num_bos;
+  struct pi_bo *bos[MAX_BO_COUNT];
+
+  // Address space of the job, only for PI_EXEC_VA jobs
+  struct pi_vm *vm;
+
+  // Fences the GPU has to wait on before executing the job
+  u32 num_deps;
+  struct dma_fence **deps;
+
+  // Copied as is into the ring entry of the job
+  u32 regs[RING_ENTRY_WORDS];
 };
 
 
-/*
- * Need to make sure these fields are aligned by 4 and 8 bytes
- */
-struct pi_exec_buffer_obj {
-  /*
-   * GEM handle.
-   */
-  __u32 handle;
-
-  /*
-   * Flags for type of buffer.
-   */
-  __u8 flag;
-
-  __u8 padding[3]; // just in case
+// Time spent in the exec ioctls, from the lookup of the buffers until the jobs
+// are queued
+struct pi_submit_stats {
+  atomic64_t submits;
+  atomic64_t ns;
 };
 
 
-int process_gem_exec_obj(unsigned long addr, size_t size, u8 flag,
-                          struct pi_gpu *gpu, struct pi_exec_buffer *buffer);
+int process_gem_exec_obj(unsigned long addr, size_t size, u8 flag, u32 *regs,
+                         struct pi_exec_buffer *buffer);
+
+void pi_job_free(struct pi_job *job);
 
 int gpu_render_ioctl(struct drm_device *dev, void *data,
                      struct drm_file *file);
 
+int pi_exec_batch_ioctl(struct drm_device *dev, void *data,
+                        struct drm_file *file);
+
+int pi_wait_ioctl(struct drm_device *dev, void *data, struct drm_file *file);
+
 #endif
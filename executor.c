@@ -0,0 +1,643 @@
+/*
+ * Description:
+ * Command stream executor of the emulated GPU. It walks through the
+ * instruction buffer programmed in vram (see execbuffer.h for the offsets) and
+ * rasterizes the commands into the frame buffer object.
+ *
+ * The decode loop is table driven (see pi_cmd_table) and nothing is allocated
+ * or logged per instruction, so it can be used to measure the throughput of the
+ * rasterization pipeline (see the exec_bench debugfs file). Drawing commands
+ * are only binned here, the tile rasterizer in raster.c draws them.
+ */
+#include "asm-generic/errno-base.h"
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_debugfs.h"
+#include "drm/drm_device.h"
+#include "drm/drm_file.h"
+#include "linux/err.h"
+#include "linux/kernel.h"
+#include "linux/ktime.h"
+#include "linux/math64.h"
+#include "linux/minmax.h"
+#include "linux/mutex.h"
+#include "linux/seq_file.h"
+#include "linux/slab.h"
+#include "linux/string.h"
+#include "linux/vmalloc.h"
+
+#include "driver.h"
+#include "execbuffer.h"
+#include "executor.h"
+#include "raster.h"
+#include "vm.h"
+
+// Returned by a command to stop the decode loop without an error
+#define PI_EXEC_STOP 1
+
+static inline bool pi_has_target(struct pi_exec_ctx *ctx) {
+  return ctx->target.cpp != 0;
+}
+
+// Rasterizes everything binned for the current target
+static void pi_exec_flush(struct pi_exec_ctx *ctx) {
+  if (pi_has_target(ctx))
+    ctx->pixels += pi_raster_flush(ctx->raster);
+}
+
+static int pi_cmd_nop(struct pi_exec_ctx *ctx, const u32 *cmd) { return 0; }
+
+static int pi_cmd_end(struct pi_exec_ctx *ctx, const u32 *cmd) {
+  return PI_EXEC_STOP;
+}
+
+// Rows of a target, whole rows of micro-tiles if it's tiled
+static u32 pi_target_rows(u32 height, u32 format) {
+  if (format & PI_TARGET_TILED)
+    return ALIGN(height, PI_MICROTILE_SIZE);
+  return height;
+}
+
+/*
+ * Validates a render target of width x height pixels, where size bytes can be
+ * accessed. format is a PIX_FMT_*, with PI_TARGET_TILED for the tiled layout:
+ * the pitch then has to hold whole micro-tiles (a multiple of 8 pixels), and
+ * the height is rounded up to whole rows of micro-tiles before checking the
+ * size.
+ */
+static int pi_check_target(u32 width, u32 height, u32 pitch, u32 format,
+                           size_t size) {
+  u32 index = format & ~PI_TARGET_TILED;
+  u8 cpp;
+
+  if (index >= ARRAY_SIZE(pi_formats))
+    return -EINVAL;
+
+  cpp = pi_formats[index].cpp;
+
+  // RGB888 pixels are accessed byte per byte, the others need aligned rows
+  if (pitch < width * cpp || (cpp != 3 && pitch % cpp))
+    return -EINVAL;
+  // Tiled rows hold whole micro-tiles
+  if ((format & PI_TARGET_TILED) && pitch % (PI_MICROTILE_SIZE * cpp))
+    return -EINVAL;
+  if ((u64)pitch * pi_target_rows(height, format) > size)
+    return -EINVAL;
+  if (DIV_ROUND_UP(width, PI_TILE_SIZE) > PI_MAX_TILES_X ||
+      DIV_ROUND_UP(height, PI_TILE_SIZE) > PI_MAX_TILES_Y)
+    return -EINVAL;
+  return 0;
+}
+
+static int pi_exec_set_target(struct pi_exec_ctx *ctx, u8 *vaddr, size_t size,
+                              u32 width, u32 height, u32 pitch, u32 format) {
+  struct pi_exec_target *target = &ctx->target;
+  int ret;
+
+  ret = pi_check_target(width, height, pitch, format, size);
+  if (ret)
+    return ret;
+
+  // Whatever was binned so far belongs to the previous target
+  pi_exec_flush(ctx);
+
+  target->vaddr = vaddr;
+  target->size = size;
+  target->width = width;
+  target->height = height;
+  target->pitch = pitch;
+  target->format = format & ~PI_TARGET_TILED;
+  target->cpp = pi_formats[target->format].cpp;
+  target->tiled = format & PI_TARGET_TILED;
+  return pi_raster_begin(ctx->raster, target);
+}
+
+static int pi_cmd_set_target(struct pi_exec_ctx *ctx, const u32 *cmd) {
+  if (!ctx->frame)
+    return -EINVAL;
+
+  return pi_exec_set_target(ctx, ctx->frame, ctx->frame_size, cmd[1] & 0xFFFF,
+                            cmd[1] >> 16, cmd[2], cmd[3]);
+}
+
+// The render target is looked up in the address space of the job every time,
+// so the same command buffer can be submitted again after rebinding
+static int pi_cmd_set_target_va(struct pi_exec_ctx *ctx, const u32 *cmd) {
+  u64 va = ((u64)cmd[2] << 32) | cmd[1];
+  u32 height = cmd[3] >> 16;
+  u64 size = (u64)cmd[4] * pi_target_rows(height, cmd[5]);
+  u8 *vaddr;
+
+  if (!ctx->vm || !size)
+    return -EINVAL;
+
+  vaddr = pi_vm_translate(ctx->vm, va, size, true);
+  if (IS_ERR(vaddr))
+    return PTR_ERR(vaddr);
+
+  return pi_exec_set_target(ctx, vaddr, size, cmd[3] & 0xFFFF, height, cmd[4],
+                            cmd[5]);
+}
+
+static int pi_cmd_clear(struct pi_exec_ctx *ctx, const u32 *cmd) {
+  struct pi_exec_target *target = &ctx->target;
+
+  if (!pi_has_target(ctx))
+    return -EINVAL;
+
+  ctx->color = pi_formats[target->format].pack(cmd[1]);
+  pi_raster_add_rect(ctx->raster, 0, 0, target->width, target->height,
+                     ctx->color);
+  return 0;
+}
+
+static int pi_cmd_fill_rect(struct pi_exec_ctx *ctx, const u32 *cmd) {
+  struct pi_exec_target *target = &ctx->target;
+  s32 x0 = PI_CMD_X(cmd[1]);
+  s32 y0 = PI_CMD_Y(cmd[1]);
+  s32 x1 = x0 + (s32)(cmd[2] & 0xFFFF);
+  s32 y1 = y0 + (s32)(cmd[2] >> 16);
+
+  if (!pi_has_target(ctx))
+    return -EINVAL;
+
+  ctx->color = pi_formats[target->format].pack(cmd[3]);
+  pi_raster_add_rect(ctx->raster, x0, y0, x1, y1, ctx->color);
+  return 0;
+}
+
+static int pi_cmd_draw_tri(struct pi_exec_ctx *ctx, const u32 *cmd) {
+  struct pi_exec_target *target = &ctx->target;
+  s32 vx[3], vy[3];
+
+  if (!pi_has_target(ctx))
+    return -EINVAL;
+
+  for (int i = 0; i < 3; i++) {
+    vx[i] = PI_CMD_X(cmd[1 + i]) * PI_SUBPIXEL_ONE;
+    vy[i] = PI_CMD_Y(cmd[1 + i]) * PI_SUBPIXEL_ONE;
+  }
+
+  ctx->color = pi_formats[target->format].pack(cmd[4]);
+  pi_raster_add_tri(ctx->raster, vx, vy, ctx->color);
+  return 0;
+}
+
+typedef int (*pi_cmd_fn)(struct pi_exec_ctx *ctx, const u32 *cmd);
+
+struct pi_cmd_desc {
+  pi_cmd_fn exec;
+  u16 len; // in words, header included
+};
+
+static const struct pi_cmd_desc pi_cmd_table[PI_OP_COUNT] = {
+    [PI_OP_NOP] = {pi_cmd_nop, 1},
+    [PI_OP_END] = {pi_cmd_end, 1},
+    [PI_OP_SET_TARGET] = {pi_cmd_set_target, 4},
+    [PI_OP_CLEAR] = {pi_cmd_clear, 2},
+    [PI_OP_FILL_RECT] = {pi_cmd_fill_rect, 4},
+    [PI_OP_DRAW_TRI] = {pi_cmd_draw_tri, 5},
+    [PI_OP_SET_TARGET_VA] = {pi_cmd_set_target_va, 6},
+};
+
+void pi_exec_ctx_init(struct pi_exec_ctx *ctx, struct pi_raster *raster,
+                      u8 *frame, size_t frame_size) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->raster = raster;
+  ctx->frame = frame;
+  ctx->frame_size = frame_size;
+}
+
+static int pi_decode(struct pi_exec_ctx *ctx, const u32 *cmds, size_t len) {
+  const u32 *end = cmds + len / sizeof(u32);
+  int ret;
+
+  while (cmds < end) {
+    u32 hdr = *cmds;
+    u32 op = PI_CMD_OP(hdr);
+    const struct pi_cmd_desc *desc;
+
+    if (op >= PI_OP_COUNT)
+      return -EINVAL;
+
+    desc = &pi_cmd_table[op];
+    if (PI_CMD_LEN(hdr) != desc->len || end - cmds < desc->len)
+      return -EINVAL;
+
+    ret = desc->exec(ctx, cmds);
+    ctx->commands++;
+    if (ret)
+      return ret == PI_EXEC_STOP ? 0 : ret;
+
+    cmds += desc->len;
+  }
+  return 0;
+}
+
+/**
+ * pi_validate - checks a command stream without executing it
+ * @cmds: first command of the stream
+ * @len: length of the stream in bytes
+ * @frame_size: size of the frame buffer object the stream renders into
+ *
+ * Makes the same checks as the executor on every command up to the end of the
+ * stream or the first PI_OP_END: known opcodes with the right length, render
+ * targets that fit in the frame buffer object, and no drawing before a target
+ * is set. Coordinates don't need to be checked since primitives are clipped to
+ * the render target.
+ *
+ * Returns:
+ * 0 if the stream can be executed, -EINVAL otherwise.
+ */
+int pi_validate(const u32 *cmds, size_t len, size_t frame_size) {
+  const u32 *end = cmds + len / sizeof(u32);
+  bool has_target = false;
+  int ret;
+
+  while (cmds < end) {
+    u32 hdr = *cmds;
+    u32 op = PI_CMD_OP(hdr);
+
+    if (op >= PI_OP_COUNT)
+      return -EINVAL;
+    if (PI_CMD_LEN(hdr) != pi_cmd_table[op].len ||
+        end - cmds < pi_cmd_table[op].len)
+      return -EINVAL;
+
+    switch (op) {
+    case PI_OP_NOP:
+      break;
+    case PI_OP_END:
+      return 0;
+    case PI_OP_SET_TARGET:
+      ret = pi_check_target(cmds[1] & 0xFFFF, cmds[1] >> 16, cmds[2], cmds[3],
+                            frame_size);
+      if (ret)
+        return ret;
+      has_target = true;
+      break;
+    case PI_OP_SET_TARGET_VA:
+      // Only for PI_EXEC_VA jobs, which have no frame buffer object
+      return -EINVAL;
+    default:
+      if (!has_target)
+        return -EINVAL;
+      break;
+    }
+
+    cmds += pi_cmd_table[op].len;
+  }
+  return 0;
+}
+
+/**
+ * pi_execute - runs a command stream
+ * @ctx: executor state, with the frame buffer set up by pi_exec_ctx_init()
+ * @cmds: first command of the stream
+ * @len: length of the stream in bytes
+ *
+ * Execution stops at the end of the stream or at the first PI_OP_END. The
+ * commands are only decoded and binned while walking through the stream, the
+ * pixels are drawn whenever the bins are flushed (see raster.c). The caller
+ * must hold ctx->raster->lock.
+ *
+ * Returns:
+ * 0 on success, -EINVAL if the stream contains an invalid command. Commands
+ * before the invalid one have already been executed.
+ */
+int pi_execute(struct pi_exec_ctx *ctx, const u32 *cmds, size_t len) {
+  int ret = pi_decode(ctx, cmds, len);
+
+  pi_exec_flush(ctx);
+  return ret;
+}
+
+/*
+ * Emulates the GPU executing one ring entry: reads the instruction and frame
+ * buffer registers programmed by process_gem_exec_obj() and executes the
+ * instruction buffer. If the entry has an address space, the instruction
+ * buffer register is a GPU address and goes through its page tables instead.
+ *
+ * Only called by the GPU front-end (see ring.c).
+ */
+int execute_bfr(struct pi_gpu *gpu, const u32 *regs) {
+  struct pi_exec_ctx ctx;
+  u64 ins_addr, frm_addr, frm_len;
+  u32 ins_start, ins_len;
+  const u32 *cmds;
+  struct pi_vm *vm;
+  u64 start_ns;
+  int ret;
+
+  ins_addr = ((u64)regs[INS_BUFFER_OFFSET + 1] << 32) | regs[INS_BUFFER_OFFSET];
+  ins_start = regs[INS_BUFFER_START_OFFSET];
+  ins_len = regs[INS_BUFFER_LEN_OFFSET];
+  frm_addr = ((u64)regs[FRM_BUFFER_OFFSET + 1] << 32) | regs[FRM_BUFFER_OFFSET];
+  frm_len = ((u64)regs[FRM_BUFFER_LEN_OFFSET + 1] << 32) |
+            regs[FRM_BUFFER_LEN_OFFSET];
+  vm = (struct pi_vm *)(uintptr_t)(((u64)regs[VM_OFFSET + 1] << 32) |
+                                   regs[VM_OFFSET]);
+
+  if (vm) {
+    cmds = pi_vm_translate(vm, ins_addr + ins_start, ins_len, false);
+    if (IS_ERR(cmds))
+      return PTR_ERR(cmds);
+  } else {
+    if (!ins_addr || !frm_addr)
+      return -EINVAL;
+    cmds = (const u32 *)(uintptr_t)(ins_addr + ins_start);
+  }
+
+  mutex_lock(&gpu->raster.lock);
+  pi_exec_ctx_init(&ctx, &gpu->raster, (u8 *)(uintptr_t)frm_addr, frm_len);
+  ctx.vm = vm;
+
+  start_ns = ktime_get_ns();
+  ret = pi_execute(&ctx, cmds, ins_len);
+  mutex_unlock(&gpu->raster.lock);
+
+  gpu->exec_stats.busy_ns += ktime_get_ns() - start_ns;
+  gpu->exec_stats.jobs++;
+  gpu->exec_stats.commands += ctx.commands;
+  gpu->exec_stats.pixels += ctx.pixels;
+
+  return ret;
+}
+
+/*-------------------------------------------------------------------------------
+ * Benchmark
+ *
+ * A synthetic scene rendered into a scratch 1080p frame, in every format.
+ *-------------------------------------------------------------------------------
+ */
+
+#define PI_BENCH_WIDTH 1920
+#define PI_BENCH_HEIGHT 1080
+#define PI_BENCH_RECTS 256
+#define PI_BENCH_TRIS 256
+#define PI_BENCH_ITERATIONS 16
+
+static const char *const pi_format_names[] = {
+    [PIX_FMT_RGB565] = "RGB565",
+    [PIX_FMT_RGB888] = "RGB888",
+    [PIX_FMT_XRGB8888] = "XRGB8888",
+};
+
+static inline u32 pi_bench_rand(u32 *seed) {
+  *seed = *seed * 1664525 + 1013904223;
+  return *seed >> 8;
+}
+
+static size_t pi_bench_build(u32 *cmds, u8 format) {
+  const u32 cpp = pi_formats[format].cpp;
+  u32 seed = 0x1234;
+  u32 *cmd = cmds;
+
+  *cmd++ = PI_CMD_HDR(PI_OP_SET_TARGET, 4);
+  *cmd++ = PI_BENCH_WIDTH | (PI_BENCH_HEIGHT << 16);
+  *cmd++ = PI_BENCH_WIDTH * cpp;
+  *cmd++ = format;
+
+  *cmd++ = PI_CMD_HDR(PI_OP_CLEAR, 2);
+  *cmd++ = 0x00202020;
+
+  for (int i = 0; i < PI_BENCH_RECTS; i++) {
+    *cmd++ = PI_CMD_HDR(PI_OP_FILL_RECT, 4);
+    *cmd++ = PI_CMD_XY(pi_bench_rand(&seed) % PI_BENCH_WIDTH,
+                       pi_bench_rand(&seed) % PI_BENCH_HEIGHT);
+    *cmd++ = PI_CMD_XY(16 + pi_bench_rand(&seed) % 128,
+                       16 + pi_bench_rand(&seed) % 128);
+    *cmd++ = pi_bench_rand(&seed);
+  }
+
+  for (int i = 0; i < PI_BENCH_TRIS; i++) {
+    s32 x = pi_bench_rand(&seed) % PI_BENCH_WIDTH;
+    s32 y = pi_bench_rand(&seed) % PI_BENCH_HEIGHT;
+
+    *cmd++ = PI_CMD_HDR(PI_OP_DRAW_TRI, 5);
+    *cmd++ = PI_CMD_XY(x, y);
+    *cmd++ = PI_CMD_XY(x + pi_bench_rand(&seed) % 128, y + 16);
+    *cmd++ = PI_CMD_XY(x + pi_bench_rand(&seed) % 64,
+                       y + 16 + pi_bench_rand(&seed) % 128);
+    *cmd++ = pi_bench_rand(&seed);
+  }
+
+  *cmd++ = PI_CMD_HDR(PI_OP_END, 1);
+
+  return (cmd - cmds) * sizeof(u32);
+}
+
+// Triangles only, from a few pixels up to a quarter of the frame
+static size_t pi_bench_build_tris(u32 *cmds, u8 format) {
+  const u32 cpp = pi_formats[format].cpp;
+  u32 seed = 0x5678;
+  u32 *cmd = cmds;
+
+  *cmd++ = PI_CMD_HDR(PI_OP_SET_TARGET, 4);
+  *cmd++ = PI_BENCH_WIDTH | (PI_BENCH_HEIGHT << 16);
+  *cmd++ = PI_BENCH_WIDTH * cpp;
+  *cmd++ = format;
+
+  for (int i = 0; i < PI_BENCH_TRIS; i++) {
+    s32 size = 8 << (i % 7);
+    s32 x = pi_bench_rand(&seed) % PI_BENCH_WIDTH;
+    s32 y = pi_bench_rand(&seed) % PI_BENCH_HEIGHT;
+
+    *cmd++ = PI_CMD_HDR(PI_OP_DRAW_TRI, 5);
+    *cmd++ = PI_CMD_XY(x, y);
+    *cmd++ = PI_CMD_XY(x + pi_bench_rand(&seed) % size, y + size / 4);
+    *cmd++ = PI_CMD_XY(x + pi_bench_rand(&seed) % size - size / 2,
+                       y + size / 4 + pi_bench_rand(&seed) % size);
+    *cmd++ = pi_bench_rand(&seed);
+  }
+
+  *cmd++ = PI_CMD_HDR(PI_OP_END, 1);
+
+  return (cmd - cmds) * sizeof(u32);
+}
+
+static int pi_exec_bench_show(struct seq_file *m, void *unused) {
+  struct drm_debugfs_entry *entry = m->private;
+  struct pi_gpu *gpu = to_gpu(entry->dev);
+  const size_t frame_size = PI_BENCH_WIDTH * PI_BENCH_HEIGHT * 4;
+  const size_t max_words = 4 + 2 + PI_BENCH_RECTS * 4 + PI_BENCH_TRIS * 5 + 1;
+  struct pi_exec_ctx ctx;
+  u32 *cmds;
+  u8 *frame;
+  int ret = 0;
+
+  frame = vmalloc(frame_size);
+  cmds = kmalloc_array(max_words, sizeof(u32), GFP_KERNEL);
+  if (!frame || !cmds) {
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  for (u8 format = 0; format < ARRAY_SIZE(pi_formats); format++) {
+    size_t len = pi_bench_build(cmds, format);
+    u64 commands = 0, pixels = 0, elapsed;
+    u64 start = ktime_get_ns();
+
+    mutex_lock(&gpu->raster.lock);
+    for (int i = 0; i < PI_BENCH_ITERATIONS && !ret; i++) {
+      pi_exec_ctx_init(&ctx, &gpu->raster, frame, frame_size);
+      ret = pi_execute(&ctx, cmds, len);
+      commands += ctx.commands;
+      pixels += ctx.pixels;
+    }
+    mutex_unlock(&gpu->raster.lock);
+    elapsed = max_t(u64, ktime_get_ns() - start, 1);
+    if (ret)
+      goto out;
+
+    seq_printf(m, "%-8s: %llu commands/s, %llu pixels/s\n",
+               pi_format_names[format],
+               div64_u64(commands * NSEC_PER_SEC, elapsed),
+               div64_u64(pixels * NSEC_PER_SEC, elapsed));
+  }
+
+  seq_printf(m,
+             "submitted: %llu jobs (%llu errors), %llu commands, %llu pixels, "
+             "%llu ns\n",
+             gpu->exec_stats.jobs, gpu->exec_stats.errors,
+             gpu->exec_stats.commands, gpu->exec_stats.pixels,
+             gpu->exec_stats.busy_ns);
+
+out:
+  kfree(cmds);
+  vfree(frame);
+  return ret;
+}
+
+/*
+ * Renders the XRGB8888 scene with 1, 2, 4 and all the raster workers, to see
+ * how well the tiles are spread between the cores. Counts above the number of
+ * workers, or already measured (on 4 cores), are skipped.
+ */
+static int pi_raster_scaling_show(struct seq_file *m, void *unused) {
+  struct drm_debugfs_entry *entry = m->private;
+  struct pi_gpu *gpu = to_gpu(entry->dev);
+  struct pi_raster *raster = &gpu->raster;
+  const size_t frame_size = PI_BENCH_WIDTH * PI_BENCH_HEIGHT * 4;
+  const size_t max_words = 4 + 2 + PI_BENCH_RECTS * 4 + PI_BENCH_TRIS * 5 + 1;
+  const unsigned int threads[] = {1, 2, 4, raster->max_workers};
+  unsigned int last = 0;
+  struct pi_exec_ctx ctx;
+  size_t len;
+  u32 *cmds;
+  u8 *frame;
+  int ret = 0;
+
+  frame = vmalloc(frame_size);
+  cmds = kmalloc_array(max_words, sizeof(u32), GFP_KERNEL);
+  if (!frame || !cmds) {
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  len = pi_bench_build(cmds, PIX_FMT_XRGB8888);
+
+  mutex_lock(&raster->lock);
+  for (unsigned int t = 0; t < ARRAY_SIZE(threads) && !ret; t++) {
+    u64 start, elapsed;
+    int i;
+
+    if (threads[t] > raster->max_workers || threads[t] <= last)
+      continue;
+    last = threads[t];
+
+    raster->nr_workers = threads[t];
+    start = ktime_get_ns();
+    for (i = 0; i < PI_BENCH_ITERATIONS && !ret; i++) {
+      pi_exec_ctx_init(&ctx, raster, frame, frame_size);
+      ret = pi_execute(&ctx, cmds, len);
+    }
+    elapsed = max_t(u64, ktime_get_ns() - start, 1);
+
+    seq_printf(m, "%2u threads: %llu frames/s\n", threads[t],
+               div64_u64((u64)i * NSEC_PER_SEC, elapsed));
+  }
+  raster->nr_workers = raster->max_workers;
+  mutex_unlock(&raster->lock);
+
+out:
+  kfree(cmds);
+  vfree(frame);
+  return ret;
+}
+
+/*
+ * Renders a triangle heavy scene with every usable coverage kernel, checks
+ * that the frame is exactly the same as with the scalar kernel and reports the
+ * fill rate.
+ */
+static int pi_raster_simd_show(struct seq_file *m, void *unused) {
+  struct drm_debugfs_entry *entry = m->private;
+  struct pi_gpu *gpu = to_gpu(entry->dev);
+  struct pi_raster *raster = &gpu->raster;
+  const struct pi_block_impl *best = raster->block;
+  const size_t frame_size = PI_BENCH_WIDTH * PI_BENCH_HEIGHT * 4;
+  const size_t max_words = 4 + PI_BENCH_TRIS * 5 + 1;
+  struct pi_exec_ctx ctx;
+  u8 *frame, *ref;
+  u32 *cmds;
+  int ret = 0;
+
+  frame = vmalloc(frame_size);
+  ref = vmalloc(frame_size);
+  cmds = kmalloc_array(max_words, sizeof(u32), GFP_KERNEL);
+  if (!frame || !ref || !cmds) {
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  mutex_lock(&raster->lock);
+  for (u8 format = 0; format < ARRAY_SIZE(pi_formats) && !ret; format++) {
+    size_t len = pi_bench_build_tris(cmds, format);
+
+    for (unsigned int i = 0; i < pi_num_block_impls && !ret; i++) {
+      const struct pi_block_impl *block = &pi_block_impls[i];
+      u8 *dst = i ? frame : ref;
+      u64 pixels = 0, start, elapsed;
+      const char *check = "";
+
+      if (!block->usable())
+        continue;
+
+      raster->block = block;
+      memset(dst, 0, frame_size);
+      start = ktime_get_ns();
+      for (int n = 0; n < PI_BENCH_ITERATIONS && !ret; n++) {
+        pi_exec_ctx_init(&ctx, raster, dst, frame_size);
+        ret = pi_execute(&ctx, cmds, len);
+        pixels += ctx.pixels;
+      }
+      elapsed = max_t(u64, ktime_get_ns() - start, 1);
+
+      // The scalar kernel comes first and is the reference
+      if (i)
+        check = memcmp(dst, ref, frame_size) ? ", MISMATCH" : ", exact";
+
+      seq_printf(m, "%-8s %-6s: %llu Mpixels/s%s\n", pi_format_names[format],
+                 block->name, div64_u64(pixels * 1000, elapsed), check);
+    }
+  }
+  raster->block = best;
+  mutex_unlock(&raster->lock);
+
+out:
+  kfree(cmds);
+  vfree(ref);
+  vfree(frame);
+  return ret;
+}
+
+static const struct drm_debugfs_info pi_executor_debugfs_list[] = {
+    {"exec_bench", pi_exec_bench_show, 0},
+    {"raster_scaling", pi_raster_scaling_show, 0},
+    {"raster_simd", pi_raster_simd_show, 0},
+};
+
+void pi_executor_debugfs_init(struct pi_gpu *gpu) {
+  drm_debugfs_add_files(&gpu->drm_device, pi_executor_debugfs_list,
+                        ARRAY_SIZE(pi_executor_debugfs_list));
+}
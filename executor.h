@@ -0,0 +1,71 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include "asm-generic/int-ll64.h"
+#include "linux/types.h"
+
+#include "pi_gpu_drm.h"
+
+
+/*
+ * Render target the commands are drawn into. This is a view of the frame
+ * buffer object, described by the PI_OP_SET_TARGET command (or of a range of
+ * the address space of the job, see PI_OP_SET_TARGET_VA).
+ */
+struct pi_exec_target {
+  u8 *vaddr;
+  size_t size; // size of the whole frame buffer object
+
+  u32 width;
+  u32 height;
+  u32 pitch;
+  u8 format;  // PIX_FMT_*
+  u8 cpp;     // bytes per pixel
+  bool tiled; // see PI_TARGET_TILED
+};
+
+struct pi_exec_stats {
+  u64 jobs;
+  u64 commands;
+  u64 pixels;
+  u64 busy_ns;
+  u64 errors;
+};
+
+/*
+ * State of the executor while it walks through one command stream. It lives on
+ * the stack of whoever runs the stream, nothing is allocated while executing.
+ */
+struct pi_raster;
+struct pi_vm;
+
+struct pi_exec_ctx {
+  struct pi_exec_target target;
+  u32 color; // current color, already converted to target.format
+  struct pi_raster *raster;
+
+  // Frame buffer object of the job, NULL for PI_EXEC_VA jobs
+  u8 *frame;
+  size_t frame_size;
+
+  // Address space of the job, NULL unless it's a PI_EXEC_VA job
+  struct pi_vm *vm;
+
+  u64 commands;
+  u64 pixels;
+};
+
+struct pi_gpu;
+
+void pi_exec_ctx_init(struct pi_exec_ctx *ctx, struct pi_raster *raster,
+                      u8 *frame, size_t frame_size);
+
+int pi_validate(const u32 *cmds, size_t len, size_t frame_size);
+
+int pi_execute(struct pi_exec_ctx *ctx, const u32 *cmds, size_t len);
+
+int execute_bfr(struct pi_gpu *gpu, const u32 *regs);
+
+void pi_executor_debugfs_init(struct pi_gpu *gpu);
+
+#endif
@@ -0,0 +1,320 @@
+/*
+ * Description:
+ * Interface between userspace and the driver: the custom ioctls, their
+ * arguments and the format of the command stream. It's included both by the
+ * driver and by userspace (see userspace/libpigpu.h), so it can only use the
+ * __u32 style types and nothing from the kernel.
+ */
+#ifndef PI_GPU_DRM_H
+#define PI_GPU_DRM_H
+
+#ifdef __KERNEL__
+#include "drm/drm.h"
+#include "drm/drm_fourcc.h"
+#else
+#include "drm.h" // from libdrm, usually in /usr/include/drm
+#include "drm_fourcc.h"
+#endif
+
+#define DRM_IOCTL_EXC_BUFFER 0x00
+#define DRM_IOCTL_PI_WAIT 0x01
+#define DRM_IOCTL_PI_EXEC_BATCH 0x02
+#define DRM_IOCTL_PI_BO_LIST_CREATE 0x03
+#define DRM_IOCTL_PI_BO_LIST_DESTROY 0x04
+#define DRM_IOCTL_PI_VM_BIND 0x05
+#define DRM_IOCTL_PI_VM_UNBIND 0x06
+#define DRM_IOCTL_PI_GEM_CREATE 0x07
+
+// NOTE: We only need to define our cutom iocts like this.
+// So all the ioctls in the .iocts field in drm_driver are custom ones, WE
+// created Non-custom ioctls aren't added there. For example dumb_create is a
+// callback from an ioctl which help us create GEM object (and returns a GEM
+// object handler)
+#define DRM_IOCTL_EXC_BUFFER_IOCTL                                             \
+  DRM_IOWR(DRM_COMMAND_BASE + DRM_IOCTL_EXC_BUFFER, struct pi_exec_buffer)
+#define DRM_IOCTL_PI_WAIT_IOCTL                                                \
+  DRM_IOW(DRM_COMMAND_BASE + DRM_IOCTL_PI_WAIT, struct pi_wait)
+#define DRM_IOCTL_PI_EXEC_BATCH_IOCTL                                          \
+  DRM_IOW(DRM_COMMAND_BASE + DRM_IOCTL_PI_EXEC_BATCH, struct pi_exec_batch)
+#define DRM_IOCTL_PI_BO_LIST_CREATE_IOCTL                                      \
+  DRM_IOWR(DRM_COMMAND_BASE + DRM_IOCTL_PI_BO_LIST_CREATE,                     \
+           struct pi_bo_list_create)
+#define DRM_IOCTL_PI_BO_LIST_DESTROY_IOCTL                                     \
+  DRM_IOW(DRM_COMMAND_BASE + DRM_IOCTL_PI_BO_LIST_DESTROY,                     \
+          struct pi_bo_list_destroy)
+#define DRM_IOCTL_PI_VM_BIND_IOCTL                                             \
+  DRM_IOW(DRM_COMMAND_BASE + DRM_IOCTL_PI_VM_BIND, struct pi_vm_bind)
+#define DRM_IOCTL_PI_VM_UNBIND_IOCTL                                           \
+  DRM_IOW(DRM_COMMAND_BASE + DRM_IOCTL_PI_VM_UNBIND, struct pi_vm_unbind)
+#define DRM_IOCTL_PI_GEM_CREATE_IOCTL                                          \
+  DRM_IOWR(DRM_COMMAND_BASE + DRM_IOCTL_PI_GEM_CREATE, struct pi_gem_create)
+
+
+// Pixel formats understood by the (emulated) hardware. Used both for the
+// scanout format register and for the render targets of the executor.
+enum {
+  PIX_FMT_RGB565 = 0,
+  PIX_FMT_RGB888 = 1,
+  PIX_FMT_XRGB8888 = 2,
+};
+
+/*
+ * Tiled layout
+ *
+ * Render targets and framebuffers can be stored as 8x8 pixel micro-tiles
+ * instead of rows of pixels. The pixels of a micro-tile are contiguous, row
+ * after row, and so are the micro-tiles of a row of micro-tiles, left to right.
+ * The pitch is still the bytes per row of pixels, so a row of micro-tiles is
+ * pitch * 8 bytes. It must be a multiple of 8 pixels, and the height is
+ * rounded up to a multiple of 8 rows: pixel x, y is at
+ *
+ *   (y / 8) * pitch * 8 + (x / 8) * 64 * cpp + ((y % 8) * 8 + x % 8) * cpp
+ *
+ * An 8x8 block of the rasterizer is then one run of 256 bytes (XRGB8888)
+ * instead of 8 runs of 32 bytes a pitch apart, and a 64x64 raster tile is 8
+ * runs of 2KB instead of 64 of 256 bytes.
+ */
+#define PI_MICROTILE_SHIFT 3
+#define PI_MICROTILE_SIZE (1 << PI_MICROTILE_SHIFT)
+
+// OR'd into the PIX_FMT_* of PI_OP_SET_TARGET(_VA) to render in the tiled
+// layout
+#define PI_TARGET_TILED (1 << 8)
+
+/*
+ * Framebuffer modifier of the tiled layout. The display only reads linear
+ * frames, so tiled framebuffers are always detiled into display memory.
+ *
+ * This GPU has no vendor ID, and every value of an assigned vendor (NONE
+ * included, whose values belong to the shared layouts of drm_fourcc.h) could
+ * one day mean another layout. The modifier is private to the driver instead:
+ * vendor 0xff, the far end of the vendor codes, which are handed out from 1
+ * upwards. Clients only learn about it from the IN_FORMATS of the primary
+ * plane, and it must never be shared with other devices.
+ */
+#define PI_FORMAT_MOD_VENDOR_PRIVATE 0xffULL
+// Same as fourcc_mod_code(), which only takes the vendors of drm_fourcc.h
+#define PI_FORMAT_MOD_PRIVATE(val)                                             \
+  ((PI_FORMAT_MOD_VENDOR_PRIVATE << 56) | ((val) & 0x00ffffffffffffffULL))
+#define PI_FORMAT_MOD_TILED_8X8 PI_FORMAT_MOD_PRIVATE(1)
+
+/*
+ * Command stream format
+ *
+ * The instruction buffer is a stream of 32-bit words. Every command starts with
+ * a header word followed by its operands:
+ *
+ *   bits  0..7  -> opcode (PI_OP_*)
+ *   bits 16..31 -> length of the command in words, header included
+ *
+ * Coordinates are packed as two signed 16-bit values, x in the low half and y
+ * in the high half (see PI_CMD_XY). Sizes are packed the same way, but
+ * unsigned. Colors are always given as XRGB8888 and are converted to the format
+ * of the render target when the command is decoded.
+ *
+ * NOTE: The length is fixed per opcode for now, but it's still encoded so that
+ * commands with a variable number of operands can be added later on without
+ * breaking older streams.
+ */
+#define PI_CMD_HDR(op, len) ((__u32)(op) | ((__u32)(len) << 16))
+#define PI_CMD_OP(hdr) ((hdr) & 0xFF)
+#define PI_CMD_LEN(hdr) ((hdr) >> 16)
+
+#define PI_CMD_XY(x, y) ((__u32)(__u16)(x) | ((__u32)(__u16)(y) << 16))
+#define PI_CMD_X(xy) ((__s16)((xy) & 0xFFFF))
+#define PI_CMD_Y(xy) ((__s16)((xy) >> 16))
+
+enum pi_opcode {
+  PI_OP_NOP = 0x00,        // [hdr]
+  PI_OP_END = 0x01,        // [hdr] stops execution before the end of the range
+  // [hdr, width | height << 16, pitch, PIX_FMT_* (| PI_TARGET_TILED)]
+  PI_OP_SET_TARGET = 0x02,
+  PI_OP_CLEAR = 0x03,      // [hdr, color]
+  PI_OP_FILL_RECT = 0x04,  // [hdr, xy, width | height << 16, color]
+  PI_OP_DRAW_TRI = 0x05,   // [hdr, xy0, xy1, xy2, color]
+  // [hdr, va_lo, va_hi, width | height << 16, pitch, PIX_FMT_*], only for
+  // PI_EXEC_VA jobs. The target is pitch * height bytes at GPU address va
+  // (height rounded up to whole micro-tiles if tiled).
+  PI_OP_SET_TARGET_VA = 0x06,
+  PI_OP_COUNT,
+};
+
+
+// Type of a buffer object of a job, see &pi_exec_buffer_obj
+#define INS_OBJ 0x00
+#define FRM_OBJ 0x01
+#define DATA_OBJ 0x02 // only kept resident while the job runs, BO lists only
+
+
+#define PI_MAX_SYNCS 64           // per direction and per job
+#define PI_MAX_BATCH 64           // jobs per DRM_IOCTL_PI_EXEC_BATCH
+#define PI_MAX_BO_LIST_ENTRIES 1024
+
+
+struct pi_exec_buffer {
+  __u64 buffers;     // pointer to buffer objects of type &pi_exec_buffer_obj
+  __u32 num_buffers; // number of buffer objects;
+                     // at most 2, an instruction buffer and a frame buffer.
+                     // Jobs that need more (DATA_OBJ) pass a bo_list instead.
+
+  /* Offset from where we start execution from the instruction buffer (one of
+   * the submitted buffers). Usually 0.
+   */
+  __u32 instr_start_offset;
+
+  /* Length of how many instructions we want to execute from the instruction
+   * buffer from instr_start_offset. If specified as 0, the entire length of the
+   * buffer is executed.
+   */
+  __u32 instr_len;
+
+  __u32 flags; // PI_EXEC_*
+
+  /* Returned by the ioctl. Sync file fd signaled once the GPU is done with the
+   * submission. Only set if PI_EXEC_FENCE_OUT was passed, -1 otherwise.
+   */
+  __s32 fence_fd;
+
+  /* ID of a BO list created with DRM_IOCTL_PI_BO_LIST_CREATE, used instead of
+   * buffers. 0 if the job uses buffers, both can't be set at the same time.
+   */
+  __u32 bo_list;
+
+  /* Returned by the ioctl. Sequence number of the submission, to be passed to
+   * the PI_WAIT ioctl.
+   */
+  __u64 seqno;
+
+  /* Syncobjs to wait on before the submission is executed, pointer to an
+   * array of &pi_exec_sync
+   */
+  __u64 in_syncs;
+
+  /* Syncobjs signaled once the submission is done, pointer to an array of
+   * &pi_exec_sync
+   */
+  __u64 out_syncs;
+
+  __u32 num_in_syncs;
+  __u32 num_out_syncs;
+
+  /* GPU address of the instructions, only with PI_EXEC_VA. instr_len must be
+   * set, and buffers, instr_start_offset and bo_list must be 0.
+   */
+  __u64 instr_va;
+};
+
+#define PI_EXEC_FENCE_OUT (1 << 0)
+/* Instructions are fetched from instr_va in the address space of the client,
+ * and render targets are set with PI_OP_SET_TARGET_VA (see
+ * DRM_IOCTL_PI_VM_BIND).
+ */
+#define PI_EXEC_VA (1 << 1)
+#define PI_EXEC_FLAGS (PI_EXEC_FENCE_OUT | PI_EXEC_VA)
+
+
+struct pi_exec_sync {
+  __u32 handle; // syncobj handle
+  __u32 pad;
+
+  /* Point on the timeline of the syncobj. Must be 0 for binary syncobjs. For
+   * out syncs, a new point is added to the timeline.
+   */
+  __u64 point;
+};
+
+
+struct pi_exec_batch {
+  __u64 jobs;     // pointer to an array of &pi_exec_buffer
+  __u32 num_jobs; // at most PI_MAX_BATCH
+  __u32 pad;      // must be 0
+};
+
+
+struct pi_bo_list_create {
+  __u64 entries;     // pointer to an array of &pi_exec_buffer_obj
+  __u32 num_entries; // at most PI_MAX_BO_LIST_ENTRIES
+  __u32 id;          // returned by the ioctl, never 0
+};
+
+
+struct pi_bo_list_destroy {
+  __u32 id;
+  __u32 pad;
+};
+
+
+/*
+ * Binds size bytes of a buffer object, starting at offset, at address va of the
+ * address space of the client. va, offset and size have to be multiples of
+ * 4KB, and the range can't overlap another binding.
+ */
+struct pi_vm_bind {
+  __u32 handle;
+  __u32 flags; // PI_VM_BIND_*
+  __u64 va;
+  __u64 offset;
+  __u64 size;
+};
+
+#define PI_VM_BIND_READ_ONLY (1 << 0) // the GPU can't write to the binding
+#define PI_VM_BIND_FLAGS (PI_VM_BIND_READ_ONLY)
+
+
+// Unbinds a whole binding, with the va and size it was bound with
+struct pi_vm_unbind {
+  __u64 va;
+  __u64 size;
+};
+
+
+/*
+ * Creates a buffer object in vram or in system memory. Vram is small, it's
+ * meant for objects touched all the time like command buffers, constants or
+ * cursors. Without a placement flag, objects up to 64KB go to vram. Objects
+ * that don't fit in vram silently go to system memory, placement tells where
+ * the object ended up.
+ */
+struct pi_gem_create {
+  __u64 size;   // rounded up to a multiple of the page size
+  __u32 flags;  // one of PI_GEM_VRAM, PI_GEM_SYSTEM or PI_GEM_SCANOUT, or 0
+  __u32 handle; // out
+  __u64 offset; // out, to mmap the object with
+  __u32 placement; // out, the flag of where the object ended up
+  __u32 pad;
+};
+
+#define PI_GEM_VRAM (1 << 0)   // vram preferred
+#define PI_GEM_SYSTEM (1 << 1) // system memory only
+// Contiguous DMA memory the display can scan out without a copy
+#define PI_GEM_SCANOUT (1 << 2)
+
+
+struct pi_wait {
+  __u64 seqno; // as returned by DRM_IOCTL_EXC_BUFFER
+
+  /* Relative timeout in nanoseconds. 0 only checks if the submission is done.
+   * The ioctl fails with -ETIME if the submission isn't done in time.
+   */
+  __s64 timeout_ns;
+};
+
+
+/*
+ * Need to make sure these fields are aligned by 4 and 8 bytes
+ */
+struct pi_exec_buffer_obj {
+  /*
+   * GEM handle.
+   */
+  __u32 handle;
+
+  /*
+   * Flags for type of buffer (INS_OBJ, FRM_OBJ or DATA_OBJ).
+   */
+  __u8 flag;
+
+  __u8 padding[3]; // just in case
+};
+
+#endif
@@ -0,0 +1,709 @@
+/*
+ * Description:
+ * Tile binning rasterizer used by the executor.
+ *
+ * The executor hands primitives over as it decodes them. They're set up once
+ * (edge functions, clipped bounding box), binned into the 64x64 tiles they
+ * touch and only drawn when the bins are flushed. Flushing splits the
+ * non-empty tiles between a pool of per-CPU workers. A worker that's done with
+ * its own tiles steals tiles from the others, so a frame with all its geometry
+ * in one corner still keeps every core busy.
+ *
+ * Triangles are drawn 8x8 pixels at a time. The coverage of the blocks on the
+ * border of a triangle is computed by a SIMD kernel (raster_neon.c and
+ * raster_x86.c), pi_block_masks_scalar() being the reference.
+ *
+ * Tiled targets (PI_TARGET_TILED) are stored as 8x8 micro-tiles, the size of a
+ * block, so a block covered by a triangle is filled as one run of memory, and
+ * so is a row of micro-tiles covered by a rectangle.
+ */
+#include "asm-generic/errno-base.h"
+#include "asm-generic/int-ll64.h"
+#include "asm/simd.h"
+#include "linux/atomic.h"
+#include "linux/bitops.h"
+#include "linux/bits.h"
+#include "linux/cpumask.h"
+#include "linux/kernel.h"
+#include "linux/minmax.h"
+#include "linux/mm.h"
+#include "linux/slab.h"
+#include "linux/string.h"
+#include "linux/workqueue.h"
+
+#ifdef CONFIG_ARM64
+#include "asm/cpufeature.h"
+#endif
+
+#ifdef CONFIG_X86_64
+#include "asm/cpufeature.h"
+#endif
+
+#include "driver.h"
+#include "executor.h"
+#include "raster.h"
+#include "simd.h"
+
+#define PI_BIN_END U32_MAX
+
+// Below this many tiles per worker, waking up more workers costs more than it
+// saves
+#define PI_MIN_TILES_PER_WORKER 4
+
+static u32 pi_pack_rgb565(u32 xrgb) {
+  return ((xrgb >> 8) & 0xF800) | ((xrgb >> 5) & 0x07E0) |
+         ((xrgb >> 3) & 0x001F);
+}
+
+static u32 pi_pack_rgb888(u32 xrgb) { return xrgb & 0x00FFFFFF; }
+
+static u32 pi_pack_xrgb8888(u32 xrgb) { return xrgb; }
+
+static void pi_fill_rgb565(u8 *dst, u32 color, u32 count) {
+  memset16((u16 *)dst, color, count);
+}
+
+// RGB888 is stored as B, G, R in memory (little endian [23:0] R:G:B)
+static void pi_fill_rgb888(u8 *dst, u32 color, u32 count) {
+  u8 b = color, g = color >> 8, r = color >> 16;
+
+  for (u32 i = 0; i < count; i++) {
+    dst[0] = b;
+    dst[1] = g;
+    dst[2] = r;
+    dst += 3;
+  }
+}
+
+static void pi_fill_xrgb8888(u8 *dst, u32 color, u32 count) {
+  memset32((u32 *)dst, color, count);
+}
+
+const struct pi_format_desc pi_formats[] = {
+    [PIX_FMT_RGB565] = {2, pi_pack_rgb565, pi_fill_rgb565},
+    [PIX_FMT_RGB888] = {3, pi_pack_rgb888, pi_fill_rgb888},
+    [PIX_FMT_XRGB8888] = {4, pi_pack_xrgb8888, pi_fill_xrgb8888},
+};
+
+static inline u8 *pi_target_pixel(const struct pi_exec_target *target, u32 x,
+                                  u32 y) {
+  if (target->tiled)
+    return target->vaddr +
+           pi_tiled_offset(x, y, target->pitch, target->cpp);
+  return target->vaddr + (size_t)y * target->pitch + (size_t)x * target->cpp;
+}
+
+// In a tiled target, a span is contiguous up to the end of its micro-tile
+static inline void pi_fill_span(const struct pi_exec_target *target, u32 x,
+                                u32 y, u32 count, u32 color) {
+  const struct pi_format_desc *desc = &pi_formats[target->format];
+
+  while (target->tiled &&
+         count > PI_MICROTILE_SIZE - (x & (PI_MICROTILE_SIZE - 1))) {
+    u32 n = PI_MICROTILE_SIZE - (x & (PI_MICROTILE_SIZE - 1));
+
+    desc->fill(pi_target_pixel(target, x, y), color, n);
+    x += n;
+    count -= n;
+  }
+  desc->fill(pi_target_pixel(target, x, y), color, count);
+}
+
+// Fills whole micro-tiles of a tiled target: count pixels (a multiple of 8)
+// from x on the 8 rows from y, both multiples of 8, which are contiguous
+static inline void pi_fill_microtiles(const struct pi_exec_target *target,
+                                      u32 x, u32 y, u32 count, u32 color) {
+  pi_formats[target->format].fill(pi_target_pixel(target, x, y), color,
+                                  count * PI_MICROTILE_SIZE);
+}
+
+static void pi_edge_init(struct pi_edge *e, s32 ax, s32 ay, s32 bx, s32 by) {
+  e->a = ay - by;
+  e->b = bx - ax;
+  e->c = (s64)ax * by - (s64)ay * bx;
+  // Samples exactly on an edge shared by two triangles must only be drawn once
+  e->bias = (e->a > 0 || (e->a == 0 && e->b < 0)) ? 0 : -1;
+}
+
+static inline s64 pi_edge_eval(const struct pi_edge *e, s64 x, s64 y) {
+  return e->a * x + e->b * y + e->c + e->bias;
+}
+
+// Subpixel position of the center of a pixel
+static inline s64 pi_sample(s32 pixel) {
+  return (s64)pixel * PI_SUBPIXEL_ONE + PI_SUBPIXEL_HALF;
+}
+
+/*
+ * Smallest and largest values of an edge function over the samples of the
+ * (inclusive) pixel rectangle. The function is linear, so they're at two of
+ * the corners of the rectangle.
+ */
+static void pi_edge_range(const struct pi_edge *e, s32 x0, s32 y0, s32 x1,
+                          s32 y1, s64 *lo, s64 *hi) {
+  *lo = pi_edge_eval(e, pi_sample(e->a >= 0 ? x0 : x1),
+                     pi_sample(e->b >= 0 ? y0 : y1));
+  *hi = pi_edge_eval(e, pi_sample(e->a >= 0 ? x1 : x0),
+                     pi_sample(e->b >= 0 ? y1 : y0));
+}
+
+// Checks if a triangle can cover any sample of the (inclusive) pixel rectangle
+static bool pi_tri_touches(const struct pi_prim *prim, s32 x0, s32 y0, s32 x1,
+                           s32 y1) {
+  for (int i = 0; i < 3; i++) {
+    s64 lo, hi;
+
+    pi_edge_range(&prim->e[i], x0, y0, x1, y1, &lo, &hi);
+    if (hi < 0)
+      return false;
+  }
+  return true;
+}
+
+static void pi_draw_rect(const struct pi_exec_target *target,
+                         const struct pi_prim *prim, s32 x0, s32 y0, s32 x1,
+                         s32 y1) {
+  // The whole micro-tiles of the rectangle, from tx0 to tx1 (exclusive)
+  s32 tx0 = ALIGN(x0, PI_MICROTILE_SIZE);
+  s32 tx1 = ALIGN_DOWN(x1 + 1, PI_MICROTILE_SIZE);
+
+  for (s32 y = y0; y <= y1;) {
+    if (!target->tiled || tx0 >= tx1 || y % PI_MICROTILE_SIZE ||
+        y + PI_MICROTILE_SIZE - 1 > y1) {
+      pi_fill_span(target, x0, y, x1 - x0 + 1, prim->color);
+      y++;
+      continue;
+    }
+
+    // A row of micro-tiles the rectangle crosses, only the sides are spans
+    pi_fill_microtiles(target, tx0, y, tx1 - tx0, prim->color);
+    for (s32 row = y; row < y + PI_MICROTILE_SIZE; row++) {
+      if (x0 < tx0)
+        pi_fill_span(target, x0, row, tx0 - x0, prim->color);
+      if (tx1 <= x1)
+        pi_fill_span(target, tx1, row, x1 - tx1 + 1, prim->color);
+    }
+    y += PI_MICROTILE_SIZE;
+  }
+}
+
+void pi_block_masks_scalar(const s32 *w, const s32 *dx, const s32 *dy,
+                           u8 *masks) {
+  for (int row = 0; row < PI_BLOCK_SIZE; row++) {
+    u8 mask = 0;
+
+    for (int x = 0; x < PI_BLOCK_SIZE; x++) {
+      s32 w0 = w[0] + x * dx[0] + row * dy[0];
+      s32 w1 = w[1] + x * dx[1] + row * dy[1];
+      s32 w2 = w[2] + x * dx[2] + row * dy[2];
+
+      if ((w0 | w1 | w2) >= 0)
+        mask |= 1 << x;
+    }
+    masks[row] = mask;
+  }
+}
+
+/*
+ * Draws the part of a triangle inside of a block (at most 8x8 pixels, clipped
+ * to the bounding box of the triangle and the tile).
+ *
+ * Every edge is first checked against the corners of the block: if the block
+ * is outside of one edge, it's skipped, and if it's inside of all of them,
+ * it's filled without looking at the pixels. Only the blocks on the border of
+ * the triangle go through the coverage kernel.
+ */
+static u32 pi_draw_tri_block(const struct pi_exec_target *target,
+                             const struct pi_block_impl *block,
+                             const struct pi_prim *prim, s32 x0, s32 y0,
+                             s32 x1, s32 y1) {
+  u32 width = x1 - x0 + 1;
+  s32 w[3], dx[3], dy[3];
+  u8 masks[PI_BLOCK_SIZE];
+  bool partial = false;
+  u32 pixels = 0;
+
+  for (int i = 0; i < 3; i++) {
+    const struct pi_edge *e = &prim->e[i];
+    s64 lo, hi;
+
+    pi_edge_range(e, x0, y0, x1, y1, &lo, &hi);
+    if (hi < 0)
+      return 0;
+
+    // An edge that's the same for the whole block doesn't need to be
+    // evaluated, and its values wouldn't always fit in 32 bits anyway
+    if (lo >= 0) {
+      w[i] = dx[i] = dy[i] = 0;
+      continue;
+    }
+
+    // Both signs are in the block, so every sample of the block (and the 7
+    // next ones in either direction) is less than 2^30 away from 0
+    w[i] = pi_edge_eval(e, pi_sample(x0), pi_sample(y0));
+    dx[i] = e->a * PI_SUBPIXEL_ONE;
+    dy[i] = e->b * PI_SUBPIXEL_ONE;
+    partial = true;
+  }
+
+  if (!partial) {
+    // A whole block is a whole micro-tile of a tiled target
+    if (target->tiled && width == PI_BLOCK_SIZE &&
+        y1 - y0 + 1 == PI_BLOCK_SIZE) {
+      pi_fill_microtiles(target, x0, y0, PI_BLOCK_SIZE, prim->color);
+      return PI_BLOCK_SIZE * PI_BLOCK_SIZE;
+    }
+    for (s32 y = y0; y <= y1; y++)
+      pi_fill_span(target, x0, y, width, prim->color);
+    return width * (y1 - y0 + 1);
+  }
+
+  block->masks(w, dx, dy, masks);
+
+  for (s32 y = y0; y <= y1; y++) {
+    u32 mask = masks[y - y0] & GENMASK(width - 1, 0);
+    u32 start, count;
+
+    if (!mask)
+      continue;
+
+    // The covered samples of a row are always contiguous
+    start = __ffs(mask);
+    count = __fls(mask) - start + 1;
+    pi_fill_span(target, x0 + start, y, count, prim->color);
+    pixels += count;
+  }
+  return pixels;
+}
+
+static u64 pi_draw_tri(const struct pi_exec_target *target,
+                       const struct pi_block_impl *block,
+                       const struct pi_prim *prim, s32 x0, s32 y0, s32 x1,
+                       s32 y1) {
+  u64 pixels = 0;
+
+  // Blocks are aligned on 8 pixels, the ones on the sides are clipped
+  for (s32 by = y0; by <= y1; by = (by | (PI_BLOCK_SIZE - 1)) + 1) {
+    s32 by1 = min(by | (PI_BLOCK_SIZE - 1), y1);
+
+    for (s32 bx = x0; bx <= x1; bx = (bx | (PI_BLOCK_SIZE - 1)) + 1) {
+      s32 bx1 = min(bx | (PI_BLOCK_SIZE - 1), x1);
+
+      pixels += pi_draw_tri_block(target, block, prim, bx, by, bx1, by1);
+    }
+  }
+  return pixels;
+}
+
+static bool pi_block_always_usable(void) { return true; }
+
+#ifdef CONFIG_ARM64
+static bool pi_block_neon_usable(void) {
+  return cpu_have_named_feature(ASIMD);
+}
+#endif
+
+#ifdef CONFIG_X86_64
+static bool pi_block_avx2_usable(void) {
+  return boot_cpu_has(X86_FEATURE_AVX2) &&
+         cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL);
+}
+#endif
+
+const struct pi_block_impl pi_block_impls[] = {
+    {"scalar", pi_block_masks_scalar, false, pi_block_always_usable},
+#ifdef CONFIG_ARM64
+    {"neon", pi_block_masks_neon, true, pi_block_neon_usable},
+#endif
+#ifdef CONFIG_X86_64
+    {"sse2", pi_block_masks_sse2, true, pi_block_always_usable},
+    {"avx2", pi_block_masks_avx2, true, pi_block_avx2_usable},
+#endif
+};
+
+const unsigned int pi_num_block_impls = ARRAY_SIZE(pi_block_impls);
+
+// Claims the SIMD registers for the coverage kernel, or falls back to the
+// scalar one when that's not allowed
+static const struct pi_block_impl *
+pi_block_begin(const struct pi_block_impl *block) {
+  if (!block->simd)
+    return block;
+  if (!may_use_simd())
+    return &pi_block_impls[0];
+
+  pi_simd_begin();
+  return block;
+}
+
+static void pi_block_end(const struct pi_block_impl *block) {
+  if (block->simd)
+    pi_simd_end();
+}
+
+// Draws every primitive binned in a tile, in submission order
+static u64 pi_raster_tile(struct pi_raster *raster, u32 tile) {
+  const struct pi_exec_target *target = raster->target;
+  const struct pi_block_impl *block;
+  s32 tx0 = (tile % raster->tiles_x) << PI_TILE_SHIFT;
+  s32 ty0 = (tile / raster->tiles_x) << PI_TILE_SHIFT;
+  s32 tx1 = min_t(s32, tx0 + PI_TILE_SIZE, target->width) - 1;
+  s32 ty1 = min_t(s32, ty0 + PI_TILE_SIZE, target->height) - 1;
+  u64 pixels = 0;
+
+  // Claimed once per tile, not per triangle, since it's not free either
+  block = pi_block_begin(raster->block);
+
+  for (u32 ref = raster->bin_head[tile]; ref != PI_BIN_END;
+       ref = raster->refs[ref].next) {
+    const struct pi_prim *prim = &raster->prims[raster->refs[ref].prim];
+    s32 x0 = max(prim->min_x, tx0);
+    s32 y0 = max(prim->min_y, ty0);
+    s32 x1 = min(prim->max_x, tx1);
+    s32 y1 = min(prim->max_y, ty1);
+
+    if (prim->type == PI_PRIM_RECT) {
+      pi_draw_rect(target, prim, x0, y0, x1, y1);
+      pixels += (u64)(x1 - x0 + 1) * (y1 - y0 + 1);
+    } else {
+      pixels += pi_draw_tri(target, block, prim, x0, y0, x1, y1);
+    }
+  }
+
+  pi_block_end(block);
+  return pixels;
+}
+
+/*
+ * Claims the next tile to rasterize: first from the range of the worker
+ * itself, then from the ranges of the others.
+ */
+static bool pi_raster_claim(struct pi_raster *raster,
+                            struct pi_raster_worker *self, u32 *tile) {
+  for (unsigned int i = 0; i < raster->nr_running; i++) {
+    struct pi_raster_worker *victim =
+        &raster->workers[(self->index + i) % raster->nr_running];
+    u32 next;
+
+    // Cheap check first, so exhausted ranges aren't hammered with atomics
+    if ((u32)atomic_read(&victim->next) >= victim->end)
+      continue;
+
+    next = atomic_fetch_inc(&victim->next);
+    if (next < victim->end) {
+      *tile = raster->active[next];
+      return true;
+    }
+  }
+  return false;
+}
+
+static void pi_raster_worker_run(struct pi_raster_worker *worker) {
+  struct pi_raster *raster = worker->raster;
+  u32 tile;
+
+  while (pi_raster_claim(raster, worker, &tile))
+    worker->pixels += pi_raster_tile(raster, tile);
+}
+
+static void pi_raster_work(struct work_struct *work) {
+  pi_raster_worker_run(container_of(work, struct pi_raster_worker, work));
+}
+
+static void pi_raster_reset_bins(struct pi_raster *raster) {
+  raster->num_prims = 0;
+  raster->num_refs = 0;
+  memset(raster->bin_head, 0xFF,
+         raster->tiles_x * raster->tiles_y * sizeof(*raster->bin_head));
+}
+
+static void pi_raster_rasterize(struct pi_raster *raster) {
+  u32 num_tiles = raster->tiles_x * raster->tiles_y;
+  unsigned int nr_workers;
+  u32 chunk;
+
+  raster->num_active = 0;
+  for (u32 tile = 0; tile < num_tiles; tile++) {
+    if (raster->bin_head[tile] != PI_BIN_END)
+      raster->active[raster->num_active++] = tile;
+  }
+  if (!raster->num_active)
+    return;
+
+  nr_workers = min_t(unsigned int, raster->nr_workers,
+                     DIV_ROUND_UP(raster->num_active, PI_MIN_TILES_PER_WORKER));
+  chunk = DIV_ROUND_UP(raster->num_active, nr_workers);
+  raster->nr_running = nr_workers;
+
+  for (unsigned int i = 0; i < nr_workers; i++) {
+    struct pi_raster_worker *worker = &raster->workers[i];
+
+    atomic_set(&worker->next, min(i * chunk, raster->num_active));
+    worker->end = min((i + 1) * chunk, raster->num_active);
+    worker->pixels = 0;
+  }
+
+  for (unsigned int i = 1; i < nr_workers; i++) {
+    struct pi_raster_worker *worker = &raster->workers[i];
+
+    if (cpu_online(worker->cpu))
+      queue_work_on(worker->cpu, raster->wq, &worker->work);
+    else
+      queue_work(raster->wq, &worker->work);
+  }
+
+  // The caller is worker 0
+  pi_raster_worker_run(&raster->workers[0]);
+
+  for (unsigned int i = 1; i < nr_workers; i++)
+    flush_work(&raster->workers[i].work);
+
+  for (unsigned int i = 0; i < nr_workers; i++)
+    raster->pixels += raster->workers[i].pixels;
+}
+
+/**
+ * pi_raster_flush - rasterizes everything that's binned
+ * @raster: rasterizer, with raster->lock held
+ *
+ * Returns:
+ * The number of pixels drawn since the last flush, including the primitives
+ * that had to be rasterized early because the bins were full.
+ */
+u64 pi_raster_flush(struct pi_raster *raster) {
+  u64 pixels;
+
+  if (raster->num_prims) {
+    pi_raster_rasterize(raster);
+    pi_raster_reset_bins(raster);
+  }
+
+  pixels = raster->pixels;
+  raster->pixels = 0;
+  return pixels;
+}
+
+static struct pi_prim *pi_raster_new_prim(struct pi_raster *raster) {
+  if (raster->num_prims == PI_MAX_PRIMS) {
+    pi_raster_rasterize(raster);
+    pi_raster_reset_bins(raster);
+  }
+  return &raster->prims[raster->num_prims];
+}
+
+static void pi_raster_bin(struct pi_raster *raster, u32 prim_index, u32 tile) {
+  struct pi_bin_ref *ref = &raster->refs[raster->num_refs];
+
+  ref->prim = prim_index;
+  ref->next = PI_BIN_END;
+
+  if (raster->bin_head[tile] == PI_BIN_END)
+    raster->bin_head[tile] = raster->num_refs;
+  else
+    raster->refs[raster->bin_tail[tile]].next = raster->num_refs;
+  raster->bin_tail[tile] = raster->num_refs;
+  raster->num_refs++;
+}
+
+// Adds the primitive at the end of raster->prims to the bins of the tiles
+// it touches
+static void pi_raster_commit_prim(struct pi_raster *raster) {
+  struct pi_prim *prim = &raster->prims[raster->num_prims];
+  u32 tx0 = prim->min_x >> PI_TILE_SHIFT;
+  u32 ty0 = prim->min_y >> PI_TILE_SHIFT;
+  u32 tx1 = prim->max_x >> PI_TILE_SHIFT;
+  u32 ty1 = prim->max_y >> PI_TILE_SHIFT;
+  u32 index;
+
+  // The refs of a primitive are never split across two flushes
+  if (raster->num_refs + (tx1 - tx0 + 1) * (ty1 - ty0 + 1) > PI_MAX_BIN_REFS) {
+    struct pi_prim tmp = *prim;
+
+    pi_raster_rasterize(raster);
+    pi_raster_reset_bins(raster);
+    raster->prims[0] = tmp;
+    prim = &raster->prims[0];
+  }
+
+  index = raster->num_prims++;
+
+  for (u32 ty = ty0; ty <= ty1; ty++) {
+    for (u32 tx = tx0; tx <= tx1; tx++) {
+      if (prim->type == PI_PRIM_TRI &&
+          !pi_tri_touches(prim, tx << PI_TILE_SHIFT, ty << PI_TILE_SHIFT,
+                          ((tx + 1) << PI_TILE_SHIFT) - 1,
+                          ((ty + 1) << PI_TILE_SHIFT) - 1))
+        continue;
+      pi_raster_bin(raster, index, ty * raster->tiles_x + tx);
+    }
+  }
+}
+
+/**
+ * pi_raster_add_rect - bins a rectangle
+ * @raster: rasterizer, with raster->lock held
+ * @x0: left edge, inclusive
+ * @y0: top edge, inclusive
+ * @x1: right edge, exclusive
+ * @y1: bottom edge, exclusive
+ * @color: already packed in the format of the target
+ */
+void pi_raster_add_rect(struct pi_raster *raster, s32 x0, s32 y0, s32 x1,
+                        s32 y1, u32 color) {
+  const struct pi_exec_target *target = raster->target;
+  struct pi_prim *prim;
+
+  // Clip to the render target, anything outside of it is just dropped
+  x0 = max(x0, 0);
+  y0 = max(y0, 0);
+  x1 = min_t(s32, x1, target->width);
+  y1 = min_t(s32, y1, target->height);
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  prim = pi_raster_new_prim(raster);
+  prim->type = PI_PRIM_RECT;
+  prim->color = color;
+  prim->min_x = x0;
+  prim->min_y = y0;
+  prim->max_x = x1 - 1;
+  prim->max_y = y1 - 1;
+  pi_raster_commit_prim(raster);
+}
+
+/**
+ * pi_raster_add_tri - sets up and bins a triangle
+ * @raster: rasterizer, with raster->lock held
+ * @vx: x coordinates of the vertices, in subpixels
+ * @vy: y coordinates of the vertices, in subpixels
+ * @color: already packed in the format of the target
+ *
+ * Either winding is accepted, degenerate triangles are dropped.
+ */
+void pi_raster_add_tri(struct pi_raster *raster, const s32 *vx, const s32 *vy,
+                       u32 color) {
+  const struct pi_exec_target *target = raster->target;
+  struct pi_prim *prim;
+  int v1 = 1, v2 = 2;
+  s64 area;
+
+  area = (s64)(vx[1] - vx[0]) * (vy[2] - vy[0]) -
+         (s64)(vy[1] - vy[0]) * (vx[2] - vx[0]);
+  if (area == 0)
+    return;
+  if (area < 0)
+    swap(v1, v2);
+
+  prim = pi_raster_new_prim(raster);
+  prim->type = PI_PRIM_TRI;
+  prim->color = color;
+
+  // Bounding box in pixels, clipped to the render target
+  prim->min_x = max(min3(vx[0], vx[1], vx[2]) >> PI_SUBPIXEL_BITS, 0);
+  prim->min_y = max(min3(vy[0], vy[1], vy[2]) >> PI_SUBPIXEL_BITS, 0);
+  prim->max_x = min_t(s32, max3(vx[0], vx[1], vx[2]) >> PI_SUBPIXEL_BITS,
+                      target->width - 1);
+  prim->max_y = min_t(s32, max3(vy[0], vy[1], vy[2]) >> PI_SUBPIXEL_BITS,
+                      target->height - 1);
+  if (prim->min_x > prim->max_x || prim->min_y > prim->max_y)
+    return;
+
+  pi_edge_init(&prim->e[0], vx[v1], vy[v1], vx[v2], vy[v2]);
+  pi_edge_init(&prim->e[1], vx[v2], vy[v2], vx[0], vy[0]);
+  pi_edge_init(&prim->e[2], vx[0], vy[0], vx[v1], vy[v1]);
+  pi_raster_commit_prim(raster);
+}
+
+/**
+ * pi_raster_begin - starts binning for a render target
+ * @raster: rasterizer, with raster->lock held
+ * @target: render target, must stay valid until the next flush
+ *
+ * Anything binned for the previous target must have been flushed.
+ *
+ * Returns:
+ * 0 on success, -EINVAL if the target is too big to be binned.
+ */
+int pi_raster_begin(struct pi_raster *raster,
+                    const struct pi_exec_target *target) {
+  u32 tiles_x = DIV_ROUND_UP(target->width, PI_TILE_SIZE);
+  u32 tiles_y = DIV_ROUND_UP(target->height, PI_TILE_SIZE);
+
+  if (tiles_x > PI_MAX_TILES_X || tiles_y > PI_MAX_TILES_Y)
+    return -EINVAL;
+
+  raster->target = target;
+  raster->tiles_x = tiles_x;
+  raster->tiles_y = tiles_y;
+  pi_raster_reset_bins(raster);
+  return 0;
+}
+
+int pi_raster_init(struct pi_raster *raster) {
+  unsigned int cpu;
+
+  mutex_init(&raster->lock);
+
+  raster->prims = kvmalloc_array(PI_MAX_PRIMS, sizeof(*raster->prims),
+                                 GFP_KERNEL);
+  raster->refs = kvmalloc_array(PI_MAX_BIN_REFS, sizeof(*raster->refs),
+                                GFP_KERNEL);
+  raster->bin_head =
+      kvmalloc_array(PI_MAX_TILES, sizeof(*raster->bin_head), GFP_KERNEL);
+  raster->bin_tail =
+      kvmalloc_array(PI_MAX_TILES, sizeof(*raster->bin_tail), GFP_KERNEL);
+  raster->active =
+      kvmalloc_array(PI_MAX_TILES, sizeof(*raster->active), GFP_KERNEL);
+  if (!raster->prims || !raster->refs || !raster->bin_head ||
+      !raster->bin_tail || !raster->active)
+    goto err;
+
+  raster->wq = alloc_workqueue("pi_gpu_raster", WQ_HIGHPRI, 0);
+  if (!raster->wq)
+    goto err;
+
+  // One worker per online CPU, worker 0 being whoever flushes
+  raster->max_workers = 0;
+  for_each_online_cpu(cpu) {
+    struct pi_raster_worker *worker = &raster->workers[raster->max_workers];
+
+    if (raster->max_workers == PI_MAX_RASTER_WORKERS)
+      break;
+
+    INIT_WORK(&worker->work, pi_raster_work);
+    worker->raster = raster;
+    worker->index = raster->max_workers++;
+    worker->cpu = cpu;
+  }
+  raster->nr_workers = raster->max_workers;
+
+  for (int i = pi_num_block_impls - 1; i >= 0; i--) {
+    if (pi_block_impls[i].usable()) {
+      raster->block = &pi_block_impls[i];
+      break;
+    }
+  }
+
+  return 0;
+
+err:
+  pi_raster_fini(raster);
+  return -ENOMEM;
+}
+
+void pi_raster_fini(struct pi_raster *raster) {
+  if (raster->wq) {
+    destroy_workqueue(raster->wq);
+    raster->wq = NULL;
+  }
+  kvfree(raster->active);
+  kvfree(raster->bin_tail);
+  kvfree(raster->bin_head);
+  kvfree(raster->refs);
+  kvfree(raster->prims);
+  raster->active = NULL;
+  raster->bin_tail = NULL;
+  raster->bin_head = NULL;
+  raster->refs = NULL;
+  raster->prims = NULL;
+}
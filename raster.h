@@ -0,0 +1,209 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include "asm-generic/int-ll64.h"
+#include "linux/atomic.h"
+#include "linux/build_bug.h"
+#include "linux/mutex.h"
+#include "linux/types.h"
+#include "linux/workqueue.h"
+
+#include "pi_gpu_drm.h"
+
+/*
+ * Tiles are 64x64 pixels. At 4 bytes per pixel, that's 16KB of pixels, which
+ * fits in the L1 data cache of the Cortex-A76 cores of the Pi 5 (64KB), and
+ * leaves enough room for the bin of the tile.
+ */
+#define PI_TILE_SHIFT 6
+#define PI_TILE_SIZE (1 << PI_TILE_SHIFT)
+
+// Largest render target that can be binned: 4096x4096 pixels
+#define PI_MAX_TILES_X 64
+#define PI_MAX_TILES_Y 64
+#define PI_MAX_TILES (PI_MAX_TILES_X * PI_MAX_TILES_Y)
+
+// Once either is full, the binned primitives are rasterized right away
+#define PI_MAX_PRIMS 4096
+#define PI_MAX_BIN_REFS (64 * 1024)
+
+#define PI_MAX_RASTER_WORKERS 16
+
+// Vertices are snapped to a 1/16th of a pixel grid internally and pixels are
+// sampled at their center
+#define PI_SUBPIXEL_BITS 4
+#define PI_SUBPIXEL_ONE (1 << PI_SUBPIXEL_BITS)
+#define PI_SUBPIXEL_HALF (PI_SUBPIXEL_ONE >> 1)
+
+// Triangles are rasterized in 8x8 blocks of pixels
+#define PI_BLOCK_SHIFT 3
+#define PI_BLOCK_SIZE (1 << PI_BLOCK_SHIFT)
+
+// A block is a micro-tile of a tiled target
+static_assert(PI_BLOCK_SIZE == PI_MICROTILE_SIZE);
+
+struct pi_exec_target;
+
+struct pi_format_desc {
+  u8 cpp;
+  u32 (*pack)(u32 xrgb);
+  void (*fill)(u8 *dst, u32 color, u32 count);
+};
+
+// Indexed by PIX_FMT_*
+extern const struct pi_format_desc pi_formats[3];
+
+// Offset of pixel x, y in the tiled layout (see PI_MICROTILE_SIZE)
+static inline size_t pi_tiled_offset(u32 x, u32 y, u32 pitch, u8 cpp) {
+  const u32 mask = PI_MICROTILE_SIZE - 1;
+
+  return ((size_t)(y >> PI_MICROTILE_SHIFT) * pitch << PI_MICROTILE_SHIFT) +
+         (((size_t)(x >> PI_MICROTILE_SHIFT) << (2 * PI_MICROTILE_SHIFT)) +
+          ((y & mask) << PI_MICROTILE_SHIFT) + (x & mask)) *
+             cpp;
+}
+
+/*
+ * Edge function of the edge going from a to b:
+ * E(x, y) = a * x + b * y + c
+ *
+ * E is positive on the inside of a triangle wound counter-clockwise (in a y
+ * down coordinate system), and 0 on the edge itself.
+ */
+struct pi_edge {
+  s64 a;
+  s64 b;
+  s64 c;
+  s64 bias; // 0 for top-left edges, -1 otherwise (top-left fill rule)
+};
+
+enum {
+  PI_PRIM_RECT,
+  PI_PRIM_TRI,
+};
+
+struct pi_prim {
+  u8 type; // PI_PRIM_*
+  u32 color; // already packed in the format of the target
+
+  // Bounding box in pixels, inclusive and clipped to the render target
+  s32 min_x;
+  s32 min_y;
+  s32 max_x;
+  s32 max_y;
+
+  struct pi_edge e[3]; // only for triangles
+};
+
+/*
+ * Coverage of a block of 8x8 pixels, computed from the edge functions of a
+ * triangle:
+ *   w[i]  -> edge i at the center of the top left pixel of the block
+ *   dx[i] -> step of edge i from one pixel to the next one on the right
+ *   dy[i] -> step of edge i from one row of the block to the next one
+ *
+ * Bit n of masks[row] is set if the pixel n of the row is inside all the
+ * edges. Only edges the block straddles are passed with their actual values,
+ * so they all fit in 32 bits (see pi_draw_tri()).
+ *
+ * All the implementations must give exactly the same masks as the scalar one.
+ */
+struct pi_block_impl {
+  const char *name;
+  void (*masks)(const s32 *w, const s32 *dx, const s32 *dy, u8 *masks);
+  bool simd; // needs the FPU/SIMD registers
+  bool (*usable)(void);
+};
+
+// From the slowest to the fastest one, the scalar one is always first
+extern const struct pi_block_impl pi_block_impls[];
+extern const unsigned int pi_num_block_impls;
+
+void pi_block_masks_scalar(const s32 *w, const s32 *dx, const s32 *dy,
+                           u8 *masks);
+void pi_block_masks_neon(const s32 *w, const s32 *dx, const s32 *dy,
+                         u8 *masks);
+void pi_block_masks_sse2(const s32 *w, const s32 *dx, const s32 *dy,
+                         u8 *masks);
+void pi_block_masks_avx2(const s32 *w, const s32 *dx, const s32 *dy,
+                         u8 *masks);
+
+// Entry of the bin of a tile, bins are linked lists in submission order
+struct pi_bin_ref {
+  u32 prim;
+  u32 next;
+};
+
+struct pi_raster;
+
+struct pi_raster_worker {
+  struct work_struct work;
+  struct pi_raster *raster;
+  unsigned int index;
+  int cpu;
+
+  // Range of raster->active the worker starts with. Other workers steal from
+  // it by incrementing next as well once they're done with their own range.
+  atomic_t next;
+  u32 end;
+
+  u64 pixels;
+};
+
+/*
+ * Tile binning rasterizer
+ *
+ * Primitives are first set up and binned into the tiles they touch, then the
+ * tiles are rasterized in parallel by a pool of per-CPU workers. Every tile is
+ * only ever touched by one worker, and a tile draws its primitives in order,
+ * so the result is the same as drawing them one after the other.
+ */
+struct pi_raster {
+  // Only one command stream can be binned at a time
+  struct mutex lock;
+
+  const struct pi_exec_target *target;
+  u32 tiles_x;
+  u32 tiles_y;
+
+  u32 num_prims;
+  struct pi_prim *prims;
+
+  u32 num_refs;
+  struct pi_bin_ref *refs;
+  u32 *bin_head;
+  u32 *bin_tail;
+
+  // Tiles with at least one primitive, built when flushing
+  u32 num_active;
+  u32 *active;
+
+  // Pixels drawn since the last call to pi_raster_flush()
+  u64 pixels;
+
+  // Coverage kernel used for triangles, the fastest usable one by default
+  const struct pi_block_impl *block;
+
+  struct workqueue_struct *wq;
+  unsigned int nr_workers; // most workers a flush may use
+  unsigned int max_workers;
+  unsigned int nr_running; // workers used by the current flush
+  struct pi_raster_worker workers[PI_MAX_RASTER_WORKERS];
+};
+
+int pi_raster_init(struct pi_raster *raster);
+
+void pi_raster_fini(struct pi_raster *raster);
+
+int pi_raster_begin(struct pi_raster *raster,
+                    const struct pi_exec_target *target);
+
+void pi_raster_add_rect(struct pi_raster *raster, s32 x0, s32 y0, s32 x1,
+                        s32 y1, u32 color);
+
+void pi_raster_add_tri(struct pi_raster *raster, const s32 *vx, const s32 *vy,
+                       u32 color);
+
+u64 pi_raster_flush(struct pi_raster *raster);
+
+#endif
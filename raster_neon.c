@@ -0,0 +1,45 @@
+/*
+ * Description:
+ * NEON coverage kernel of the rasterizer (see struct pi_block_impl).
+ *
+ * Built with the FPU flags of the kernel, so it must only be called between
+ * kernel_neon_begin() and kernel_neon_end().
+ */
+#include "asm/neon-intrinsics.h"
+
+#include "raster.h"
+
+/*
+ * A row of a block is two vectors of 4 pixels. A pixel is inside if the OR of
+ * its 3 edge values is positive, and the comparison results are turned into a
+ * bitmask with a per-lane bit and a horizontal add.
+ */
+void pi_block_masks_neon(const s32 *w, const s32 *dx, const s32 *dy,
+                         u8 *masks) {
+  static const s32 lanes[PI_BLOCK_SIZE] = {0, 1, 2, 3, 4, 5, 6, 7};
+  static const u32 bits[PI_BLOCK_SIZE] = {1, 2, 4, 8, 16, 32, 64, 128};
+  const int32x4_t lanes_lo = vld1q_s32(lanes);
+  const int32x4_t lanes_hi = vld1q_s32(lanes + 4);
+  const uint32x4_t bits_lo = vld1q_u32(bits);
+  const uint32x4_t bits_hi = vld1q_u32(bits + 4);
+  int32x4_t e_lo[3], e_hi[3], step[3];
+
+  for (int i = 0; i < 3; i++) {
+    e_lo[i] = vmlaq_n_s32(vdupq_n_s32(w[i]), lanes_lo, dx[i]);
+    e_hi[i] = vmlaq_n_s32(vdupq_n_s32(w[i]), lanes_hi, dx[i]);
+    step[i] = vdupq_n_s32(dy[i]);
+  }
+
+  for (int row = 0; row < PI_BLOCK_SIZE; row++) {
+    int32x4_t lo = vorrq_s32(vorrq_s32(e_lo[0], e_lo[1]), e_lo[2]);
+    int32x4_t hi = vorrq_s32(vorrq_s32(e_hi[0], e_hi[1]), e_hi[2]);
+
+    masks[row] = vaddvq_u32(vandq_u32(vcgezq_s32(lo), bits_lo)) |
+                 vaddvq_u32(vandq_u32(vcgezq_s32(hi), bits_hi));
+
+    for (int i = 0; i < 3; i++) {
+      e_lo[i] = vaddq_s32(e_lo[i], step[i]);
+      e_hi[i] = vaddq_s32(e_hi[i], step[i]);
+    }
+  }
+}
@@ -0,0 +1,65 @@
+/*
+ * Description:
+ * SSE2 and AVX2 coverage kernels of the rasterizer (see struct
+ * pi_block_impl).
+ *
+ * The intrinsics headers pull in parts of libc, so the kernels are written
+ * with the vector extensions of the compiler instead. The file is built with
+ * the FPU flags of the kernel (SSE2), the AVX2 kernel enables AVX2 for itself
+ * and is only used if the CPU has it. Both must only be called between
+ * kernel_fpu_begin() and kernel_fpu_end().
+ */
+#include "raster.h"
+
+typedef s32 pi_v4si __attribute__((vector_size(16)));
+typedef float pi_v4sf __attribute__((vector_size(16)));
+typedef s32 pi_v8si __attribute__((vector_size(32)));
+typedef float pi_v8sf __attribute__((vector_size(32)));
+
+/*
+ * A row of a block is two vectors of 4 pixels. A pixel is inside if the OR of
+ * its 3 edge values is positive, so the mask is the inverted sign bits.
+ */
+void pi_block_masks_sse2(const s32 *w, const s32 *dx, const s32 *dy,
+                         u8 *masks) {
+  pi_v4si e_lo[3], e_hi[3];
+
+  for (int i = 0; i < 3; i++) {
+    e_lo[i] = (pi_v4si){w[i], w[i] + dx[i], w[i] + 2 * dx[i],
+                        w[i] + 3 * dx[i]};
+    e_hi[i] = e_lo[i] + 4 * dx[i];
+  }
+
+  for (int row = 0; row < PI_BLOCK_SIZE; row++) {
+    pi_v4si lo = e_lo[0] | e_lo[1] | e_lo[2];
+    pi_v4si hi = e_hi[0] | e_hi[1] | e_hi[2];
+    u32 sign = __builtin_ia32_movmskps((pi_v4sf)lo) |
+               __builtin_ia32_movmskps((pi_v4sf)hi) << 4;
+
+    masks[row] = ~sign;
+
+    for (int i = 0; i < 3; i++) {
+      e_lo[i] += dy[i];
+      e_hi[i] += dy[i];
+    }
+  }
+}
+
+// Same as the SSE2 kernel, but a whole row fits in one vector
+__attribute__((target("avx2"))) void
+pi_block_masks_avx2(const s32 *w, const s32 *dx, const s32 *dy, u8 *masks) {
+  const pi_v8si lanes = {0, 1, 2, 3, 4, 5, 6, 7};
+  pi_v8si e[3];
+
+  for (int i = 0; i < 3; i++)
+    e[i] = w[i] + lanes * dx[i];
+
+  for (int row = 0; row < PI_BLOCK_SIZE; row++) {
+    pi_v8si v = e[0] | e[1] | e[2];
+
+    masks[row] = ~__builtin_ia32_movmskps256((pi_v8sf)v);
+
+    for (int i = 0; i < 3; i++)
+      e[i] += dy[i];
+  }
+}
@@ -0,0 +1,463 @@
+/*
+ * Description:
+ * Residency manager, moving the buffer objects used by submissions between
+ * system memory (shmem) and vram.
+ *
+ * Vram is much smaller than the working set of the clients, so only the objects
+ * used frame after frame get a place in it. Every object a job references by
+ * handle is tracked. Once an object has been used in two different frames, it's
+ * marked for promotion, and as soon as the last job using it is done, the
+ * worker copies it into vram. The addresses of a job are fixed when it's
+ * submitted, so objects only move while no job uses them, ahead of the next
+ * submissions using them. Room is made by evicting the least recently used
+ * objects back to shmem, never the ones the current frame used. A frame ends
+ * at every display update.
+ *
+ * Objects in BO lists or bound in a GPU address space stay where they are,
+ * their kernel addresses are captured when the list is created or the object
+ * is bound.
+ *
+ * Moving an object zaps its userspace mappings and updates bo->map with both
+ * the reservation lock and bo_cache.lock held, like every other update of the
+ * mapping. Userspace faults take the reservation lock and map the object
+ * wherever it is at that point (see pi_bo_fault()).
+ */
+#include "asm-generic/errno-base.h"
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_debugfs.h"
+#include "drm/drm_device.h"
+#include "drm/drm_gem.h"
+#include "drm/drm_gem_shmem_helper.h"
+#include "drm/drm_mm.h"
+#include "drm/drm_vma_manager.h"
+#include "linux/dma-resv.h"
+#include "linux/fs.h"
+#include "linux/iosys-map.h"
+#include "linux/list.h"
+#include "linux/math64.h"
+#include "linux/minmax.h"
+#include "linux/mutex.h"
+#include "linux/seq_file.h"
+#include "linux/string.h"
+#include "linux/workqueue.h"
+
+#include "bo.h"
+#include "driver.h"
+#include "residency.h"
+#include "vram.h"
+
+/*
+ * Only objects created by clients in system memory move, and they're in vram
+ * while they have a range of it. Stable with the reservation lock held.
+ */
+bool pi_bo_resident(struct pi_bo *bo) {
+  return bo->poolable && drm_mm_node_allocated(&bo->vram_node);
+}
+
+// The next userspace access to the object faults and maps its new location
+static void pi_bo_zap(struct pi_bo *bo) {
+  struct drm_gem_object *obj = &bo->base.base;
+
+  drm_vma_node_unmap(&obj->vma_node, obj->dev->anon_inode->i_mapping);
+}
+
+/*
+ * Copies an object back to shmem. Called with the reservation lock held, once
+ * pi_bo_begin_move() succeeded. On failure, the object is left in vram.
+ */
+static int pi_residency_evict_locked(struct pi_gpu *gpu, struct pi_bo *bo) {
+  struct drm_gem_object *obj = &bo->base.base;
+  struct pi_residency *res = &gpu->residency;
+  struct iosys_map map;
+  int ret;
+
+  // The pages were unpinned when the object got promoted
+  ret = drm_gem_shmem_vmap(&bo->base, &map);
+  if (ret)
+    return ret;
+
+  // Userspace can't write to vram anymore once its mappings are gone, and
+  // faults wait for the reservation lock
+  pi_bo_zap(bo);
+  memcpy(map.vaddr, bo->map.vaddr, obj->size);
+
+  mutex_lock(&gpu->vram_heap.lock);
+  drm_mm_remove_node(&bo->vram_node);
+  mutex_unlock(&gpu->vram_heap.lock);
+
+  mutex_lock(&res->lock);
+  list_del_init(&bo->res.link);
+  bo->res.resident = false;
+  bo->res.evicted = true;
+  bo->res.evicted_frame = res->frame;
+  res->stats.resident_objects--;
+  res->stats.resident_bytes -= obj->size;
+  res->stats.evictions++;
+  res->stats.evicted_bytes += obj->size;
+  res->frame_bytes += obj->size;
+  mutex_unlock(&res->lock);
+
+  pi_bo_end_move(bo, &map);
+  return 0;
+}
+
+/**
+ * pi_residency_evict - moves an object back to system memory
+ * @gpu: the device
+ * @bo: object in vram, with its reservation lock held
+ *
+ * Returns:
+ * 0 on success, -EBUSY if a job is using the object, or another negative
+ * error code.
+ */
+int pi_residency_evict(struct pi_gpu *gpu, struct pi_bo *bo) {
+  int ret;
+
+  if (!pi_bo_begin_move(bo))
+    return -EBUSY;
+
+  ret = pi_residency_evict_locked(gpu, bo);
+  if (ret)
+    pi_bo_end_move(bo, &bo->map);
+  return ret;
+}
+
+/*
+ * Finds the least recently used object in vram that can be evicted, and
+ * returns it referenced, with its reservation lock held and ready to move.
+ * Objects are only trylocked, the caller can hold the lock of another one.
+ */
+static struct pi_bo *pi_residency_lock_victim(struct pi_gpu *gpu,
+                                              bool keep_frame) {
+  struct pi_residency *res = &gpu->residency;
+  u64 attempts;
+
+  mutex_lock(&res->lock);
+  attempts = res->stats.resident_objects;
+  mutex_unlock(&res->lock);
+
+  while (attempts--) {
+    struct pi_bo *bo = NULL, *it;
+
+    mutex_lock(&res->lock);
+    list_for_each_entry(it, &res->resident, res.link) {
+      if (keep_frame && it->res.last_frame == res->frame)
+        continue;
+      // Skips the objects being freed
+      if (kref_get_unless_zero(&it->base.base.refcount)) {
+        bo = it;
+        break;
+      }
+    }
+    mutex_unlock(&res->lock);
+
+    if (!bo)
+      return NULL;
+
+    if (dma_resv_trylock(bo->base.base.resv)) {
+      if (pi_bo_resident(bo) && !bo->res.pin_count && pi_bo_begin_move(bo))
+        return bo;
+      dma_resv_unlock(bo->base.base.resv);
+    }
+
+    // Busy, so not that cold after all
+    mutex_lock(&res->lock);
+    if (bo->res.resident)
+      list_move_tail(&bo->res.link, &res->resident);
+    mutex_unlock(&res->lock);
+    drm_gem_object_put(&bo->base.base);
+  }
+
+  return NULL;
+}
+
+/**
+ * pi_residency_alloc_vram - allocates a range of vram, evicting if needed
+ * @gpu: the device
+ * @node: range to allocate
+ * @size: size of the range, a multiple of the page size
+ * @keep_frame: don't evict the objects used during the current frame
+ *
+ * Evicts the least recently used objects until the range fits.
+ *
+ * Returns:
+ * 0 on success, -ENOSPC if nothing else can be evicted, or another negative
+ * error code.
+ */
+int pi_residency_alloc_vram(struct pi_gpu *gpu, struct drm_mm_node *node,
+                            size_t size, bool keep_frame) {
+  struct pi_vram_heap *heap = &gpu->vram_heap;
+  struct pi_bo *victim;
+  int ret;
+
+  if (!heap->size || size > heap->size)
+    return -ENOSPC;
+
+  for (;;) {
+    mutex_lock(&heap->lock);
+    ret = drm_mm_insert_node_generic(&heap->mm, node, size, PAGE_SIZE, 0,
+                                     DRM_MM_INSERT_BEST);
+    mutex_unlock(&heap->lock);
+    if (ret != -ENOSPC)
+      return ret;
+
+    victim = pi_residency_lock_victim(gpu, keep_frame);
+    if (!victim)
+      return -ENOSPC;
+
+    ret = pi_residency_evict_locked(gpu, victim);
+    if (ret)
+      pi_bo_end_move(victim, &victim->map);
+    dma_resv_unlock(victim->base.base.resv);
+    drm_gem_object_put(&victim->base.base);
+    if (ret)
+      return ret;
+  }
+}
+
+static void pi_residency_promote(struct pi_gpu *gpu, struct pi_bo *bo) {
+  struct drm_gem_object *obj = &bo->base.base;
+  struct pi_residency *res = &gpu->residency;
+  struct iosys_map map, vram;
+
+  dma_resv_lock(obj->resv, NULL);
+
+  // Exported, imported or pinned objects hand out their pages
+  if (pi_bo_resident(bo) || bo->res.pin_count || obj->import_attach ||
+      obj->dma_buf || bo->base.madv || !pi_bo_begin_move(bo))
+    goto unlock;
+
+  if (pi_residency_alloc_vram(gpu, &bo->vram_node, obj->size, true))
+    goto abort;
+
+  map = bo->map;
+  if (iosys_map_is_null(&map) && drm_gem_shmem_vmap(&bo->base, &map))
+    goto free_node;
+
+  vram = IOSYS_MAP_INIT_VADDR((u8 *)gpu->vram + bo->vram_node.start);
+  pi_bo_zap(bo);
+  memcpy(vram.vaddr, map.vaddr, obj->size);
+  // Unpins the pages, they can be swapped out while the object is in vram
+  drm_gem_shmem_vunmap(&bo->base, &map);
+
+  mutex_lock(&res->lock);
+  list_add_tail(&bo->res.link, &res->resident);
+  bo->res.resident = true;
+  if (bo->res.evicted &&
+      res->frame - bo->res.evicted_frame < PI_RES_THRASH_FRAMES)
+    res->stats.thrashes++;
+  res->stats.resident_objects++;
+  res->stats.resident_bytes += obj->size;
+  res->stats.promotions++;
+  res->stats.promoted_bytes += obj->size;
+  res->frame_bytes += obj->size;
+  mutex_unlock(&res->lock);
+
+  pi_bo_end_move(bo, &vram);
+  goto unlock;
+
+free_node:
+  mutex_lock(&gpu->vram_heap.lock);
+  drm_mm_remove_node(&bo->vram_node);
+  mutex_unlock(&gpu->vram_heap.lock);
+abort:
+  pi_bo_end_move(bo, &bo->map);
+unlock:
+  dma_resv_unlock(obj->resv);
+}
+
+static void pi_residency_work(struct work_struct *work) {
+  struct pi_residency *res = container_of(work, struct pi_residency, work);
+  struct pi_gpu *gpu = container_of(res, struct pi_gpu, residency);
+  struct pi_bo *bo;
+
+  for (;;) {
+    mutex_lock(&res->lock);
+    bo = list_first_entry_or_null(&res->pending, struct pi_bo, res.link);
+    if (bo) {
+      list_del_init(&bo->res.link);
+      // Marked again by the next submission using it if this one fails
+      bo->res.promote = false;
+    }
+    mutex_unlock(&res->lock);
+
+    if (!bo)
+      break;
+
+    pi_residency_promote(gpu, bo);
+    drm_gem_object_put(&bo->base.base);
+  }
+}
+
+/**
+ * pi_residency_use - tracks an object used by a submission
+ * @gpu: the device
+ * @bo: object, mapped by the job with pi_bo_vmap()
+ *
+ * Marks the object as recently used, and for promotion if it's been used in
+ * two different frames. It's queued for the worker once the job is done with
+ * it, see pi_bo_vunmap().
+ */
+void pi_residency_use(struct pi_gpu *gpu, struct pi_bo *bo) {
+  struct pi_residency *res = &gpu->residency;
+
+  if (!bo->poolable || !gpu->vram_heap.size)
+    return;
+
+  mutex_lock(&res->lock);
+  if (!bo->res.frames_used || bo->res.last_frame != res->frame) {
+    bo->res.last_frame = res->frame;
+    bo->res.frames_used = min(bo->res.frames_used + 1, 2u);
+  }
+
+  if (bo->res.resident)
+    list_move_tail(&bo->res.link, &res->resident);
+  // Large frames would evict everything else
+  else if (bo->res.frames_used >= 2 &&
+           bo->base.base.size <= gpu->vram_heap.size / 4)
+    bo->res.promote = true;
+  mutex_unlock(&res->lock);
+}
+
+// Hands an object marked for promotion to the worker, the caller holds a
+// reference to it
+void pi_residency_queue(struct pi_gpu *gpu, struct pi_bo *bo) {
+  struct pi_residency *res = &gpu->residency;
+
+  mutex_lock(&res->lock);
+  if (bo->res.promote && !bo->res.resident && list_empty(&bo->res.link)) {
+    drm_gem_object_get(&bo->base.base);
+    list_add_tail(&bo->res.link, &res->pending);
+    schedule_work(&res->work);
+  }
+  mutex_unlock(&res->lock);
+}
+
+// Gives the range of vram of an object being freed back
+void pi_residency_release(struct pi_gpu *gpu, struct pi_bo *bo) {
+  struct pi_residency *res = &gpu->residency;
+
+  mutex_lock(&res->lock);
+  if (bo->res.resident) {
+    list_del_init(&bo->res.link);
+    bo->res.resident = false;
+    res->stats.resident_objects--;
+    res->stats.resident_bytes -= bo->base.base.size;
+  }
+  mutex_unlock(&res->lock);
+
+  if (drm_mm_node_allocated(&bo->vram_node)) {
+    mutex_lock(&gpu->vram_heap.lock);
+    drm_mm_remove_node(&bo->vram_node);
+    mutex_unlock(&gpu->vram_heap.lock);
+  }
+}
+
+/*
+ * Forgets the history of an object recycled by the pool, so its new owner
+ * starts from a cold object in system memory, like with a new one.
+ */
+void pi_residency_reset(struct pi_gpu *gpu, struct pi_bo *bo) {
+  struct pi_residency *res = &gpu->residency;
+
+  // Resident objects aren't pooled, but don't trust the old state either
+  pi_residency_release(gpu, bo);
+
+  mutex_lock(&res->lock);
+  list_del_init(&bo->res.link);
+  bo->res.last_frame = 0;
+  bo->res.frames_used = 0;
+  bo->res.promote = false;
+  bo->res.evicted = false;
+  bo->res.evicted_frame = 0;
+  mutex_unlock(&res->lock);
+
+  // Nobody else knows about the object yet
+  bo->res.pin_count = 0;
+}
+
+// Called at every display update
+void pi_residency_end_frame(struct pi_gpu *gpu) {
+  struct pi_residency *res = &gpu->residency;
+
+  mutex_lock(&res->lock);
+  res->stats.last_frame_bytes = res->frame_bytes;
+  res->stats.max_frame_bytes = max(res->stats.max_frame_bytes, res->frame_bytes);
+  res->frame_bytes = 0;
+  res->frame++;
+  mutex_unlock(&res->lock);
+}
+
+void pi_residency_init(struct pi_gpu *gpu) {
+  struct pi_residency *res = &gpu->residency;
+
+  mutex_init(&res->lock);
+  INIT_LIST_HEAD(&res->resident);
+  INIT_LIST_HEAD(&res->pending);
+  INIT_WORK(&res->work, pi_residency_work);
+}
+
+// Drops the pending promotions. Runs when the drm device is released, before
+// the vram heap goes, as the promotions hold references to their objects.
+void pi_residency_fini(struct pi_gpu *gpu) {
+  struct pi_residency *res = &gpu->residency;
+  struct pi_bo *bo, *tmp;
+  LIST_HEAD(pending);
+
+  // pi_residency_init() never got called
+  if (!res->work.func)
+    return;
+
+  cancel_work_sync(&res->work);
+
+  mutex_lock(&res->lock);
+  list_splice_init(&res->pending, &pending);
+  mutex_unlock(&res->lock);
+
+  list_for_each_entry_safe(bo, tmp, &pending, res.link) {
+    list_del_init(&bo->res.link);
+    drm_gem_object_put(&bo->base.base);
+  }
+}
+
+// A working set that doesn't fit in vram shows up as a high thrash rate
+static int pi_residency_show(struct seq_file *m, void *unused) {
+  struct drm_debugfs_entry *entry = m->private;
+  struct pi_gpu *gpu = to_gpu(entry->dev);
+  struct pi_residency *res = &gpu->residency;
+  struct pi_residency_stats stats;
+  u32 frame;
+  u64 frames;
+
+  mutex_lock(&res->lock);
+  stats = res->stats;
+  frame = res->frame;
+  mutex_unlock(&res->lock);
+  frames = max_t(u64, frame, 1);
+
+  seq_printf(m, "frames: %u\n", frame);
+  seq_printf(m, "resident: %llu objects, %llu KB of %llu KB\n",
+             stats.resident_objects, stats.resident_bytes >> 10,
+             gpu->vram_heap.size >> 10);
+  seq_printf(m, "promotions: %llu (%llu KB), evictions: %llu (%llu KB)\n",
+             stats.promotions, stats.promoted_bytes >> 10, stats.evictions,
+             stats.evicted_bytes >> 10);
+  seq_printf(m, "migrated per frame: %llu KB average, %llu KB last, %llu KB max\n",
+             div64_u64((stats.promoted_bytes + stats.evicted_bytes) >> 10,
+                       frames),
+             stats.last_frame_bytes >> 10, stats.max_frame_bytes >> 10);
+  seq_printf(m, "thrash rate: %llu%% (%llu promotions less than %d frames after "
+             "an eviction)\n",
+             div64_u64(stats.thrashes * 100, max_t(u64, stats.promotions, 1)),
+             stats.thrashes, PI_RES_THRASH_FRAMES);
+  return 0;
+}
+
+static const struct drm_debugfs_info pi_residency_debugfs_list[] = {
+    {"residency", pi_residency_show, 0},
+};
+
+void pi_residency_debugfs_init(struct pi_gpu *gpu) {
+  drm_debugfs_add_files(&gpu->drm_device, pi_residency_debugfs_list,
+                        ARRAY_SIZE(pi_residency_debugfs_list));
+}
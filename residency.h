@@ -0,0 +1,87 @@
+#ifndef RESIDENCY_H
+#define RESIDENCY_H
+
+#include "asm-generic/int-ll64.h"
+#include "linux/list.h"
+#include "linux/mutex.h"
+#include "linux/types.h"
+#include "linux/workqueue.h"
+
+struct drm_mm_node;
+struct pi_bo;
+struct pi_gpu;
+
+// Promoting an object evicted less than this many frames ago is thrashing
+#define PI_RES_THRASH_FRAMES 8
+
+/*
+ * Residency state of a buffer object in system memory. All of it is protected
+ * by residency.lock, except pin_count which is protected by the reservation
+ * lock of the object.
+ */
+struct pi_bo_residency {
+  // On residency.resident while the object is in vram, or on residency.pending
+  // while it's waiting for the worker to promote it
+  struct list_head link;
+
+  bool resident; // on residency.resident
+
+  u32 last_frame;  // last frame a submission used the object in
+  u32 frames_used; // number of frames it was used in, saturates at 2
+  bool promote;    // should go to vram once no job uses it anymore
+
+  bool evicted; // evicted_frame is valid
+  u32 evicted_frame;
+
+  // Kernel mappings and pins from outside the driver (display, dma-buf), the
+  // object can't move while there are any
+  u32 pin_count;
+};
+
+struct pi_residency_stats {
+  u64 resident_objects;
+  u64 resident_bytes;
+  u64 promotions;
+  u64 promoted_bytes;
+  u64 evictions;
+  u64 evicted_bytes;
+  u64 thrashes;
+  u64 last_frame_bytes;
+  u64 max_frame_bytes;
+};
+
+struct pi_residency {
+  struct mutex lock;
+  struct list_head resident; // least recently used first
+  struct list_head pending;  // referenced, promoted by the worker
+  struct work_struct work;
+
+  u32 frame;
+  u64 frame_bytes; // moved during the current frame
+  struct pi_residency_stats stats;
+};
+
+void pi_residency_init(struct pi_gpu *gpu);
+
+void pi_residency_fini(struct pi_gpu *gpu);
+
+void pi_residency_use(struct pi_gpu *gpu, struct pi_bo *bo);
+
+void pi_residency_queue(struct pi_gpu *gpu, struct pi_bo *bo);
+
+void pi_residency_end_frame(struct pi_gpu *gpu);
+
+bool pi_bo_resident(struct pi_bo *bo);
+
+int pi_residency_alloc_vram(struct pi_gpu *gpu, struct drm_mm_node *node,
+                            size_t size, bool keep_frame);
+
+int pi_residency_evict(struct pi_gpu *gpu, struct pi_bo *bo);
+
+void pi_residency_release(struct pi_gpu *gpu, struct pi_bo *bo);
+
+void pi_residency_reset(struct pi_gpu *gpu, struct pi_bo *bo);
+
+void pi_residency_debugfs_init(struct pi_gpu *gpu);
+
+#endif
@@ -0,0 +1,395 @@
+/*
+ * Description:
+ * Command ring shared between the driver and the emulated GPU.
+ *
+ * Submitting a job only copies its buffer registers into the next ring entry
+ * and rings the doorbell. The GPU front-end (a work item on an ordered
+ * workqueue, since there's no actual hardware) then executes the entries in
+ * order, so the exec ioctl returns before anything is rendered. Every job gets
+ * a dma_fence, signaled once the GPU completed it.
+ *
+ * A job whose dependencies haven't signaled yet stalls the ring, but not the
+ * workqueue: the front-end returns and a fence callback queues it again.
+ */
+#include "asm-generic/errno-base.h"
+#include "linux/compiler.h"
+#include "linux/dma-fence.h"
+#include "linux/err.h"
+#include "linux/jiffies.h"
+#include "linux/list.h"
+#include "linux/minmax.h"
+#include "linux/sched.h"
+#include "linux/slab.h"
+#include "linux/string.h"
+#include "linux/wait.h"
+#include "linux/workqueue.h"
+
+#include "driver.h"
+#include "execbuffer.h"
+#include "executor.h"
+#include "ring.h"
+#include "vm.h"
+
+// A dependency that doesn't signal would stall the whole ring, so give up on it
+// after a while
+#define PI_RING_DEP_TIMEOUT (10 * HZ)
+
+static inline u32 *pi_ring_reg(struct pi_gpu *gpu, u32 offset) {
+  return gpu->vram + offset;
+}
+
+static inline u32 *pi_ring_entry(struct pi_gpu *gpu, u32 index) {
+  return gpu->vram + RING_ENTRIES_OFFSET +
+         (index & (RING_SIZE - 1)) * RING_ENTRY_WORDS;
+}
+
+/*
+ * The GPU only has room for the low 32 bits of the sequence numbers. The last
+ * one it completed is at most RING_SIZE jobs behind the last one submitted, so
+ * the high bits are the ones of next_seqno, minus a wrap around.
+ */
+static u64 pi_ring_completed_seqno(struct pi_gpu *gpu) {
+  u32 completed = READ_ONCE(*pi_ring_reg(gpu, RING_COMPLETED_OFFSET));
+  u64 next;
+
+  // A job is submitted before the GPU can complete it
+  smp_rmb();
+  next = READ_ONCE(gpu->ring.next_seqno);
+  return next - (u32)((u32)next - completed);
+}
+
+static inline bool pi_ring_completed(struct pi_gpu *gpu, u64 seqno) {
+  return seqno <= pi_ring_completed_seqno(gpu);
+}
+
+static inline u32 pi_ring_space(struct pi_gpu *gpu) {
+  u32 head = READ_ONCE(*pi_ring_reg(gpu, RING_HEAD_OFFSET));
+  u32 tail = READ_ONCE(*pi_ring_reg(gpu, RING_TAIL_OFFSET));
+
+  return RING_SIZE - (tail - head);
+}
+
+static const char *pi_fence_get_driver_name(struct dma_fence *fence) {
+  return "pi_gpu";
+}
+
+static const char *pi_fence_get_timeline_name(struct dma_fence *fence) {
+  return "pi_gpu-ring";
+}
+
+// Fences are signaled by pi_ring_retire(), so the default wait is enough
+static const struct dma_fence_ops pi_fence_ops = {
+    .use_64bit_seqno = true,
+    .get_driver_name = pi_fence_get_driver_name,
+    .get_timeline_name = pi_fence_get_timeline_name,
+};
+
+/*
+ * Emulates the completion interrupt: signals the fence of every job the GPU is
+ * done with and releases them.
+ *
+ * Called before the head moves past the completed entries, so their status can
+ * still be read from the ring.
+ */
+static void pi_ring_retire(struct pi_gpu *gpu) {
+  struct pi_ring *ring = &gpu->ring;
+  u64 completed = pi_ring_completed_seqno(gpu);
+  struct pi_job *job, *tmp;
+  LIST_HEAD(done);
+
+  spin_lock(&ring->job_lock);
+  list_for_each_entry_safe(job, tmp, &ring->pending, link) {
+    if (job->seqno > completed)
+      break;
+    list_move_tail(&job->link, &done);
+  }
+  spin_unlock(&ring->job_lock);
+
+  // Unmapping the buffers can sleep, so it's done outside of the lock
+  list_for_each_entry_safe(job, tmp, &done, link) {
+    s32 status = pi_ring_entry(gpu, job->slot)[RING_ENTRY_STATUS_OFFSET];
+
+    if (status)
+      dma_fence_set_error(job->fence, status);
+    dma_fence_signal(job->fence);
+
+    list_del(&job->link);
+    pi_job_free(job);
+  }
+
+  wake_up_all(&ring->done_wq);
+}
+
+static void pi_ring_kick(struct pi_ring *ring) {
+  mod_delayed_work(ring->wq, &ring->front_end, 0);
+}
+
+static void pi_ring_dep_signaled(struct dma_fence *fence,
+                                 struct dma_fence_cb *cb) {
+  pi_ring_kick(container_of(cb, struct pi_ring, dep_cb));
+}
+
+static bool pi_ring_idle(struct pi_ring *ring) {
+  bool idle;
+
+  spin_lock(&ring->job_lock);
+  idle = list_empty(&ring->pending);
+  spin_unlock(&ring->job_lock);
+  return idle;
+}
+
+/*
+ * Emulates a semaphore wait at the start of an entry: the GPU doesn't execute a
+ * job before all of its dependencies signaled. Instead of sleeping on them, a
+ * callback is added to the first one still pending, and the front-end is also
+ * queued again for when the job times out.
+ *
+ * Returns:
+ * 0 if the job can be executed, -EAGAIN if it has to wait, or the error it has
+ * to be completed with.
+ */
+static int pi_ring_wait_deps(struct pi_gpu *gpu, u32 seqno) {
+  struct pi_ring *ring = &gpu->ring;
+  struct pi_job *job;
+  u32 i;
+
+  // Jobs are executed in order, so the one at the head is the oldest pending
+  // one. It can't go away since only the front-end retires jobs.
+  spin_lock(&ring->job_lock);
+  job = list_first_entry_or_null(&ring->pending, struct pi_job, link);
+  spin_unlock(&ring->job_lock);
+
+  if (WARN_ON_ONCE(!job || (u32)job->seqno != seqno))
+    return -EINVAL;
+
+  // Woken up by the callback or the timeout, either way it gets added again
+  if (ring->dep) {
+    dma_fence_remove_callback(ring->dep, &ring->dep_cb);
+    dma_fence_put(ring->dep);
+    ring->dep = NULL;
+  }
+
+  for (i = 0; i < job->num_deps; i++) {
+    if (dma_fence_is_signaled(job->deps[i]))
+      continue;
+
+    if (!ring->dep_waiting) {
+      ring->dep_waiting = true;
+      ring->dep_deadline = jiffies + PI_RING_DEP_TIMEOUT;
+    } else if (time_after_eq(jiffies, ring->dep_deadline)) {
+      ring->dep_waiting = false;
+      return -ETIME;
+    }
+
+    // -ENOENT if it signaled in the meantime
+    if (dma_fence_add_callback(job->deps[i], &ring->dep_cb,
+                               pi_ring_dep_signaled))
+      continue;
+
+    ring->dep = dma_fence_get(job->deps[i]);
+    queue_delayed_work(ring->wq, &ring->front_end,
+                       max_t(long, ring->dep_deadline - jiffies, 0));
+    return -EAGAIN;
+  }
+  ring->dep_waiting = false;
+
+  // Don't render on top of results that never got produced
+  for (i = 0; i < job->num_deps; i++) {
+    if (job->deps[i]->error)
+      return -ECANCELED;
+  }
+  return 0;
+}
+
+static void pi_ring_front_end(struct work_struct *work) {
+  struct pi_gpu *gpu =
+      container_of(to_delayed_work(work), struct pi_gpu, ring.front_end);
+  u32 head = READ_ONCE(*pi_ring_reg(gpu, RING_HEAD_OFFSET));
+
+  while (head != READ_ONCE(*pi_ring_reg(gpu, RING_TAIL_OFFSET))) {
+    u32 *entry = pi_ring_entry(gpu, head);
+    int ret;
+
+    // Pairs with the barrier in pi_ring_submit(), the entry is written before
+    // the tail moves
+    smp_rmb();
+
+    ret = pi_ring_wait_deps(gpu, entry[RING_ENTRY_SEQNO_OFFSET]);
+    if (ret == -EAGAIN)
+      return;
+    if (!ret)
+      ret = execute_bfr(gpu, entry);
+    if (ret)
+      gpu->exec_stats.errors++;
+
+    entry[RING_ENTRY_STATUS_OFFSET] = ret;
+    WRITE_ONCE(*pi_ring_reg(gpu, RING_COMPLETED_OFFSET),
+               entry[RING_ENTRY_SEQNO_OFFSET]);
+
+    pi_ring_retire(gpu);
+
+    // The slot can only be reused once we're done with it
+    smp_mb();
+    WRITE_ONCE(*pi_ring_reg(gpu, RING_HEAD_OFFSET), ++head);
+    wake_up_all(&gpu->ring.space_wq);
+  }
+}
+
+int pi_ring_init(struct pi_gpu *gpu) {
+  struct pi_ring *ring = &gpu->ring;
+
+  mutex_init(&ring->submit_lock);
+  spin_lock_init(&ring->job_lock);
+  INIT_LIST_HEAD(&ring->pending);
+  init_waitqueue_head(&ring->space_wq);
+  init_waitqueue_head(&ring->done_wq);
+  spin_lock_init(&ring->fence_lock);
+  ring->fence_context = dma_fence_context_alloc(1);
+  INIT_DELAYED_WORK(&ring->front_end, pi_ring_front_end);
+  ring->next_seqno = 0;
+
+  memset(pi_ring_reg(gpu, RING_HEAD_OFFSET), 0,
+         (RING_ENTRIES_OFFSET - RING_HEAD_OFFSET +
+          RING_SIZE * RING_ENTRY_WORDS) *
+             sizeof(u32));
+
+  // Ordered, since the GPU executes the ring in order
+  ring->wq = alloc_ordered_workqueue("pi_gpu_ring", 0);
+  if (!ring->wq)
+    return -ENOMEM;
+
+  return 0;
+}
+
+// Waits for the GPU to go idle and stops the front-end
+void pi_ring_fini(struct pi_gpu *gpu) {
+  struct pi_ring *ring = &gpu->ring;
+
+  if (!ring->wq)
+    return;
+
+  // Jobs waiting on dependencies only time out through the delayed work
+  wait_event(ring->done_wq, pi_ring_idle(ring));
+  cancel_delayed_work_sync(&ring->front_end);
+  destroy_workqueue(ring->wq);
+  ring->wq = NULL;
+}
+
+/**
+ * pi_ring_submit - appends jobs to the ring and kicks the GPU
+ * @gpu: device to submit to
+ * @jobs: jobs with their buffer registers filled in. On success, the ring owns
+ * the jobs and frees them once the GPU completed them.
+ * @fences: filled with a new reference to the fence of every job
+ * @count: number of jobs, at most RING_SIZE
+ *
+ * The jobs are written back-to-back and the doorbell is only rung once. Only
+ * waits if the ring doesn't have room for all of them.
+ *
+ * Returns:
+ * 0 on success, -ERESTARTSYS if interrupted while waiting for space. Either
+ * all the jobs are queued or none of them is.
+ */
+int pi_ring_submit(struct pi_gpu *gpu, struct pi_job **jobs,
+                   struct dma_fence **fences, u32 count) {
+  struct pi_ring *ring = &gpu->ring;
+  u32 tail;
+  u32 i;
+  int ret;
+
+  if (WARN_ON(count > RING_SIZE))
+    return -EINVAL;
+
+  for (i = 0; i < count; i++) {
+    fences[i] = kzalloc(sizeof(*fences[i]), GFP_KERNEL);
+    if (!fences[i]) {
+      ret = -ENOMEM;
+      goto free_fences;
+    }
+  }
+
+  ret = mutex_lock_interruptible(&ring->submit_lock);
+  if (ret)
+    goto free_fences;
+
+  ret = wait_event_interruptible(ring->space_wq, pi_ring_space(gpu) >= count);
+  if (ret)
+    goto unlock;
+
+  tail = READ_ONCE(*pi_ring_reg(gpu, RING_TAIL_OFFSET));
+
+  for (i = 0; i < count; i++) {
+    struct pi_job *job = jobs[i];
+
+    job->seqno = ring->next_seqno + 1;
+    WRITE_ONCE(ring->next_seqno, job->seqno);
+    // Only the low 32 bits, see pi_ring_completed_seqno()
+    job->regs[RING_ENTRY_SEQNO_OFFSET] = (u32)job->seqno;
+
+    // One reference for the job, one for the caller
+    dma_fence_init(fences[i], &pi_fence_ops, &ring->fence_lock,
+                   ring->fence_context, job->seqno);
+    job->fence = fences[i];
+    dma_fence_get(fences[i]);
+
+    // Before the GPU can see the job, so unbinding never misses it
+    if (job->vm)
+      pi_vm_set_last_fence(job->vm, fences[i]);
+
+    job->slot = tail + i;
+    memcpy(pi_ring_entry(gpu, job->slot), job->regs, sizeof(job->regs));
+  }
+
+  spin_lock(&ring->job_lock);
+  for (i = 0; i < count; i++)
+    list_add_tail(&jobs[i]->link, &ring->pending);
+  spin_unlock(&ring->job_lock);
+
+  // The entries have to be visible before the GPU sees the new tail
+  smp_wmb();
+  WRITE_ONCE(*pi_ring_reg(gpu, RING_TAIL_OFFSET), tail + count);
+
+  // Ring the doorbell. There's no hardware listening to it, so the front-end
+  // is kicked right away.
+  WRITE_ONCE(*pi_ring_reg(gpu, RING_DOORBELL_OFFSET), tail + count);
+  pi_ring_kick(ring);
+
+  mutex_unlock(&ring->submit_lock);
+  return 0;
+
+unlock:
+  mutex_unlock(&ring->submit_lock);
+free_fences:
+  for (i = 0; i < count; i++) {
+    kfree(fences[i]);
+    fences[i] = NULL;
+  }
+  return ret;
+}
+
+/**
+ * pi_ring_wait - waits for the job with the given sequence number
+ * @gpu: device the job was submitted to
+ * @seqno: sequence number returned by the exec ioctl
+ * @timeout: in jiffies, 0 only checks if the job is done
+ *
+ * Returns:
+ * 0 once the job completed, -ETIME on timeout, -ERESTARTSYS if interrupted,
+ * and -EINVAL if the job was never submitted.
+ */
+int pi_ring_wait(struct pi_gpu *gpu, u64 seqno, unsigned long timeout) {
+  struct pi_ring *ring = &gpu->ring;
+  long ret;
+
+  if (seqno > READ_ONCE(ring->next_seqno))
+    return -EINVAL;
+
+  ret = wait_event_interruptible_timeout(ring->done_wq,
+                                         pi_ring_completed(gpu, seqno),
+                                         timeout);
+  if (ret < 0)
+    return ret;
+  if (ret == 0 && !pi_ring_completed(gpu, seqno))
+    return -ETIME;
+  return 0;
+}
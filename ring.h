@@ -0,0 +1,79 @@
+#ifndef RING_H
+#define RING_H
+
+#include "asm-generic/int-ll64.h"
+#include "linux/dma-fence.h"
+#include "linux/list.h"
+#include "linux/mutex.h"
+#include "linux/spinlock.h"
+#include "linux/wait.h"
+#include "linux/workqueue.h"
+
+/*
+ * Command ring
+ *
+ * The ring lives in vram, right after the registers. All the offsets are in
+ * 32-bit words from the start of vram (just like INS_BUFFER_OFFSET and
+ * friends).
+ *
+ * The head and tail are free running counters, the slot of an entry is the
+ * counter modulo RING_SIZE. The driver appends entries at the tail and rings
+ * the doorbell, the GPU front-end consumes them from the head and writes the
+ * sequence number of the last entry it finished into RING_COMPLETED_OFFSET.
+ */
+#define RING_HEAD_OFFSET 0x2000      // written by the GPU
+#define RING_TAIL_OFFSET 0x2001      // written by the driver
+#define RING_DOORBELL_OFFSET 0x2002  // written by the driver to kick the GPU
+#define RING_COMPLETED_OFFSET 0x2003 // written by the GPU
+#define RING_ENTRIES_OFFSET 0x2010
+
+#define RING_SIZE 64 // must be a power of 2
+#define RING_ENTRY_WORDS 16
+
+// Slot of an entry (see execbuffer.h for the offsets of the buffer registers)
+#define RING_ENTRY_SEQNO_OFFSET 0x08
+#define RING_ENTRY_STATUS_OFFSET 0x09 // 0 or -errno, written by the GPU
+
+struct pi_gpu;
+struct pi_job;
+
+struct pi_ring {
+  // Serializes the writers of the tail
+  struct mutex submit_lock;
+
+  // Protects pending, jobs are added at submission and removed once the GPU
+  // completed them
+  spinlock_t job_lock;
+  struct list_head pending;
+  u64 next_seqno; // never wraps around
+
+  // Woken up every time the GPU frees slots
+  wait_queue_head_t space_wq;
+  // Woken up every time the GPU completes jobs
+  wait_queue_head_t done_wq;
+
+  u64 fence_context;
+  spinlock_t fence_lock;
+
+  // Emulated GPU front-end, consuming the ring
+  struct workqueue_struct *wq;
+  struct delayed_work front_end;
+
+  // Dependency the job at the head waits for, the front-end gets kicked again
+  // once it signals or the deadline passes. Only touched by the front-end.
+  struct dma_fence *dep;
+  struct dma_fence_cb dep_cb;
+  unsigned long dep_deadline; // in jiffies
+  bool dep_waiting;
+};
+
+int pi_ring_init(struct pi_gpu *gpu);
+
+void pi_ring_fini(struct pi_gpu *gpu);
+
+int pi_ring_submit(struct pi_gpu *gpu, struct pi_job **jobs,
+                   struct dma_fence **fences, u32 count);
+
+int pi_ring_wait(struct pi_gpu *gpu, u64 seqno, unsigned long timeout);
+
+#endif
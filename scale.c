@@ -0,0 +1,252 @@
+/*
+ * Description:
+ * Scaling of the primary and overlay planes.
+ *
+ * A plane whose source rectangle isn't the size of its destination one is
+ * scaled while it's composed (see pi_layer_row()), with a separable bilinear
+ * filter: each row it shows is interpolated between two rows of the
+ * framebuffer, then horizontally. Where each destination pixel samples the
+ * source, and with which weights, only depends on the two rectangles, so the
+ * tables (struct pi_scaler) are computed once when they change, typically with
+ * the mode, and not per frame. Both passes are SIMD kernels (scale_neon.c and
+ * scale_x86.c), the scalar ones being the reference.
+ *
+ * A client can then render at 720p and have it shown at 1080p, for less than
+ * half the fill rate of rendering at 1080p.
+ */
+#include "asm-generic/errno-base.h"
+#include "asm-generic/int-ll64.h"
+#include "asm/simd.h"
+#include "drm/drm_debugfs.h"
+#include "drm/drm_rect.h"
+#include "linux/ktime.h"
+#include "linux/math64.h"
+#include "linux/minmax.h"
+#include "linux/random.h"
+#include "linux/seq_file.h"
+#include "linux/string.h"
+#include "linux/vmalloc.h"
+
+#ifdef CONFIG_ARM64
+#include "asm/cpufeature.h"
+#endif
+
+#include "driver.h"
+#include "scale.h"
+#include "simd.h"
+
+static inline u32 pi_lerp(u32 a, u32 b, u32 frac) {
+  u32 out = 0;
+
+  for (int c = 0; c < 32; c += 8)
+    out |= ((((a >> c) & 0xff) * (PI_SCALE_ONE - frac) +
+             ((b >> c) & 0xff) * frac + PI_SCALE_ONE / 2) /
+            PI_SCALE_ONE)
+           << c;
+  return out;
+}
+
+void pi_vlerp_scalar(u32 *dst, const u32 *a, const u32 *b, unsigned int pixels,
+                     u8 frac) {
+  for (unsigned int i = 0; i < pixels; i++)
+    dst[i] = pi_lerp(a[i], b[i], frac);
+}
+
+void pi_hlerp_scalar(u32 *dst, const u32 *src, const u16 *index,
+                     const u8 *frac, unsigned int pixels, unsigned int base) {
+  for (unsigned int i = 0; i < pixels; i++) {
+    const u32 *p = src + index[i] - base;
+
+    dst[i] = pi_lerp(p[0], p[1], frac[i]);
+  }
+}
+
+static bool pi_scale_always_usable(void) { return true; }
+
+#ifdef CONFIG_ARM64
+static bool pi_scale_neon_usable(void) {
+  return cpu_have_named_feature(ASIMD);
+}
+#endif
+
+const struct pi_scale_impl pi_scale_impls[] = {
+    {"scalar", pi_vlerp_scalar, pi_hlerp_scalar, false,
+     pi_scale_always_usable},
+#ifdef CONFIG_ARM64
+    {"neon", pi_vlerp_neon, pi_hlerp_neon, true, pi_scale_neon_usable},
+#endif
+#ifdef CONFIG_X86_64
+    // Every x86-64 CPU has SSE2
+    {"sse2", pi_vlerp_sse2, pi_hlerp_sse2, true, pi_scale_always_usable},
+#endif
+};
+
+const unsigned int pi_num_scale_impls = ARRAY_SIZE(pi_scale_impls);
+
+void pi_scale_init(struct pi_gpu *gpu) {
+  for (int i = pi_num_scale_impls - 1; i >= 0; i--) {
+    if (pi_scale_impls[i].usable()) {
+      gpu->scale = &pi_scale_impls[i];
+      return;
+    }
+  }
+}
+
+/*
+ * The center of destination pixel i is at src1 + (i + 1/2) * src / dst in the
+ * source, which is between the centers of two of its pixels. The positions
+ * are counted from the center of the first pixel the source touches, and
+ * clamped to the pixels it touches, which are at least 2.
+ */
+static void pi_scale_axis_init(struct pi_scale_axis *axis, int src1, int src2,
+                               unsigned int dst) {
+  unsigned int count = ((src2 + 0xffff) >> 16) - (src1 >> 16);
+  u64 src = src2 - src1;
+
+  for (unsigned int i = 0; i < dst; i++) {
+    s64 pos = (s64)div_u64((2 * i + 1) * src, 2 * dst) + (src1 & 0xffff) -
+              0x8000;
+    unsigned int index, frac;
+
+    pos = max_t(s64, pos, 0);
+    index = pos >> 16;
+    frac = ((pos & 0xffff) * PI_SCALE_ONE + 0x8000) >> 16;
+    if (index >= count - 1) {
+      index = count - 2;
+      frac = PI_SCALE_ONE;
+    }
+
+    axis->index[i] = index;
+    axis->frac[i] = frac;
+  }
+}
+
+/**
+ * pi_scaler_update - gets the filter of a plane ready
+ * @scaler: the filter of the plane
+ * @src: source rectangle, in 16.16 fixed point, at least 2x2 pixels
+ * @dst: destination rectangle, at most %PI_COMPOSE_MAX_WIDTH pixels wide and
+ * high
+ *
+ * Nothing is computed if the rectangles didn't change since the last call.
+ */
+void pi_scaler_update(struct pi_scaler *scaler, const struct drm_rect *src,
+                      const struct drm_rect *dst) {
+  if (drm_rect_equals(&scaler->src, src) && drm_rect_equals(&scaler->dst, dst))
+    return;
+
+  pi_scale_axis_init(&scaler->x, src->x1, src->x2, drm_rect_width(dst));
+  pi_scale_axis_init(&scaler->y, src->y1, src->y2, drm_rect_height(dst));
+  scaler->src = *src;
+  scaler->dst = *dst;
+}
+
+#define PI_SCALE_ITERATIONS 8
+
+static const struct {
+  const char *name;
+  unsigned int src_width, src_height;
+  unsigned int dst_width, dst_height;
+} pi_scale_benches[] = {
+    {"720p-1080p", 1280, 720, 1920, 1080},
+    {"1080p-540p", 1920, 1080, 960, 540},
+};
+
+// Same as the composition, the SIMD registers are claimed a row at a time
+static void pi_scale_frame(const struct pi_scale_impl *impl,
+                           const struct pi_scaler *scaler, u32 *dst,
+                           const u32 *src, u32 *tmp) {
+  unsigned int src_width = drm_rect_width(&scaler->src) >> 16;
+  unsigned int width = drm_rect_width(&scaler->dst);
+
+  for (int y = 0; y < drm_rect_height(&scaler->dst); y++) {
+    const struct pi_scale_impl *used = impl;
+    const u32 *row = src + scaler->y.index[y] * src_width;
+
+    if (impl->simd) {
+      if (may_use_simd())
+        pi_simd_begin();
+      else
+        used = &pi_scale_impls[0];
+    }
+
+    if (scaler->y.frac[y]) {
+      used->vlerp(tmp, row, row + src_width, src_width, scaler->y.frac[y]);
+      row = tmp;
+    }
+    used->hlerp(dst, row, scaler->x.index, scaler->x.frac, width, 0);
+
+    if (used->simd)
+      pi_simd_end();
+    dst += width;
+  }
+}
+
+static int pi_scale_show(struct seq_file *m, void *unused) {
+  const size_t pixels = 1920 * 1080;
+  struct pi_scaler *scaler;
+  u32 *src, *dst, *ref, *tmp;
+  u64 start, elapsed;
+  int ret = 0;
+
+  scaler = vzalloc(sizeof(*scaler));
+  src = vmalloc(pixels * 4);
+  dst = vmalloc(pixels * 4);
+  ref = vmalloc(pixels * 4);
+  tmp = vmalloc(PI_COMPOSE_MAX_WIDTH * 4);
+  if (!scaler || !src || !dst || !ref || !tmp) {
+    ret = -ENOMEM;
+    goto out;
+  }
+  get_random_bytes(src, pixels * 4);
+
+  for (unsigned int b = 0; b < ARRAY_SIZE(pi_scale_benches); b++) {
+    struct drm_rect s = DRM_RECT_INIT(0, 0, pi_scale_benches[b].src_width << 16,
+                                      pi_scale_benches[b].src_height << 16);
+    struct drm_rect d = DRM_RECT_INIT(0, 0, pi_scale_benches[b].dst_width,
+                                      pi_scale_benches[b].dst_height);
+    u64 out_pixels = (u64)drm_rect_width(&d) * drm_rect_height(&d);
+
+    pi_scaler_update(scaler, &s, &d);
+    for (unsigned int i = 0; i < pi_num_scale_impls; i++) {
+      const struct pi_scale_impl *impl = &pi_scale_impls[i];
+      u32 *out = i ? dst : ref;
+      const char *check;
+
+      if (!impl->usable())
+        continue;
+
+      start = ktime_get_ns();
+      for (int n = 0; n < PI_SCALE_ITERATIONS; n++)
+        pi_scale_frame(impl, scaler, out, src, tmp);
+      elapsed = max_t(u64, ktime_get_ns() - start, 1);
+
+      // The scalar kernels come first and are the reference
+      check = "";
+      if (i)
+        check = memcmp(out, ref, out_pixels * 4) ? ", MISMATCH" : ", exact";
+
+      seq_printf(m, "%-10s %-6s: %llu Mpixels/s%s\n", pi_scale_benches[b].name,
+                 impl->name,
+                 div64_u64(out_pixels * PI_SCALE_ITERATIONS * 1000, elapsed),
+                 check);
+    }
+  }
+
+out:
+  vfree(tmp);
+  vfree(ref);
+  vfree(dst);
+  vfree(src);
+  vfree(scaler);
+  return ret;
+}
+
+static const struct drm_debugfs_info pi_scale_debugfs_list[] = {
+    {"scale", pi_scale_show, 0},
+};
+
+void pi_scale_debugfs_init(struct pi_gpu *gpu) {
+  drm_debugfs_add_files(&gpu->drm_device, pi_scale_debugfs_list,
+                        ARRAY_SIZE(pi_scale_debugfs_list));
+}
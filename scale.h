@@ -0,0 +1,91 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_rect.h"
+#include "linux/types.h"
+
+#include "compose.h"
+
+struct pi_gpu;
+
+/*
+ * Planes are scaled with a separable bilinear filter: a pixel is interpolated
+ * between two rows of the framebuffer, then between two pixels of that row.
+ * The weight of the second one is a fixed point fraction from 0 to
+ * PI_SCALE_ONE, so the filter has 129 phases. Each byte is interpolated as
+ * (a * (128 - frac) + b * frac + 64) / 128, rounded down.
+ */
+#define PI_SCALE_ONE 128
+
+// Source size over destination size in 16.16 fixed point: up to 8 times
+// bigger, and up to 2 times smaller, beyond which the 2 taps would skip pixels
+#define PI_SCALE_MIN ((1 << 16) / 8)
+#define PI_SCALE_MAX (2 << 16)
+
+/*
+ * The two passes of the filter. hlerp interpolates dst[i] between
+ * src[index[i] - base] and the pixel after it.
+ *
+ * All the implementations must give exactly the same pixels as the scalar one.
+ */
+struct pi_scale_impl {
+  const char *name;
+  void (*vlerp)(u32 *dst, const u32 *a, const u32 *b, unsigned int pixels,
+                u8 frac);
+  void (*hlerp)(u32 *dst, const u32 *src, const u16 *index, const u8 *frac,
+                unsigned int pixels, unsigned int base);
+  bool simd; // needs the FPU/SIMD registers
+  bool (*usable)(void);
+};
+
+// From the slowest to the fastest one, the scalar one is always first
+extern const struct pi_scale_impl pi_scale_impls[];
+extern const unsigned int pi_num_scale_impls;
+
+void pi_vlerp_scalar(u32 *dst, const u32 *a, const u32 *b, unsigned int pixels,
+                     u8 frac);
+void pi_hlerp_scalar(u32 *dst, const u32 *src, const u16 *index,
+                     const u8 *frac, unsigned int pixels, unsigned int base);
+void pi_vlerp_neon(u32 *dst, const u32 *a, const u32 *b, unsigned int pixels,
+                   u8 frac);
+void pi_hlerp_neon(u32 *dst, const u32 *src, const u16 *index, const u8 *frac,
+                   unsigned int pixels, unsigned int base);
+void pi_vlerp_sse2(u32 *dst, const u32 *a, const u32 *b, unsigned int pixels,
+                   u8 frac);
+void pi_hlerp_sse2(u32 *dst, const u32 *src, const u16 *index, const u8 *frac,
+                   unsigned int pixels, unsigned int base);
+
+/*
+ * Where a scaled plane samples its source rectangle, for each pixel of its
+ * destination: the first of the two pixels, counted from the first pixel the
+ * source rectangle touches, and the weight of the second one.
+ */
+struct pi_scale_axis {
+  u16 index[PI_COMPOSE_MAX_WIDTH];
+  u8 frac[PI_COMPOSE_MAX_WIDTH];
+};
+
+// The filter of a plane, only recomputed when its rectangles change, so once
+// per mode or plane resize
+struct pi_scaler {
+  struct drm_rect src; // 16.16 fixed point
+  struct drm_rect dst;
+  struct pi_scale_axis x, y;
+};
+
+// Whether a plane shown from src to dst has to be scaled
+static inline bool pi_scale_needed(const struct drm_rect *src,
+                                   const struct drm_rect *dst) {
+  return drm_rect_width(src) != drm_rect_width(dst) << 16 ||
+         drm_rect_height(src) != drm_rect_height(dst) << 16;
+}
+
+void pi_scale_init(struct pi_gpu *gpu);
+
+void pi_scaler_update(struct pi_scaler *scaler, const struct drm_rect *src,
+                      const struct drm_rect *dst);
+
+void pi_scale_debugfs_init(struct pi_gpu *gpu);
+
+#endif
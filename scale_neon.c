@@ -0,0 +1,62 @@
+/*
+ * Description:
+ * NEON scaling kernels (see struct pi_scale_impl).
+ *
+ * Built with the FPU flags of the kernel, so they must only be called between
+ * kernel_neon_begin() and kernel_neon_end().
+ */
+#include "asm/neon-intrinsics.h"
+
+#include "scale.h"
+
+/*
+ * 4 pixels at a time, as 16 bytes, where wa and wb are the weights of a and b
+ * for each byte. The rounding narrowing shift is the + 64 and / 128.
+ */
+static inline uint8x16_t pi_lerp_n(uint8x16_t a, uint8x16_t b, uint8x16_t wa,
+                                   uint8x16_t wb) {
+  uint16x8_t lo = vmull_u8(vget_low_u8(a), vget_low_u8(wa));
+  uint16x8_t hi = vmull_u8(vget_high_u8(a), vget_high_u8(wa));
+
+  lo = vmlal_u8(lo, vget_low_u8(b), vget_low_u8(wb));
+  hi = vmlal_u8(hi, vget_high_u8(b), vget_high_u8(wb));
+  return vcombine_u8(vrshrn_n_u16(lo, 7), vrshrn_n_u16(hi, 7));
+}
+
+void pi_vlerp_neon(u32 *dst, const u32 *a, const u32 *b, unsigned int pixels,
+                   u8 frac) {
+  uint8x16_t wa = vdupq_n_u8(PI_SCALE_ONE - frac);
+  uint8x16_t wb = vdupq_n_u8(frac);
+  unsigned int i = 0;
+
+  for (; i + 4 <= pixels; i += 4)
+    vst1q_u8((u8 *)(dst + i), pi_lerp_n(vld1q_u8((const u8 *)(a + i)),
+                                        vld1q_u8((const u8 *)(b + i)), wa,
+                                        wb));
+
+  pi_vlerp_scalar(dst + i, a + i, b + i, pixels - i, frac);
+}
+
+// The pixels are gathered one by one, the interpolation is vectorized
+void pi_hlerp_neon(u32 *dst, const u32 *src, const u16 *index, const u8 *frac,
+                   unsigned int pixels, unsigned int base) {
+  uint8x16_t one = vdupq_n_u8(PI_SCALE_ONE);
+  unsigned int i = 0;
+
+  for (; i + 4 <= pixels; i += 4) {
+    const u32 *p0 = src + index[i] - base, *p1 = src + index[i + 1] - base;
+    const u32 *p2 = src + index[i + 2] - base, *p3 = src + index[i + 3] - base;
+    uint32x4_t a = {p0[0], p1[0], p2[0], p3[0]};
+    uint32x4_t b = {p0[1], p1[1], p2[1], p3[1]};
+    // Each weight in the 4 bytes of its pixel
+    uint32x4_t w = {frac[i] * 0x01010101U, frac[i + 1] * 0x01010101U,
+                    frac[i + 2] * 0x01010101U, frac[i + 3] * 0x01010101U};
+    uint8x16_t wb = vreinterpretq_u8_u32(w);
+
+    vst1q_u8((u8 *)(dst + i),
+             pi_lerp_n(vreinterpretq_u8_u32(a), vreinterpretq_u8_u32(b),
+                       vsubq_u8(one, wb), wb));
+  }
+
+  pi_hlerp_scalar(dst + i, src, index + i, frac + i, pixels - i, base);
+}
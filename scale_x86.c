@@ -0,0 +1,75 @@
+/*
+ * Description:
+ * SSE2 scaling kernels (see struct pi_scale_impl).
+ *
+ * Written with the vector extensions of the compiler, like raster_x86.c. The
+ * file is built with the FPU flags of the kernel (SSE2), so the kernels must
+ * only be called between kernel_fpu_begin() and kernel_fpu_end().
+ */
+#include "scale.h"
+
+typedef u32 pi_v4su __attribute__((vector_size(16)));
+typedef s16 pi_v8hi __attribute__((vector_size(16)));
+typedef u16 pi_v8hu __attribute__((vector_size(16)));
+typedef char pi_v16qi __attribute__((vector_size(16)));
+
+/*
+ * 4 pixels at a time, widened to 16 bit lanes, 2 pixels per vector, where
+ * wa and wb are the weights of a and b for each lane.
+ */
+static inline __attribute__((always_inline)) pi_v16qi
+pi_lerp_v(pi_v16qi a, pi_v16qi b, pi_v8hu wa_lo, pi_v8hu wb_lo, pi_v8hu wa_hi,
+          pi_v8hu wb_hi) {
+  const pi_v16qi zero = {0};
+  pi_v8hu lo = (pi_v8hu)__builtin_ia32_punpcklbw128(a, zero) * wa_lo +
+               (pi_v8hu)__builtin_ia32_punpcklbw128(b, zero) * wb_lo;
+  pi_v8hu hi = (pi_v8hu)__builtin_ia32_punpckhbw128(a, zero) * wa_hi +
+               (pi_v8hu)__builtin_ia32_punpckhbw128(b, zero) * wb_hi;
+
+  return __builtin_ia32_packuswb128((pi_v8hi)((lo + 64) >> 7),
+                                    (pi_v8hi)((hi + 64) >> 7));
+}
+
+void pi_vlerp_sse2(u32 *dst, const u32 *a, const u32 *b, unsigned int pixels,
+                   u8 frac) {
+  const u16 weight = frac;
+  pi_v8hu wb = {0};
+  pi_v8hu wa;
+  unsigned int i = 0;
+
+  wb += weight;
+  wa = PI_SCALE_ONE - wb;
+  for (; i + 4 <= pixels; i += 4) {
+    pi_v16qi va, vb;
+
+    __builtin_memcpy(&va, a + i, sizeof(va));
+    __builtin_memcpy(&vb, b + i, sizeof(vb));
+    va = pi_lerp_v(va, vb, wa, wb, wa, wb);
+    __builtin_memcpy(dst + i, &va, sizeof(va));
+  }
+
+  pi_vlerp_scalar(dst + i, a + i, b + i, pixels - i, frac);
+}
+
+// The pixels are gathered one by one, the interpolation is vectorized
+void pi_hlerp_sse2(u32 *dst, const u32 *src, const u16 *index, const u8 *frac,
+                   unsigned int pixels, unsigned int base) {
+  unsigned int i = 0;
+
+  for (; i + 4 <= pixels; i += 4) {
+    const u32 *p0 = src + index[i] - base, *p1 = src + index[i + 1] - base;
+    const u32 *p2 = src + index[i + 2] - base, *p3 = src + index[i + 3] - base;
+    pi_v4su a = {p0[0], p1[0], p2[0], p3[0]};
+    pi_v4su b = {p0[1], p1[1], p2[1], p3[1]};
+    u16 f0 = frac[i], f1 = frac[i + 1], f2 = frac[i + 2], f3 = frac[i + 3];
+    pi_v8hu wb_lo = {f0, f0, f0, f0, f1, f1, f1, f1};
+    pi_v8hu wb_hi = {f2, f2, f2, f2, f3, f3, f3, f3};
+    pi_v16qi out;
+
+    out = pi_lerp_v((pi_v16qi)a, (pi_v16qi)b, PI_SCALE_ONE - wb_lo, wb_lo,
+                    PI_SCALE_ONE - wb_hi, wb_hi);
+    __builtin_memcpy(dst + i, &out, sizeof(out));
+  }
+
+  pi_hlerp_scalar(dst + i, src, index + i, frac + i, pixels - i, base);
+}
@@ -0,0 +1,36 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "asm/simd.h"
+
+#ifdef CONFIG_ARM64
+#include "asm/neon.h"
+#endif
+
+#ifdef CONFIG_X86_64
+#include "asm/fpu/api.h"
+#endif
+
+/*
+ * The kernel doesn't save the SIMD registers of the tasks it interrupts, so
+ * they have to be claimed before running a SIMD kernel (rasterization,
+ * composition, conversion or scaling), and only where may_use_simd(). Claiming
+ * them disables preemption, so they're held a tile or a row at a time.
+ */
+static inline void pi_simd_begin(void) {
+#if defined(CONFIG_ARM64)
+  kernel_neon_begin();
+#elif defined(CONFIG_X86_64)
+  kernel_fpu_begin();
+#endif
+}
+
+static inline void pi_simd_end(void) {
+#if defined(CONFIG_ARM64)
+  kernel_neon_end();
+#elif defined(CONFIG_X86_64)
+  kernel_fpu_end();
+#endif
+}
+
+#endif
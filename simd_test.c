@@ -0,0 +1,312 @@
+/*
+ * Description:
+ * KUnit tests of the SIMD kernels.
+ *
+ * The debugfs benchmarks only compare the SIMD kernels with the scalar ones on
+ * whole frames. These go after the inputs the vector code treats differently,
+ * like the masks of edges landing exactly on a pixel, and every usable SIMD
+ * kernel has to match the scalar one exactly.
+ *
+ * Rows are run at every width up to a few vectors, starting at every alignment
+ * of the source and destination, so the scalar tails and the unaligned loads
+ * and stores are all covered. Nothing past the end of a row may be written.
+ *
+ * They're built into the module when the kernel has KUnit, and run when it's
+ * loaded.
+ */
+#include "kunit/test.h"
+#include "linux/prandom.h"
+#include "linux/string.h"
+
+#include "compose.h"
+#include "convert.h"
+#include "raster.h"
+#include "scale.h"
+#include "simd.h"
+
+// Random but reproducible, so a failure can be run again
+#define PI_TEST_SEED 0x50494750
+
+#define PI_TEST_BLOCKS 4096
+
+// Rows of up to 4 times the 16 pixels the widest loops take, plus a tail,
+// starting up to 3 pixels (or bytes) past an aligned address
+#define PI_TEST_MAX_WIDTH 67
+#define PI_TEST_MAX_OFFSET 3
+// A power of 2, so kmalloc() aligns the buffers to it
+#define PI_TEST_BUF_SIZE 512
+static_assert((PI_TEST_MAX_WIDTH + PI_TEST_MAX_OFFSET + 1) * 4 <=
+              PI_TEST_BUF_SIZE);
+
+static s32 pi_test_range(struct rnd_state *rnd, s32 max) {
+  return (s32)(prandom_u32_state(rnd) % (2 * (u32)max + 1)) - max;
+}
+
+// Edge i of a block, with one pixel of it exactly on the edge or next to it
+static void pi_test_edge(struct rnd_state *rnd, s32 *w, s32 *dx, s32 *dy) {
+  u32 kind = prandom_u32_state(rnd) % 4;
+  s32 x = prandom_u32_state(rnd) % PI_BLOCK_SIZE;
+  s32 y = prandom_u32_state(rnd) % PI_BLOCK_SIZE;
+
+  // Small enough for the whole block to fit in 32 bits
+  *dx = kind == 3 ? 0 : pi_test_range(rnd, 1 << 16);
+  *dy = kind == 3 ? 0 : pi_test_range(rnd, 1 << 16);
+  *w = pi_test_range(rnd, 1 << 24);
+  if (kind == 1)
+    *w = -(x * *dx + y * *dy);
+  else if (kind == 2)
+    *w = -(x * *dx + y * *dy) - 1;
+}
+
+static void pi_test_block_masks(struct kunit *test) {
+  struct rnd_state rnd;
+  unsigned int tested = 0;
+
+  prandom_seed_state(&rnd, PI_TEST_SEED);
+
+  for (unsigned int n = 0; n < PI_TEST_BLOCKS; n++) {
+    s32 w[3], dx[3], dy[3];
+    u8 ref[PI_BLOCK_SIZE];
+
+    for (int i = 0; i < 3; i++)
+      pi_test_edge(&rnd, &w[i], &dx[i], &dy[i]);
+    pi_block_masks_scalar(w, dx, dy, ref);
+
+    for (unsigned int i = 1; i < pi_num_block_impls; i++) {
+      const struct pi_block_impl *block = &pi_block_impls[i];
+      u8 masks[PI_BLOCK_SIZE];
+
+      if (!block->usable())
+        continue;
+
+      pi_simd_begin();
+      block->masks(w, dx, dy, masks);
+      pi_simd_end();
+      tested++;
+
+      KUNIT_EXPECT_MEMEQ_MSG(test, masks, ref, sizeof(ref),
+                             "%s: w %d %d %d, dx %d %d %d, dy %d %d %d",
+                             block->name, w[0], w[1], w[2], dx[0], dx[1],
+                             dx[2], dy[0], dy[1], dy[2]);
+    }
+  }
+
+  if (!tested)
+    kunit_skip(test, "no usable SIMD coverage kernel");
+}
+
+static void *pi_test_buf(struct kunit *test) {
+  void *buf = kunit_kmalloc(test, PI_TEST_BUF_SIZE, GFP_KERNEL);
+
+  KUNIT_ASSERT_NOT_NULL(test, buf);
+  return buf;
+}
+
+// Random destination, the same for both kernels, so stray writes show up
+static void pi_test_fill_dst(struct rnd_state *rnd, void *dst, void *ref) {
+  prandom_bytes_state(rnd, ref, PI_TEST_BUF_SIZE);
+  memcpy(dst, ref, PI_TEST_BUF_SIZE);
+}
+
+static void pi_test_convert(struct kunit *test) {
+  u32 *src = pi_test_buf(test);
+  u8 *dst = pi_test_buf(test);
+  u8 *ref = pi_test_buf(test);
+  struct rnd_state rnd;
+  unsigned int tested = 0;
+
+  prandom_seed_state(&rnd, PI_TEST_SEED);
+
+  for (unsigned int i = 1; i < pi_num_convert_impls; i++) {
+    const struct pi_convert_impl *impl = &pi_convert_impls[i];
+
+    if (!impl->usable())
+      continue;
+    tested++;
+
+    for (unsigned int width = 0; width <= PI_TEST_MAX_WIDTH; width++) {
+      for (unsigned int s = 0; s <= PI_TEST_MAX_OFFSET; s++) {
+        for (unsigned int d = 0; d <= PI_TEST_MAX_OFFSET; d++) {
+          u8 thresholds[4];
+
+          prandom_bytes_state(&rnd, src, PI_TEST_BUF_SIZE);
+          for (int t = 0; t < 4; t++)
+            thresholds[t] = prandom_u32_state(&rnd) % 16;
+
+          for (int dithered = 0; dithered < 2; dithered++) {
+            const u8 *dither = dithered ? thresholds : NULL;
+
+            pi_test_fill_dst(&rnd, dst, ref);
+            pi_xrgb8888_to_rgb565_scalar((u16 *)ref + d, src + s, width,
+                                         dither);
+            pi_simd_begin();
+            impl->to_rgb565((u16 *)dst + d, src + s, width, dither);
+            pi_simd_end();
+            KUNIT_EXPECT_MEMEQ_MSG(test, dst, ref, PI_TEST_BUF_SIZE,
+                                   "%s rgb565: %u pixels, src +%u, dst +%u%s",
+                                   impl->name, width, s, d,
+                                   dither ? ", dithered" : "");
+          }
+
+          pi_test_fill_dst(&rnd, dst, ref);
+          pi_xrgb8888_to_rgb888_scalar(ref + d, src + s, width);
+          pi_simd_begin();
+          impl->to_rgb888(dst + d, src + s, width);
+          pi_simd_end();
+          KUNIT_EXPECT_MEMEQ_MSG(test, dst, ref, PI_TEST_BUF_SIZE,
+                                 "%s rgb888: %u pixels, src +%u, dst +%u",
+                                 impl->name, width, s, d);
+        }
+      }
+    }
+  }
+
+  if (!tested)
+    kunit_skip(test, "no usable SIMD conversion kernel");
+}
+
+// The shortcuts of the kernels for opaque and transparent pixels, and the
+// rounding of the others
+static const u8 pi_test_alphas[] = {0, 1, 127, 128, 254, 255};
+
+static void pi_test_blend(struct kunit *test) {
+  u32 *src = pi_test_buf(test);
+  u32 *dst = pi_test_buf(test);
+  u32 *ref = pi_test_buf(test);
+  struct rnd_state rnd;
+  unsigned int tested = 0;
+
+  prandom_seed_state(&rnd, PI_TEST_SEED);
+
+  for (unsigned int i = 1; i < pi_num_blend_impls; i++) {
+    const struct pi_blend_impl *impl = &pi_blend_impls[i];
+
+    if (!impl->usable())
+      continue;
+    tested++;
+
+    for (unsigned int width = 0; width <= PI_TEST_MAX_WIDTH; width++) {
+      for (unsigned int s = 0; s <= PI_TEST_MAX_OFFSET; s++) {
+        for (unsigned int d = 0; d <= PI_TEST_MAX_OFFSET; d++) {
+          // Opaque, transparent and translucent pixels, mixed
+          prandom_bytes_state(&rnd, src, PI_TEST_BUF_SIZE);
+          for (unsigned int p = 0; p < width + s; p++) {
+            u32 kind = prandom_u32_state(&rnd) % 3;
+
+            if (kind == 0)
+              src[p] |= 0xff000000;
+            else if (kind == 1)
+              src[p] &= 0x00ffffff;
+          }
+
+          for (unsigned int a = 0; a < ARRAY_SIZE(pi_test_alphas); a++) {
+            u8 alpha = pi_test_alphas[a];
+
+            pi_test_fill_dst(&rnd, dst, ref);
+            pi_blend_premulti_scalar(ref + d, src + s, width, alpha);
+            pi_simd_begin();
+            impl->premulti(dst + d, src + s, width, alpha);
+            pi_simd_end();
+            KUNIT_EXPECT_MEMEQ_MSG(
+                test, dst, ref, PI_TEST_BUF_SIZE,
+                "%s premulti: %u pixels, src +%u, dst +%u, alpha %u",
+                impl->name, width, s, d, alpha);
+
+            pi_test_fill_dst(&rnd, dst, ref);
+            pi_blend_coverage_scalar(ref + d, src + s, width, alpha);
+            pi_simd_begin();
+            impl->coverage(dst + d, src + s, width, alpha);
+            pi_simd_end();
+            KUNIT_EXPECT_MEMEQ_MSG(
+                test, dst, ref, PI_TEST_BUF_SIZE,
+                "%s coverage: %u pixels, src +%u, dst +%u, alpha %u",
+                impl->name, width, s, d, alpha);
+          }
+        }
+      }
+    }
+  }
+
+  if (!tested)
+    kunit_skip(test, "no usable SIMD blending kernel");
+}
+
+// Both ends of the filter, and the phases around its middle
+static const u8 pi_test_fracs[] = {0, 1, 63, 64, 65, 127, PI_SCALE_ONE};
+
+static void pi_test_scale(struct kunit *test) {
+  u32 *a = pi_test_buf(test);
+  u32 *b = pi_test_buf(test);
+  u32 *dst = pi_test_buf(test);
+  u32 *ref = pi_test_buf(test);
+  u16 index[PI_TEST_MAX_WIDTH];
+  u8 frac[PI_TEST_MAX_WIDTH];
+  struct rnd_state rnd;
+  unsigned int tested = 0;
+
+  prandom_seed_state(&rnd, PI_TEST_SEED);
+
+  for (unsigned int i = 1; i < pi_num_scale_impls; i++) {
+    const struct pi_scale_impl *impl = &pi_scale_impls[i];
+
+    if (!impl->usable())
+      continue;
+    tested++;
+
+    for (unsigned int width = 0; width <= PI_TEST_MAX_WIDTH; width++) {
+      for (unsigned int s = 0; s <= PI_TEST_MAX_OFFSET; s++) {
+        for (unsigned int d = 0; d <= PI_TEST_MAX_OFFSET; d++) {
+          unsigned int base = prandom_u32_state(&rnd) % 1024;
+
+          prandom_bytes_state(&rnd, a, PI_TEST_BUF_SIZE);
+          prandom_bytes_state(&rnd, b, PI_TEST_BUF_SIZE);
+
+          for (unsigned int f = 0; f < ARRAY_SIZE(pi_test_fracs); f++) {
+            pi_test_fill_dst(&rnd, dst, ref);
+            pi_vlerp_scalar(ref + d, a + s, b + s, width, pi_test_fracs[f]);
+            pi_simd_begin();
+            impl->vlerp(dst + d, a + s, b + s, width, pi_test_fracs[f]);
+            pi_simd_end();
+            KUNIT_EXPECT_MEMEQ_MSG(
+                test, dst, ref, PI_TEST_BUF_SIZE,
+                "%s vlerp: %u pixels, src +%u, dst +%u, frac %u", impl->name,
+                width, s, d, pi_test_fracs[f]);
+          }
+
+          // Any of the width + 1 pixel pairs of the row, in any order
+          for (unsigned int p = 0; p < width; p++) {
+            index[p] = base + prandom_u32_state(&rnd) % (width + 1);
+            frac[p] = prandom_u32_state(&rnd) % (PI_SCALE_ONE + 1);
+          }
+
+          pi_test_fill_dst(&rnd, dst, ref);
+          pi_hlerp_scalar(ref + d, a + s, index, frac, width, base);
+          pi_simd_begin();
+          impl->hlerp(dst + d, a + s, index, frac, width, base);
+          pi_simd_end();
+          KUNIT_EXPECT_MEMEQ_MSG(test, dst, ref, PI_TEST_BUF_SIZE,
+                                 "%s hlerp: %u pixels, src +%u, dst +%u",
+                                 impl->name, width, s, d);
+        }
+      }
+    }
+  }
+
+  if (!tested)
+    kunit_skip(test, "no usable SIMD scaling kernel");
+}
+
+static struct kunit_case pi_simd_test_cases[] = {
+    KUNIT_CASE(pi_test_block_masks),
+    KUNIT_CASE(pi_test_convert),
+    KUNIT_CASE(pi_test_blend),
+    KUNIT_CASE(pi_test_scale),
+    {},
+};
+
+static struct kunit_suite pi_simd_test_suite = {
+    .name = "pi_gpu_simd",
+    .test_cases = pi_simd_test_cases,
+};
+
+kunit_test_suite(pi_simd_test_suite);
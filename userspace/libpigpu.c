@@ -0,0 +1,337 @@
+/*
+ * Description:
+ * Implementation of libpigpu, see libpigpu.h. Only the slow paths live here,
+ * recording a command is inline in the header.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <xf86drm.h>
+
+#include "libpigpu.h"
+
+// Dumb buffers are created as 4 bytes per pixel, 1024 pixels wide images
+#define PIGPU_BO_PITCH 4096
+
+int pigpu_bo_create(int fd, uint64_t size, struct pigpu_bo **out) {
+  struct drm_mode_create_dumb create;
+  struct drm_mode_map_dumb mapping;
+  struct drm_mode_destroy_dumb destroy;
+  struct pigpu_bo *bo;
+
+  if (!size)
+    return -EINVAL;
+
+  bo = calloc(1, sizeof(*bo));
+  if (!bo)
+    return -ENOMEM;
+
+  memset(&create, 0, sizeof(create));
+  create.width = PIGPU_BO_PITCH / 4;
+  create.height = (size + PIGPU_BO_PITCH - 1) / PIGPU_BO_PITCH;
+  create.bpp = 32;
+  if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create))
+    goto free;
+
+  memset(&mapping, 0, sizeof(mapping));
+  mapping.handle = create.handle;
+  if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &mapping))
+    goto destroy;
+
+  bo->map = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                 mapping.offset);
+  if (bo->map == MAP_FAILED)
+    goto destroy;
+
+  bo->fd = fd;
+  bo->handle = create.handle;
+  bo->size = create.size;
+  bo->refs = 1;
+  *out = bo;
+  return 0;
+
+destroy:
+  memset(&destroy, 0, sizeof(destroy));
+  destroy.handle = create.handle;
+  drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+free:
+  free(bo);
+  return -errno;
+}
+
+struct pigpu_bo *pigpu_bo_ref(struct pigpu_bo *bo) {
+  bo->refs++;
+  return bo;
+}
+
+void pigpu_bo_unref(struct pigpu_bo *bo) {
+  struct drm_mode_destroy_dumb destroy;
+
+  if (!bo || --bo->refs)
+    return;
+
+  munmap(bo->map, bo->size);
+  memset(&destroy, 0, sizeof(destroy));
+  destroy.handle = bo->handle;
+  drmIoctl(bo->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+  free(bo);
+}
+
+// timeout_ns < 0 waits forever
+int pigpu_wait(int fd, uint64_t seqno, int64_t timeout_ns) {
+  struct pi_wait wait;
+
+  memset(&wait, 0, sizeof(wait));
+  wait.seqno = seqno;
+  wait.timeout_ns = timeout_ns < 0 ? INT64_MAX : timeout_ns;
+  return drmIoctl(fd, DRM_IOCTL_PI_WAIT_IOCTL, &wait) ? -errno : 0;
+}
+
+// Waits for the jobs of a slot and drops the objects they referenced
+static int pigpu_slot_idle(struct pigpu_cmdbuf *cb, struct pigpu_slot *slot) {
+  int ret = 0;
+
+  if (slot->seqno)
+    ret = pigpu_wait(cb->fd, slot->seqno, -1);
+  if (ret)
+    return ret;
+
+  for (uint32_t i = 0; i < slot->num_refs; i++)
+    pigpu_bo_unref(slot->refs[i]);
+  slot->num_refs = 0;
+  slot->seqno = 0;
+  return 0;
+}
+
+static void pigpu_use_slot(struct pigpu_cmdbuf *cb, uint32_t index) {
+  uint32_t *map = cb->slots[index].bo->map;
+
+  cb->slot = index;
+  cb->start = map;
+  cb->cur = map;
+  cb->end = map + cb->slots[index].bo->size / sizeof(uint32_t);
+}
+
+int pigpu_cmdbuf_create(int fd, uint64_t bo_size, struct pigpu_cmdbuf **out) {
+  struct pigpu_cmdbuf *cb;
+  int ret;
+
+  cb = calloc(1, sizeof(*cb));
+  if (!cb)
+    return -ENOMEM;
+
+  cb->fd = fd;
+  for (uint32_t i = 0; i < PIGPU_CMDBUF_SLOTS; i++) {
+    ret = pigpu_bo_create(fd, bo_size, &cb->slots[i].bo);
+    if (ret) {
+      pigpu_cmdbuf_destroy(cb);
+      return ret;
+    }
+  }
+
+  pigpu_use_slot(cb, 0);
+  *out = cb;
+  return 0;
+}
+
+void pigpu_cmdbuf_destroy(struct pigpu_cmdbuf *cb) {
+  if (!cb)
+    return;
+
+  for (uint32_t i = 0; i < PIGPU_CMDBUF_SLOTS; i++) {
+    struct pigpu_slot *slot = &cb->slots[i];
+
+    // Still drops the references if waiting failed, there's nothing else to
+    // do at this point
+    if (slot->seqno)
+      pigpu_wait(cb->fd, slot->seqno, -1);
+    slot->seqno = 0;
+    pigpu_slot_idle(cb, slot);
+    pigpu_bo_unref(slot->bo);
+  }
+  pigpu_bo_unref(cb->target);
+  free(cb);
+}
+
+/**
+ * pigpu_cmdbuf_flush - submits the commands recorded since the last flush
+ * @cb: command buffer
+ * @seqno: if not NULL, set to the sequence number of the job (0 if there was
+ * nothing to submit), to be passed to pigpu_wait()
+ *
+ * The commands are submitted in place, from the instruction buffer they were
+ * recorded into.
+ */
+int pigpu_cmdbuf_flush(struct pigpu_cmdbuf *cb, uint64_t *seqno) {
+  struct pigpu_slot *slot = &cb->slots[cb->slot];
+  struct pi_exec_buffer_obj objs[2];
+  struct pi_exec_buffer args;
+  int ret = cb->error;
+
+  if (seqno)
+    *seqno = 0;
+
+  cb->error = 0;
+  if (ret || cb->cur == cb->start)
+    goto out;
+
+  // Jobs only start in a slot that can still reference their target, see
+  // pigpu_emit_slow()
+
+  memset(objs, 0, sizeof(objs));
+  objs[0].handle = slot->bo->handle;
+  objs[0].flag = INS_OBJ;
+  objs[1].handle = cb->target->handle;
+  objs[1].flag = FRM_OBJ;
+
+  memset(&args, 0, sizeof(args));
+  args.buffers = (uintptr_t)objs;
+  args.num_buffers = 2;
+  args.instr_start_offset = (cb->start - (uint32_t *)slot->bo->map) * 4;
+  args.instr_len = (cb->cur - cb->start) * 4;
+
+  if (drmIoctl(cb->fd, DRM_IOCTL_EXC_BUFFER_IOCTL, &args)) {
+    ret = -errno;
+    goto out;
+  }
+
+  slot->seqno = args.seqno;
+  slot->refs[slot->num_refs++] = pigpu_bo_ref(cb->target);
+  if (seqno)
+    *seqno = args.seqno;
+
+out:
+  // Whatever happened, the next job starts after these commands
+  cb->start = cb->cur;
+  return ret;
+}
+
+// Flushes and waits for every job of the command buffer
+int pigpu_cmdbuf_finish(struct pigpu_cmdbuf *cb) {
+  int ret = pigpu_cmdbuf_flush(cb, NULL);
+
+  for (uint32_t i = 0; i < PIGPU_CMDBUF_SLOTS; i++) {
+    int err = pigpu_slot_idle(cb, &cb->slots[i]);
+
+    if (!ret)
+      ret = err;
+  }
+  return ret;
+}
+
+/*
+ * Drops the commands recorded since the last flush, so that their storage is
+ * recorded over again. Nothing is freed or unmapped, and the render target has
+ * to be set again.
+ */
+void pigpu_cmdbuf_reset(struct pigpu_cmdbuf *cb) {
+  cb->cur = cb->start;
+  cb->error = 0;
+  pigpu_bo_unref(cb->target);
+  cb->target = NULL;
+}
+
+/*
+ * Commands recorded from now on render into bo. A job can only have one frame
+ * buffer object, so switching to another object flushes the commands recorded
+ * so far.
+ */
+int pigpu_set_target(struct pigpu_cmdbuf *cb, struct pigpu_bo *bo,
+                     uint32_t width, uint32_t height, uint32_t pitch,
+                     uint32_t format) {
+  uint32_t *cmd;
+  int ret;
+
+  if (bo != cb->target && cb->cur != cb->start) {
+    ret = pigpu_cmdbuf_flush(cb, NULL);
+    if (ret)
+      return ret;
+  }
+
+  if (bo != cb->target) {
+    pigpu_bo_unref(cb->target);
+    cb->target = pigpu_bo_ref(bo);
+  }
+
+  cb->target_cmd[0] = PI_CMD_HDR(PI_OP_SET_TARGET, 4);
+  cb->target_cmd[1] = width | (height << 16);
+  cb->target_cmd[2] = pitch;
+  cb->target_cmd[3] = format;
+
+  // At the start of a job the target is only written along with the first
+  // drawing command, see pigpu_emit_slow()
+  if (cb->cur == cb->start)
+    return 0;
+
+  cmd = pigpu_emit(cb, 4);
+  if (!cmd)
+    return cb->error;
+  cb->recorded--; // not a command of the caller
+  memcpy(cmd, cb->target_cmd, sizeof(cb->target_cmd));
+  return 0;
+}
+
+// Moves on to the next instruction buffer of the ring
+static int pigpu_next_slot(struct pigpu_cmdbuf *cb) {
+  uint32_t next = (cb->slot + 1) % PIGPU_CMDBUF_SLOTS;
+  int ret;
+
+  ret = pigpu_cmdbuf_flush(cb, NULL);
+  if (ret)
+    return ret;
+
+  // Usually already idle, unless the GPU is a whole ring behind
+  ret = pigpu_slot_idle(cb, &cb->slots[next]);
+  if (ret)
+    return ret;
+
+  pigpu_use_slot(cb, next);
+  return 0;
+}
+
+/*
+ * Called by pigpu_emit() at the start of a job or when the instruction buffer
+ * is full. Every job starts by setting its render target.
+ */
+uint32_t *pigpu_emit_slow(struct pigpu_cmdbuf *cb, uint32_t words) {
+  uint32_t needed = words;
+  uint32_t *cmd;
+
+  if (cb->error)
+    return NULL;
+
+  if (!cb->target) {
+    cb->error = -EINVAL;
+    return NULL;
+  }
+
+  if (cb->cur == cb->start)
+    needed += 4;
+
+  // A full slot, or one that can't reference another frame buffer object
+  if ((uint32_t)(cb->end - cb->cur) < needed ||
+      (cb->cur == cb->start &&
+       cb->slots[cb->slot].num_refs == PIGPU_MAX_SLOT_REFS)) {
+    cb->error = pigpu_next_slot(cb);
+    if (cb->error)
+      return NULL;
+    needed = words + 4;
+  }
+
+  if ((uint32_t)(cb->end - cb->cur) < needed) {
+    cb->error = -E2BIG;
+    return NULL;
+  }
+
+  if (cb->cur == cb->start) {
+    memcpy(cb->cur, cb->target_cmd, sizeof(cb->target_cmd));
+    cb->cur += 4;
+  }
+
+  cmd = cb->cur;
+  cb->cur += words;
+  cb->recorded++;
+  return cmd;
+}
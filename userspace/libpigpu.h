@@ -0,0 +1,165 @@
+/*
+ * Description:
+ * Small userspace library to drive the GPU without going through raw ioctls.
+ *
+ * Commands are recorded straight into mapped instruction buffer objects, so
+ * recording is just a few stores per command: nothing is copied and nothing
+ * is allocated once the command buffer is created. A command buffer owns a
+ * ring of PIGPU_CMDBUF_SLOTS instruction buffers, filled one after the other.
+ * Every flush submits the commands recorded since the last one as a job, and
+ * the next commands are recorded right after them in the same buffer. Once a
+ * buffer is full, recording moves on to the next one in the ring, waiting for
+ * the GPU to be done with it first if needed.
+ *
+ * Usage:
+ *   pigpu_cmdbuf_create(fd, 64 * 1024, &cb);
+ *   pigpu_set_target(cb, frame, 1920, 1080, 1920 * 4, PIX_FMT_XRGB8888);
+ *   pigpu_clear(cb, 0x00000000);
+ *   pigpu_fill_rect(cb, 10, 10, 100, 100, 0x00FF0000);
+ *   pigpu_cmdbuf_flush(cb, &seqno);
+ *
+ * Functions returning an int return 0 or a negative errno. Nothing is thread
+ * safe, a command buffer is meant to be used by one thread at a time.
+ */
+#ifndef LIBPIGPU_H
+#define LIBPIGPU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pi_gpu_drm.h"
+
+#define PIGPU_CMDBUF_SLOTS 4
+
+// Frame buffer objects referenced by the jobs of one slot, at most
+#define PIGPU_MAX_SLOT_REFS 64
+
+#define PIGPU_UNLIKELY(x) __builtin_expect(!!(x), 0)
+
+// Dumb buffer object, mapped for as long as it exists
+struct pigpu_bo {
+  int fd;
+  uint32_t handle;
+  uint64_t size;
+  void *map;
+
+  // One for the owner and one per slot whose jobs use the object
+  uint32_t refs;
+};
+
+int pigpu_bo_create(int fd, uint64_t size, struct pigpu_bo **bo);
+
+struct pigpu_bo *pigpu_bo_ref(struct pigpu_bo *bo);
+
+void pigpu_bo_unref(struct pigpu_bo *bo);
+
+int pigpu_wait(int fd, uint64_t seqno, int64_t timeout_ns);
+
+struct pigpu_slot {
+  struct pigpu_bo *bo;
+  uint64_t seqno; // of the last job submitted from the slot, 0 if none
+
+  // Kept alive until the jobs of the slot are done
+  uint32_t num_refs;
+  struct pigpu_bo *refs[PIGPU_MAX_SLOT_REFS];
+};
+
+struct pigpu_cmdbuf {
+  int fd;
+  int error; // first error while recording, returned by the next flush
+
+  struct pigpu_slot slots[PIGPU_CMDBUF_SLOTS];
+  uint32_t slot; // slot being recorded into
+
+  // In the mapping of the current slot. Commands between start and cur are
+  // recorded but not submitted yet.
+  uint32_t *start;
+  uint32_t *cur;
+  uint32_t *end;
+
+  // Render target of the commands being recorded, set again at the start of
+  // every job since targets don't carry over from one job to the next
+  struct pigpu_bo *target;
+  uint32_t target_cmd[4];
+
+  uint64_t recorded; // commands recorded so far
+};
+
+int pigpu_cmdbuf_create(int fd, uint64_t bo_size, struct pigpu_cmdbuf **cb);
+
+void pigpu_cmdbuf_destroy(struct pigpu_cmdbuf *cb);
+
+int pigpu_cmdbuf_flush(struct pigpu_cmdbuf *cb, uint64_t *seqno);
+
+int pigpu_cmdbuf_finish(struct pigpu_cmdbuf *cb);
+
+void pigpu_cmdbuf_reset(struct pigpu_cmdbuf *cb);
+
+int pigpu_set_target(struct pigpu_cmdbuf *cb, struct pigpu_bo *bo,
+                     uint32_t width, uint32_t height, uint32_t pitch,
+                     uint32_t format);
+
+uint32_t *pigpu_emit_slow(struct pigpu_cmdbuf *cb, uint32_t words);
+
+/*
+ * Reserves room for a command of the given number of words in the current
+ * instruction buffer. Only calls into the library when a job starts (to set its
+ * render target) or when the buffer is full.
+ *
+ * Returns:
+ * Where to write the command, or NULL if it can't be recorded (cb->error).
+ */
+static inline uint32_t *pigpu_emit(struct pigpu_cmdbuf *cb, uint32_t words) {
+  uint32_t *cmd = cb->cur;
+
+  if (PIGPU_UNLIKELY(cmd == cb->start || (uint32_t)(cb->end - cmd) < words))
+    return pigpu_emit_slow(cb, words);
+
+  cb->cur = cmd + words;
+  cb->recorded++;
+  return cmd;
+}
+
+static inline int pigpu_clear(struct pigpu_cmdbuf *cb, uint32_t color) {
+  uint32_t *cmd = pigpu_emit(cb, 2);
+
+  if (!cmd)
+    return cb->error;
+
+  cmd[0] = PI_CMD_HDR(PI_OP_CLEAR, 2);
+  cmd[1] = color;
+  return 0;
+}
+
+static inline int pigpu_fill_rect(struct pigpu_cmdbuf *cb, int16_t x,
+                                  int16_t y, uint16_t width, uint16_t height,
+                                  uint32_t color) {
+  uint32_t *cmd = pigpu_emit(cb, 4);
+
+  if (!cmd)
+    return cb->error;
+
+  cmd[0] = PI_CMD_HDR(PI_OP_FILL_RECT, 4);
+  cmd[1] = PI_CMD_XY(x, y);
+  cmd[2] = PI_CMD_XY(width, height);
+  cmd[3] = color;
+  return 0;
+}
+
+static inline int pigpu_draw_tri(struct pigpu_cmdbuf *cb, int16_t x0,
+                                 int16_t y0, int16_t x1, int16_t y1,
+                                 int16_t x2, int16_t y2, uint32_t color) {
+  uint32_t *cmd = pigpu_emit(cb, 5);
+
+  if (!cmd)
+    return cb->error;
+
+  cmd[0] = PI_CMD_HDR(PI_OP_DRAW_TRI, 5);
+  cmd[1] = PI_CMD_XY(x0, y0);
+  cmd[2] = PI_CMD_XY(x1, y1);
+  cmd[3] = PI_CMD_XY(x2, y2);
+  cmd[4] = color;
+  return 0;
+}
+
+#endif
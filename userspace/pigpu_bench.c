@@ -0,0 +1,154 @@
+/*
+ * Description:
+ * Microbenchmark of libpigpu. Reports how many commands per second can be
+ * recorded, without submitting anything (recording then resetting the command
+ * buffer, like a client rebuilding its command lists every frame), and then
+ * with every batch of commands flushed to the GPU. Also reports how fast the
+ * sub-allocator is and how many GEM handles it needs for many small
+ * allocations.
+ *
+ * Usage: pigpu_bench [device], /dev/dri/renderD128 by default
+ */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libpigpu.h"
+#include "pigpu_heap.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define COMMANDS_PER_BATCH 1000
+#define RECORD_BATCHES 20000
+#define SUBMIT_BATCHES 200
+#define SMALL_ALLOCS 10000
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t bench_rand(uint32_t *seed) {
+  *seed = *seed * 1664525 + 1013904223;
+  return *seed >> 8;
+}
+
+// Half rectangles, half triangles, all small
+static int record_batch(struct pigpu_cmdbuf *cb, uint32_t *seed) {
+  int ret = 0;
+
+  for (int i = 0; i < COMMANDS_PER_BATCH && !ret; i += 2) {
+    int16_t x = bench_rand(seed) % WIDTH;
+    int16_t y = bench_rand(seed) % HEIGHT;
+    uint32_t color = bench_rand(seed);
+
+    ret = pigpu_fill_rect(cb, x, y, 16, 16, color);
+    if (!ret)
+      ret = pigpu_draw_tri(cb, x, y, x + 16, y, x, y + 16, color);
+  }
+  return ret;
+}
+
+// Vertex/constant sized allocations, from 16 bytes to 4KB
+static int bench_heap(int fd) {
+  static struct pigpu_alloc allocs[SMALL_ALLOCS];
+  struct pigpu_heap *heap;
+  uint64_t start, elapsed;
+  uint32_t seed = 2;
+  int ret;
+
+  ret = pigpu_heap_create(fd, 0, 0, 0, &heap);
+  if (ret)
+    return ret;
+
+  start = now_ns();
+  for (int i = 0; i < SMALL_ALLOCS && !ret; i++)
+    ret = pigpu_heap_alloc(heap, 16 << (bench_rand(&seed) % 9), &allocs[i]);
+  elapsed = now_ns() - start;
+
+  if (!ret)
+    printf("suballoc:      %llu allocs/s, %d allocations in %u GEM handles\n",
+           (unsigned long long)((uint64_t)SMALL_ALLOCS * 1000000000 / elapsed),
+           SMALL_ALLOCS, heap->num_handles);
+
+  for (int i = 0; i < SMALL_ALLOCS; i++)
+    pigpu_heap_free(heap, &allocs[i]);
+  pigpu_heap_destroy(heap);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "/dev/dri/renderD128";
+  struct pigpu_cmdbuf *cb;
+  struct pigpu_bo *frame;
+  uint64_t start, elapsed;
+  uint32_t seed = 1;
+  int fd, ret;
+
+  fd = open(path, O_RDWR);
+  if (fd < 0) {
+    perror("open");
+    return 1;
+  }
+
+  ret = pigpu_bo_create(fd, WIDTH * HEIGHT * 4, &frame);
+  if (!ret)
+    ret = pigpu_cmdbuf_create(fd, 64 * 1024, &cb);
+  if (ret) {
+    fprintf(stderr, "Creating the buffer objects failed: %d\n", ret);
+    return 1;
+  }
+
+  // Recording only, the same storage is recorded over and over
+  start = now_ns();
+  for (int n = 0; n < RECORD_BATCHES && !ret; n++) {
+    ret = pigpu_set_target(cb, frame, WIDTH, HEIGHT, WIDTH * 4,
+                           PIX_FMT_XRGB8888);
+    if (!ret)
+      ret = record_batch(cb, &seed);
+    pigpu_cmdbuf_reset(cb);
+  }
+  elapsed = now_ns() - start;
+  if (ret) {
+    fprintf(stderr, "Recording failed: %d\n", ret);
+    return 1;
+  }
+  printf("record only:   %llu commands/s\n",
+         (unsigned long long)((uint64_t)RECORD_BATCHES * COMMANDS_PER_BATCH *
+                              1000000000 / elapsed));
+
+  // Recording and submitting, until the GPU rendered everything
+  start = now_ns();
+  ret = pigpu_set_target(cb, frame, WIDTH, HEIGHT, WIDTH * 4,
+                         PIX_FMT_XRGB8888);
+  for (int n = 0; n < SUBMIT_BATCHES && !ret; n++) {
+    ret = record_batch(cb, &seed);
+    if (!ret)
+      ret = pigpu_cmdbuf_flush(cb, NULL);
+  }
+  if (!ret)
+    ret = pigpu_cmdbuf_finish(cb);
+  elapsed = now_ns() - start;
+  if (ret) {
+    fprintf(stderr, "Submitting failed: %d\n", ret);
+    return 1;
+  }
+  printf("record+submit: %llu commands/s\n",
+         (unsigned long long)((uint64_t)SUBMIT_BATCHES * COMMANDS_PER_BATCH *
+                              1000000000 / elapsed));
+
+  ret = bench_heap(fd);
+  if (ret) {
+    fprintf(stderr, "Sub-allocating failed: %d\n", ret);
+    return 1;
+  }
+
+  pigpu_cmdbuf_destroy(cb);
+  pigpu_bo_unref(frame);
+  close(fd);
+  return 0;
+}
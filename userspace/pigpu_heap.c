@@ -0,0 +1,400 @@
+/*
+ * Description:
+ * Implementation of the sub-allocator of libpigpu, see pigpu_heap.h.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xf86drm.h>
+
+#include "pigpu_heap.h"
+
+static uint64_t pigpu_align(uint64_t value, uint64_t align) {
+  return (value + align - 1) & ~(align - 1);
+}
+
+/*
+ * Binds a whole buffer object at the next free GPU address of the heap, aligned
+ * to align. Blocks are aligned to a slab so that objects are aligned to their
+ * size class on the GPU too.
+ */
+static int pigpu_heap_bind(struct pigpu_heap *heap, struct pigpu_bo *bo,
+                           uint64_t align, uint64_t *va) {
+  uint64_t start = pigpu_align(heap->va_next, align);
+  struct pi_vm_bind bind;
+
+  *va = 0;
+  if (!heap->va_next)
+    return 0;
+  if (bo->size % PIGPU_VA_ALIGN || start >= heap->va_end ||
+      bo->size > heap->va_end - start)
+    return -ENOSPC;
+
+  memset(&bind, 0, sizeof(bind));
+  bind.handle = bo->handle;
+  bind.va = start;
+  bind.size = bo->size;
+  if (drmIoctl(heap->fd, DRM_IOCTL_PI_VM_BIND_IOCTL, &bind))
+    return -errno;
+
+  // Addresses are never reused, the range of the heap is meant to be large
+  heap->va_next = start + bo->size;
+  *va = bind.va;
+  return 0;
+}
+
+static void pigpu_heap_unbind(struct pigpu_heap *heap, struct pigpu_bo *bo,
+                              uint64_t va) {
+  struct pi_vm_unbind unbind;
+
+  if (!va)
+    return;
+
+  memset(&unbind, 0, sizeof(unbind));
+  unbind.va = va;
+  unbind.size = bo->size;
+  drmIoctl(heap->fd, DRM_IOCTL_PI_VM_UNBIND_IOCTL, &unbind);
+}
+
+// A buffer object owned by the heap, bound if the heap is
+static int pigpu_heap_create_bo(struct pigpu_heap *heap, uint64_t size,
+                                uint64_t align, struct pigpu_bo **bo,
+                                uint64_t *va) {
+  int ret;
+
+  ret = pigpu_bo_create(heap->fd, size, bo);
+  if (ret)
+    return ret;
+
+  ret = pigpu_heap_bind(heap, *bo, align, va);
+  if (ret) {
+    pigpu_bo_unref(*bo);
+    return ret;
+  }
+
+  heap->num_handles++;
+  return 0;
+}
+
+static void pigpu_heap_destroy_bo(struct pigpu_heap *heap, struct pigpu_bo *bo,
+                                  uint64_t va) {
+  pigpu_heap_unbind(heap, bo, va);
+  pigpu_bo_unref(bo);
+  heap->num_handles--;
+}
+
+/**
+ * pigpu_heap_create - creates a sub-allocator
+ * @fd: device
+ * @ring_size: size of the ring for transient allocations, 0 for none
+ * @va_start: first GPU address the heap can bind its buffer objects at, 0 to
+ * not bind them
+ * @va_size: size of the GPU address range of the heap
+ * @out: filled with the heap
+ */
+int pigpu_heap_create(int fd, uint64_t ring_size, uint64_t va_start,
+                      uint64_t va_size, struct pigpu_heap **out) {
+  struct pigpu_heap *heap;
+  int ret;
+
+  if ((va_start | va_size) % PIGPU_VA_ALIGN)
+    return -EINVAL;
+
+  heap = calloc(1, sizeof(*heap));
+  if (!heap)
+    return -ENOMEM;
+
+  heap->fd = fd;
+  if (va_start) {
+    heap->va_next = va_start;
+    heap->va_end = va_start + va_size;
+  }
+
+  if (ring_size) {
+    ret = pigpu_heap_create_bo(heap, ring_size, PIGPU_VA_ALIGN, &heap->ring,
+                               &heap->ring_va);
+    if (ret) {
+      free(heap);
+      return ret;
+    }
+  }
+
+  *out = heap;
+  return 0;
+}
+
+// Dedicated allocations must have been freed already
+void pigpu_heap_destroy(struct pigpu_heap *heap) {
+  if (!heap)
+    return;
+
+  // The GPU may still be reading transient data
+  while (heap->num_frames) {
+    pigpu_wait(heap->fd, heap->frames[heap->first_frame].seqno, -1);
+    heap->first_frame = (heap->first_frame + 1) % PIGPU_MAX_FRAMES;
+    heap->num_frames--;
+  }
+
+  for (uint32_t i = 0; i < heap->num_blocks; i++) {
+    struct pigpu_block *block = &heap->blocks[i];
+
+    for (uint32_t s = 0; s < block->num_slabs; s++)
+      free(block->slabs[s]);
+    pigpu_heap_destroy_bo(heap, block->bo, block->va);
+  }
+
+  if (heap->ring)
+    pigpu_heap_destroy_bo(heap, heap->ring, heap->ring_va);
+  free(heap);
+}
+
+static void pigpu_slab_push(struct pigpu_slab **list, struct pigpu_slab *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+static void pigpu_slab_remove(struct pigpu_slab **list,
+                              struct pigpu_slab *slab) {
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  slab->prev = NULL;
+  slab->next = NULL;
+}
+
+// Reuses an empty slab of any class, or carves a new one out of a block
+static struct pigpu_slab *pigpu_heap_new_slab(struct pigpu_heap *heap,
+                                              uint32_t cls) {
+  struct pigpu_block *block;
+  struct pigpu_slab *slab = heap->empty;
+  int ret;
+
+  if (slab) {
+    pigpu_slab_remove(&heap->empty, slab);
+  } else {
+    block = heap->num_blocks ? &heap->blocks[heap->num_blocks - 1] : NULL;
+    if (!block || block->num_slabs == PIGPU_SLABS_PER_BLOCK) {
+      if (heap->num_blocks == PIGPU_HEAP_MAX_BLOCKS)
+        return NULL;
+
+      block = &heap->blocks[heap->num_blocks];
+      ret = pigpu_heap_create_bo(heap, PIGPU_HEAP_BLOCK_SIZE, PIGPU_SLAB_SIZE,
+                                 &block->bo, &block->va);
+      if (ret)
+        return NULL;
+      heap->num_blocks++;
+    }
+
+    slab = calloc(1, sizeof(*slab));
+    if (!slab)
+      return NULL;
+
+    slab->block = block;
+    slab->offset = block->num_slabs * PIGPU_SLAB_SIZE;
+    block->slabs[block->num_slabs++] = slab;
+  }
+
+  slab->cls = cls;
+  slab->num_objects = PIGPU_SLAB_SIZE >> (cls + PIGPU_MIN_CLASS_SHIFT);
+  slab->num_free = slab->num_objects;
+  memset(slab->free_mask, 0, sizeof(slab->free_mask));
+  for (uint32_t i = 0; i < slab->num_objects; i++)
+    slab->free_mask[i / 64] |= 1ULL << (i % 64);
+
+  pigpu_slab_push(&heap->partial[cls], slab);
+  return slab;
+}
+
+static int pigpu_heap_alloc_dedicated(struct pigpu_heap *heap, uint64_t size,
+                                      struct pigpu_alloc *alloc) {
+  struct pigpu_bo *bo;
+  uint64_t va;
+  int ret;
+
+  ret = pigpu_heap_create_bo(heap, size, PIGPU_VA_ALIGN, &bo, &va);
+  if (ret)
+    return ret;
+
+  memset(alloc, 0, sizeof(*alloc));
+  alloc->bo = bo;
+  alloc->size = bo->size;
+  alloc->va = va;
+  alloc->map = bo->map;
+  alloc->dedicated = 1;
+  return 0;
+}
+
+/*
+ * Allocates size bytes, aligned to their size class (or to a page for
+ * dedicated allocations). The memory isn't cleared.
+ */
+int pigpu_heap_alloc(struct pigpu_heap *heap, uint64_t size,
+                     struct pigpu_alloc *alloc) {
+  uint32_t shift, cls, index = 0;
+  struct pigpu_slab *slab;
+
+  if (!size)
+    return -EINVAL;
+  if (size > 1ULL << PIGPU_MAX_CLASS_SHIFT)
+    return pigpu_heap_alloc_dedicated(heap, size, alloc);
+
+  shift = size <= 1ULL << PIGPU_MIN_CLASS_SHIFT
+              ? PIGPU_MIN_CLASS_SHIFT
+              : 64 - __builtin_clzll(size - 1);
+  cls = shift - PIGPU_MIN_CLASS_SHIFT;
+
+  slab = heap->partial[cls];
+  if (!slab)
+    slab = pigpu_heap_new_slab(heap, cls);
+  if (!slab)
+    return -ENOMEM;
+
+  for (uint32_t w = 0; w < PIGPU_SLAB_MAX_OBJECTS / 64; w++) {
+    if (slab->free_mask[w]) {
+      index = w * 64 + __builtin_ctzll(slab->free_mask[w]);
+      slab->free_mask[w] &= slab->free_mask[w] - 1;
+      break;
+    }
+  }
+
+  if (!--slab->num_free)
+    pigpu_slab_remove(&heap->partial[cls], slab);
+
+  memset(alloc, 0, sizeof(*alloc));
+  alloc->bo = slab->block->bo;
+  alloc->offset = slab->offset + ((uint64_t)index << shift);
+  alloc->size = 1ULL << shift;
+  alloc->va = slab->block->va ? slab->block->va + alloc->offset : 0;
+  alloc->map = (uint8_t *)alloc->bo->map + alloc->offset;
+  alloc->slab = slab;
+  return 0;
+}
+
+/*
+ * Frees an allocation of pigpu_heap_alloc(). The GPU must be done with it,
+ * there's no deferred freeing. Transient allocations are released with their
+ * frame instead, freeing them does nothing.
+ */
+void pigpu_heap_free(struct pigpu_heap *heap, struct pigpu_alloc *alloc) {
+  struct pigpu_slab *slab = alloc->slab;
+
+  if (alloc->dedicated) {
+    pigpu_heap_destroy_bo(heap, alloc->bo, alloc->va);
+  } else if (slab) {
+    uint32_t index = (alloc->offset - slab->offset) >>
+                     (slab->cls + PIGPU_MIN_CLASS_SHIFT);
+
+    slab->free_mask[index / 64] |= 1ULL << (index % 64);
+    if (!slab->num_free++)
+      pigpu_slab_push(&heap->partial[slab->cls], slab);
+
+    // Empty slabs can be reused by any size class
+    if (slab->num_free == slab->num_objects) {
+      pigpu_slab_remove(&heap->partial[slab->cls], slab);
+      pigpu_slab_push(&heap->empty, slab);
+    }
+  }
+  memset(alloc, 0, sizeof(*alloc));
+}
+
+// Waits for the oldest frame and releases its transient data
+static int pigpu_heap_retire_frame(struct pigpu_heap *heap) {
+  uint32_t first = heap->first_frame;
+  int ret = 0;
+
+  if (heap->frames[first].seqno)
+    ret = pigpu_wait(heap->fd, heap->frames[first].seqno, -1);
+  if (ret)
+    return ret;
+
+  heap->tail = heap->frames[first].end;
+  heap->first_frame = (first + 1) % PIGPU_MAX_FRAMES;
+  heap->num_frames--;
+  return 0;
+}
+
+/**
+ * pigpu_heap_transient - allocates data that only lives for the current frame
+ * @heap: heap created with a ring
+ * @size: size in bytes
+ * @align: power of 2 alignment, 0 for 16 bytes
+ * @alloc: filled with the allocation
+ *
+ * Just bumps a pointer in the ring, unless the ring is full. The oldest frames
+ * are then waited on until there's enough room.
+ */
+int pigpu_heap_transient(struct pigpu_heap *heap, uint64_t size,
+                         uint64_t align, struct pigpu_alloc *alloc) {
+  uint64_t ring_size, pos, offset;
+  int ret;
+
+  if (!align)
+    align = 16;
+  if (!heap->ring || !size || (align & (align - 1)) || align > PIGPU_VA_ALIGN)
+    return -EINVAL;
+
+  ring_size = heap->ring->size;
+  if (size > ring_size)
+    return -E2BIG;
+
+  for (;;) {
+    pos = heap->head;
+    offset = pigpu_align(pos % ring_size, align);
+
+    // Allocations never wrap around the end of the ring
+    if (offset + size > ring_size)
+      pos += ring_size - pos % ring_size;
+    else
+      pos += offset - pos % ring_size;
+
+    if (pos + size - heap->tail <= ring_size)
+      break;
+
+    // The current frame alone doesn't fit in the ring
+    if (!heap->num_frames)
+      return -ENOSPC;
+
+    ret = pigpu_heap_retire_frame(heap);
+    if (ret)
+      return ret;
+  }
+
+  heap->head = pos + size;
+
+  memset(alloc, 0, sizeof(*alloc));
+  alloc->bo = heap->ring;
+  alloc->offset = pos % ring_size;
+  alloc->size = size;
+  alloc->va = heap->ring_va ? heap->ring_va + alloc->offset : 0;
+  alloc->map = (uint8_t *)heap->ring->map + alloc->offset;
+  return 0;
+}
+
+/*
+ * Ends the current frame. Its transient data is released once the job with
+ * the given seqno (the last one using the data) is done. seqno can be 0 if the
+ * data wasn't used by the GPU.
+ */
+int pigpu_heap_frame_end(struct pigpu_heap *heap, uint64_t seqno) {
+  uint32_t index;
+  int ret;
+
+  if (heap->num_frames == PIGPU_MAX_FRAMES) {
+    ret = pigpu_heap_retire_frame(heap);
+    if (ret)
+      return ret;
+  }
+
+  index = (heap->first_frame + heap->num_frames) % PIGPU_MAX_FRAMES;
+  heap->frames[index].end = heap->head;
+  heap->frames[index].seqno = seqno;
+  heap->num_frames++;
+  return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Description:
+ * Sub-allocator of libpigpu. Small allocations (vertices, constants, small
+ * textures, ...) are packed into a few large buffer objects instead of getting
+ * a dumb buffer each, so a client only has a handful of GEM handles: fewer
+ * objects to look up per submission and less kernel memory per client.
+ *
+ *  - Allocations of up to 16KB come from slabs of 64KB, one size class per
+ *    power of 2 from 64 bytes. The slabs are carved out of 4MB buffer objects.
+ *  - Data that only lives for a frame comes from a ring buffer object with
+ *    pigpu_heap_transient(), and is released all at once when the frame is
+ *    done on the GPU (see pigpu_heap_frame_end()).
+ *  - Anything bigger than 16KB gets its own buffer object.
+ *
+ * If the heap is created with a GPU address range, every buffer object of the
+ * heap is bound in the address space of the client (DRM_IOCTL_PI_VM_BIND), and
+ * every allocation has a GPU address.
+ */
+#ifndef PIGPU_HEAP_H
+#define PIGPU_HEAP_H
+
+#include <stdint.h>
+
+#include "libpigpu.h"
+
+#define PIGPU_HEAP_BLOCK_SIZE (4 << 20)
+#define PIGPU_HEAP_MAX_BLOCKS 64
+#define PIGPU_SLAB_SIZE (64 << 10)
+
+#define PIGPU_MIN_CLASS_SHIFT 6 // 64 bytes
+#define PIGPU_MAX_CLASS_SHIFT 14 // 16KB
+#define PIGPU_NUM_CLASSES (PIGPU_MAX_CLASS_SHIFT - PIGPU_MIN_CLASS_SHIFT + 1)
+#define PIGPU_SLAB_MAX_OBJECTS (PIGPU_SLAB_SIZE >> PIGPU_MIN_CLASS_SHIFT)
+
+// Frames whose transient data can be in flight at once
+#define PIGPU_MAX_FRAMES 16
+
+// GPU addresses of the heap are page aligned
+#define PIGPU_VA_ALIGN 4096
+
+#define PIGPU_SLABS_PER_BLOCK (PIGPU_HEAP_BLOCK_SIZE / PIGPU_SLAB_SIZE)
+
+struct pigpu_slab;
+
+struct pigpu_block {
+  struct pigpu_bo *bo;
+  uint64_t va; // 0 if the heap isn't bound
+  uint32_t num_slabs; // carved out so far
+  struct pigpu_slab *slabs[PIGPU_SLABS_PER_BLOCK];
+};
+
+struct pigpu_slab {
+  // In the list of slabs of its class with free objects, or of empty slabs
+  struct pigpu_slab *prev;
+  struct pigpu_slab *next;
+
+  struct pigpu_block *block;
+  uint32_t offset; // in the buffer object of the block
+  uint32_t cls;    // size class, objects are 64 << cls bytes
+  uint32_t num_free;
+  uint32_t num_objects;
+  uint64_t free_mask[PIGPU_SLAB_MAX_OBJECTS / 64]; // bit set -> object free
+};
+
+// An allocation, only valid until it's freed
+struct pigpu_alloc {
+  struct pigpu_bo *bo; // not referenced by the allocation
+  uint64_t offset;     // in bo
+  uint64_t size;
+  uint64_t va;         // GPU address, 0 if the heap isn't bound
+  void *map;           // CPU address
+
+  struct pigpu_slab *slab; // NULL if transient or dedicated
+  int dedicated;
+};
+
+struct pigpu_heap {
+  int fd;
+
+  // Next GPU address to bind a buffer object at, 0 if the heap isn't bound
+  uint64_t va_next;
+  uint64_t va_end;
+
+  uint32_t num_blocks;
+  struct pigpu_block blocks[PIGPU_HEAP_MAX_BLOCKS];
+
+  struct pigpu_slab *partial[PIGPU_NUM_CLASSES];
+  struct pigpu_slab *empty;
+
+  // Transient ring. head and tail are free running byte counters.
+  struct pigpu_bo *ring;
+  uint64_t ring_va;
+  uint64_t head;
+  uint64_t tail;
+  struct {
+    uint64_t end; // head when the frame ended
+    uint64_t seqno;
+  } frames[PIGPU_MAX_FRAMES];
+  uint32_t first_frame;
+  uint32_t num_frames;
+
+  uint32_t num_handles; // GEM handles owned by the heap
+};
+
+int pigpu_heap_create(int fd, uint64_t ring_size, uint64_t va_start,
+                      uint64_t va_size, struct pigpu_heap **heap);
+
+void pigpu_heap_destroy(struct pigpu_heap *heap);
+
+int pigpu_heap_alloc(struct pigpu_heap *heap, uint64_t size,
+                     struct pigpu_alloc *alloc);
+
+void pigpu_heap_free(struct pigpu_heap *heap, struct pigpu_alloc *alloc);
+
+int pigpu_heap_transient(struct pigpu_heap *heap, uint64_t size,
+                         uint64_t align, struct pigpu_alloc *alloc);
+
+int pigpu_heap_frame_end(struct pigpu_heap *heap, uint64_t seqno);
+
+#endif
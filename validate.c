@@ -0,0 +1,201 @@
+/*
+ * Description:
+ * Validation of the instruction buffers of the exec ioctls. Any render node
+ * client can submit, so every command stream is checked by pi_validate() before
+ * it's queued and invalid ones are rejected right away.
+ *
+ * Most clients resubmit the same command lists every frame, so the ranges that
+ * passed are remembered per buffer object along with a hash of their contents.
+ * Hashing with xxh64 is a lot cheaper than decoding every command again. The
+ * client can still write to the buffer object after it was validated, so the
+ * executor keeps its own checks and this is only about rejecting bad streams
+ * early.
+ */
+#include "asm-generic/errno-base.h"
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_debugfs.h"
+#include "drm/drm_device.h"
+#include "drm/drm_file.h"
+#include "linux/kernel.h"
+#include "linux/ktime.h"
+#include "linux/math64.h"
+#include "linux/minmax.h"
+#include "linux/seq_file.h"
+#include "linux/spinlock.h"
+#include "linux/string.h"
+#include "linux/vmalloc.h"
+#include "linux/xxhash.h"
+
+#include "driver.h"
+#include "executor.h"
+#include "validate.h"
+
+void pi_cmd_cache_init(struct pi_cmd_cache *cache) {
+  spin_lock_init(&cache->lock);
+  cache->next = 0;
+  memset(cache->entries, 0, sizeof(cache->entries));
+}
+
+static bool pi_cmd_cache_lookup(struct pi_cmd_cache *cache,
+                                const struct pi_cmd_cache_entry *key) {
+  bool found = false;
+
+  spin_lock(&cache->lock);
+  for (unsigned int i = 0; i < PI_CMD_CACHE_ENTRIES && !found; i++)
+    found = !memcmp(&cache->entries[i], key, sizeof(*key));
+  spin_unlock(&cache->lock);
+
+  return found;
+}
+
+static void pi_cmd_cache_insert(struct pi_cmd_cache *cache,
+                                const struct pi_cmd_cache_entry *key) {
+  spin_lock(&cache->lock);
+  cache->entries[cache->next] = *key;
+  cache->next = (cache->next + 1) % PI_CMD_CACHE_ENTRIES;
+  spin_unlock(&cache->lock);
+}
+
+/**
+ * pi_validate_cached - validates a range of an instruction buffer object
+ * @cache: validation cache of the buffer object
+ * @vaddr: kernel mapping of the buffer object
+ * @start: offset of the range in bytes
+ * @len: length of the range in bytes
+ * @frame_size: size of the frame buffer object of the job
+ * @hit: set if the range was already validated with the same contents
+ *
+ * Returns:
+ * 0 if the range can be executed, -EINVAL otherwise.
+ */
+int pi_validate_cached(struct pi_cmd_cache *cache, const u8 *vaddr, u32 start,
+                       u32 len, u64 frame_size, bool *hit) {
+  struct pi_cmd_cache_entry key = {
+      .frame_size = frame_size,
+      .start = start,
+      .len = len,
+  };
+  int ret;
+
+  // 0 marks empty entries, a hash of 0 is just never cached
+  key.hash = xxh64(vaddr + start, len, 0);
+
+  *hit = key.hash && pi_cmd_cache_lookup(cache, &key);
+  if (*hit)
+    return 0;
+
+  ret = pi_validate((const u32 *)(vaddr + start), len, frame_size);
+  if (!ret && key.hash)
+    pi_cmd_cache_insert(cache, &key);
+  return ret;
+}
+
+/*-------------------------------------------------------------------------------
+ * Benchmark
+ *
+ * Validation cost per KB of commands, decoded and through the cache, on
+ * streams of a few sizes made of the commands of a typical frame.
+ *-------------------------------------------------------------------------------
+ */
+
+#define PI_VALIDATE_BENCH_BYTES (4 * 1024 * 1024)
+#define PI_VALIDATE_BENCH_WIDTH 1920
+#define PI_VALIDATE_BENCH_HEIGHT 1080
+
+// Fills len bytes of commands, returns the length actually used
+static size_t pi_validate_bench_build(u32 *cmds, size_t len) {
+  u32 *end = cmds + len / sizeof(u32);
+  u32 *cmd = cmds;
+  u32 seed = 0x9abc;
+
+  *cmd++ = PI_CMD_HDR(PI_OP_SET_TARGET, 4);
+  *cmd++ = PI_VALIDATE_BENCH_WIDTH | (PI_VALIDATE_BENCH_HEIGHT << 16);
+  *cmd++ = PI_VALIDATE_BENCH_WIDTH * 4;
+  *cmd++ = PIX_FMT_XRGB8888;
+
+  *cmd++ = PI_CMD_HDR(PI_OP_CLEAR, 2);
+  *cmd++ = 0x00202020;
+
+  // Rectangles and triangles, as many as fit
+  while (end - cmd >= 9) {
+    seed = seed * 1664525 + 1013904223;
+
+    *cmd++ = PI_CMD_HDR(PI_OP_FILL_RECT, 4);
+    *cmd++ = PI_CMD_XY(seed % PI_VALIDATE_BENCH_WIDTH, seed % 1024);
+    *cmd++ = PI_CMD_XY(64, 64);
+    *cmd++ = seed;
+
+    *cmd++ = PI_CMD_HDR(PI_OP_DRAW_TRI, 5);
+    *cmd++ = PI_CMD_XY(seed % 1024, 0);
+    *cmd++ = PI_CMD_XY(seed % 1024 + 64, 32);
+    *cmd++ = PI_CMD_XY(seed % 1024, 64);
+    *cmd++ = seed;
+  }
+
+  return (cmd - cmds) * sizeof(u32);
+}
+
+static int pi_validate_show(struct seq_file *m, void *unused) {
+  struct drm_debugfs_entry *entry = m->private;
+  struct pi_gpu *gpu = to_gpu(entry->dev);
+  struct pi_validate_stats *stats = &gpu->validate_stats;
+  const size_t sizes[] = {1024, 16 * 1024, 256 * 1024, 4 * 1024 * 1024};
+  const size_t frame_size =
+      PI_VALIDATE_BENCH_WIDTH * PI_VALIDATE_BENCH_HEIGHT * 4;
+  u64 hits = atomic64_read(&stats->hits);
+  u64 misses = atomic64_read(&stats->misses);
+  u64 bytes = atomic64_read(&stats->bytes);
+  struct pi_cmd_cache cache;
+  u32 *cmds;
+  int ret = 0;
+
+  seq_printf(m, "hits: %llu, misses: %llu, rejected: %llu, hit rate: %llu%%\n",
+             hits, misses, (u64)atomic64_read(&stats->rejected),
+             div64_u64(hits * 100, max_t(u64, hits + misses, 1)));
+  seq_printf(m, "validated: %llu KB, %llu ns\n", bytes / 1024,
+             (u64)atomic64_read(&stats->ns));
+
+  cmds = vmalloc(PI_VALIDATE_BENCH_BYTES);
+  if (!cmds)
+    return -ENOMEM;
+
+  for (unsigned int i = 0; i < ARRAY_SIZE(sizes) && !ret; i++) {
+    size_t len = pi_validate_bench_build(cmds, sizes[i]);
+    // Roughly 16MB of commands per measurement
+    const int iterations = max_t(int, (16 << 20) / len, 1);
+    u64 uncached_ns, cached_ns, start;
+    bool hit;
+
+    start = ktime_get_ns();
+    for (int n = 0; n < iterations && !ret; n++)
+      ret = pi_validate(cmds, len, frame_size);
+    uncached_ns = ktime_get_ns() - start;
+
+    // The first iteration fills the cache, like the first frame would
+    pi_cmd_cache_init(&cache);
+    start = ktime_get_ns();
+    for (int n = 0; n < iterations && !ret; n++)
+      ret = pi_validate_cached(&cache, (const u8 *)cmds, 0, len, frame_size,
+                               &hit);
+    cached_ns = ktime_get_ns() - start;
+
+    if (ret)
+      break;
+
+    seq_printf(m, "%7zu bytes: uncached %llu ns/KB, cached %llu ns/KB\n", len,
+               div64_u64(uncached_ns * 1024, (u64)len * iterations),
+               div64_u64(cached_ns * 1024, (u64)len * iterations));
+  }
+
+  vfree(cmds);
+  return ret;
+}
+
+static const struct drm_debugfs_info pi_validate_debugfs_list[] = {
+    {"validate", pi_validate_show, 0},
+};
+
+void pi_validate_debugfs_init(struct pi_gpu *gpu) {
+  drm_debugfs_add_files(&gpu->drm_device, pi_validate_debugfs_list,
+                        ARRAY_SIZE(pi_validate_debugfs_list));
+}
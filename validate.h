@@ -0,0 +1,47 @@
+#ifndef VALIDATE_H
+#define VALIDATE_H
+
+#include "asm-generic/int-ll64.h"
+#include "linux/atomic.h"
+#include "linux/spinlock.h"
+#include "linux/types.h"
+
+struct pi_gpu;
+
+// Ranges of an instruction buffer object that were validated
+#define PI_CMD_CACHE_ENTRIES 4
+
+struct pi_cmd_cache_entry {
+  u64 hash; // of the contents of the range, 0 if the entry is empty
+  u64 frame_size;
+  u32 start;
+  u32 len;
+};
+
+/*
+ * Per buffer object cache of validated command streams. Static command lists
+ * are resubmitted every frame with the same contents, so hashing them is
+ * enough to know they're still valid.
+ */
+struct pi_cmd_cache {
+  spinlock_t lock;
+  u32 next; // entry replaced by the next insertion
+  struct pi_cmd_cache_entry entries[PI_CMD_CACHE_ENTRIES];
+};
+
+struct pi_validate_stats {
+  atomic64_t hits;
+  atomic64_t misses;
+  atomic64_t rejected;
+  atomic64_t bytes;
+  atomic64_t ns;
+};
+
+void pi_cmd_cache_init(struct pi_cmd_cache *cache);
+
+int pi_validate_cached(struct pi_cmd_cache *cache, const u8 *vaddr, u32 start,
+                       u32 len, u64 frame_size, bool *hit);
+
+void pi_validate_debugfs_init(struct pi_gpu *gpu);
+
+#endif
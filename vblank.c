@@ -0,0 +1,159 @@
+/*
+ * Description:
+ * Vertical blanking interrupt emulated with an hrtimer.
+ *
+ * Without vblank support, page flips complete as soon as they're committed and
+ * clients render as fast as they can, most of their frames never being shown.
+ * The timer fires once per refresh period, at the refresh_hz module parameter,
+ * and reports a vblank to the DRM core. That paces DRM_IOCTL_MODE_PAGE_FLIP and
+ * atomic commits (their completion events are sent at the next vblank), makes
+ * DRM_IOCTL_WAIT_VBLANK work, and gives clients vblank timestamps to pace their
+ * frames with.
+ *
+ * Like real hardware, the timer is moved forward before the vblank is handled,
+ * so the time of the vblank being handled is the previous expiry.
+ */
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_crtc.h"
+#include "drm/drm_debugfs.h"
+#include "drm/drm_device.h"
+#include "drm/drm_print.h"
+#include "drm/drm_vblank.h"
+#include "linux/hrtimer.h"
+#include "linux/ktime.h"
+#include "linux/minmax.h"
+#include "linux/module.h"
+#include "linux/seq_file.h"
+#include "linux/spinlock.h"
+
+#include "driver.h"
+#include "vblank.h"
+
+static unsigned int refresh_hz = 60;
+module_param(refresh_hz, uint, 0644);
+MODULE_PARM_DESC(refresh_hz,
+                 "Refresh rate of the emulated display, in Hz (1-240, applied "
+                 "the next time vblank interrupts are enabled)");
+
+static enum hrtimer_restart pi_vblank_timer(struct hrtimer *timer) {
+  struct pi_gpu *gpu = container_of(timer, struct pi_gpu, vblank.timer);
+  struct pi_vblank *vblank = &gpu->vblank;
+  u64 overruns;
+
+  // Disabling only tries to cancel the timer, see pi_vblank_disable()
+  if (!READ_ONCE(vblank->enabled))
+    return HRTIMER_NORESTART;
+
+  overruns = hrtimer_forward_now(timer, vblank->period);
+  vblank->count++;
+  if (overruns > 1)
+    vblank->missed += overruns - 1;
+
+  // Only fails if vblank interrupts were disabled in the meantime
+  if (!drm_crtc_handle_vblank(&gpu->crtc))
+    return HRTIMER_NORESTART;
+  return HRTIMER_RESTART;
+}
+
+int pi_vblank_enable(struct drm_crtc *crtc) {
+  struct pi_gpu *gpu = to_gpu(crtc->dev);
+  struct pi_vblank *vblank = &gpu->vblank;
+
+  vblank->period =
+      ns_to_ktime(NSEC_PER_SEC / clamp(READ_ONCE(refresh_hz), 1U, 240U));
+  WRITE_ONCE(vblank->enabled, true);
+  hrtimer_start(&vblank->timer, vblank->period, HRTIMER_MODE_REL);
+  return 0;
+}
+
+/*
+ * Called with the vblank_time_lock of the device held, which the timer takes
+ * in drm_crtc_handle_vblank(), so it can't wait for a running timer like
+ * hrtimer_cancel() does. A running timer sees enabled cleared and stops.
+ */
+void pi_vblank_disable(struct drm_crtc *crtc) {
+  struct pi_vblank *vblank = &to_gpu(crtc->dev)->vblank;
+
+  WRITE_ONCE(vblank->enabled, false);
+  hrtimer_try_to_cancel(&vblank->timer);
+}
+
+/**
+ * pi_vblank_get_timestamp - gets the time of the last vblank
+ * @crtc: the CRTC
+ * @max_error: unused, the timestamp is exact
+ * @vblank_time: filled with the time of the last vblank
+ * @in_vblank_irq: whether it's called while handling the vblank
+ *
+ * Returns:
+ * Always true, the timestamp is always precise.
+ */
+bool pi_vblank_get_timestamp(struct drm_crtc *crtc, int *max_error,
+                             ktime_t *vblank_time, bool in_vblank_irq) {
+  struct drm_device *dev = crtc->dev;
+  struct pi_vblank *vblank = &to_gpu(dev)->vblank;
+  struct drm_vblank_crtc *drm_vblank = &dev->vblank[drm_crtc_index(crtc)];
+
+  if (!READ_ONCE(drm_vblank->enabled)) {
+    *vblank_time = ktime_get();
+    return true;
+  }
+
+  // The timer was moved forward a period before handling the vblank
+  *vblank_time =
+      ktime_sub(READ_ONCE(vblank->timer.node.expires), vblank->period);
+  return true;
+}
+
+/**
+ * pi_vblank_send_event - completes the commit at the next vblank
+ * @crtc: the CRTC
+ *
+ * The completion event of the commit, if it asked for one, is sent at the next
+ * vblank, or right away if the CRTC is off.
+ */
+void pi_vblank_send_event(struct drm_crtc *crtc) {
+  struct drm_pending_vblank_event *event = crtc->state->event;
+
+  if (!event)
+    return;
+
+  crtc->state->event = NULL;
+  spin_lock_irq(&crtc->dev->event_lock);
+  if (drm_crtc_vblank_get(crtc) == 0)
+    drm_crtc_arm_vblank_event(crtc, event);
+  else
+    drm_crtc_send_vblank_event(crtc, event);
+  spin_unlock_irq(&crtc->dev->event_lock);
+}
+
+int pi_vblank_init(struct pi_gpu *gpu) {
+  hrtimer_init(&gpu->vblank.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  gpu->vblank.timer.function = pi_vblank_timer;
+
+  return drm_vblank_init(&gpu->drm_device, 1);
+}
+
+// Disabling vblank interrupts may have left the timer running
+void pi_vblank_fini(struct pi_gpu *gpu) { hrtimer_cancel(&gpu->vblank.timer); }
+
+static int pi_vblank_show(struct seq_file *m, void *unused) {
+  struct drm_debugfs_entry *entry = m->private;
+  struct pi_gpu *gpu = to_gpu(entry->dev);
+  struct pi_vblank *vblank = &gpu->vblank;
+
+  seq_printf(m, "refresh: %u Hz, period: %lld ns\n", READ_ONCE(refresh_hz),
+             ktime_to_ns(vblank->period));
+  seq_printf(m, "vblanks: %llu, missed: %llu\n", READ_ONCE(vblank->count),
+             READ_ONCE(vblank->missed));
+  return 0;
+}
+
+static const struct drm_debugfs_info pi_vblank_debugfs_list[] = {
+    {"vblank", pi_vblank_show, 0},
+};
+
+void pi_vblank_debugfs_init(struct pi_gpu *gpu) {
+  drm_debugfs_add_files(&gpu->drm_device, pi_vblank_debugfs_list,
+                        ARRAY_SIZE(pi_vblank_debugfs_list));
+}
@@ -0,0 +1,41 @@
+#ifndef VBLANK_H
+#define VBLANK_H
+
+#include "asm-generic/int-ll64.h"
+#include "linux/hrtimer.h"
+#include "linux/ktime.h"
+#include "linux/types.h"
+
+struct drm_crtc;
+struct pi_gpu;
+
+/*
+ * Emulated vertical blanking. There's no display to raise an interrupt at the
+ * end of a frame, so a timer firing at the refresh rate does it.
+ */
+struct pi_vblank {
+  struct hrtimer timer;
+  ktime_t period; // set when the interrupt is enabled
+  bool enabled;   // the timer stops by itself once cleared
+
+  // Only updated by the timer
+  u64 count;
+  u64 missed; // periods the timer fired too late for
+};
+
+int pi_vblank_init(struct pi_gpu *gpu);
+
+void pi_vblank_fini(struct pi_gpu *gpu);
+
+int pi_vblank_enable(struct drm_crtc *crtc);
+
+void pi_vblank_disable(struct drm_crtc *crtc);
+
+bool pi_vblank_get_timestamp(struct drm_crtc *crtc, int *max_error,
+                             ktime_t *vblank_time, bool in_vblank_irq);
+
+void pi_vblank_send_event(struct drm_crtc *crtc);
+
+void pi_vblank_debugfs_init(struct pi_gpu *gpu);
+
+#endif
@@ -0,0 +1,357 @@
+/*
+ * Description:
+ * Per client GPU virtual address spaces. Clients bind buffer objects at
+ * addresses of their choice with DRM_IOCTL_PI_VM_BIND, and the emulated GPU
+ * translates those addresses through the page tables of the address space (see
+ * pi_vm_translate()). Command buffers can then reference buffer objects by
+ * address and be submitted as is, without the driver patching anything.
+ */
+#include "asm-generic/errno-base.h"
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_device.h"
+#include "drm/drm_file.h"
+#include "drm/drm_gem.h"
+#include "linux/align.h"
+#include "linux/build_bug.h"
+#include "linux/dma-fence.h"
+#include "linux/err.h"
+#include "linux/interval_tree_generic.h"
+#include "linux/kref.h"
+#include "linux/limits.h"
+#include "linux/mutex.h"
+#include "linux/slab.h"
+#include "linux/string.h"
+
+#include "bo.h"
+#include "driver.h"
+#include "vm.h"
+
+// A buffer object (or a part of it) bound in an address space
+struct pi_vm_binding {
+  struct rb_node rb;
+  u64 start; // first byte
+  u64 last;  // last byte, inclusive
+  u64 __subtree_last;
+
+  // Referenced and mapped (so pinned) for as long as it's bound
+  struct pi_bo *bo;
+  u64 offset; // in the buffer object
+  u32 flags;  // PI_VM_BIND_*
+};
+
+#define PI_VM_BINDING_START(b) ((b)->start)
+#define PI_VM_BINDING_LAST(b) ((b)->last)
+
+INTERVAL_TREE_DEFINE(struct pi_vm_binding, rb, u64, __subtree_last,
+                     PI_VM_BINDING_START, PI_VM_BINDING_LAST, static,
+                     pi_vm_it);
+
+#define PI_VM_PD_INDEX(vpn) ((vpn) >> PI_VM_PT_SHIFT)
+#define PI_VM_PT_INDEX(vpn) ((vpn) & (PI_VM_PT_ENTRIES - 1))
+
+struct pi_vm *pi_vm_create(void) {
+  struct pi_vm *vm;
+
+  vm = kzalloc(sizeof(*vm), GFP_KERNEL);
+  if (!vm)
+    return NULL;
+
+  vm->pd = kcalloc(PI_VM_PD_ENTRIES, sizeof(*vm->pd), GFP_KERNEL);
+  if (!vm->pd) {
+    kfree(vm);
+    return NULL;
+  }
+
+  kref_init(&vm->ref);
+  mutex_init(&vm->lock);
+  vm->bindings = RB_ROOT_CACHED;
+  return vm;
+}
+
+static void pi_vm_binding_free(struct pi_vm_binding *binding) {
+  pi_bo_vunmap(binding->bo);
+  drm_gem_object_put(&binding->bo->base.base);
+  kfree(binding);
+}
+
+/*
+ * Only called once the last job using the address space is done (the jobs hold
+ * a reference), so nothing can access the buffer objects anymore.
+ */
+static void pi_vm_release(struct kref *ref) {
+  struct pi_vm *vm = container_of(ref, struct pi_vm, ref);
+  struct pi_vm_binding *binding;
+
+  while ((binding = pi_vm_it_iter_first(&vm->bindings, 0, U64_MAX))) {
+    pi_vm_it_remove(binding, &vm->bindings);
+    pi_vm_binding_free(binding);
+  }
+
+  for (u32 i = 0; i < PI_VM_PD_ENTRIES; i++)
+    kfree((u64 *)(uintptr_t)(vm->pd[i] & PI_PTE_ADDR_MASK));
+  kfree(vm->pd);
+
+  dma_fence_put(vm->last_fence);
+  mutex_destroy(&vm->lock);
+  kfree(vm);
+}
+
+void pi_vm_put(struct pi_vm *vm) {
+  kref_put(&vm->ref, pi_vm_release);
+}
+
+/*
+ * Called by the ring with every job using the address space, before the GPU can
+ * see the job. Jobs complete in order, so the fence of the last one is enough
+ * to know when the GPU is done with all of them.
+ */
+void pi_vm_set_last_fence(struct pi_vm *vm, struct dma_fence *fence) {
+  mutex_lock(&vm->lock);
+  dma_fence_put(vm->last_fence);
+  vm->last_fence = dma_fence_get(fence);
+  mutex_unlock(&vm->lock);
+}
+
+// Returns the page table of vpn, allocating it if needed. NULL if out of memory.
+static u64 *pi_vm_get_pt(struct pi_vm *vm, u64 vpn, bool alloc) {
+  u64 *pde = &vm->pd[PI_VM_PD_INDEX(vpn)];
+  u64 *pt;
+
+  if (*pde & PI_PTE_VALID)
+    return (u64 *)(uintptr_t)(*pde & PI_PTE_ADDR_MASK);
+  if (!alloc)
+    return NULL;
+
+  // Page tables are exactly one GPU page, so they're aligned like one
+  BUILD_BUG_ON(PI_VM_PT_ENTRIES * sizeof(u64) != PI_VM_PAGE_SIZE);
+  pt = kzalloc(PI_VM_PAGE_SIZE, GFP_KERNEL);
+  if (!pt)
+    return NULL;
+
+  *pde = (uintptr_t)pt | PI_PTE_VALID;
+  return pt;
+}
+
+// The whole TLB is dropped when unbinding, that's rare enough
+static void pi_vm_tlb_flush(struct pi_vm *vm) {
+  memset(vm->tlb, 0, sizeof(vm->tlb));
+}
+
+/*
+ * Emulates a page table walk of the GPU. Only valid entries are cached in the
+ * TLB, so binding never needs to flush it.
+ */
+static u64 pi_vm_lookup_pte(struct pi_vm *vm, u64 vpn) {
+  struct pi_vm_tlb_entry *entry = &vm->tlb[vpn % PI_VM_TLB_ENTRIES];
+  u64 *pt;
+
+  if (entry->pte && entry->vpn == vpn)
+    return entry->pte;
+
+  pt = pi_vm_get_pt(vm, vpn, false);
+  if (!pt || !(pt[PI_VM_PT_INDEX(vpn)] & PI_PTE_VALID))
+    return 0;
+
+  entry->vpn = vpn;
+  entry->pte = pt[PI_VM_PT_INDEX(vpn)];
+  return entry->pte;
+}
+
+/**
+ * pi_vm_translate - translates a GPU address range, like the GPU MMU would
+ * @vm: address space of the job
+ * @va: GPU address of the first byte
+ * @size: size of the range in bytes
+ * @write: if the GPU writes to the range
+ *
+ * The executor accesses its buffers linearly, so the whole range has to be
+ * backed by a single binding (which is contiguous in the kernel mapping of its
+ * buffer object). Every page of the range is still walked, exactly like the GPU
+ * would fault on the first page that isn't mapped.
+ *
+ * Returns:
+ * The address the range can be accessed at, or an ERR_PTR(-EFAULT) if part of
+ * the range isn't mapped or is read-only and write is set.
+ */
+void *pi_vm_translate(struct pi_vm *vm, u64 va, u64 size, bool write) {
+  u64 first, last, base = 0;
+  void *ret = ERR_PTR(-EFAULT);
+
+  if (!size || va >= (1ULL << PI_VM_VA_BITS) ||
+      size > (1ULL << PI_VM_VA_BITS) - va)
+    return ERR_PTR(-EFAULT);
+
+  first = va >> PI_VM_PAGE_SHIFT;
+  last = (va + size - 1) >> PI_VM_PAGE_SHIFT;
+
+  mutex_lock(&vm->lock);
+  for (u64 vpn = first; vpn <= last; vpn++) {
+    u64 pte = pi_vm_lookup_pte(vm, vpn);
+
+    if (!pte || (write && !(pte & PI_PTE_WRITE)))
+      goto out;
+
+    if (vpn == first)
+      base = pte & PI_PTE_ADDR_MASK;
+    else if ((pte & PI_PTE_ADDR_MASK) !=
+             base + ((vpn - first) << PI_VM_PAGE_SHIFT))
+      goto out;
+  }
+  ret = (void *)(uintptr_t)(base + (va & (PI_VM_PAGE_SIZE - 1)));
+
+out:
+  mutex_unlock(&vm->lock);
+  return ret;
+}
+
+static int pi_vm_write_ptes(struct pi_vm *vm, struct pi_vm_binding *binding,
+                            void *vaddr) {
+  u64 first = binding->start >> PI_VM_PAGE_SHIFT;
+  u64 last = binding->last >> PI_VM_PAGE_SHIFT;
+  u64 flags = PI_PTE_VALID;
+
+  if (!(binding->flags & PI_VM_BIND_READ_ONLY))
+    flags |= PI_PTE_WRITE;
+
+  for (u64 vpn = first; vpn <= last; vpn++) {
+    u64 *pt = pi_vm_get_pt(vm, vpn, true);
+    u64 addr = (uintptr_t)vaddr + binding->offset +
+               ((vpn - first) << PI_VM_PAGE_SHIFT);
+
+    if (!pt)
+      return -ENOMEM;
+    pt[PI_VM_PT_INDEX(vpn)] = addr | flags;
+  }
+  return 0;
+}
+
+static void pi_vm_clear_ptes(struct pi_vm *vm, struct pi_vm_binding *binding) {
+  u64 first = binding->start >> PI_VM_PAGE_SHIFT;
+  u64 last = binding->last >> PI_VM_PAGE_SHIFT;
+
+  for (u64 vpn = first; vpn <= last; vpn++) {
+    u64 *pt = pi_vm_get_pt(vm, vpn, false);
+
+    if (pt)
+      pt[PI_VM_PT_INDEX(vpn)] = 0;
+  }
+  pi_vm_tlb_flush(vm);
+}
+
+// Page aligned, inside of the address space, and never at address 0 so that
+// a NULL address always faults
+static bool pi_vm_range_valid(u64 va, u64 size) {
+  return size && IS_ALIGNED(va | size, PI_VM_PAGE_SIZE) &&
+         va >= PI_VM_PAGE_SIZE && va < (1ULL << PI_VM_VA_BITS) &&
+         size <= (1ULL << PI_VM_VA_BITS) - va;
+}
+
+int pi_vm_bind_ioctl(struct drm_device *dev, void *data,
+                     struct drm_file *file) {
+  struct pi_file *pfile = file->driver_priv;
+  struct pi_vm *vm = pfile->vm;
+  struct pi_vm_bind *args = data;
+  struct pi_vm_binding *binding;
+  struct drm_gem_object *gem;
+  struct iosys_map map;
+  int ret;
+
+  if (args->flags & ~PI_VM_BIND_FLAGS)
+    return -EINVAL;
+  if (!pi_vm_range_valid(args->va, args->size) ||
+      !IS_ALIGNED(args->offset, PI_VM_PAGE_SIZE))
+    return -EINVAL;
+
+  gem = drm_gem_object_lookup(file, args->handle);
+  if (!gem)
+    return -ENOENT;
+
+  if (gem->dev != dev || !pi_is_bo(gem)) {
+    ret = -ENODEV;
+    goto put;
+  }
+  if (args->offset > gem->size || args->size > gem->size - args->offset) {
+    ret = -EINVAL;
+    goto put;
+  }
+
+  binding = kzalloc(sizeof(*binding), GFP_KERNEL);
+  if (!binding) {
+    ret = -ENOMEM;
+    goto put;
+  }
+
+  // Pins the pages for as long as they're bound
+  ret = pi_bo_vmap(to_pi_bo(gem), &map);
+  if (ret) {
+    kfree(binding);
+    goto put;
+  }
+
+  // The binding owns the reference from the lookup from now on
+  binding->bo = to_pi_bo(gem);
+  binding->start = args->va;
+  binding->last = args->va + args->size - 1;
+  binding->offset = args->offset;
+  binding->flags = args->flags;
+
+  mutex_lock(&vm->lock);
+  if (pi_vm_it_iter_first(&vm->bindings, binding->start, binding->last)) {
+    ret = -EBUSY;
+  } else {
+    ret = pi_vm_write_ptes(vm, binding, map.vaddr);
+    if (ret)
+      pi_vm_clear_ptes(vm, binding);
+    else
+      pi_vm_it_insert(binding, &vm->bindings);
+  }
+  mutex_unlock(&vm->lock);
+
+  if (ret)
+    pi_vm_binding_free(binding);
+  return ret;
+
+put:
+  drm_gem_object_put(gem);
+  return ret;
+}
+
+/*
+ * Only whole bindings can be unbound. The pages are unmapped from the GPU right
+ * away, but the buffer object is only released once the jobs already submitted
+ * with the address space are done, since they may still be accessing it.
+ */
+int pi_vm_unbind_ioctl(struct drm_device *dev, void *data,
+                       struct drm_file *file) {
+  struct pi_file *pfile = file->driver_priv;
+  struct pi_vm *vm = pfile->vm;
+  struct pi_vm_unbind *args = data;
+  struct pi_vm_binding *binding;
+  struct dma_fence *fence;
+
+  if (!pi_vm_range_valid(args->va, args->size))
+    return -EINVAL;
+
+  mutex_lock(&vm->lock);
+  binding =
+      pi_vm_it_iter_first(&vm->bindings, args->va, args->va + args->size - 1);
+  if (!binding || binding->start != args->va ||
+      binding->last != args->va + args->size - 1) {
+    mutex_unlock(&vm->lock);
+    return binding ? -EINVAL : -ENOENT;
+  }
+
+  pi_vm_it_remove(binding, &vm->bindings);
+  pi_vm_clear_ptes(vm, binding);
+  fence = dma_fence_get(vm->last_fence);
+  mutex_unlock(&vm->lock);
+
+  // Not interruptible, the binding is already gone
+  if (fence) {
+    dma_fence_wait(fence, false);
+    dma_fence_put(fence);
+  }
+
+  pi_vm_binding_free(binding);
+  return 0;
+}
@@ -0,0 +1,86 @@
+#ifndef VM_H
+#define VM_H
+
+#include "asm-generic/int-ll64.h"
+#include "linux/kref.h"
+#include "linux/mutex.h"
+#include "linux/rbtree.h"
+
+struct dma_fence;
+struct drm_device;
+struct drm_file;
+
+/*
+ * GPU virtual address space
+ *
+ * Every client gets its own 4GB address space. Buffer objects are bound at
+ * addresses picked by the client, so command buffers can reference them by
+ * address and be submitted again and again without being patched.
+ *
+ * The emulated GPU translates addresses through a 2-level page table of 64-bit
+ * entries, with 4KB pages:
+ *
+ *   bits 31..21 -> page directory index (2048 entries)
+ *   bits 20..12 -> page table index (512 entries, one 4KB table)
+ *   bits 11..0  -> offset in the page
+ *
+ * A PTE holds the address the GPU accesses the page at (the kernel mapping of
+ * the buffer object, since there's no actual GPU) and PI_PTE_* flags in the
+ * low bits.
+ */
+#define PI_VM_VA_BITS 32
+#define PI_VM_PAGE_SHIFT 12
+#define PI_VM_PAGE_SIZE (1ULL << PI_VM_PAGE_SHIFT)
+#define PI_VM_PT_SHIFT 9
+#define PI_VM_PT_ENTRIES (1 << PI_VM_PT_SHIFT)
+#define PI_VM_PD_ENTRIES (1 << (PI_VM_VA_BITS - PI_VM_PAGE_SHIFT - PI_VM_PT_SHIFT))
+
+#define PI_PTE_VALID (1ULL << 0)
+#define PI_PTE_WRITE (1ULL << 1)
+#define PI_PTE_ADDR_MASK (~(PI_VM_PAGE_SIZE - 1))
+
+// Direct mapped, indexed by the low bits of the page number
+#define PI_VM_TLB_ENTRIES 16
+
+struct pi_vm_tlb_entry {
+  u64 vpn;
+  u64 pte; // 0 if the entry is empty
+};
+
+struct pi_vm {
+  struct kref ref;
+
+  // Protects everything below, including the page tables and the TLB
+  struct mutex lock;
+
+  struct rb_root_cached bindings; // &pi_vm_binding, by address range
+
+  // Page directory, every entry points to a page table (or is 0)
+  u64 *pd;
+
+  struct pi_vm_tlb_entry tlb[PI_VM_TLB_ENTRIES];
+
+  // Fence of the last job submitted with this address space. Unbinding waits
+  // on it before releasing the buffer object.
+  struct dma_fence *last_fence;
+};
+
+struct pi_vm *pi_vm_create(void);
+
+static inline struct pi_vm *pi_vm_get(struct pi_vm *vm) {
+  kref_get(&vm->ref);
+  return vm;
+}
+
+void pi_vm_put(struct pi_vm *vm);
+
+void pi_vm_set_last_fence(struct pi_vm *vm, struct dma_fence *fence);
+
+void *pi_vm_translate(struct pi_vm *vm, u64 va, u64 size, bool write);
+
+int pi_vm_bind_ioctl(struct drm_device *dev, void *data, struct drm_file *file);
+
+int pi_vm_unbind_ioctl(struct drm_device *dev, void *data,
+                       struct drm_file *file);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Description:
+ * Vram heap and the buffer objects placed in it.
+ *
+ * The reserved memory region used to be allocated as a whole and only its
+ * first few words were used, for the registers and the ring. Past them and the
+ * display memory, the rest of it is now managed by a drm_mm range allocator.
+ * Buffer objects in vram aren't shmem objects: they're a range of the coherent
+ * allocation, always mapped in the kernel, and mapped in userspace with
+ * dma_mmap_coherent(). They don't have pages to pin, so pi_bo_vmap() just
+ * returns their mapping.
+ */
+#include "asm-generic/errno-base.h"
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_device.h"
+#include "drm/drm_gem.h"
+#include "drm/drm_mm.h"
+#include "drm/drm_print.h"
+#include "drm/drm_vma_manager.h"
+#include "linux/dma-mapping.h"
+#include "linux/err.h"
+#include "linux/iosys-map.h"
+#include "linux/mm.h"
+#include "linux/mutex.h"
+#include "linux/pfn.h"
+#include "linux/slab.h"
+#include "linux/string.h"
+#include "linux/vmalloc.h"
+
+#include "bo.h"
+#include "driver.h"
+#include "residency.h"
+#include "vram.h"
+
+static void pi_vram_bo_free(struct drm_gem_object *obj) {
+  struct pi_bo *bo = to_pi_bo(obj);
+  struct pi_gpu *gpu = to_gpu(obj->dev);
+  struct pi_vram_heap *heap = &gpu->vram_heap;
+
+  if (drm_mm_node_allocated(&bo->vram_node)) {
+    mutex_lock(&heap->lock);
+    drm_mm_remove_node(&bo->vram_node);
+    mutex_unlock(&heap->lock);
+
+    atomic64_dec(&gpu->mem_stats.vram_objects);
+    atomic64_sub(obj->size, &gpu->mem_stats.vram_bytes);
+  }
+
+  drm_gem_object_release(obj);
+  kfree(bo);
+}
+
+static int pi_vram_bo_vmap(struct drm_gem_object *obj, struct iosys_map *map) {
+  *map = to_pi_bo(obj)->map;
+  return 0;
+}
+
+static void pi_vram_bo_vunmap(struct drm_gem_object *obj,
+                              struct iosys_map *map) {}
+
+static int pi_vram_bo_mmap(struct drm_gem_object *obj,
+                           struct vm_area_struct *vma) {
+  struct pi_gpu *gpu = to_gpu(obj->dev);
+  u64 start = to_pi_bo(obj)->vram_node.start;
+
+  // The fake offset of the object isn't an offset in the object
+  vma->vm_pgoff -= drm_vma_node_start(&obj->vma_node);
+  vm_flags_set(vma, VM_DONTEXPAND);
+
+  return dma_mmap_coherent(obj->dev->dev, vma, (u8 *)gpu->vram + start,
+                           gpu->dma_handle_vram + start, obj->size);
+}
+
+// The mapping holds a reference to the object, like for every GEM object
+static const struct vm_operations_struct pi_vram_vm_ops = {
+    .open = drm_gem_vm_open,
+    .close = drm_gem_vm_close,
+};
+
+static const struct drm_gem_object_funcs pi_vram_gem_funcs = {
+    .free = pi_vram_bo_free,
+    .vmap = pi_vram_bo_vmap,
+    .vunmap = pi_vram_bo_vunmap,
+    .mmap = pi_vram_bo_mmap,
+    .vm_ops = &pi_vram_vm_ops,
+};
+
+// Page frame of a byte of vram, for userspace mappings
+unsigned long pi_vram_pfn(struct pi_gpu *gpu, u64 offset) {
+  void *vaddr = (u8 *)gpu->vram + offset;
+
+  // dma_alloc_coherent() returns either a remapped or a linear address
+  if (is_vmalloc_addr(vaddr))
+    return vmalloc_to_pfn(vaddr);
+  return PHYS_PFN(virt_to_phys(vaddr));
+}
+
+bool pi_bo_in_vram(struct pi_bo *bo) {
+  return bo->base.base.funcs == &pi_vram_gem_funcs;
+}
+
+/**
+ * pi_vram_bo_create - creates a buffer object in vram
+ * @gpu: the device
+ * @size: size of the object, rounded up to a whole number of pages
+ *
+ * The object is cleared, like a new shmem object would be.
+ *
+ * Returns:
+ * The object with a reference for the caller, ERR_PTR(-ENOSPC) if vram is
+ * full, or another ERR_PTR().
+ */
+struct pi_bo *pi_vram_bo_create(struct pi_gpu *gpu, size_t size) {
+  struct drm_gem_object *obj;
+  struct pi_bo *bo;
+  int ret;
+
+  size = PAGE_ALIGN(size);
+  if (!size || size > gpu->vram_heap.size)
+    return ERR_PTR(-ENOSPC);
+
+  bo = kzalloc(sizeof(*bo), GFP_KERNEL);
+  if (!bo)
+    return ERR_PTR(-ENOMEM);
+
+  pi_bo_init(bo);
+  obj = &bo->base.base;
+  obj->funcs = &pi_vram_gem_funcs;
+  drm_gem_private_object_init(&gpu->drm_device, obj, size);
+
+  // Objects the residency manager promoted make room
+  ret = pi_residency_alloc_vram(gpu, &bo->vram_node, size, false);
+  if (ret) {
+    drm_gem_object_release(obj);
+    kfree(bo);
+    return ERR_PTR(ret);
+  }
+
+  atomic64_inc(&gpu->mem_stats.vram_objects);
+  atomic64_add(size, &gpu->mem_stats.vram_bytes);
+
+  bo->map = IOSYS_MAP_INIT_VADDR((u8 *)gpu->vram + bo->vram_node.start);
+  memset(bo->map.vaddr, 0, size);
+
+  ret = drm_gem_create_mmap_offset(obj);
+  if (ret) {
+    drm_gem_object_put(obj);
+    return ERR_PTR(ret);
+  }
+
+  return bo;
+}
+
+void pi_vram_heap_init(struct pi_gpu *gpu) {
+  struct pi_vram_heap *heap = &gpu->vram_heap;
+
+  mutex_init(&heap->lock);
+
+  // Whole pages only, for mmap
+  if (gpu->vram_size < VRAM_HEAP_START + PAGE_SIZE) {
+    drm_warn(&gpu->drm_device, "vram too small for a heap, %zu bytes\n",
+             gpu->vram_size);
+    return;
+  }
+
+  heap->size = round_down(gpu->vram_size - VRAM_HEAP_START, PAGE_SIZE);
+  drm_mm_init(&heap->mm, VRAM_HEAP_START, heap->size);
+}
+
+// Runs when the drm device is released, after the last client and the pool
+// let go of their objects. drm_mm_takedown() warns about any one left over.
+void pi_vram_heap_fini(struct pi_gpu *gpu) {
+  struct pi_vram_heap *heap = &gpu->vram_heap;
+
+  if (!heap->size)
+    return;
+
+  drm_mm_takedown(&heap->mm);
+  heap->size = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef VRAM_H
+#define VRAM_H
+
+#include "asm-generic/int-ll64.h"
+#include "drm/drm_mm.h"
+#include "linux/mutex.h"
+#include "linux/types.h"
+
+#include "ring.h"
+
+struct pi_bo;
+struct pi_gpu;
+
+/*
+ * Layout of vram: the registers and the command ring take the first 64KB,
+ * followed by the display memory that framebuffers in system memory are copied
+ * to, and the rest is handed out to buffer objects by the vram heap. Offsets
+ * are in bytes from the start of vram.
+ */
+#define VRAM_DISPLAY_START 0x10000
+#define VRAM_DISPLAY_SIZE (4 * 1024 * 1024)
+#define VRAM_HEAP_START (VRAM_DISPLAY_START + VRAM_DISPLAY_SIZE)
+
+static_assert((RING_ENTRIES_OFFSET + RING_SIZE * RING_ENTRY_WORDS) * 4 <=
+              VRAM_DISPLAY_START);
+
+// Buffer objects smaller than this go to vram unless told otherwise
+#define VRAM_SMALL_OBJECT (64 * 1024)
+
+/*
+ * Range allocator for the part of vram not used by the registers and the ring.
+ * Vram is coherent memory the CPU and the GPU can both access directly, but
+ * there's little of it, so it's meant for small objects that are touched all
+ * the time: command buffers, constants, cursors.
+ */
+struct pi_vram_heap {
+  struct mutex lock;
+  struct drm_mm mm;
+  u64 size; // 0 if vram is too small to have a heap
+};
+
+void pi_vram_heap_init(struct pi_gpu *gpu);
+
+void pi_vram_heap_fini(struct pi_gpu *gpu);
+
+struct pi_bo *pi_vram_bo_create(struct pi_gpu *gpu, size_t size);
+
+bool pi_bo_in_vram(struct pi_bo *bo);
+
+unsigned long pi_vram_pfn(struct pi_gpu *gpu, u64 offset);
+
+#endif